@@ -94,6 +94,7 @@ static struct zio_block *zbk_alloc_block(struct zio_bi *bi,
 	struct zbk_item *item;
 	struct zio_control *ctrl;
 	unsigned long flags;
+	int node = zio_cset_node(bi->cset);
 	void *data;
 
 	pr_debug("%s:%d\n", __func__, __LINE__);
@@ -107,10 +108,10 @@ static struct zio_block *zbk_alloc_block(struct zio_bi *bi,
 	zbki->nitem++;
 	spin_unlock_irqrestore(&bi->lock, flags);
 
-	/* alloc item and data. Control remains null at this point */
-	item = kmem_cache_alloc(zbk_slab, gfp);
-	data = kmalloc(datalen, gfp);
-	ctrl = zio_alloc_control(gfp);
+	/* alloc item, data and control, on the node of the cset */
+	item = kmem_cache_alloc_node(zbk_slab, gfp, node);
+	data = kmalloc_node(datalen, gfp, node);
+	ctrl = zio_alloc_control_node(gfp, node);
 	if (!item || !data || !ctrl)
 		goto out_free;
 	memset(item, 0, sizeof(*item));
@@ -175,7 +176,7 @@ static int zbk_store_block(struct zio_bi *bi, struct zio_block *block)
 	struct zio_channel *chan = bi->chan;
 	struct zbk_item *item = to_item(block);
 	unsigned long flags;
-	int awake = 0, pushed = 0, isempty;
+	int pushed = 0, isempty;
 	int output = (bi->flags & ZIO_DIR) == ZIO_DIR_OUTPUT;
 
 	pr_debug("%s:%d (%p, %p)\n", __func__, __LINE__, bi, block);
@@ -183,20 +184,15 @@ static int zbk_store_block(struct zio_bi *bi, struct zio_block *block)
 	/* add to the buffer instance or push to the trigger */
 	spin_lock_irqsave(&bi->lock, flags);
 	isempty = list_empty(&zbki->list);
-	if (isempty) {
-		if (unlikely(output))
-			pushed = zio_trigger_try_push(bi, chan, block);
-		else
-			awake = 1;
-	}
-	if (!pushed)
+	if (isempty && unlikely(output))
+		pushed = zio_trigger_try_push(bi, chan, block);
+	if (!pushed) {
 		list_add_tail(&item->list, &zbki->list);
+		/* this also awakes user space, for input */
+		zio_bi_level_update(bi, 1);
+	}
 
 	spin_unlock_irqrestore(&bi->lock, flags);
-
-	/* if first input, awake user space */
-	if (awake)
-		wake_up_interruptible(&bi->q);
 	return 0;
 }
 
@@ -222,6 +218,7 @@ static struct zio_block *zbk_retr_block(struct zio_bi *bi)
 	first = zbki->list.next;
 	item = list_entry(first, struct zbk_item, list);
 	list_del(&item->list);
+	zio_bi_level_update(bi, -1);
 	spin_unlock_irqrestore(&bi->lock, flags);
 
 	pr_debug("%s:%d (%p, %p)\n", __func__, __LINE__, bi, item);
@@ -230,13 +227,14 @@ static struct zio_block *zbk_retr_block(struct zio_bi *bi)
 out_unlock:
 	spin_unlock_irqrestore(&bi->lock, flags);
 	/* There is no data in buffer, and we may pull to have data soon */
-	ti = bi->cset->ti;
+	rcu_read_lock();
+	ti = zio_cset_ti(bi->cset);
 	if ((bi->flags & ZIO_DIR) == ZIO_DIR_INPUT && ti->t_op->pull_block) {
 		/* chek if trigger is disabled */
-		if (unlikely((ti->flags & ZIO_STATUS) == ZIO_DISABLED))
-			return NULL;
-		ti->t_op->pull_block(ti, bi->chan);
+		if (likely((ti->flags & ZIO_STATUS) != ZIO_DISABLED))
+			ti->t_op->pull_block(ti, bi->chan);
 	}
+	rcu_read_unlock();
 	pr_debug("%s:%d (%p, %p)\n", __func__, __LINE__, bi, NULL);
 	return NULL;
 }
@@ -249,7 +247,8 @@ static struct zio_bi *zbk_create(struct zio_buffer_type *zbuf,
 
 	pr_debug("%s:%d\n", __func__, __LINE__);
 
-	zbki = kzalloc(sizeof(*zbki), GFP_ATOMIC);
+	zbki = kzalloc_node(sizeof(*zbki), GFP_ATOMIC,
+			    zio_cset_node(chan->cset));
 	if (!zbki)
 		return ERR_PTR(-ENOMEM);
 	INIT_LIST_HEAD(&zbki->list);
@@ -286,6 +285,7 @@ static const struct zio_buffer_operations zbk_buffer_ops = {
 
 static struct zio_buffer_type zbk_buffer = {
 	.owner =	THIS_MODULE,
+	.flags =	ZIO_BUF_FLAG_SWAP_DATA | ZIO_BUF_FLAG_LEVEL,
 	.zattr_set = {
 		.std_zattr = zbk_std_zattr,
 	},
@@ -0,0 +1,629 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright 2011-2019 CERN
+ */
+
+/*
+ * This is a buffer whose storage is provided by user space. A process
+ * registers a memory region with an ioctl command on one of the char
+ * devices of the channel: the pages are pinned and blocks are carved
+ * out of the region by the ZIO first-fit allocator, so raw_io (and
+ * DMA through zio_dma_alloc_sg) writes straight into user memory.
+ * Like for the vmalloc buffer, mem_offset in the control tells where
+ * the block lives (as offset from the registered address), so the
+ * control stream is the completion notification.
+ * The prefix of all local code/data is "zbu_".
+ */
+
+#include <linux/version.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/list.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/compat.h>
+#include <linux/types.h>
+
+#include <linux/zio.h>
+#include <linux/zio-buffer.h>
+#include <linux/zio-trigger.h>
+
+#if KERNEL_VERSION(5, 6, 0) <= LINUX_VERSION_CODE
+static int zbu_pin_pages(unsigned long uaddr, int npages, struct page **pages)
+{
+	return pin_user_pages_fast(uaddr, npages, FOLL_WRITE | FOLL_LONGTERM,
+				   pages);
+}
+
+static void zbu_unpin_pages(struct page **pages, unsigned long npages)
+{
+	unpin_user_pages_dirty_lock(pages, npages, true);
+}
+#else
+static int zbu_pin_pages(unsigned long uaddr, int npages, struct page **pages)
+{
+	return get_user_pages_fast(uaddr, npages, 1 /* write */, pages);
+}
+
+static void zbu_unpin_pages(struct page **pages, unsigned long npages)
+{
+	unsigned long i;
+
+	for (i = 0; i < npages; i++) {
+		set_page_dirty_lock(pages[i]);
+		put_page(pages[i]);
+	}
+}
+#endif
+
+/* A registered region, with the kernel mapping of its pinned pages */
+struct zbu_region {
+	struct page **pages;
+	unsigned long npages;
+	unsigned long size;
+	void *vaddr;		/* vmap() of the pages */
+	void *data;		/* vaddr plus the in-page offset of the region */
+	struct zio_ffa *ffa;
+	struct file *owner;	/* the file used to register the region */
+};
+
+struct zbu_instance {
+	struct zio_bi bi;
+	struct list_head list; /* items, one per block */
+	struct mutex mutex; /* serializes register and unregister */
+	struct zbu_region *region; /* NULL if nothing is registered */
+	unsigned long alloc_size; /* allocated size */
+};
+#define to_zbui(bi) container_of(bi, struct zbu_instance, bi)
+
+static struct kmem_cache *zbu_slab;
+
+/* The list in the structure above collects a bunch of these */
+struct zbu_item {
+	struct zio_block block;
+	struct list_head list;	/* item list */
+	struct zbu_instance *instance;
+	unsigned long begin;
+	size_t len; /* block.datalen may change, so save this */
+};
+#define to_item(block) container_of(block, struct zbu_item, block)
+
+static ZIO_ATTR_DEFINE_STD(ZIO_BUF, zbu_std_zattr) = {
+	ZIO_ATTR(zbuf, ZIO_ATTR_ZBUF_MAXKB, ZIO_RO_PERM,
+		 ZIO_ATTR_ZBUF_MAXKB, 0),
+	ZIO_ATTR(zbuf, ZIO_ATTR_ZBUF_ALLOC_KB, ZIO_RO_PERM,
+		 ZIO_ATTR_ZBUF_ALLOC_KB, 0),
+};
+
+static int zbu_info_get(struct device *dev, struct zio_attribute *zattr,
+			uint32_t *usr_val)
+{
+	struct zio_bi *bi = to_zio_bi(dev);
+	struct zbu_instance *zbui = to_zbui(bi);
+
+	switch (zattr->id) {
+	case ZIO_ATTR_ZBUF_MAXKB:
+		/* The size of the registered region, if any */
+		*usr_val = zbui->region ? zbui->region->size / 1024 : 0;
+		break;
+	case ZIO_ATTR_ZBUF_ALLOC_KB:
+		*usr_val = zbui->alloc_size / 1024;
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+static struct zio_sysfs_operations zbu_sysfs_ops = {
+	.info_get = zbu_info_get,
+};
+
+/* Alloc is called by the trigger (for input) or by f->write (for output) */
+static struct zio_block *zbu_alloc_block(struct zio_bi *bi,
+					 size_t datalen, gfp_t gfp)
+{
+	struct zbu_instance *zbui = to_zbui(bi);
+	struct zbu_region *region;
+	struct zbu_item *item;
+	struct zio_control *ctrl;
+	unsigned long offset = ZIO_FFA_NOSPACE, flags;
+	int node = zio_cset_node(bi->cset);
+
+	pr_debug("%s:%d\n", __func__, __LINE__);
+
+	/*
+	 * alloc item and control first, the region is checked while locked.
+	 * Data pages belong to the user: only our metadata follows the node.
+	 */
+	item = kmem_cache_alloc_node(zbu_slab, gfp, node);
+	ctrl = zio_alloc_control_node(gfp, node);
+	if (!item || !ctrl)
+		goto out_free;
+
+	spin_lock_irqsave(&bi->lock, flags);
+	region = zbui->region;
+	if (!region || (bi->flags & ZIO_DISABLED)) {
+		/* Nothing registered (yet, or any more): the block is lost */
+		spin_unlock_irqrestore(&bi->lock, flags);
+		goto out_free;
+	}
+	offset = zio_ffa_alloc(region->ffa, datalen, GFP_ATOMIC);
+	if (offset == ZIO_FFA_NOSPACE) {
+		/* NOSPACE means that the region is 'full' */
+		bi->flags |= ZIO_BI_NOSPACE;
+		spin_unlock_irqrestore(&bi->lock, flags);
+		goto out_free;
+	}
+	zbui->alloc_size += datalen;
+	spin_unlock_irqrestore(&bi->lock, flags);
+
+	memset(item, 0, sizeof(*item));
+	item->begin = offset;
+	item->len = datalen;
+	item->block.data = region->data + offset;
+	item->block.datalen = datalen;
+	item->instance = zbui;
+
+	/* mem_offset in current_ctrl is the last allocated */
+	bi->chan->current_ctrl->mem_offset = offset;
+	zio_set_ctrl(&item->block, ctrl);
+	return &item->block;
+
+out_free:
+	if (item)
+		kmem_cache_free(zbu_slab, item);
+	if (ctrl)
+		zio_free_control(ctrl);
+	return NULL;
+}
+
+/* Free is called by f->read (for input) or by the trigger (for output) */
+static void zbu_free_block(struct zio_bi *bi, struct zio_block *block)
+{
+	struct zbu_item *item;
+	struct zbu_instance *zbui;
+	unsigned long flags;
+
+	pr_debug("%s:%d\n", __func__, __LINE__);
+	item = to_item(block);
+	zbui = item->instance;
+
+	/* The region can't go away while blocks are allocated out of it */
+	if (bi->flags & ZIO_BI_PUSHING) {
+		/* freed while pushing: we hold the bi lock already */
+		zbui->alloc_size -= item->len;
+		zio_ffa_free_s(zbui->region->ffa, item->begin, item->len);
+	} else {
+		spin_lock_irqsave(&bi->lock, flags);
+		zbui->alloc_size -= item->len;
+		zio_ffa_free_s(zbui->region->ffa, item->begin, item->len);
+		bi->flags &= ~ZIO_BI_NOSPACE;
+		spin_unlock_irqrestore(&bi->lock, flags);
+	}
+
+	zio_free_control(zio_get_ctrl(block));
+	kmem_cache_free(zbu_slab, item);
+}
+
+/* Store is called by the trigger (for input) or by f->write (for output) */
+static int zbu_store_block(struct zio_bi *bi, struct zio_block *block)
+{
+	struct zbu_instance *zbui = to_zbui(bi);
+	struct zio_channel *chan = bi->chan;
+	struct zbu_item *item;
+	unsigned long flags;
+	int pushed = 0, output;
+
+	pr_debug("%s:%d (%p, %p)\n", __func__, __LINE__, bi, block);
+
+	item = to_item(block);
+	zio_get_ctrl(block)->mem_offset = item->begin;
+
+	output = (bi->flags & ZIO_DIR) == ZIO_DIR_OUTPUT;
+
+	/*
+	 * User space reads data through its own mapping of the pages,
+	 * not through the vmap alias we wrote to: flush the latter.
+	 */
+	if (!output)
+		flush_kernel_vmap_range(block->data, item->len);
+
+	/* add to the buffer instance or push to the trigger */
+	spin_lock_irqsave(&bi->lock, flags);
+	if (list_empty(&zbui->list) && unlikely(output))
+		pushed = zio_trigger_try_push(bi, chan, block);
+	if (!pushed) {
+		list_add_tail(&item->list, &zbui->list);
+		/* this also awakes user space, for input */
+		zio_bi_level_update(bi, 1);
+	}
+	spin_unlock_irqrestore(&bi->lock, flags);
+	return 0;
+}
+
+/* Retr is called by f->read (for input) or by the trigger (for output) */
+static struct zio_block *zbu_retr_block(struct zio_bi *bi)
+{
+	struct zbu_instance *zbui = to_zbui(bi);
+	struct zbu_item *item;
+	struct zio_ti *ti;
+	unsigned long flags;
+
+	/* PUSHING is only active temporarily during locked context */
+	if (bi->flags & ZIO_BI_PUSHING)
+		return NULL;
+
+	spin_lock_irqsave(&bi->lock, flags);
+	if (list_empty(&zbui->list))
+		goto out_unlock;
+	item = list_first_entry(&zbui->list, struct zbu_item, list);
+	list_del(&item->list);
+	zio_bi_level_update(bi, -1);
+	spin_unlock_irqrestore(&bi->lock, flags);
+
+	if ((bi->flags & ZIO_DIR) == ZIO_DIR_OUTPUT)
+		wake_up_interruptible(&bi->q);
+	pr_debug("%s:%d (%p, %p)\n", __func__, __LINE__, bi, item);
+	return &item->block;
+
+out_unlock:
+	spin_unlock_irqrestore(&bi->lock, flags);
+	/* There is no data in buffer, and we may pull to have data soon */
+	rcu_read_lock();
+	ti = zio_cset_ti(bi->cset);
+	if ((bi->flags & ZIO_DIR) == ZIO_DIR_INPUT && ti->t_op->pull_block) {
+		/* chek if trigger is disabled */
+		if (likely((ti->flags & ZIO_STATUS) != ZIO_DISABLED))
+			ti->t_op->pull_block(ti, bi->chan);
+	}
+	rcu_read_unlock();
+	pr_debug("%s:%d (%p, %p)\n", __func__, __LINE__, bi, NULL);
+	return NULL;
+}
+
+static void zbu_region_free(struct zbu_region *region)
+{
+	if (region->vaddr)
+		vunmap(region->vaddr);
+	zbu_unpin_pages(region->pages, region->npages);
+	zio_ffa_destroy(region->ffa);
+	kvfree(region->pages);
+	kfree(region);
+}
+
+/* Pin and map the region described by user space */
+static struct zbu_region *zbu_region_create(struct file *f,
+					    struct zio_umem_region *ureg)
+{
+	struct zbu_region *region;
+	unsigned long uaddr = ureg->addr;
+	unsigned long first, last;
+	int ret;
+
+	/* mem_offset in the control is 32 bits wide */
+	if (!ureg->size || ureg->size > U32_MAX ||
+	    ureg->addr + ureg->size < ureg->addr)
+		return ERR_PTR(-EINVAL);
+
+	region = kzalloc(sizeof(*region), GFP_KERNEL);
+	if (!region)
+		return ERR_PTR(-ENOMEM);
+	first = uaddr >> PAGE_SHIFT;
+	last = (uaddr + ureg->size - 1) >> PAGE_SHIFT;
+	region->npages = last - first + 1;
+	region->size = ureg->size;
+	region->owner = f;
+
+	region->pages = kvmalloc_array(region->npages, sizeof(*region->pages),
+				       GFP_KERNEL);
+	region->ffa = zio_ffa_create(0, region->size);
+	if (!region->pages || !region->ffa) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	ret = zbu_pin_pages(uaddr & PAGE_MASK, region->npages, region->pages);
+	if (ret < 0)
+		goto out_free;
+	if (ret != region->npages) {
+		/* Partially pinned: release what we got */
+		zbu_unpin_pages(region->pages, ret);
+		ret = -EFAULT;
+		goto out_free;
+	}
+
+	region->vaddr = vmap(region->pages, region->npages, VM_MAP,
+			     PAGE_KERNEL);
+	if (!region->vaddr) {
+		zbu_unpin_pages(region->pages, region->npages);
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	region->data = region->vaddr + offset_in_page(uaddr);
+	return region;
+
+out_free:
+	if (region->ffa)
+		zio_ffa_destroy(region->ffa);
+	kvfree(region->pages);
+	kfree(region);
+	return ERR_PTR(ret);
+}
+
+static int zbu_register(struct zbu_instance *zbui, struct file *f,
+			void __user *uarg)
+{
+	struct zio_bi *bi = &zbui->bi;
+	struct zio_umem_region ureg;
+	struct zbu_region *region;
+	unsigned long flags;
+	int ret = 0;
+
+	if (copy_from_user(&ureg, uarg, sizeof(ureg)))
+		return -EFAULT;
+
+	mutex_lock(&zbui->mutex);
+	if (zbui->region) {
+		ret = -EBUSY;
+		goto out;
+	}
+	region = zbu_region_create(f, &ureg);
+	if (IS_ERR(region)) {
+		ret = PTR_ERR(region);
+		goto out;
+	}
+
+	spin_lock_irqsave(&bi->lock, flags);
+	zbui->region = region;
+	bi->flags &= ~ZIO_BI_NOSPACE;
+	spin_unlock_irqrestore(&bi->lock, flags);
+
+	/* Self-timed csets are armed as soon as possible: now we can */
+	if (bi->cset->flags & ZIO_CSET_SELF_TIMED) {
+		rcu_read_lock();
+		zio_arm_trigger(zio_cset_ti(bi->cset));
+		rcu_read_unlock();
+	}
+out:
+	mutex_unlock(&zbui->mutex);
+	return ret;
+}
+
+/*
+ * Unregistration must make sure that nobody uses the region any more:
+ * the trigger is aborted and disabled (so blocks owned by raw_io are
+ * released), the user block and queued blocks are freed, and only then
+ * the pages are unmapped and unpinned. The trigger is restored later.
+ * Only the file used to register the region can remove it.
+ */
+static int zbu_unregister(struct zbu_instance *zbui, struct file *owner)
+{
+	struct zio_bi *bi = &zbui->bi;
+	struct zio_channel *chan = bi->chan;
+	struct zio_cset *cset = bi->cset;
+	struct zio_ti *ti = cset->ti;
+	struct zbu_region *region;
+	struct zbu_item *item, *tmp;
+	struct zio_block *block;
+	unsigned long flags, bflags;
+	LIST_HEAD(flush);
+	int tflags;
+
+	mutex_lock(&zbui->mutex);
+	region = zbui->region;
+	if (!region || region->owner != owner) {
+		mutex_unlock(&zbui->mutex);
+		return region ? -EPERM : -ENOENT;
+	}
+
+	/* No more allocations from now on */
+	spin_lock_irqsave(&bi->lock, flags);
+	bflags = bi->flags;
+	bi->flags |= ZIO_DISABLED;
+	spin_unlock_irqrestore(&bi->lock, flags);
+
+	tflags = zio_trigger_abort_disable(cset, 1);
+
+	/* A stop_io that doesn't free the active block leaves it to us */
+	block = xchg(&chan->active_block, NULL);
+	clear_bit(chan->index, cset->chan_ready);
+	zio_buffer_free_block(bi, block);
+
+	zio_user_block_get(chan, TASK_UNINTERRUPTIBLE);
+	if (chan->user_block && chan->user_bi == bi) {
+		zio_buffer_free_block(bi, chan->user_block);
+		chan->user_block = NULL;
+	}
+	zio_user_block_put(chan);
+
+	/* Flush the buffer (retr_block would pull, so do it by hand) */
+	spin_lock_irqsave(&bi->lock, flags);
+	list_splice_init(&zbui->list, &flush);
+	zio_bi_level_update(bi, -atomic_read(&bi->nblocks));
+	spin_unlock_irqrestore(&bi->lock, flags);
+	list_for_each_entry_safe(item, tmp, &flush, list)
+		zbu_free_block(bi, &item->block);
+
+	spin_lock_irqsave(&bi->lock, flags);
+	WARN(zbui->alloc_size, "%s: %lu bytes still allocated\n",
+	     dev_name(&bi->head.dev), zbui->alloc_size);
+	zbui->region = NULL;
+	bi->flags = (bi->flags & ~ZIO_STATUS) | (bflags & ZIO_STATUS);
+	spin_unlock_irqrestore(&bi->lock, flags);
+
+	zbu_region_free(region);
+
+	/* Restore trigger: without a region blocks are just lost */
+	if ((tflags & ZIO_STATUS) == ZIO_ENABLED)
+		clear_bit(ZIO_STATUS_BIT, &ti->flags);
+	if (tflags & ZIO_TI_ARMED)
+		zio_arm_trigger(ti);
+
+	mutex_unlock(&zbui->mutex);
+	return 0;
+}
+
+/* Create is called by zio for each channel electing to use this buffer type */
+static struct zio_bi *zbu_create(struct zio_buffer_type *zbuf,
+				 struct zio_channel *chan)
+{
+	struct zbu_instance *zbui;
+
+	pr_debug("%s:%d\n", __func__, __LINE__);
+
+	/* zero-sized blocks can't use this buffer type */
+	if (chan->cset->ssize == 0)
+		return ERR_PTR(-EINVAL);
+
+	zbui = kzalloc_node(sizeof(*zbui), GFP_ATOMIC,
+			    zio_cset_node(chan->cset));
+	if (!zbui)
+		return ERR_PTR(-ENOMEM);
+	INIT_LIST_HEAD(&zbui->list);
+	mutex_init(&zbui->mutex);
+
+	/* all the fields of zio_bi are initialied by the caller */
+	return &zbui->bi;
+}
+
+/* destroy is called by zio on channel removal or if it changes buffer type */
+static void zbu_destroy(struct zio_bi *bi)
+{
+	struct zbu_instance *zbui = to_zbui(bi);
+	struct zbu_item *item, *tmp;
+
+	pr_debug("%s:%d\n", __func__, __LINE__);
+
+	/* no need to lock here, zio ensures we are not active */
+	list_for_each_entry_safe(item, tmp, &zbui->list, list)
+		zbu_free_block(bi, &item->block);
+	/* The region is released on close, but be robust anyways */
+	if (zbui->region)
+		zbu_region_free(zbui->region);
+	kfree(zbui);
+}
+
+static const struct zio_buffer_operations zbu_buffer_ops = {
+	.alloc_block =	zbu_alloc_block,
+	.free_block =	zbu_free_block,
+	.store_block =	zbu_store_block,
+	.retr_block =	zbu_retr_block,
+	.create =	zbu_create,
+	.destroy =	zbu_destroy,
+};
+
+/*
+ * After a change of buffer type, a file may work on an instance of
+ * another type, or on a replaced one of ours that is being drained:
+ * regions are only managed on the current instance of the channel.
+ * A replaced instance keeps its region until it is destroyed.
+ */
+static struct zbu_instance *zbu_f_instance(struct file *f)
+{
+	struct zio_f_priv *priv = f->private_data;
+	struct zio_bi *bi = priv->bi;
+
+	if (bi->b_op != &zbu_buffer_ops || bi != READ_ONCE(bi->chan->bi))
+		return NULL;
+	return to_zbui(bi);
+}
+
+/*
+ * File operations are the generic ones, plus ioctl to register the
+ * region and a release method that unregisters it when the owner
+ * file is closed (this includes process exit).
+ */
+static long zbu_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
+{
+	struct zbu_instance *zbui = zbu_f_instance(f);
+
+	switch (cmd) {
+	case ZIO_IOC_UMEM_REGISTER:
+		if (!zbui)
+			return -ENODEV;
+		return zbu_register(zbui, f, (void __user *)arg);
+	case ZIO_IOC_UMEM_UNREGISTER:
+		if (!zbui)
+			return -ENODEV;
+		return zbu_unregister(zbui, f);
+	default:
+		return zio_generic_file_operations.unlocked_ioctl(f, cmd, arg);
+	}
+}
+
+#ifdef CONFIG_COMPAT
+static long zbu_compat_ioctl(struct file *f, unsigned int cmd,
+			     unsigned long arg)
+{
+	if (cmd == ZIO_IOC_UMEM_REGISTER)
+		arg = (unsigned long)compat_ptr(arg);
+	return zbu_ioctl(f, cmd, arg);
+}
+#endif
+
+static int zbu_release(struct inode *inode, struct file *f)
+{
+	struct zbu_instance *zbui = zbu_f_instance(f);
+
+	if (zbui)
+		zbu_unregister(zbui, f);
+	return zio_generic_file_operations.release(inode, f);
+}
+
+static struct file_operations zbu_file_operations;
+
+static struct zio_buffer_type zbu_buffer = {
+	.owner =	THIS_MODULE,
+	.flags =	ZIO_BUF_FLAG_LEVEL,
+	.zattr_set = {
+		.std_zattr = zbu_std_zattr,
+	},
+	.s_op = &zbu_sysfs_ops,
+	.b_op = &zbu_buffer_ops,
+	.f_op = &zbu_file_operations,
+};
+
+static int __init zbu_init(void)
+{
+	int ret;
+
+	zbu_file_operations = zio_generic_file_operations;
+	zbu_file_operations.owner = THIS_MODULE;
+	zbu_file_operations.unlocked_ioctl = zbu_ioctl;
+#ifdef CONFIG_COMPAT
+	zbu_file_operations.compat_ioctl = zbu_compat_ioctl;
+#endif
+	zbu_file_operations.release = zbu_release;
+
+	zbu_slab = kmem_cache_create("zio-usermem", sizeof(struct zbu_item),
+				     __alignof__(struct zbu_item), 0, NULL);
+	if (!zbu_slab)
+		return -ENOMEM;
+	ret = zio_register_buf(&zbu_buffer, "usermem");
+	if (ret < 0)
+		kmem_cache_destroy(zbu_slab);
+	return ret;
+}
+
+static void __exit zbu_exit(void)
+{
+	zio_unregister_buf(&zbu_buffer);
+	kmem_cache_destroy(zbu_slab);
+}
+
+module_init(zbu_init);
+module_exit(zbu_exit);
+MODULE_VERSION(GIT_VERSION); /* Defined in local Makefile */
+MODULE_LICENSE("GPL");
+
+ADDITIONAL_VERSIONS;
@@ -24,6 +24,8 @@
 #include <linux/vmalloc.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/kref.h>
+#include <linux/workqueue.h>
 
 #include <linux/zio.h>
 #include <linux/zio-buffer.h>
@@ -34,26 +36,65 @@
 #else
 #define	address_of(vmf)	((vmf)->virtual_address)
 #endif
+#if KERNEL_VERSION(4, 4, 0) > LINUX_VERSION_CODE
+#define gfpflags_allow_blocking(gfp)	((gfp) & __GFP_WAIT)
+#endif
+#if KERNEL_VERSION(4, 11, 0) > LINUX_VERSION_CODE
+#define kref_read(kref)	atomic_read(&(kref)->refcount)
+#endif
 
 /*
  * We export a linear buffer to user space, for a single mmap call.
- * The circular buffer is managed by the ZIO first-fit allocator
+ * The circular buffer is managed by the ZIO first-fit allocator.
+ *
+ * To resize without stopping, the buffer is made of areas: new blocks
+ * come from the current one, while each block and each mapping keeps
+ * its own area alive. A replaced area is freed when its last block is
+ * freed and its last mapping goes away. The control reports the area
+ * id in "reserved", so user space knows when to map again.
+ *
+ * Channels that are never used should not pin vmalloc space, so the
+ * area is only allocated on first open, mmap or arm, and it can be
+ * released after "idle-release-ms" with no blocks and no mappings.
+ * The next use allocates a new area, with a new id.
+ *
+ * Users that map the area once (e.g. for DMA) pin it with area_get: a
+ * pin is a reference like the others, but it doesn't keep the area from
+ * being released as idle. Pinners are told when their area is replaced
+ * or released, and may ask for aligned blocks.
  */
+struct zbk_area {
+	struct kref ref;
+	uint32_t id;
+	void *data;
+	unsigned long size;
+	struct zio_ffa *ffa;
+	struct work_struct work; /* vfree is not for atomic context */
+	spinlock_t lock; /* for the pins */
+	struct list_head pins;
+	unsigned int npins;
+	int retired;
+	size_t align; /* of new blocks, the largest pinners asked for */
+};
+
 struct zbk_instance {
 	struct zio_bi bi;
 	struct list_head list; /* items, one per block */
-	struct zio_ffa *ffa;
-	void *data;
-	atomic_t map_count;
-	unsigned long size;
+	struct zbk_area *area; /* current one, for new blocks, or NULL */
 	unsigned long alloc_size; /* allocated size */
 	unsigned long flags;
+	unsigned long last_use; /* jiffies of the last allocation */
+	uint32_t next_id; /* of the next area */
+	uint32_t idle_ms; /* release the area when idle, 0 = never */
+	struct work_struct install_work; /* allocate for atomic callers */
+	struct delayed_work idle_work;
 };
 #define to_zbki(bi) container_of(bi, struct zbk_instance, bi)
 
 #define ZBK_FLAG_MERGE_DATA	1
 
 static struct kmem_cache *zbk_slab;
+static struct workqueue_struct *zbk_wq;
 
 
 /* The list in the structure above collects a bunch of these */
@@ -61,6 +102,7 @@ struct zbk_item {
 	struct zio_block block;
 	struct list_head list;	/* item list */
 	struct zbk_instance *instance;
+	struct zbk_area *area;
 	unsigned long begin;
 	size_t len; /* block.datalen may change, so save this */
 };
@@ -68,6 +110,7 @@ struct zbk_item {
 
 enum {
 	ZBK_ATTR_MERGE_DATA = ZIO_MAX_STD_ATTR,
+	ZBK_ATTR_IDLE_MS,
 };
 
 static ZIO_ATTR_DEFINE_STD(ZIO_BUF, zbk_std_zattr) = {
@@ -80,70 +123,209 @@ static ZIO_ATTR_DEFINE_STD(ZIO_BUF, zbk_std_zattr) = {
 static struct zio_attribute zbk_ext_attr[] = {
 	ZIO_ATTR_EXT("merge-data", ZIO_RW_PERM,
 		     ZBK_ATTR_MERGE_DATA, 0),
+	ZIO_ATTR_EXT("idle-release-ms", ZIO_RW_PERM,
+		     ZBK_ATTR_IDLE_MS, 0),
 };
 
+static struct zbk_area *zbk_area_create(unsigned long size, int node)
+{
+	struct zbk_area *area;
+
+	area = kzalloc_node(sizeof(*area), GFP_KERNEL, node);
+	if (!area)
+		return NULL;
+	area->ffa = zio_ffa_create_node(0, size, node);
+	area->data = vmalloc_node(size, node);
+	if (!area->ffa || !area->data) {
+		zio_ffa_destroy(area->ffa);
+		vfree(area->data);
+		kfree(area);
+		return NULL;
+	}
+	area->size = size;
+	kref_init(&area->ref);
+	spin_lock_init(&area->lock);
+	INIT_LIST_HEAD(&area->pins);
+	return area;
+}
+
+static void zbk_area_work(struct work_struct *work)
+{
+	struct zbk_area *area = container_of(work, struct zbk_area, work);
+
+	pr_debug("%s: area %u\n", __func__, area->id);
+	vfree(area->data);
+	zio_ffa_destroy(area->ffa);
+	kfree(area);
+}
+
+/* The last reference may be dropped in atomic context (free_block) */
+static void zbk_area_release(struct kref *ref)
+{
+	struct zbk_area *area = container_of(ref, struct zbk_area, ref);
+
+	INIT_WORK(&area->work, zbk_area_work);
+	queue_work(zbk_wq, &area->work);
+}
+
+static inline void zbk_area_put(struct zbk_area *area)
+{
+	kref_put(&area->ref, zbk_area_release);
+}
+
+/* The area is no longer the current one: tell the pinners */
+static void zbk_area_retire(struct zbk_area *area)
+{
+	struct zio_bi_area *ba;
+	unsigned long flags;
+
+	spin_lock_irqsave(&area->lock, flags);
+	area->retired = 1;
+	list_for_each_entry(ba, &area->pins, list)
+		ba->invalidate(ba);
+	spin_unlock_irqrestore(&area->lock, flags);
+}
+
+/* Get the current area, for a new block or a new mapping (may be NULL) */
+static struct zbk_area *zbk_area_get(struct zbk_instance *zbki)
+{
+	struct zbk_area *area;
+	unsigned long flags;
+
+	spin_lock_irqsave(&zbki->bi.lock, flags);
+	area = zbki->area;
+	if (area)
+		kref_get(&area->ref);
+	spin_unlock_irqrestore(&zbki->bi.lock, flags);
+	return area;
+}
+
+/* Allocate the area if the instance has none: process context only */
+static int zbk_area_install(struct zbk_instance *zbki)
+{
+	struct zio_bi *bi = &zbki->bi;
+	struct zbk_area *area;
+	unsigned long flags, size;
+
+	if (READ_ONCE(zbki->area))
+		return 0;
+	size = 1024 * bi->zattr_set.std_zattr[ZIO_ATTR_ZBUF_MAXKB].value;
+	area = zbk_area_create(size, zio_cset_node(bi->cset));
+	if (!area)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&bi->lock, flags);
+	if (!zbki->area) {
+		area->id = zbki->next_id++;
+		zbki->area = area;
+		zbki->last_use = jiffies;
+		bi->flags &= ~ZIO_BI_NOSPACE;
+		area = NULL;
+	}
+	spin_unlock_irqrestore(&bi->lock, flags);
+	if (area) { /* somebody else did it meanwhile */
+		zbk_area_put(area);
+		return 0;
+	}
+	pr_debug("%s: %s: %lu bytes\n", __func__, dev_name(&bi->head.dev),
+		 size);
+	if (zbki->idle_ms)
+		queue_delayed_work(zbk_wq, &zbki->idle_work,
+				   msecs_to_jiffies(zbki->idle_ms));
+	wake_up_interruptible(&bi->q);
+	return 0;
+}
+
+/* The trigger arms in atomic context: it can only ask for the area */
+static void zbk_install_work(struct work_struct *work)
+{
+	struct zbk_instance *zbki = container_of(work, struct zbk_instance,
+						 install_work);
+
+	if (zbk_area_install(zbki))
+		dev_warn(&zbki->bi.head.dev, "can't allocate buffer area\n");
+}
+
+/* Release the area if no block and no mapping used it for idle_ms */
+static void zbk_idle_work(struct work_struct *work)
+{
+	struct zbk_instance *zbki = container_of(to_delayed_work(work),
+						 struct zbk_instance,
+						 idle_work);
+	struct zio_bi *bi = &zbki->bi;
+	struct zbk_area *area = NULL;
+	unsigned long flags, idle;
+	int rearm;
+
+	idle = msecs_to_jiffies(READ_ONCE(zbki->idle_ms));
+	if (!idle)
+		return;
+	spin_lock_irqsave(&bi->lock, flags);
+	/* Pins don't count: their owners are told, and let it go */
+	if (zbki->area && time_after_eq(jiffies, zbki->last_use + idle) &&
+	    list_empty(&zbki->list) && !zbki->alloc_size &&
+	    kref_read(&zbki->area->ref) == 1 + READ_ONCE(zbki->area->npins)) {
+		area = zbki->area;
+		zbki->area = NULL;
+	}
+	rearm = zbki->area != NULL;
+	spin_unlock_irqrestore(&bi->lock, flags);
+
+	if (area) {
+		pr_debug("%s: %s: release area %u\n", __func__,
+			 dev_name(&bi->head.dev), area->id);
+		zbk_area_retire(area);
+		zbk_area_put(area);
+	}
+	if (rearm)
+		queue_delayed_work(zbk_wq, &zbki->idle_work, idle);
+}
+
 static int zbk_conf_set(struct device *dev, struct zio_attribute *zattr,
 		uint32_t  usr_val)
 {
 	struct zio_bi *bi = to_zio_bi(dev);
-	struct zio_ti *ti = NULL;
 	struct zbk_instance *zbki = to_zbki(bi);
-	struct zio_block *block;
-	unsigned long flags, bflags, tflags;
-	void *data;
-	int ret = 0;
+	struct zbk_area *area, *old;
+	unsigned long flags;
 
 	switch (zattr->id) {
 	case ZIO_ATTR_ZBUF_MAXKB:
 		if (usr_val == zattr->value)
 			return 0; /* nothing to do */
-		/* Lock and disable */
-		spin_lock_irqsave(&bi->lock, flags);
-		if (atomic_read(&zbki->map_count)) {
-			spin_unlock_irqrestore(&bi->lock, flags);
-			return -EBUSY;
-		}
-		bflags = bi->flags;
-		bi->flags |= ZIO_DISABLED;
-		spin_unlock_irqrestore(&bi->lock, flags);
-
+		if (!usr_val)
+			return -EINVAL;
+		/* Not allocated yet: the next use picks the new size */
+		if (!READ_ONCE(zbki->area))
+			return 0;
 		/*
-		 * Disable trigger while resizing buffer to avoid
-		 * problems with blocks that point to a different
-		 * vmalloc() area
+		 * Resize while running: new blocks come from the new area,
+		 * stored blocks and mappings keep the old one until they go
 		 */
-		ti = bi->cset->ti;
-		tflags = zio_trigger_abort_disable(ti->cset, 1);
-
-		/* Flush the buffer */
-		while ((block = bi->b_op->retr_block(bi)))
-			bi->b_op->free_block(bi, block);
-
-		/* Change size */
-		data = vmalloc(usr_val * 1024);
-		if (data) {
-			vfree(zbki->data);
-			zio_ffa_destroy(zbki->ffa);
-			zbki->ffa = zio_ffa_create(0, usr_val * 1024);
-			/* FIXME: what if this malloc failed? */
-			zbki->size = usr_val * 1024;
-			zbki->data = data;
-		} else {
-			ret = -ENOMEM;
-		}
-
-		/* Lock and restore flags */
+		area = zbk_area_create(usr_val * 1024,
+				       zio_cset_node(bi->cset));
+		if (!area)
+			return -ENOMEM;
 		spin_lock_irqsave(&bi->lock, flags);
-		bi->flags = bflags;
+		old = zbki->area;
+		area->id = zbki->next_id++;
+		zbki->area = area;
+		/* The new area may have space for a writer or a trigger */
+		bi->flags &= ~ZIO_BI_NOSPACE;
 		spin_unlock_irqrestore(&bi->lock, flags);
+		if (old) {
+			zbk_area_retire(old);
+			zbk_area_put(old);
+		}
+		wake_up_interruptible(&bi->q);
+		return 0;
 
-		/* Restore trigger */
-		if (ti && ((tflags & ZIO_STATUS) == ZIO_ENABLED))
-			ti->flags = (ti->flags & ~ZIO_STATUS) | ZIO_ENABLED;
-		if (ti && (tflags & ZIO_TI_ARMED))
-			zio_arm_trigger(ti);
-
-		return ret;
+	case ZBK_ATTR_IDLE_MS:
+		zbki->idle_ms = usr_val;
+		if (usr_val && READ_ONCE(zbki->area))
+			mod_delayed_work(zbk_wq, &zbki->idle_work,
+					 msecs_to_jiffies(usr_val));
+		break;
 
 	case ZBK_ATTR_MERGE_DATA:
 		if (usr_val)
@@ -185,35 +367,57 @@ static struct zio_block *zbk_alloc_block(struct zio_bi *bi,
 {
 	struct zbk_instance *zbki = to_zbki(bi);
 	struct zbk_item *item;
+	struct zbk_area *area;
 	struct zio_control *ctrl;
 	unsigned long offset, flags;
+	size_t len = datalen;
+	int node = zio_cset_node(bi->cset);
 
 	pr_debug("%s:%d\n", __func__, __LINE__);
 
-	/* alloc item and data. Control remains null at this point */
-	item = kmem_cache_alloc(zbk_slab, gfp);
-	offset = zio_ffa_alloc(zbki->ffa, datalen, gfp);
-	ctrl = zio_alloc_control(gfp);
+	/* alloc item and data, item and control on the node of the cset */
+	area = zbk_area_get(zbki);
+	if (unlikely(!area)) {
+		/* First use, or released when idle: atomic callers wait */
+		if (!gfpflags_allow_blocking(gfp)) {
+			queue_work(zbk_wq, &zbki->install_work);
+			return NULL;
+		}
+		if (zbk_area_install(zbki))
+			return NULL;
+		area = zbk_area_get(zbki);
+		if (!area)
+			return NULL;
+	}
+	zbki->last_use = jiffies;
+	/* Pinners may want blocks that don't share pages with others */
+	if (READ_ONCE(area->align))
+		len = ALIGN(datalen, READ_ONCE(area->align));
+	item = kmem_cache_alloc_node(zbk_slab, gfp, node);
+	offset = zio_ffa_alloc(area->ffa, len, gfp);
+	ctrl = zio_alloc_control_node(gfp, node);
 	if (!item || !ctrl || offset == ZIO_FFA_NOSPACE)
 		goto out_free;
 	memset(item, 0, sizeof(*item));
 	item->begin = offset;
-	item->len = datalen;
-	item->block.data = zbki->data + offset;
+	item->len = len;
+	item->block.data = area->data + offset;
 	item->block.datalen = datalen;
 	item->instance = zbki;
+	item->area = area; /* the reference is the block's now */
 
 	spin_lock_irqsave(&bi->lock, flags);
 	zbki->alloc_size += item->len;
 	spin_unlock_irqrestore(&bi->lock, flags);
 	/* mem_offset in current_ctrl is the last allocated */
 	bi->chan->current_ctrl->mem_offset = offset;
+	bi->chan->current_ctrl->reserved = area->id;
 	zio_set_ctrl(&item->block, ctrl);
 	return &item->block;
 
 out_free:
 	if (offset != ZIO_FFA_NOSPACE) {
-		zio_ffa_free_s(zbki->ffa, offset, datalen);
+		zio_ffa_free_s(area->ffa, offset, len);
 	} else {
 		/* NOSPACE means that the buffer is 'full', there is
 		 * no space for the requested datalen */
@@ -221,6 +425,7 @@ out_free:
 	  	bi->flags |= ZIO_BI_NOSPACE;
 		spin_unlock_irqrestore(&bi->lock, flags);
 	}
+	zbk_area_put(area);
 	kmem_cache_free(zbk_slab, item);
 	zio_free_control(ctrl);
 	return NULL;
@@ -251,21 +456,27 @@ static void zbk_free_block(struct zio_bi *bi, struct zio_block *block)
 	spin_unlock_irqrestore(&bi->lock, flags);
 
 out_free:
-	zio_ffa_free_s(zbki->ffa, item->begin, item->len);
+	zio_ffa_free_s(item->area->ffa, item->begin, item->len);
+	zbk_area_put(item->area);
 	zio_free_control(ctrl);
 	kmem_cache_free(zbk_slab, item);
 }
 
-/* An helper for store_block() if we are trying to merge data runs */
-static void zbk_try_merge(struct zbk_instance *zbki, struct zbk_item *item)
+/*
+ * An helper for store_block() if we are trying to merge data runs.
+ * It returns 1 if the item has been merged (and freed), 0 otherwise
+ */
+static int zbk_try_merge(struct zbk_instance *zbki, struct zbk_item *item)
 {
 	struct zbk_item *prev;
 	struct zio_control *ctrl, *prevc;
 
 	/* Called while locked and already part of the list */
 	prev = list_entry(item->list.prev, struct zbk_item, list);
-	if (prev->begin + prev->len != item->begin)
-		return; /* no, thanks */
+	if (prev->area != item->area || prev->begin + prev->len != item->begin)
+		return 0; /* no, thanks */
+	if (prev->block.datalen != prev->len)
+		return 0; /* aligned for a pinner: there is a hole */
 
 	/* merge: remove from list, fix prev block, remove new control */
 	list_del(&item->list);
@@ -277,7 +488,9 @@ static void zbk_try_merge(struct zbk_instance *zbki, struct zbk_item *item)
 	prevc->nsamples += ctrl->nsamples;		/* meta information */
 
 	zio_free_control(ctrl);
+	zbk_area_put(item->area); /* not the last one: prev has it too */
 	kmem_cache_free(zbk_slab, item);
+	return 1;
 }
 
 /* Store is called by the trigger (for input) or by f->write (for output) */
@@ -287,34 +500,32 @@ static int zbk_store_block(struct zio_bi *bi, struct zio_block *block)
 	struct zio_channel *chan = bi->chan;
 	struct zbk_item *item;
 	unsigned long flags;
-	int awake = 0, pushed = 0, output, first;
+	int pushed = 0, output, first;
 
 	pr_debug("%s:%d (%p, %p)\n", __func__, __LINE__, bi, block);
 
 	item = to_item(block);
 	zio_get_ctrl(block)->mem_offset = item->begin;
+	zio_get_ctrl(block)->reserved = item->area->id;
 
 	output = (bi->flags & ZIO_DIR) == ZIO_DIR_OUTPUT;
 
 	/* add to the buffer instance or push to the trigger */
 	spin_lock_irqsave(&bi->lock, flags);
 	first = list_empty(&zbki->list);
-	if (first) {
-		if (unlikely(output))
-			pushed = zio_trigger_try_push(bi, chan, block);
-		else
-			awake = 1;
-	}
-	if (!pushed)
+	if (first && unlikely(output))
+		pushed = zio_trigger_try_push(bi, chan, block);
+	if (!pushed) {
 		list_add_tail(&item->list, &zbki->list);
-
-	if (!first && zbki->flags & ZBK_FLAG_MERGE_DATA)
-		zbk_try_merge(zbki, item);
+		/*
+		 * A merged block does not change the fill level; otherwise
+		 * the update also awakes user space, for input
+		 */
+		if (first || !(zbki->flags & ZBK_FLAG_MERGE_DATA) ||
+		    !zbk_try_merge(zbki, item))
+			zio_bi_level_update(bi, 1);
+	}
 	spin_unlock_irqrestore(&bi->lock, flags);
-
-	/* if first input, awake user space */
-	if (awake)
-		wake_up_interruptible(&bi->q);
 	return 0;
 }
 
@@ -341,6 +552,7 @@ static struct zio_block *zbk_retr_block(struct zio_bi *bi)
 	first = zbki->list.next;
 	item = list_entry(first, struct zbk_item, list);
 	list_del(&item->list);
+	zio_bi_level_update(bi, -1);
 	awake = 1;
 	spin_unlock_irqrestore(&bi->lock, flags);
 
@@ -352,13 +564,14 @@ static struct zio_block *zbk_retr_block(struct zio_bi *bi)
 out_unlock:
 	spin_unlock_irqrestore(&bi->lock, flags);
 	/* There is no data in buffer, and we may pull to have data soon */
-	ti = bi->cset->ti;
+	rcu_read_lock();
+	ti = zio_cset_ti(bi->cset);
 	if ((bi->flags & ZIO_DIR) == ZIO_DIR_INPUT && ti->t_op->pull_block) {
 		/* chek if trigger is disabled */
-		if (unlikely((ti->flags & ZIO_STATUS) == ZIO_DISABLED))
-			return NULL;
-		ti->t_op->pull_block(ti, bi->chan);
+		if (likely((ti->flags & ZIO_STATUS) != ZIO_DISABLED))
+			ti->t_op->pull_block(ti, bi->chan);
 	}
+	rcu_read_unlock();
 	pr_debug("%s:%d (%p, %p)\n", __func__, __LINE__, bi, NULL);
 	return NULL;
 }
@@ -368,9 +581,6 @@ static struct zio_bi *zbk_create(struct zio_buffer_type *zbuf,
 				 struct zio_channel *chan)
 {
 	struct zbk_instance *zbki;
-	struct zio_ffa *ffa;
-	void *data;
-	size_t size;
 
 	pr_debug("%s:%d\n", __func__, __LINE__);
 
@@ -378,26 +588,17 @@ static struct zio_bi *zbk_create(struct zio_buffer_type *zbuf,
 	if (chan->cset->ssize == 0)
 		return ERR_PTR(-EINVAL);
 
-	size = 1024 * zbuf->zattr_set.std_zattr[ZIO_ATTR_ZBUF_MAXKB].value;
-
-	zbki = kzalloc(sizeof(*zbki), GFP_ATOMIC);
-	ffa = zio_ffa_create(0, size);
-	data = vmalloc(size);
-	if (!zbki || !ffa || !data)
-		goto out_nomem;
-	zbki->size = size;
-	zbki->ffa = ffa;
-	zbki->data = data;
+	/* The area is allocated on first use (see zbk_area_install) */
+	zbki = kzalloc_node(sizeof(*zbki), GFP_ATOMIC,
+			    zio_cset_node(chan->cset));
+	if (!zbki)
+		return ERR_PTR(-ENOMEM);
 	INIT_LIST_HEAD(&zbki->list);
+	INIT_WORK(&zbki->install_work, zbk_install_work);
+	INIT_DELAYED_WORK(&zbki->idle_work, zbk_idle_work);
 
 	/* all the fields of zio_bi are initialied by the caller */
 	return &zbki->bi;
-out_nomem:
-	kfree(zbki);
-	zio_ffa_destroy(ffa);
-	if (data)
-		vfree(data);
-	return ERR_PTR(-ENOMEM);
 }
 
 /* destroy is called by zio on channel removal or if it changes buffer type */
@@ -409,16 +610,74 @@ static void zbk_destroy(struct zio_bi *bi)
 
 	pr_debug("%s:%d\n", __func__, __LINE__);
 
+	cancel_work_sync(&zbki->install_work);
+	cancel_delayed_work_sync(&zbki->idle_work);
 	/* no need to lock here, zio ensures we are not active */
 	list_for_each_safe(pos, tmp, &zbki->list) {
 		item = list_entry(pos, struct zbk_item, list);
 		zbk_free_block(&zbki->bi, &item->block);
 	}
-	vfree(zbki->data);
-	zio_ffa_destroy(zbki->ffa);
+	/* Mappings may still hold the area, it goes with the last of them */
+	if (zbki->area) {
+		zbk_area_retire(zbki->area);
+		zbk_area_put(zbki->area);
+	}
 	kfree(zbki);
 }
 
+/* Pin the current area, allocating it if needed: process context only */
+static int zbk_area_pin(struct zio_bi *bi, struct zio_bi_area *ba)
+{
+	struct zbk_instance *zbki = to_zbki(bi);
+	struct zbk_area *area;
+	unsigned long flags;
+	int err;
+
+	if (ba->align & (ba->align - 1))
+		return -EINVAL;
+	err = zbk_area_install(zbki);
+	if (err)
+		return err;
+	area = zbk_area_get(zbki);
+	if (!area)
+		return -EAGAIN; /* released meanwhile */
+	if (!try_module_get(THIS_MODULE)) {
+		zbk_area_put(area);
+		return -ENODEV;
+	}
+
+	spin_lock_irqsave(&area->lock, flags);
+	if (area->retired) {
+		spin_unlock_irqrestore(&area->lock, flags);
+		zbk_area_put(area);
+		module_put(THIS_MODULE);
+		return -EAGAIN;
+	}
+	if (ba->align > area->align)
+		WRITE_ONCE(area->align, ba->align);
+	list_add(&ba->list, &area->pins);
+	area->npins++;
+	spin_unlock_irqrestore(&area->lock, flags);
+
+	ba->data = area->data;
+	ba->size = area->size;
+	ba->buf_priv = area;
+	return 0;
+}
+
+static void zbk_area_unpin(struct zio_bi_area *ba)
+{
+	struct zbk_area *area = ba->buf_priv;
+	unsigned long flags;
+
+	spin_lock_irqsave(&area->lock, flags);
+	list_del(&ba->list);
+	area->npins--;
+	spin_unlock_irqrestore(&area->lock, flags);
+	zbk_area_put(area);
+	module_put(THIS_MODULE);
+}
+
 static const struct zio_buffer_operations zbk_buffer_ops = {
 	.alloc_block =	zbk_alloc_block,
 	.free_block =	zbk_free_block,
@@ -426,49 +685,57 @@ static const struct zio_buffer_operations zbk_buffer_ops = {
 	.retr_block =	zbk_retr_block,
 	.create =	zbk_create,
 	.destroy =	zbk_destroy,
+	.area_get =	zbk_area_pin,
+	.area_put =	zbk_area_unpin,
 };
 
 /*
- * To support mmap we implement the vm operations. We'll need
- * refcounting later, to safely change the buffer size (which we
- * refuse by now)
+ * To support mmap we implement the vm operations. Each mapping holds
+ * the area that was current when mmap was called: the buffer can be
+ * resized while mapped, and the mapping stays valid for the blocks
+ * whose control reports its area id.
  */
 static void zbk_open(struct vm_area_struct *vma)
 {
 	struct file *f = vma->vm_file;
 	struct zio_f_priv *priv = f->private_data;
-	struct zio_bi *bi = priv->chan->bi;
-	struct zbk_instance *zbki = to_zbki(bi);
+	struct zbk_area *area = vma->vm_private_data;
+	struct zio_bi *bi;
 
-	atomic_inc(&zbki->map_count);
+	if (area) { /* a copy of an existing mapping (split, fork, mremap) */
+		kref_get(&area->ref);
+		return;
+	}
+	/* Called by zio_generic_mmap with bi->lock held, after zbk_mmap */
+	bi = priv->bi;
+	area = to_zbki(bi)->area;
+	if (area)
+		kref_get(&area->ref);
+	vma->vm_private_data = area; /* if NULL, fault fails */
 }
 
 static void zbk_close(struct vm_area_struct *vma)
 {
-	struct file *f = vma->vm_file;
-	struct zio_f_priv *priv = f->private_data;
-	struct zio_bi *bi = priv->chan->bi;
-	struct zbk_instance *zbki = to_zbki(bi);
-
-	atomic_dec(&zbki->map_count);
+	if (vma->vm_private_data)
+		zbk_area_put(vma->vm_private_data);
 }
+
 static int __zbk_fault(struct vm_fault *vmf, struct file *f)
 {
 	struct zio_f_priv *priv = f->private_data;
-	struct zio_bi *bi = priv->chan->bi;
-	struct zbk_instance *zbki = to_zbki(bi);
+	struct zbk_area *area = vmf->vma->vm_private_data;
 	long off = vmf->pgoff * PAGE_SIZE;
 	struct page *p;
 	void *addr;
 
-	if (priv->type == ZIO_CDEV_CTRL)
+	if (priv->type == ZIO_CDEV_CTRL || !area)
 		return VM_FAULT_SIGBUS;
 
-	pr_debug("%s: fault at %li (size %li)\n", __func__, off, zbki->size);
-	if (off > zbki->size)
+	pr_debug("%s: fault at %li (size %li)\n", __func__, off, area->size);
+	if (off >= area->size)
 		return VM_FAULT_SIGBUS;
 
-	addr = zbki->data + off;
+	addr = area->data + off;
 	pr_debug("%s: uaddr %p, off %li: kaddr %p\n", __func__,
 		 address_of(vmf), off, addr);
 	p = vmalloc_to_page(addr);
@@ -502,8 +769,46 @@ static struct vm_operations_struct zbk_vma_ops = {
 	.fault = zbk_fault,
 };
 
+/*
+ * File operations are the generic ones, but opening and mapping a data
+ * device need the area, so they allocate it if the instance has none.
+ */
+static int zbk_f_open(struct inode *inode, struct file *f)
+{
+	struct zio_f_priv *priv = f->private_data;
+	struct zio_bi *bi = priv->bi;
+
+	return zbk_area_install(to_zbki(bi));
+}
+
+static int zbk_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	struct zio_f_priv *priv = f->private_data;
+	struct zio_bi *bi = priv->bi;
+	struct zbk_area *area;
+	int ret;
+
+	/* After a change of buffer type, this may be another instance */
+	if (bi->b_op != &zbk_buffer_ops)
+		return zio_generic_file_operations.mmap(f, vma);
+
+	/* Keep the area while mapping, so it is not released as idle */
+	ret = zbk_area_install(to_zbki(bi));
+	if (ret)
+		return ret;
+	area = zbk_area_get(to_zbki(bi));
+	if (!area)
+		return -EAGAIN;
+	ret = zio_generic_file_operations.mmap(f, vma);
+	zbk_area_put(area);
+	return ret;
+}
+
+static struct file_operations zbk_file_operations;
+
 static struct zio_buffer_type zbk_buffer = {
 	.owner =	THIS_MODULE,
+	.flags =	ZIO_BUF_FLAG_LEVEL,
 	.zattr_set = {
 		.std_zattr = zbk_std_zattr,
 		.ext_zattr = zbk_ext_attr,
@@ -512,21 +817,33 @@ static struct zio_buffer_type zbk_buffer = {
 	.s_op = &zbk_sysfs_ops,
 	.b_op = &zbk_buffer_ops,
 	.v_op = &zbk_vma_ops,
-	.f_op = &zio_generic_file_operations,
+	.f_op = &zbk_file_operations,
 };
 
 static int __init zbk_init(void)
 {
 	int ret;
 
+	zbk_file_operations = zio_generic_file_operations;
+	zbk_file_operations.owner = THIS_MODULE;
+	zbk_file_operations.open = zbk_f_open;
+	zbk_file_operations.mmap = zbk_mmap;
+
 	/* Can't use "zbk_item" as name and KMEM_CACHE_NAMED is not there */
 	zbk_slab = kmem_cache_create("zio-vmalloc", sizeof(struct zbk_item),
 				     __alignof__(struct zbk_item), 0, NULL);
 	if (!zbk_slab)
 		return -ENOMEM;
+	zbk_wq = alloc_workqueue("zio-vmalloc", 0, 0);
+	if (!zbk_wq) {
+		kmem_cache_destroy(zbk_slab);
+		return -ENOMEM;
+	}
 	ret = zio_register_buf(&zbk_buffer, "vmalloc");
-	if (ret < 0)
+	if (ret < 0) {
+		destroy_workqueue(zbk_wq);
 		kmem_cache_destroy(zbk_slab);
+	}
 	return ret;
 
 }
@@ -534,6 +851,7 @@ static int __init zbk_init(void)
 static void __exit zbk_exit(void)
 {
 	zio_unregister_buf(&zbk_buffer);
+	destroy_workqueue(zbk_wq); /* retired areas are freed by now */
 	kmem_cache_destroy(zbk_slab);
 }
 
@@ -12,12 +12,19 @@
 #include <linux/mm.h>
 #include <linux/mutex.h>
 #include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/ktime.h>
 #include <linux/version.h>
 #if KERNEL_VERSION(4, 11, 0) > LINUX_VERSION_CODE
 #include <linux/sched.h>
 #else
 #include <linux/sched/signal.h>
 #endif
+#if KERNEL_VERSION(4, 14, 0) > LINUX_VERSION_CODE
+#include <linux/wait.h>
+#else
+#include <linux/wait_bit.h>
+#endif
 #include <linux/uaccess.h>
 
 #include <linux/zio.h>
@@ -25,9 +32,17 @@
 #include <linux/zio-trigger.h>
 #include "zio-internal.h"
 
-static DEFINE_MUTEX(zmutex);
 static struct zio_status *zstat = &zio_global_status; /* Always use ptr */
 
+#if KERNEL_VERSION(3, 19, 0) > LINUX_VERSION_CODE
+#define replace_fops(f, fops) \
+	do {	\
+		struct file *__file = (f); \
+		fops_put(__file->f_op); \
+		BUG_ON(!(__file->f_op = (fops))); \
+	} while (0)
+#endif
+
 static int zio_dev_uevent(struct device *dev, struct kobj_uevent_env *env)
 {
 	unsigned long *flags;
@@ -59,61 +74,78 @@ static struct class zio_cdev_class = {
 	.devnode	= zio_devnode,
 };
 
-/* Retrieve a channel from one of its minors */
+/*
+ * Retrieve a channel from one of its minors. Both minors of a channel
+ * map to the same idr slot; call with rcu_read_lock held.
+ */
 static struct zio_channel *zio_minor_to_chan(int minor)
 {
-	struct zio_cset *zcset;
-	int chindex, found = 0;
-
-	list_for_each_entry(zcset, &zstat->list_cset, list_cset) {
-		if (minor >= zcset->minor && minor <= zcset->maxminor) {
-			found = 1;
-			break;
-		}
-	}
-	if (!found)
-		return NULL;
-	chindex = (minor - zcset->minor) / 2;
-	return zcset->chan + chindex;
+	return idr_find(&zstat->chan_idr, minor / 2);
 }
 
 static inline int zio_channel_get(struct zio_channel *chan)
 {
 	return try_module_get(chan->cset->zdev->owner);
-	/* bi use count is done in the caller */
+	/* the buffer instance is taken by the caller */
 }
 static inline void zio_channel_put(struct zio_channel *chan)
 {
-	atomic_dec(&chan->bi->use_count);
 	module_put(chan->cset->zdev->owner);
 }
 
+/*
+ * Each file works on the buffer instance it got at open time, which is
+ * the current one of the channel unless the buffer type is changed while
+ * the file is open (see zio_f_follow). The file holds the device and
+ * the module of the instance, so a replaced instance lives until its
+ * last file moves on. Call with rcu_read_lock held: a replaced instance
+ * is only released after a grace period.
+ */
+static int __zio_f_bi_get(struct zio_f_priv *priv, struct zio_bi *bi)
+{
+	if (!try_module_get(bi->f_op->owner))
+		return -ENODEV;
+	get_device(&bi->head.dev);
+	atomic_inc(&bi->use_count);
+	priv->bi = bi;
+	return 0;
+}
+
+static void __zio_f_bi_release(struct zio_bi *bi)
+{
+	struct module *owner = bi->f_op->owner;
+
+	put_device(&bi->head.dev);
+	module_put(owner);
+}
+
+static void __zio_f_bi_put(struct zio_bi *bi)
+{
+	atomic_dec(&bi->use_count);
+	__zio_f_bi_release(bi);
+}
+
 static int zio_f_open(struct inode *ino, struct file *f)
 {
 	struct zio_f_priv *priv = NULL;
 	struct zio_channel *chan;
-	struct zio_buffer_type *zbuf;
-	const struct file_operations *old_fops, *new_fops;
-	unsigned long flags;
+	struct zio_bi *bi;
+	const struct file_operations *new_fops;
 	int err, minor;
 
 	minor = iminor(ino);
+	rcu_read_lock();
 	chan = zio_minor_to_chan(minor);
+	if (chan && (!zio_chan_bi(chan) || !zio_channel_get(chan)))
+		chan = NULL;
+	rcu_read_unlock();
 
-	if (!chan || !chan->bi || !zio_channel_get(chan)) {
+	if (!chan) {
 		pr_err("%s: no channel or no buffer for minor %i\n",
 			__func__, minor);
 		return -ENODEV;
 	}
 
-	/* Take the cset lock to protect against a cset-wide buffer change */
-	spin_lock_irqsave(&chan->cset->lock, flags);
-	atomic_inc(&chan->bi->use_count);
-	err = (chan->bi->flags & ZIO_STATUS) == ZIO_DISABLED ? -EAGAIN : 0;
-	spin_unlock_irqrestore(&chan->cset->lock, flags);
-	if (err)
-		goto out;
-
 	priv = kzalloc(sizeof(struct zio_f_priv), GFP_KERNEL);
 	if (!priv) {
 		err = -ENOMEM;
@@ -121,32 +153,47 @@ static int zio_f_open(struct inode *ino, struct file *f)
 	}
 	priv->chan = chan;
 
+	rcu_read_lock();
+	err = __zio_f_bi_get(priv, zio_chan_bi(chan));
+	rcu_read_unlock();
+	if (err)
+		goto out;
+	bi = priv->bi;
+	if ((READ_ONCE(bi->flags) & ZIO_STATUS) == ZIO_DISABLED) {
+		err = -EAGAIN;
+		goto out_bi;
+	}
+
 	/* even number is control, odd number is data */
 	if (minor & 0x1)
 		priv->type = ZIO_CDEV_DATA;
 	else
 		priv->type = ZIO_CDEV_CTRL;
 
-	/* Change the file operations, locking the status structure */
-	mutex_lock(&zmutex);
-	old_fops = f->f_op;
-	zbuf = chan->cset->zbuf;
-	new_fops = fops_get(zbuf->f_op);
-	err = 0;
-	if (new_fops->open)
-		err = new_fops->open(ino, f);
-	if (err) {
-		fops_put(zbuf->f_op);
-		mutex_unlock(&zmutex);
-		goto out;
+	/*
+	 * Change the file operations to those of the buffer instance, as
+	 * misc_open does: the file is not shared yet, so no lock is needed.
+	 * If the new open fails, the VFS releases the new f_op for us.
+	 */
+	new_fops = fops_get(bi->f_op);
+	if (!new_fops) {
+		err = -ENODEV;
+		goto out_bi;
+	}
+	f->private_data = priv; /* the buffer open method may use it */
+	replace_fops(f, new_fops);
+	if (f->f_op->open) {
+		err = f->f_op->open(ino, f);
+		if (err) {
+			f->private_data = NULL;
+			goto out_bi;
+		}
 	}
-	fops_put(old_fops);
-	f->f_op = new_fops;
-	mutex_unlock(&zmutex);
 
-	f->private_data = priv;
 	return 0;
 
+out_bi:
+	__zio_f_bi_put(bi);
 out:
 	kfree(priv);
 	zio_channel_put(chan);
@@ -158,15 +205,19 @@ static const struct file_operations zfops = {
 	.open = zio_f_open,
 };
 
-/* set the base minor for a cset*/
+/* set the base minor for a cset (always even: minor / 2 is the channel) */
 int zio_minorbase_get(struct zio_cset *zcset)
 {
 	unsigned long i;
 	int nminors = zcset->n_chan * 2;
 
-	zio_ffa_reset(zstat->minors); /* always start from zero */
-	i = zio_ffa_alloc(zstat->minors, nminors, GFP_ATOMIC);
-	if (i == ZIO_FFA_NOSPACE)
+	spin_lock(&zstat->lock);
+	i = bitmap_find_next_zero_area(zstat->minors, ZIO_NR_MINORS, 0,
+				       nminors, 1);
+	if (i < ZIO_NR_MINORS)
+		bitmap_set(zstat->minors, i, nminors);
+	spin_unlock(&zstat->lock);
+	if (i >= ZIO_NR_MINORS)
 		return -ENOMEM;
 	zcset->minor = i;
 	zcset->maxminor = i + nminors - 1;
@@ -176,7 +227,50 @@ void zio_minorbase_put(struct zio_cset *zcset)
 {
 	int nminors = zcset->n_chan * 2;
 
-	zio_ffa_free_s(zstat->minors, zcset->minor, nminors);
+	spin_lock(&zstat->lock);
+	bitmap_clear(zstat->minors, zcset->minor, nminors);
+	spin_unlock(&zstat->lock);
+}
+
+/*
+ * Make the channels of a cset reachable from open. The idr is allocated
+ * outside of the lock (idr_preload), so registering thousands of channels
+ * never allocates with the global lock held.
+ */
+int zio_minors_publish(struct zio_cset *zcset)
+{
+	int i, id, base = zcset->minor / 2;
+
+	for (i = 0; i < zcset->n_chan; i++) {
+		idr_preload(GFP_KERNEL);
+		spin_lock(&zstat->lock);
+		id = idr_alloc(&zstat->chan_idr, zcset->chan + i, base + i,
+			       base + i + 1, GFP_NOWAIT);
+		spin_unlock(&zstat->lock);
+		idr_preload_end();
+		if (id < 0)
+			goto out;
+	}
+	return 0;
+out:
+	spin_lock(&zstat->lock);
+	while (--i >= 0)
+		idr_remove(&zstat->chan_idr, base + i);
+	spin_unlock(&zstat->lock);
+	synchronize_rcu();
+	return id;
+}
+
+/* After this returns no open can find the channels of the cset */
+void zio_minors_unpublish(struct zio_cset *zcset)
+{
+	int i, base = zcset->minor / 2;
+
+	spin_lock(&zstat->lock);
+	for (i = 0; i < zcset->n_chan; i++)
+		idr_remove(&zstat->chan_idr, base + i);
+	spin_unlock(&zstat->lock);
+	synchronize_rcu();
 }
 
 /*
@@ -252,7 +346,8 @@ int zio_register_cdev()
 		goto out;
 	}
 	/* alloc to zio the maximum number of minors usable in ZIO */
-	zstat->minors = zio_ffa_create(0, ZIO_NR_MINORS);
+	bitmap_zero(zstat->minors, ZIO_NR_MINORS);
+	idr_init(&zstat->chan_idr);
 	err = alloc_chrdev_region(&zstat->basedev, 0, ZIO_NR_MINORS, "zio");
 	if (err) {
 		pr_err("%s: unable to allocate region for %i minors\n",
@@ -265,13 +360,12 @@ int zio_register_cdev()
 	err = cdev_add(&zstat->chrdev, zstat->basedev, ZIO_NR_MINORS);
 	if (err)
 		goto out_cdev;
-	INIT_LIST_HEAD(&zstat->list_cset);
 	return 0;
 out_cdev:
 	unregister_chrdev_region(zstat->basedev, ZIO_NR_MINORS);
 out:
 	class_unregister(&zio_cdev_class);
-	zio_ffa_destroy(zstat->minors);
+	idr_destroy(&zstat->chan_idr);
 
 	return err;
 }
@@ -280,74 +374,74 @@ void zio_unregister_cdev()
 	cdev_del(&zstat->chrdev);
 	unregister_chrdev_region(zstat->basedev, ZIO_NR_MINORS);
 	class_unregister(&zio_cdev_class);
-	zio_ffa_destroy(zstat->minors);
+	idr_destroy(&zstat->chan_idr);
 }
 
 
 /*
- * Helper functions to check whether read and write would block. The
- * return value is a poll(2) mask, so the poll method just calls them.
- * We need locking, so to avoid hairy ifs we split read/write and ctrl/data
- * Both functions return with a user block if read/write can happen.
+ * The block being transferred with user space (chan->user_block, with its
+ * uoff and cdone, and chan->user_bi it comes from) belongs to whoever
+ * holds ZIO_CHAN_USER_BUSY in chan->user_flags. The common case, one
+ * reader or writer per channel, takes the bit with a single atomic
+ * operation and copies with no lock held. If the bit is busy (more files or threads on the same channel)
+ * callers queue on user_lock and sleep on the bit, so no task spins.
  */
-
-static int zio_can_r_ctrl(struct zio_f_priv *priv)
+int zio_user_block_get(struct zio_channel *chan, unsigned int mode)
 {
-	struct zio_channel *chan = priv->chan;
-	struct zio_bi *bi = chan->bi;
-	const int ret_ok =  POLLIN | POLLRDNORM;
-	int ret;
-
-	dev_dbg(&bi->head.dev, "%s: channel %d in cset %d", __func__,
-		bi->chan->index, bi->chan->cset->index);
+	int err;
 
-	/* If we want to read control, we discard any trailing data */
-	mutex_lock(&chan->user_lock);
-
-	/* Control: if not yet done, we can read */
-	if (chan->user_block) {
-		if (zio_is_cdone(chan->user_block)) {
-			zio_buffer_free_block(bi, chan->user_block);
-			chan->user_block = NULL;
-		} else{
-			mutex_unlock(&chan->user_lock);
-			return ret_ok;
-		}
+	if (likely(!test_and_set_bit_lock(ZIO_CHAN_USER_BUSY,
+					  &chan->user_flags)))
+		return 0;
+	if (mode == TASK_INTERRUPTIBLE) {
+		if (mutex_lock_interruptible(&chan->user_lock))
+			return -ERESTARTSYS;
+	} else {
+		mutex_lock(&chan->user_lock);
 	}
-
-	/* We want to re-read control. Get a new block */
-	chan->user_block = zio_buffer_retr_block(bi);
-	ret = 0;
-	if (chan->user_block)
-		ret = ret_ok;
-	else if (unlikely(bi->cset->ti->flags & ZIO_DISABLED))
-		ret = POLLERR;
-
+	err = wait_on_bit_lock(&chan->user_flags, ZIO_CHAN_USER_BUSY, mode);
 	mutex_unlock(&chan->user_lock);
-	return ret;
+	return err ? -ERESTARTSYS : 0;
+}
+EXPORT_SYMBOL(zio_user_block_get);
+
+void zio_user_block_put(struct zio_channel *chan)
+{
+	clear_bit_unlock(ZIO_CHAN_USER_BUSY, &chan->user_flags);
+	smp_mb__after_atomic();
+	wake_up_bit(&chan->user_flags, ZIO_CHAN_USER_BUSY);
 }
+EXPORT_SYMBOL(zio_user_block_put);
 
-static int zio_can_r_data(struct zio_f_priv *priv)
+/*
+ * The following helpers are called with the user block held. They
+ * return the block to be transferred, retrieving or allocating a new one
+ * if needed, or NULL if read/write would block.
+ */
+static struct zio_block *__zio_user_r_block(struct zio_f_priv *priv)
 {
 	struct zio_channel *chan = priv->chan;
-	struct zio_block *block;
-	struct zio_bi *bi = chan->bi;
-	const int ret_ok =  POLLIN | POLLRDNORM;
+	struct zio_block *block = chan->user_block;
+	struct zio_bi *bi = priv->bi;
 
-	if (!chan->cset->ssize)
-		return 0;
+	if (priv->type == ZIO_CDEV_DATA && !chan->cset->ssize)
+		return NULL;
 
-	mutex_lock(&chan->user_lock);
-	block = chan->user_block;
-	if (block) {
-		mutex_unlock(&chan->user_lock);
-		return ret_ok;
+	/* If we want to read control, we discard any trailing data */
+	if (block && priv->type == ZIO_CDEV_CTRL && zio_is_cdone(block)) {
+		zio_buffer_free_block(chan->user_bi, block);
+		block = NULL;
 	}
-	block = chan->user_block = zio_buffer_retr_block(bi);
-	mutex_unlock(&chan->user_lock);
-	if (block)
-		return ret_ok;
-	return 0;
+	if (!block) {
+		/* This may ask the trigger to pull */
+		block = zio_buffer_retr_block(bi);
+		if (block) {
+			set_bit(ZIO_CHAN_USER_CTRL, &chan->user_flags);
+			chan->user_bi = bi;
+		}
+	}
+	WRITE_ONCE(chan->user_block, block);
+	return block;
 }
 
 static struct zio_block *__zio_write_allocblock(struct zio_bi *bi)
@@ -355,18 +449,24 @@ static struct zio_block *__zio_write_allocblock(struct zio_bi *bi)
 	struct zio_cset *cset = bi->chan->cset;
 	size_t datalen;
 
-	datalen = cset->ssize * cset->ti->nsamples;
+	/* With the "block" policy writers wait for the low watermark */
+	if (bi->policy == ZIO_BI_POLICY_BLOCK && (bi->flags & ZIO_BI_WM_HIGH))
+		return NULL;
+	rcu_read_lock();
+	datalen = cset->ssize * zio_cset_ti(cset)->nsamples;
+	rcu_read_unlock();
 	return zio_buffer_alloc_block(bi, datalen, GFP_KERNEL);
 }
 
-static int zio_can_w_ctrl(struct zio_f_priv *priv)
+static struct zio_block *__zio_user_w_block(struct zio_f_priv *priv)
 {
 	struct zio_channel *chan = priv->chan;
-	struct zio_bi *bi = chan->bi;
-	struct zio_block *block;
+	struct zio_block *block = chan->user_block;
+	struct zio_bi *bi = priv->bi;
 	struct zio_control *ctrl;
-	const int ret_ok = POLLOUT | POLLWRNORM;
-	int ret;
+
+	if (priv->type == ZIO_CDEV_DATA && !chan->cset->ssize)
+		return NULL;
 
 	/*
 	 * A control can always be written. Writing a control means a
@@ -375,46 +475,167 @@ static int zio_can_w_ctrl(struct zio_f_priv *priv)
 	 * FIXME: shall we pick the nsamples from this control?
 	 * We currently obey trigger configuration and ignore the control.
 	 */
-	mutex_lock(&chan->user_lock);
-	block = chan->user_block;
-	if (block && block->uoff) {
+	if (priv->type == ZIO_CDEV_CTRL && block && block->uoff) {
 		/* store a partial block */
 		ctrl = zio_get_ctrl(block);
 		ctrl->nsamples = block->uoff / chan->cset->ssize;
 		if (ctrl->nsamples)
-			zio_buffer_store_block(bi, block);
+			zio_buffer_store_block(chan->user_bi, block);
 		else
-		        zio_buffer_free_block(chan->bi, block);
+			zio_buffer_free_block(chan->user_bi, block);
 		block = NULL;
 	}
-	/* if no block is there, get a new one */
-	if (!block)
-		block = chan->user_block = __zio_write_allocblock(bi);
-	ret = 0;
-	if (block)
-		ret = ret_ok;
-	else if (unlikely(bi->cset->ti->flags & ZIO_DISABLED))
-		ret = POLLERR;
-	mutex_unlock(&chan->user_lock);
+	/* if no block is there, get a new one (not from a replaced buffer) */
+	if (!block && likely(bi == READ_ONCE(chan->bi))) {
+		block = __zio_write_allocblock(bi);
+		if (block)
+			chan->user_bi = bi;
+	}
+	WRITE_ONCE(chan->user_block, block);
+	return block;
+}
+
+/*
+ * When the buffer type changes, files opened earlier keep working on the
+ * replaced instance, so blocks already stored there reach user space.
+ * When it is empty the file moves to the current instance of the channel.
+ * Nothing new is stored in a replaced instance: the trigger was aborted
+ * before the change and its blocks returned to the old instance, and
+ * writers don't allocate from it (zio_change_current_buffer refuses the
+ * change if an output instance is not empty). Buffer types that don't
+ * report their level look empty, so files move at once, as they used to.
+ */
+static inline int zio_f_stale(struct zio_f_priv *priv)
+{
+	return unlikely(priv->bi != READ_ONCE(priv->chan->bi)) &&
+		!atomic_read(&priv->bi->nblocks);
+}
+
+static void zio_f_bi_leave(struct zio_f_priv *priv, struct zio_bi *bi);
+
+/* Returns 1 if the file moved to another buffer instance */
+static int zio_f_follow(struct zio_f_priv *priv)
+{
+	struct zio_bi *old = priv->bi;
+	int err;
+
+	if (!zio_f_stale(priv))
+		return 0;
+	rcu_read_lock();
+	err = __zio_f_bi_get(priv, zio_chan_bi(priv->chan));
+	rcu_read_unlock();
+	if (err)
+		return 0;
+	zio_f_bi_leave(priv, old);
+	return 1;
+}
+
+/*
+ * Readiness for poll(2). Unlike the functions above, these don't take
+ * the user block and never retrieve or allocate a block: they look at the
+ * buffer fill level and at the block being transferred with user space,
+ * so poll has no side effects on the trigger and costs little for idle
+ * channels. A spurious result is harmless: read and write check again.
+ */
+static unsigned int zio_ti_disabled(struct zio_cset *cset)
+{
+	unsigned int ret;
+
+	rcu_read_lock();
+	ret = zio_cset_ti(cset)->flags & ZIO_DISABLED;
+	rcu_read_unlock();
 	return ret;
 }
 
-static int zio_can_w_data(struct zio_f_priv *priv)
+static unsigned int zio_r_ready(struct zio_f_priv *priv)
 {
 	struct zio_channel *chan = priv->chan;
-	struct zio_bi *bi = chan->bi;
-	struct zio_block *block;
-	const int ret_ok = POLLOUT | POLLWRNORM;
+	struct zio_bi *bi = priv->bi;
+	const unsigned int ret_ok = POLLIN | POLLRDNORM;
 
-	if (!chan->cset->ssize)
+	if (priv->type == ZIO_CDEV_DATA && !chan->cset->ssize)
 		return 0;
+	if (atomic_read(&bi->nblocks))
+		return ret_ok;
+	if (READ_ONCE(chan->user_block) && (priv->type == ZIO_CDEV_DATA ||
+			test_bit(ZIO_CHAN_USER_CTRL, &chan->user_flags)))
+		return ret_ok;
+	if (priv->type == ZIO_CDEV_CTRL && unlikely(zio_ti_disabled(chan->cset)))
+		return POLLERR;
+	return 0;
+}
 
-	mutex_lock(&chan->user_lock);
-	block = chan->user_block;
-	if (!block)
-		block = chan->user_block = __zio_write_allocblock(bi);
-	mutex_unlock(&chan->user_lock);
-	return block ? ret_ok : 0;
+static unsigned int zio_w_ready(struct zio_f_priv *priv)
+{
+	struct zio_channel *chan = priv->chan;
+	struct zio_bi *bi = priv->bi;
+	unsigned long bflags = READ_ONCE(bi->flags);
+	const unsigned int ret_ok = POLLOUT | POLLWRNORM;
+
+	if (priv->type == ZIO_CDEV_DATA && !chan->cset->ssize)
+		return 0;
+	if (READ_ONCE(chan->user_block))
+		return ret_ok;
+	/* Same conditions as __zio_write_allocblock(), without allocating */
+	if (!(bflags & ZIO_BI_NOSPACE) &&
+	    !(bi->policy == ZIO_BI_POLICY_BLOCK && (bflags & ZIO_BI_WM_HIGH)))
+		return ret_ok;
+	if (priv->type == ZIO_CDEV_CTRL && unlikely(zio_ti_disabled(chan->cset)))
+		return POLLERR;
+	return 0;
+}
+
+/*
+ * Wait conditions for read and write (and poll, if the file opted in
+ * for pulling): get a block if the user block is free, but never sleep.
+ * If somebody else holds the user block, report lockless readiness.
+ */
+static unsigned int zio_r_try(struct zio_f_priv *priv)
+{
+	struct zio_channel *chan = priv->chan;
+	struct zio_block *block;
+
+	if (test_and_set_bit_lock(ZIO_CHAN_USER_BUSY, &chan->user_flags))
+		return zio_r_ready(priv);
+	block = __zio_user_r_block(priv);
+	zio_user_block_put(chan);
+	return block ? POLLIN | POLLRDNORM : zio_r_ready(priv);
+}
+
+static unsigned int zio_w_try(struct zio_f_priv *priv)
+{
+	struct zio_channel *chan = priv->chan;
+	struct zio_block *block;
+
+	if (test_and_set_bit_lock(ZIO_CHAN_USER_BUSY, &chan->user_flags))
+		return zio_w_ready(priv);
+	block = __zio_user_w_block(priv);
+	zio_user_block_put(chan);
+	return block ? POLLOUT | POLLWRNORM : zio_w_ready(priv);
+}
+
+/*
+ * Busy polling: spin until a block is stored in the buffer, for up to
+ * the budget of this file. In read the caller already tried to retrieve
+ * a block, so the trigger has been asked to pull if it supports it.
+ * Returns 1 if a block arrived, 0 if the budget is over or we must yield.
+ */
+static int zio_busy_poll(struct zio_f_priv *priv)
+{
+	struct zio_bi *bi = priv->bi;
+	s64 end;
+
+	if (bi->flags & ZIO_BI_NO_LEVEL)
+		return 0; /* we can't see the block arrive */
+	end = ktime_to_ns(ktime_get()) +
+		(s64)priv->busy_poll_usec * NSEC_PER_USEC;
+	while (!atomic_read(&bi->nblocks)) {
+		if (need_resched() || signal_pending(current) ||
+		    ktime_to_ns(ktime_get()) > end)
+			return 0;
+		cpu_relax();
+	}
+	return 1;
 }
 
 /*
@@ -427,10 +648,9 @@ static ssize_t zio_generic_read(struct file *f, char __user *ubuf,
 {
 	struct zio_f_priv *priv = f->private_data;
 	struct zio_channel *chan = priv->chan;
-	struct zio_bi *bi = chan->bi;
+	struct zio_bi *bi = priv->bi;
 	struct zio_block *block;
-	int (*can_read)(struct zio_f_priv *);
-	int fault, rflags;
+	int fault, err;
 
 	dev_dbg(&bi->head.dev, "%s:%d type %s\n", __func__, __LINE__,
 		priv->type == ZIO_CDEV_CTRL ? "ctrl" : "data");
@@ -438,63 +658,58 @@ static ssize_t zio_generic_read(struct file *f, char __user *ubuf,
 	if ((bi->flags & ZIO_DIR) == ZIO_DIR_OUTPUT)
 		return -EINVAL;
 
-	can_read = zio_can_r_data;
 	if (unlikely(priv->type == ZIO_CDEV_CTRL)) {
 		if (count < zio_control_size(chan))
 			return -EINVAL;
 		count = zio_control_size(chan);
-		can_read = zio_can_r_ctrl;
 	}
 
 	while (1) {
-		rflags = can_read(priv);
-		if (rflags == 0 || rflags == POLLERR) {
-			if (f->f_flags & O_NONBLOCK)
-				return -EAGAIN;
-			wait_event_interruptible(bi->q, can_read(priv));
-			if (signal_pending(current))
-				return -ERESTARTSYS;
-		}
+		err = zio_user_block_get(chan, TASK_INTERRUPTIBLE);
+		if (err)
+			return err;
+		block = __zio_user_r_block(priv);
+		if (block)
+			break;
+		zio_user_block_put(chan);
 
-		/* So, it has been readable, at least for a little while */
-		mutex_lock(&chan->user_lock);
-		block = chan->user_block;
-		if (!block) {
-			mutex_unlock(&chan->user_lock);
+		if (zio_f_follow(priv))
 			continue;
-		}
+		if (priv->busy_poll_usec && zio_busy_poll(priv))
+			continue;
+		if (f->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		bi = priv->bi;
+		wait_event_interruptible(bi->q, zio_r_try(priv) ||
+					 zio_f_stale(priv));
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+	}
 
-		if (unlikely(priv->type == ZIO_CDEV_CTRL)) {
-			if (zio_is_cdone(block)) {
-				mutex_unlock(&chan->user_lock);
-				continue;
-			}
-			fault = copy_to_user(ubuf, zio_get_ctrl(block), count);
-			mutex_unlock(&chan->user_lock);
-			if (fault)
-				return -EFAULT;
+	/* We own the user block: copy with no lock held */
+	if (unlikely(priv->type == ZIO_CDEV_CTRL)) {
+		fault = copy_to_user(ubuf, zio_get_ctrl(block), count);
+		if (!fault) {
 			zio_set_cdone(block);
-			*offp += count;
-			return count;
+			clear_bit(ZIO_CHAN_USER_CTRL, &chan->user_flags);
 		}
-
-		/* data */
+	} else {
 		if (count > block->datalen - block->uoff)
 			count = block->datalen - block->uoff;
 		fault = copy_to_user(ubuf, block->data + block->uoff, count);
 		if (!fault) {
 			block->uoff += count;
 			if (block->uoff == block->datalen) {
-				chan->user_block = NULL;
-				zio_buffer_free_block(bi, block);
+				WRITE_ONCE(chan->user_block, NULL);
+				zio_buffer_free_block(chan->user_bi, block);
 			}
 		}
-		mutex_unlock(&chan->user_lock);
-		if (fault)
-			return -EFAULT;
-		*offp += count;
-		return count;
 	}
+	zio_user_block_put(chan);
+	if (fault)
+		return -EFAULT;
+	*offp += count;
+	return count;
 }
 
 static ssize_t zio_generic_write(struct file *f, const char __user *ubuf,
@@ -502,10 +717,9 @@ static ssize_t zio_generic_write(struct file *f, const char __user *ubuf,
 {
 	struct zio_f_priv *priv = f->private_data;
 	struct zio_channel *chan = priv->chan;
-	struct zio_bi *bi = chan->bi;
+	struct zio_bi *bi = priv->bi;
 	struct zio_block *block;
-	int (*can_write)(struct zio_f_priv *);
-	int fault, wflags;
+	int fault, err;
 
 	dev_dbg(&bi->head.dev, "%s:%d type %s\n", __func__, __LINE__,
 		priv->type == ZIO_CDEV_CTRL ? "ctrl" : "data");
@@ -513,75 +727,68 @@ static ssize_t zio_generic_write(struct file *f, const char __user *ubuf,
 	if ((bi->flags & ZIO_DIR) == ZIO_DIR_INPUT)
 		return -EINVAL;
 
-	can_write = zio_can_w_data;
 	if (unlikely(priv->type == ZIO_CDEV_CTRL)) {
 		if (count < zio_control_size(chan))
 			return -EINVAL;
-		can_write = zio_can_w_ctrl;
+		count = zio_control_size(chan);
 	}
 
 	while (1) {
-		wflags = can_write(priv);
-		if (wflags == 0 || wflags == POLLERR) {
-			if (f->f_flags & O_NONBLOCK)
-				return -EAGAIN;
-			wait_event_interruptible(bi->q, can_write(priv));
-			if (signal_pending(current))
-				return -ERESTARTSYS;
-		}
+		err = zio_user_block_get(chan, TASK_INTERRUPTIBLE);
+		if (err)
+			return err;
+		block = __zio_user_w_block(priv);
+		if (block)
+			break;
+		zio_user_block_put(chan);
 
-		/* So, it has been writeable, at least for a little while */
-		mutex_lock(&chan->user_lock);
-		block = chan->user_block;
-		if (!block) {
-			mutex_unlock(&chan->user_lock);
+		if (zio_f_follow(priv))
 			continue;
-		}
+		if (f->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		bi = priv->bi;
+		wait_event_interruptible(bi->q, zio_w_try(priv) ||
+					 zio_f_stale(priv));
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+	}
 
-		if (unlikely(priv->type == ZIO_CDEV_CTRL)) {
-			count = zio_control_size(chan);
-			/*
-			 * FIXME: what shall we do for already-filled data?
-			 * we are currently discarding it
-			 */
-			block->uoff = 0;
-			fault = copy_from_user(zio_get_ctrl(block), ubuf,
-					       count);
-			/* FIXME: preserve some fields in the output ctrl */
-			if (!fault && !chan->cset->ssize) {
-				zio_buffer_store_block(bi, block); /* 0-size */
-				chan->user_block = NULL;
-			}
-			mutex_unlock(&chan->user_lock);
-			if (fault)
-				return -EFAULT;
-			*offp += count;
-			return count;
+	/* We own the user block: copy with no lock held */
+	if (unlikely(priv->type == ZIO_CDEV_CTRL)) {
+		/*
+		 * FIXME: what shall we do for already-filled data?
+		 * we are currently discarding it
+		 */
+		block->uoff = 0;
+		fault = copy_from_user(zio_get_ctrl(block), ubuf, count);
+		/* FIXME: preserve some fields in the output ctrl */
+		if (!fault && !chan->cset->ssize) {
+			WRITE_ONCE(chan->user_block, NULL);
+			zio_buffer_store_block(chan->user_bi, block); /* 0-size */
 		}
-
-		/* data */
+	} else {
 		if (count > block->datalen - block->uoff)
 			count =  block->datalen - block->uoff;
 		fault = copy_from_user(block->data + block->uoff, ubuf, count);
 		if (!fault) {
 			block->uoff += count;
 			if (block->uoff == block->datalen) {
-				zio_buffer_store_block(bi, block);
-				chan->user_block = NULL;
+				WRITE_ONCE(chan->user_block, NULL);
+				zio_buffer_store_block(chan->user_bi, block);
 			}
 		}
-		mutex_unlock(&chan->user_lock);
-		if (fault)
-			return -EFAULT;
-		*offp += count;
-		return count;
 	}
+	zio_user_block_put(chan);
+	if (fault)
+		return -EFAULT;
+	*offp += count;
+	return count;
 }
 
 static int zio_generic_mmap(struct file *f, struct vm_area_struct *vma)
 {
 	struct zio_f_priv *priv = f->private_data;
-	struct zio_bi *bi = priv->chan->bi;
+	struct zio_bi *bi = priv->bi;
 	const struct vm_operations_struct *v_op = bi->v_op;
 	unsigned long flags;
 	int ret;
@@ -608,34 +815,108 @@ static unsigned int zio_generic_poll(struct file *f,
 				     struct poll_table_struct *w)
 {
 	struct zio_f_priv *priv = f->private_data;
-	struct zio_bi *bi = priv->chan->bi;
+	struct zio_bi *bi;
+	unsigned int mask;
 
+	/* Before poll_wait: we must wait on the queue of the right instance */
+	zio_f_follow(priv);
+	bi = priv->bi;
 	dev_dbg(&bi->head.dev, "%s: channel %d in cset %d", __func__,
 		bi->chan->index, bi->chan->cset->index);
 	poll_wait(f, &bi->q, w);
 
 	if ((bi->flags & ZIO_DIR) == ZIO_DIR_OUTPUT) {
-		if (unlikely(priv->type == ZIO_CDEV_CTRL))
-			return zio_can_w_ctrl(priv);
-		return zio_can_w_data(priv);
+		mask = zio_w_ready(priv);
+	} else {
+		mask = zio_r_ready(priv);
+		if (!mask && priv->busy_poll_usec && zio_busy_poll(priv))
+			mask = zio_r_ready(priv);
+		/*
+		 * Opt-in: retrieve a block, so the trigger may pull. Without
+		 * a fill level this is the only way to know, as it used to be
+		 */
+		if (!mask && (priv->poll_pull || (bi->flags & ZIO_BI_NO_LEVEL)))
+			mask = zio_r_try(priv);
 	}
-	if (unlikely(priv->type == ZIO_CDEV_CTRL))
-		return zio_can_r_ctrl(priv);
-	return zio_can_r_data(priv);
+	/* Above the high watermark: tell users before data is lost */
+	if (bi->flags & ZIO_BI_WM_HIGH)
+		mask |= POLLPRI;
+	return mask;
 }
 
-static int zio_generic_release(struct inode *inode, struct file *f)
+/* Attach the watermark eventfd to the buffer instance, or detach it */
+static long zio_wm_eventfd_set(struct zio_bi *bi, int fd)
+{
+	struct eventfd_ctx *ctx = NULL, *old;
+	unsigned long flags;
+
+	if (fd >= 0) {
+		ctx = eventfd_ctx_fdget(fd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
+	}
+	spin_lock_irqsave(&bi->lock, flags);
+	old = bi->wm_evfd;
+	bi->wm_evfd = ctx;
+	spin_unlock_irqrestore(&bi->lock, flags);
+	if (old)
+		eventfd_ctx_put(old);
+	return 0;
+}
+
+/*
+ * Commands handled here are valid for any buffer. Buffers with their own
+ * ioctl method should call this one for the commands they don't know.
+ * Arguments are passed by value, so this works for compat_ioctl too.
+ */
+static long zio_generic_ioctl(struct file *f, unsigned int cmd,
+			      unsigned long arg)
 {
 	struct zio_f_priv *priv = f->private_data;
+	struct zio_bi *bi = priv->bi;
+
+	switch (cmd) {
+	case ZIO_IOC_WM_EVENTFD:
+		return zio_wm_eventfd_set(bi, (int)arg);
+	case ZIO_IOC_BUSY_POLL:
+		if (arg > ZIO_BUSY_POLL_MAX_USEC)
+			return -EINVAL;
+		priv->busy_poll_usec = arg;
+		return 0;
+	case ZIO_IOC_POLL_PULL:
+		priv->poll_pull = !!arg;
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* The file stops using a buffer instance: at close time, or to follow */
+static void zio_f_bi_leave(struct zio_f_priv *priv, struct zio_bi *bi)
+{
 	struct zio_channel *chan = priv->chan;
-	struct zio_block *block = chan->user_block;
 
-	mutex_lock(&chan->user_lock);
-	if (atomic_read(&chan->bi->use_count) == 1 && chan->user_block) {
-		zio_buffer_free_block(chan->bi, block);
+	/* Exactly one of concurrent closers sees the count reach zero */
+	if (!atomic_dec_and_test(&bi->use_count))
+		goto out;
+	zio_user_block_get(chan, TASK_UNINTERRUPTIBLE);
+	if (chan->user_block && chan->user_bi == bi) {
+		zio_buffer_free_block(bi, chan->user_block);
 		chan->user_block = NULL;
 	}
-	mutex_unlock(&chan->user_lock);
+	zio_user_block_put(chan);
+	/* Last user: nobody is left to receive watermark events */
+	zio_wm_eventfd_set(bi, -1);
+out:
+	__zio_f_bi_release(bi);
+}
+
+static int zio_generic_release(struct inode *inode, struct file *f)
+{
+	struct zio_f_priv *priv = f->private_data;
+	struct zio_channel *chan = priv->chan;
+
+	zio_f_bi_leave(priv, priv->bi);
 	zio_channel_put(chan);
 	/* priv is allocated by zio_f_open, must be freed */
 	kfree(priv);
@@ -647,6 +928,8 @@ const struct file_operations zio_generic_file_operations = {
 	.read =		zio_generic_read,
 	.write =	zio_generic_write,
 	.poll =		zio_generic_poll,
+	.unlocked_ioctl = zio_generic_ioctl,
+	.compat_ioctl =	zio_generic_ioctl,
 	.mmap =		zio_generic_mmap,
 	.release =	zio_generic_release,
 };
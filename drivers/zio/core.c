@@ -25,11 +25,12 @@ static struct zio_status *zstat = &zio_global_status; /* Always use ptr */
  */
 static struct kmem_cache *zio_ctrl_slab;
 
-struct zio_control *zio_alloc_control(gfp_t gfp)
+/* Controls live with their data: buffers pass the node of the cset */
+struct zio_control *zio_alloc_control_node(gfp_t gfp, int node)
 {
 	struct zio_control *ctrl;
 
-	ctrl = kmem_cache_zalloc(zio_ctrl_slab, gfp);
+	ctrl = kmem_cache_alloc_node(zio_ctrl_slab, gfp | __GFP_ZERO, node);
 	if (!ctrl)
 		return NULL;
 
@@ -41,16 +42,25 @@ struct zio_control *zio_alloc_control(gfp_t gfp)
 		ctrl->flags |= ZIO_CONTROL_LITTLE_ENDIAN;
 	return ctrl;
 }
+EXPORT_SYMBOL(zio_alloc_control_node);
+
+struct zio_control *zio_alloc_control(gfp_t gfp)
+{
+	return zio_alloc_control_node(gfp, NUMA_NO_NODE);
+}
 EXPORT_SYMBOL(zio_alloc_control);
 
 /* At control release time, we can copy it to sniffers, if configured so */
+unsigned int zio_sniffdev_users;
+
 void __weak zio_sniffdev_add(struct zio_control *ctrl)
 {
 }
 
 void zio_free_control(struct zio_control *ctrl)
 {
-	zio_sniffdev_add(ctrl);
+	if (unlikely(READ_ONCE(zio_sniffdev_users)))
+		zio_sniffdev_add(ctrl);
 	kmem_cache_free(zio_ctrl_slab, ctrl);
 }
 EXPORT_SYMBOL(zio_free_control);
@@ -117,6 +127,17 @@ static int __init zio_init(void)
 	BUILD_BUG_ON(_ZIO_TRG_ATTR_STD_NUM != ARRAY_SIZE(zio_trig_attr_names));
 	BUILD_BUG_ON(ZIO_NR_MINORS > MINORMASK + 1);
 
+	/* The hot fields of channels, csets and buffers fit a 64-byte line */
+	BUILD_BUG_ON(SMP_CACHE_BYTES >= 64 &&
+		     offsetofend(struct zio_channel, index) -
+		     offsetof(struct zio_channel, cset) > 64);
+	BUILD_BUG_ON(SMP_CACHE_BYTES >= 64 &&
+		     offsetofend(struct zio_cset, stop_io) -
+		     offsetof(struct zio_cset, ti) > 64);
+	BUILD_BUG_ON(SMP_CACHE_BYTES >= 64 &&
+		     offsetof(struct zio_bi, lock) -
+		     offsetof(struct zio_bi, b_op) > 64);
+
 	err = zio_slab_init();
 	if (err)
 		return err;
@@ -0,0 +1,566 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright 2011-2019 CERN
+ */
+
+/*
+ * zio-fake-dma is a software DMA engine, to exercise the zio-dma helpers
+ * without hardware. The engine maps the blocks of each acquisition,
+ * using the same fill_desc callback a real driver uses: as slices of
+ * the data area of the buffer if it exposes one (vmalloc), else in a
+ * scatter-gather table mapped for each transfer (always, with
+ * map_sg=1, to exercise zio_dma_map_sg with any buffer). A kernel
+ * thread then plays the device: it walks the descriptor chain of each
+ * channel, checks it and writes a synthetic signal. Each 32-bit
+ * little-endian sample is its own "device memory" word address:
+ * channel i is at offset i << 24, so its data counts up from i << 22.
+ * Cset attributes report the throughput.
+ *
+ * The driver is built on the zio_dma_async engine: it only fills the
+ * descriptors and starts or stops the thread. The "device" accepts one
+ * queued transfer after the running one, so with pingpong=1 (default)
+ * it goes on with the next blocks without waiting for software.
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/platform_device.h>
+#include <linux/dma-mapping.h>
+#include <asm/unaligned.h>
+
+#include <linux/zio.h>
+#include <linux/zio-dma.h>
+#include <linux/zio-trigger.h>
+
+#define ZFDMA_VERSION ZIO_HEX_VERSION(1, 0, 0)
+#define ZFDMA_MAX_CHAN 32
+#define ZFDMA_CHAN_SHIFT 24 /* device memory offset of each channel */
+
+ZIO_PARAM_TRIGGER(zfdma_trigger);
+ZIO_PARAM_BUFFER(zfdma_buffer);
+
+static int zfdma_nchan = 4;
+module_param_named(nchan, zfdma_nchan, int, 0444);
+MODULE_PARM_DESC(nchan, "Number of channels, all in each transfer (1-32)");
+
+static int zfdma_pingpong = 1;
+module_param_named(pingpong, zfdma_pingpong, int, 0444);
+MODULE_PARM_DESC(pingpong, "Queue the next transfer in advance (default 1)");
+
+static int zfdma_map_sg;
+module_param_named(map_sg, zfdma_map_sg, int, 0444);
+MODULE_PARM_DESC(map_sg, "Map the blocks of each transfer, not the area");
+
+/* The descriptor of our imaginary device: the callback fills it */
+struct zfdma_desc {
+	uint64_t dma_addr;
+	uint64_t next;
+	uint32_t len;
+	uint32_t dev_mem_off;
+};
+
+/* A transfer given to the "device" */
+struct zfdma_job {
+	struct zio_dma_async_xfer *x;
+	uint32_t cookie;
+};
+
+/* One platform device, one zio device, one thread: one lazy structure */
+static struct {
+	struct platform_device *pdev;
+	struct zio_device *zdev;
+	struct task_struct *thread;
+	wait_queue_head_t q;
+	spinlock_t lock;		/* our "device registers" */
+	struct zio_dma_async za;
+	struct zfdma_job job[2];	/* the running one and the queued one */
+	unsigned int njobs;
+	unsigned int epoch;		/* incremented by stop */
+	int writing;			/* a page is being written */
+	uint64_t xfers, bytes, ns, errors;
+} zfdma;
+
+ZIO_ATTR_DEFINE_STD(ZIO_DEV, zfdma_zattr_dev) = {
+	ZIO_SET_ATTR_VERSION(ZFDMA_VERSION),
+};
+
+enum zfdma_ext {
+	ZFDMA_TRANSFERS,
+	ZFDMA_KB,
+	ZFDMA_USEC,
+	ZFDMA_KB_PER_SEC,
+	ZFDMA_ERRORS,
+	ZFDMA_DROPPED,
+};
+static struct zio_attribute zfdma_cset_ext[] = {
+	ZIO_ATTR_EXT("transfers", ZIO_RO_PERM, ZFDMA_TRANSFERS, 0),
+	ZIO_ATTR_EXT("transfer-kb", ZIO_RO_PERM, ZFDMA_KB, 0),
+	ZIO_ATTR_EXT("transfer-usec", ZIO_RO_PERM, ZFDMA_USEC, 0),
+	ZIO_ATTR_EXT("kb-per-sec", ZIO_RO_PERM, ZFDMA_KB_PER_SEC, 0),
+	ZIO_ATTR_EXT("descriptor-errors", ZIO_RO_PERM, ZFDMA_ERRORS, 0),
+	ZIO_ATTR_EXT("dropped", ZIO_RO_PERM, ZFDMA_DROPPED, 0),
+};
+
+static int zfdma_info_get(struct device *dev, struct zio_attribute *zattr,
+			  uint32_t *usr_val)
+{
+	unsigned long flags;
+
+	/* Standard attributes have their own ids, and nothing to report */
+	if ((zattr->flags & ZIO_ATTR_TYPE) != ZIO_ATTR_TYPE_EXT)
+		return 0;
+
+	spin_lock_irqsave(&zfdma.lock, flags);
+	switch (zattr->id) {
+	case ZFDMA_TRANSFERS:
+		*usr_val = zfdma.xfers;
+		break;
+	case ZFDMA_KB:
+		*usr_val = zfdma.bytes >> 10;
+		break;
+	case ZFDMA_USEC:
+		*usr_val = div_u64(zfdma.ns, NSEC_PER_USEC);
+		break;
+	case ZFDMA_KB_PER_SEC:
+		*usr_val = zfdma.ns ?
+			div64_u64(zfdma.bytes * (NSEC_PER_SEC >> 10), zfdma.ns)
+			: 0;
+		break;
+	case ZFDMA_ERRORS:
+		*usr_val = zfdma.errors;
+		break;
+	case ZFDMA_DROPPED:
+		*usr_val = READ_ONCE(zfdma.za.dropped);
+		break;
+	}
+	spin_unlock_irqrestore(&zfdma.lock, flags);
+	return 0;
+}
+
+static int zfdma_conf_set(struct device *dev, struct zio_attribute *zattr,
+			  uint32_t usr_val)
+{
+	return -EPERM; /* all of our attributes are read-only */
+}
+
+static const struct zio_sysfs_operations zfdma_sysfs_ops = {
+	.conf_set = zfdma_conf_set,
+	.info_get = zfdma_info_get,
+};
+
+/* The fill_desc callback, as a real driver would write it */
+static int zfdma_fill_desc(struct zio_dma_sg *zsg)
+{
+	struct zfdma_desc *desc = zsg->page_desc;
+
+	desc->dma_addr = zsg->dma_addr;
+	desc->len = zsg->len;
+	desc->dev_mem_off = zsg->dev_mem_off;
+	desc->next = zsg->flags & ZIO_DMA_SG_LAST ? 0 : zsg->dma_next_desc;
+	return 0;
+}
+
+/* The signal: each byte belongs to the word whose address is the value */
+static void zfdma_signal(uint8_t *dst, unsigned int len, uint32_t dev_off)
+{
+	while (len && (dev_off & 3)) {
+		*dst++ = (dev_off >> 2) >> ((dev_off & 3) * 8);
+		dev_off++;
+		len--;
+	}
+	while (len >= 4) {
+		put_unaligned_le32(dev_off >> 2, dst);
+		dst += 4;
+		dev_off += 4;
+		len -= 4;
+	}
+	while (len) {
+		*dst++ = (dev_off >> 2) >> ((dev_off & 3) * 8);
+		dev_off++;
+		len--;
+	}
+}
+
+/*
+ * Before writing a page, check the transfer was not stopped, and tell
+ * stop to wait for us. The lock only covers the check: the data is
+ * written without it, so the figures are not skewed and irqs stay on.
+ */
+static int zfdma_claim(unsigned int epoch)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&zfdma.lock, flags);
+	if (zfdma.epoch == epoch) {
+		zfdma.writing = 1;
+		ret = 1;
+	}
+	spin_unlock_irqrestore(&zfdma.lock, flags);
+	return ret;
+}
+
+/* Write a segment page by page, so stop waits for one page at most */
+static int zfdma_write(uint8_t *dst, unsigned int len, uint32_t dev_off,
+		       unsigned int epoch)
+{
+	unsigned int done = 0, chunk;
+
+	while (done < len) {
+		chunk = min_t(unsigned int, len - done,
+			      PAGE_SIZE - offset_in_page(dst + done));
+		if (!zfdma_claim(epoch))
+			return -EINTR;
+		zfdma_signal(dst + done, chunk, dev_off + done);
+		smp_store_release(&zfdma.writing, 0);
+		done += chunk;
+	}
+	return 0;
+}
+
+/*
+ * Read and check a descriptor of the block of a channel, at offset off
+ * in the block, with the epoch claimed: the chain must end with the
+ * block, and the device offset follow it. In an area, the bus address
+ * is known from the mapping too. It returns 1 past the last one.
+ */
+static int zfdma_desc(struct zio_dma_async_xfer *x, unsigned int c,
+		      unsigned int i, unsigned long off,
+		      struct zfdma_desc *d, uint8_t **dst)
+{
+	struct zio_dma_async_blk *blk = &x->blk[c];
+	struct zio_dma_area *area = blk->area;
+	unsigned int n = blk->slice.first_desc + i;
+	int last = i + 1 == blk->slice.n_desc;
+
+	if (!blk->block || i >= blk->slice.n_desc)
+		return 1;
+	*d = *(struct zfdma_desc *)blk->page_desc[n];
+	*dst = blk->block->data + off;
+	if (!d->len || off + d->len > blk->block->datalen ||
+	    (last && off + d->len != blk->block->datalen))
+		return -EIO;
+	if (d->next != (last ? 0 : blk->dma_page_desc[n + 1]))
+		return -EIO;
+	if (d->dev_mem_off != (c << ZFDMA_CHAN_SHIFT) + off)
+		return -EIO;
+	if (area && d->dma_addr != area->seg_addr[n] +
+	    (blk->slice.offset + off - area->seg_off[n]))
+		return -EIO;
+	return 0;
+}
+
+/*
+ * The "hardware": follow the chain of descriptors of each channel. The
+ * thread cannot access bus addresses, so it checks each descriptor and
+ * writes through the CPU address of the block. Descriptors and blocks
+ * are only touched with the epoch claimed, so after a stop (a new epoch,
+ * then the engine releases the transfer) they are not touched any more.
+ * It returns the number of bad chains, or -EINTR if stopped.
+ */
+static int zfdma_run(struct zio_dma_async_xfer *x, unsigned int epoch,
+		     uint64_t *bytes)
+{
+	struct zfdma_desc d;
+	unsigned long off;
+	unsigned int c, i;
+	uint8_t *dst;
+	int errors = 0, ret;
+
+	*bytes = 0;
+	for (c = 0; c < zfdma.za.n_chan; c++) {
+		for (i = 0, off = 0; ; i++, off += d.len) {
+			if (!zfdma_claim(epoch))
+				return -EINTR;
+			ret = zfdma_desc(x, c, i, off, &d, &dst);
+			smp_store_release(&zfdma.writing, 0);
+			if (ret > 0)
+				break;
+			if (ret < 0) {
+				dev_warn_ratelimited(zfdma.za.hwdev,
+					"chan %u: bad descriptor %u\n", c, i);
+				errors++;
+				break;
+			}
+			if (zfdma_write(dst, d.len, d.dev_mem_off, epoch))
+				return -EINTR;
+			*bytes += d.len;
+		}
+	}
+	return errors;
+}
+
+static int zfdma_thread(void *arg)
+{
+	struct zfdma_job job;
+	unsigned int epoch, njobs;
+	unsigned long flags;
+	uint64_t bytes;
+	ktime_t start;
+	int errors;
+	s64 ns;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(zfdma.q, READ_ONCE(zfdma.njobs) ||
+					 kthread_should_stop());
+		spin_lock_irqsave(&zfdma.lock, flags);
+		njobs = zfdma.njobs;
+		job = zfdma.job[0];
+		epoch = zfdma.epoch;
+		spin_unlock_irqrestore(&zfdma.lock, flags);
+		if (!njobs)
+			continue;
+
+		start = ktime_get();
+		errors = zfdma_run(job.x, epoch, &bytes);
+		if (errors < 0)
+			continue; /* stopped: the engine released it all */
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		spin_lock_irqsave(&zfdma.lock, flags);
+		if (zfdma.epoch != epoch) {
+			spin_unlock_irqrestore(&zfdma.lock, flags);
+			continue;
+		}
+		zfdma.job[0] = zfdma.job[1];
+		zfdma.njobs--;
+		zfdma.xfers++;
+		zfdma.bytes += bytes;
+		zfdma.ns += ns;
+		zfdma.errors += errors;
+		spin_unlock_irqrestore(&zfdma.lock, flags);
+
+		/* Our "completion interrupt" */
+		zio_dma_async_done(&zfdma.za, job.cookie, errors ? -EIO : 0);
+	}
+	return 0;
+}
+
+/* Engine operations: queue a transfer, stop everything */
+static int zfdma_start(struct zio_dma_async *za, struct zio_dma_async_xfer *x)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&zfdma.lock, flags);
+	if (zfdma.njobs == ARRAY_SIZE(zfdma.job)) {
+		spin_unlock_irqrestore(&zfdma.lock, flags);
+		return -EBUSY;
+	}
+	zfdma.job[zfdma.njobs].x = x;
+	zfdma.job[zfdma.njobs].cookie = x->cookie;
+	zfdma.njobs++;
+	spin_unlock_irqrestore(&zfdma.lock, flags);
+	wake_up(&zfdma.q);
+	return 0;
+}
+
+/* Stop can sleep, but a page is written in no time: just spin */
+static void zfdma_stop(struct zio_dma_async *za)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&zfdma.lock, flags);
+	zfdma.epoch++;
+	zfdma.njobs = 0;
+	spin_unlock_irqrestore(&zfdma.lock, flags);
+
+	/* The page in progress, if any, is the last one written */
+	while (smp_load_acquire(&zfdma.writing))
+		cpu_relax();
+}
+
+static unsigned long zfdma_dev_mem_off(struct zio_dma_async *za,
+				       unsigned int chan)
+{
+	return chan << ZFDMA_CHAN_SHIFT;
+}
+
+static const struct zio_dma_async_ops zfdma_dma_ops = {
+	.fill_desc =	zfdma_fill_desc,
+	.dev_mem_off =	zfdma_dev_mem_off,
+	.start =	zfdma_start,
+	.stop =		zfdma_stop,
+};
+
+static int zfdma_input(struct zio_cset *cset)
+{
+	return zio_dma_async_raw_io(&zfdma.za, cset);
+}
+
+static void zfdma_stop_io(struct zio_cset *cset)
+{
+	zio_dma_async_stop_io(&zfdma.za, cset);
+}
+
+static struct zio_cset zfdma_cset[] = {
+	{
+		ZIO_SET_OBJ_NAME("fake-dma"),
+		.raw_io =	zfdma_input,
+		.stop_io =	zfdma_stop_io,
+		.n_chan =	4,
+		.ssize =	4,
+		.flags =	ZIO_DIR_INPUT | ZIO_CSET_TYPE_ANALOG,
+		.zattr_set = {
+			.ext_zattr = zfdma_cset_ext,
+			.n_ext_attr = ARRAY_SIZE(zfdma_cset_ext),
+		},
+	},
+};
+
+static struct zio_device zfdma_tmpl = {
+	.owner =		THIS_MODULE,
+	.cset =			zfdma_cset,
+	.n_cset =		ARRAY_SIZE(zfdma_cset),
+	.s_op =			&zfdma_sysfs_ops,
+	.zattr_set = {
+		.std_zattr = zfdma_zattr_dev,
+	},
+};
+
+static const struct zio_device_id zfdma_table[] = {
+	{"zfdma", &zfdma_tmpl},
+	{},
+};
+
+static struct zio_driver zfdma_zdrv = {
+	.driver = {
+		.name = "zfdma",
+		.owner = THIS_MODULE,
+	},
+	.id_table = zfdma_table,
+	/* All drivers compiled within the ZIO projects are compatibile
+	   with the last version */
+	.min_version = ZIO_VERSION(1, 1, 0),
+};
+
+/* The platform device is the DMA device: it gets the zio device */
+static int zfdma_probe(struct platform_device *pdev)
+{
+	struct device *hwdev = &pdev->dev;
+	int err;
+
+	err = dma_set_mask(hwdev, DMA_BIT_MASK(32));
+	if (!err)
+		err = dma_set_coherent_mask(hwdev, DMA_BIT_MASK(32));
+	if (err) {
+		dev_err(hwdev, "cannot set the DMA mask\n");
+		return err;
+	}
+	err = zio_dma_pool_init(hwdev, sizeof(struct zfdma_desc), 8);
+	if (err)
+		return err;
+	err = zio_dma_async_init(&zfdma.za, hwdev, &zfdma_dma_ops,
+				 sizeof(struct zfdma_desc), zfdma_nchan,
+				 DMA_FROM_DEVICE,
+				 (zfdma_pingpong ? ZIO_DMA_ASYNC_PINGPONG : 0) |
+				 (zfdma_map_sg ? ZIO_DMA_ASYNC_MAP_SG : 0));
+	if (err)
+		return err;
+
+	zfdma.thread = kthread_run(zfdma_thread, NULL, "zio-fake-dma");
+	if (IS_ERR(zfdma.thread)) {
+		err = PTR_ERR(zfdma.thread);
+		goto out_thread;
+	}
+
+	zfdma.zdev = zio_allocate_device();
+	if (IS_ERR(zfdma.zdev)) {
+		err = PTR_ERR(zfdma.zdev);
+		goto out_alloc;
+	}
+	zfdma.zdev->owner = THIS_MODULE;
+	err = zio_register_device(zfdma.zdev, "zfdma", 0);
+	if (err)
+		goto out_register;
+	return 0;
+
+out_register:
+	zio_free_device(zfdma.zdev);
+out_alloc:
+	kthread_stop(zfdma.thread);
+out_thread:
+	zio_dma_async_exit(&zfdma.za);
+	return err;
+}
+
+static int zfdma_remove(struct platform_device *pdev)
+{
+	/* Stop a queued transfer; unregistering aborts the armed one */
+	zio_dma_async_exit(&zfdma.za);
+	zio_unregister_device(zfdma.zdev);
+	zio_free_device(zfdma.zdev);
+	kthread_stop(zfdma.thread);
+	return 0;
+}
+
+static struct platform_driver zfdma_pdrv = {
+	.driver = {
+		.name = "zio-fake-dma",
+		.owner = THIS_MODULE,
+	},
+	.probe = zfdma_probe,
+	.remove = zfdma_remove,
+};
+
+static int __init zfdma_init(void)
+{
+	struct platform_device_info info = {
+		.name = "zio-fake-dma",
+		.id = PLATFORM_DEVID_NONE,
+		.dma_mask = DMA_BIT_MASK(32),
+	};
+	int err;
+
+	if (zfdma_nchan < 1 || zfdma_nchan > ZFDMA_MAX_CHAN) {
+		pr_err("%s: nchan is %i: out of range\n", KBUILD_MODNAME,
+		       zfdma_nchan);
+		return -EINVAL;
+	}
+	zfdma_cset[0].n_chan = zfdma_nchan;
+	if (zfdma_trigger)
+		zfdma_tmpl.preferred_trigger = zfdma_trigger;
+	if (zfdma_buffer)
+		zfdma_tmpl.preferred_buffer = zfdma_buffer;
+	init_waitqueue_head(&zfdma.q);
+	spin_lock_init(&zfdma.lock);
+
+	err = zio_register_driver(&zfdma_zdrv);
+	if (err)
+		return err;
+	err = platform_driver_register(&zfdma_pdrv);
+	if (err)
+		goto out_pdrv;
+	zfdma.pdev = platform_device_register_full(&info);
+	if (IS_ERR(zfdma.pdev)) {
+		err = PTR_ERR(zfdma.pdev);
+		goto out_pdev;
+	}
+	return 0;
+
+out_pdev:
+	platform_driver_unregister(&zfdma_pdrv);
+out_pdrv:
+	zio_unregister_driver(&zfdma_zdrv);
+	return err;
+}
+
+static void __exit zfdma_exit(void)
+{
+	platform_device_unregister(zfdma.pdev);
+	platform_driver_unregister(&zfdma_pdrv);
+	zio_unregister_driver(&zfdma_zdrv);
+}
+
+module_init(zfdma_init);
+module_exit(zfdma_exit);
+
+MODULE_VERSION(GIT_VERSION); /* Defined in local Makefile */
+MODULE_DESCRIPTION("A zio driver which fakes DMA, to test zio-dma");
+MODULE_LICENSE("GPL");
+
+ADDITIONAL_VERSIONS;
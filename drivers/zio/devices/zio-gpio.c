@@ -5,25 +5,35 @@
  */
 
 /*
- * Simple driver for GPIO-based output (faked as 1 analog
+ * Simple driver for GPIO-based output and input (faked as 1 analog
  * channel).  Initially was running on the parallel port, then I
  * switched to a more generic implementation. The "analog" moves all
- * bits.  There is currently no such thing as internal timing, only
- * the last sample of a block has enduring effect.
+ * bits: they are set or read at the same time, with one array operation.
  *
- * Missing feature: internal rate (needs a transparent buffer)
- * Missing feature: input
+ * Blocks are played and acquired at the "sample-rate" of the cset, one
+ * sample per period, so bit-banged protocols can be driven from user
+ * space. After output, the last sample stays on the pins. Timing comes
+ * from an hrtimer, or from a kernel thread sleeping on hrtimers if the
+ * gpio controller can sleep (like gpio-sim).
  */
 
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/spinlock.h>
+#include <linux/version.h>
 #include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/math64.h>
 #include <linux/io.h>
 
 #include <linux/zio.h>
 #include <linux/zio-buffer.h>
+#include <linux/zio-trigger.h>
 
 #define ZGPIO_NOUT 8
 #define ZGPIO_NIN 8
@@ -43,72 +53,320 @@ ZIO_ATTR_DEFINE_STD(ZIO_DEV, zgp_zattr_dev) = {
 	ZIO_ATTR(zdev, ZIO_ATTR_NBITS, ZIO_RO_PERM, 0, 1), /* digital */
 };
 
-/* This outputs a cset, currently made up of one channel only */
-static int zgp_output(struct zio_cset *cset)
+/* Attributes of both csets: the rate applies from the next block */
+enum zgp_ext {
+	ZGP_RATE,
+	ZGP_LATE,
+};
+static struct zio_attribute zgp_cset_ext[] = {
+	[ZGP_RATE] = ZIO_ATTR_EXT_RNG("sample-rate", ZIO_RW_PERM,
+				      ZGP_RATE, 1000, 1, 1000000),
+	[ZGP_LATE] = ZIO_ATTR_EXT("late", ZIO_RO_PERM, ZGP_LATE, 0),
+};
+
+#define ZGP_SLACK_NS	(5 * NSEC_PER_USEC)
+
+/* Timing state of each cset (index 0 is output, 1 is input) */
+struct zgp_timed {
+	struct gpio_desc *desc[8];	/* a sample is one byte */
+	int ndesc;
+	int cansleep;
+	struct hrtimer timer;
+	struct task_struct *thread;	/* only if cansleep */
+	wait_queue_head_t q;
+
+	spinlock_t lock;		/* for the three flags below */
+	int in_cb, restart, exiting;
+
+	/* The current block, set under the cset lock */
+	struct zio_cset *cset;
+	int armed;
+	uint8_t *data;
+	unsigned int pos, n;
+	ktime_t period, last;
+	uint32_t late;			/* samples out of their period */
+};
+static struct zgp_timed zgp_timed[2];
+
+enum {
+	ZGP_MORE,
+	ZGP_DONE,
+	ZGP_STOP,
+};
+
+/*
+ * All lines of a cset are set or read at once. Before 5.0 the array
+ * functions use an integer per line, and before 4.10 we loop.
+ */
+#if KERNEL_VERSION(5, 0, 0) <= LINUX_VERSION_CODE
+static void zgp_set(struct zgp_timed *t, unsigned long bits)
+{
+	if (t->cansleep)
+		gpiod_set_array_value_cansleep(t->ndesc, t->desc, NULL, &bits);
+	else
+		gpiod_set_array_value(t->ndesc, t->desc, NULL, &bits);
+}
+
+static uint8_t zgp_get(struct zgp_timed *t)
+{
+	unsigned long bits = 0;
+
+	if (t->cansleep)
+		gpiod_get_array_value_cansleep(t->ndesc, t->desc, NULL, &bits);
+	else
+		gpiod_get_array_value(t->ndesc, t->desc, NULL, &bits);
+	return bits;
+}
+#elif KERNEL_VERSION(4, 10, 0) <= LINUX_VERSION_CODE
+static void zgp_set(struct zgp_timed *t, unsigned long bits)
+{
+	int i, v[ARRAY_SIZE(t->desc)];
+
+	for (i = 0; i < t->ndesc; i++)
+		v[i] = (bits >> i) & 1;
+	if (t->cansleep)
+		gpiod_set_array_value_cansleep(t->ndesc, t->desc, v);
+	else
+		gpiod_set_array_value(t->ndesc, t->desc, v);
+}
+
+static uint8_t zgp_get(struct zgp_timed *t)
+{
+	int i, v[ARRAY_SIZE(t->desc)];
+	uint8_t bits = 0;
+
+	if (t->cansleep)
+		i = gpiod_get_array_value_cansleep(t->ndesc, t->desc, v);
+	else
+		i = gpiod_get_array_value(t->ndesc, t->desc, v);
+	if (i < 0)
+		return 0;
+	for (i = 0; i < t->ndesc; i++)
+		bits |= (!!v[i]) << i;
+	return bits;
+}
+#else
+static void zgp_set(struct zgp_timed *t, unsigned long bits)
 {
-	struct zio_channel *chan;
-	struct zio_block *block;
-	struct zio_control *ctrl;
-	uint8_t datum;
 	int i;
 
-	chan_for_each(chan, cset) {
-		block = chan->active_block;
-		if (!block)
+	for (i = 0; i < t->ndesc; i++) {
+		if (t->cansleep)
+			gpiod_set_value_cansleep(t->desc[i], (bits >> i) & 1);
+		else
+			gpiod_set_value(t->desc[i], (bits >> i) & 1);
+	}
+}
+
+static uint8_t zgp_get(struct zgp_timed *t)
+{
+	uint8_t bits = 0;
+	int i;
+
+	for (i = 0; i < t->ndesc; i++) {
+		if (t->cansleep)
+			bits |= (!!gpiod_get_value_cansleep(t->desc[i])) << i;
+		else
+			bits |= (!!gpiod_get_value(t->desc[i])) << i;
+	}
+	return bits;
+}
+#endif
+
+/*
+ * Move one sample. The cset is busy meanwhile, so abort waits for us,
+ * and stop_io clears "armed" to stop the timer or the thread.
+ */
+static int zgp_step(struct zgp_timed *t)
+{
+	struct zio_cset *cset = t->cset;
+	unsigned long flags;
+	int last;
+
+	spin_lock_irqsave(&cset->lock, flags);
+	if (!t->armed) {
+		spin_unlock_irqrestore(&cset->lock, flags);
+		return ZGP_STOP;
+	}
+	zio_cset_busy_set(cset, 0);
+	spin_unlock_irqrestore(&cset->lock, flags);
+
+	if ((cset->flags & ZIO_DIR) == ZIO_DIR_OUTPUT)
+		zgp_set(t, t->data[t->pos]);
+	else
+		t->data[t->pos] = t->ndesc ? zgp_get(t) : 0;
+	t->last = ktime_get();
+	last = ++t->pos == t->n;
+	if (last) {
+		t->armed = 0;
+		zio_trigger_data_done(cset); /* this may arm again */
+	}
+	zio_cset_busy_clear(cset, 1);
+	return last ? ZGP_DONE : ZGP_MORE;
+}
+
+static enum hrtimer_restart zgp_timer_fn(struct hrtimer *timer)
+{
+	struct zgp_timed *t = container_of(timer, struct zgp_timed, timer);
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&t->lock, flags);
+	t->in_cb = 1;
+	spin_unlock_irqrestore(&t->lock, flags);
+
+	ret = zgp_step(t);
+
+	/* If data_done armed again, the next block follows in one period */
+	spin_lock_irqsave(&t->lock, flags);
+	t->in_cb = 0;
+	if (t->restart && !t->exiting)
+		ret = ZGP_MORE;
+	t->restart = 0;
+	spin_unlock_irqrestore(&t->lock, flags);
+
+	if (ret != ZGP_MORE)
+		return HRTIMER_NORESTART;
+	if (hrtimer_forward_now(timer, t->period) > 1)
+		t->late++;
+	return HRTIMER_RESTART;
+}
+
+/* For controllers that sleep, the same is done by a thread */
+static int zgp_thread(void *arg)
+{
+	struct zgp_timed *t = arg;
+	ktime_t next, now;
+
+	next = ktime_get();
+	while (!kthread_should_stop()) {
+		if (!READ_ONCE(t->armed)) {
+			wait_event_interruptible(t->q, READ_ONCE(t->armed) ||
+						 kthread_should_stop());
+			/* One period after the last sample, but not earlier */
+			next = ktime_add(t->last, t->period);
+			now = ktime_get();
+			if (ktime_before(next, now))
+				next = now;
+			continue;
+		}
+		now = ktime_get();
+		if (ktime_before(now, next)) {
+			set_current_state(TASK_INTERRUPTIBLE);
+			schedule_hrtimeout_range(&next, ZGP_SLACK_NS,
+						 HRTIMER_MODE_ABS);
 			continue;
-		ctrl = zio_get_ctrl(block);
-		/* use last sample, as previous ones would be overwritten */
-		i = ctrl->ssize * ctrl->nsamples;
-		datum = ((unsigned char *)block->data)[i - 1];
-		for (i = 0; i < zgp_nout; i++)
-			gpio_set_value(zgp_out[i], datum & (1 << i));
+		}
+		/* Don't run fast to catch up */
+		if (ktime_after(now, ktime_add(next, t->period))) {
+			t->late++;
+			next = now;
+		}
+		zgp_step(t);
+		next = ktime_add(next, t->period);
 	}
-	return 0; /* done */
+	return 0;
+}
+
+static void zgp_start(struct zgp_timed *t)
+{
+	unsigned long flags;
+
+	if (t->thread) {
+		wake_up(&t->q);
+		return;
+	}
+	spin_lock_irqsave(&t->lock, flags);
+	if (t->in_cb)
+		t->restart = 1;
+	else if (!t->exiting)
+		hrtimer_start(&t->timer, ktime_add(t->last, t->period),
+			      HRTIMER_MODE_ABS);
+	spin_unlock_irqrestore(&t->lock, flags);
+}
+
+/* The raw_io method of both csets, made up of one channel only */
+static int zgp_raw_io(struct zio_cset *cset)
+{
+	struct zgp_timed *t = zgp_timed + cset->index;
+	struct zio_block *block = cset->chan->active_block;
+	uint32_t rate = cset->zattr_set.ext_zattr[ZGP_RATE].value;
+	unsigned long flags;
+
+	if (!block || !block->datalen)
+		return 0; /* done: nothing to move */
+
+	spin_lock_irqsave(&cset->lock, flags);
+	t->cset = cset;
+	t->data = block->data;
+	t->pos = 0;
+	t->n = block->datalen; /* ssize is 1 */
+	t->period = ns_to_ktime(div_u64(NSEC_PER_SEC, rate));
+	t->armed = 1;
+	spin_unlock_irqrestore(&cset->lock, flags);
+
+	zgp_start(t);
+	return -EAGAIN; /* the timer or the thread call data_done */
 }
 
-/* Similarly, this inputs a cset. Again, currently one channel only */
-static int zgp_input(struct zio_cset *cset)
+/* stop_io, in locked context: the timer or the thread are not busy */
+static void zgp_stop_io(struct zio_cset *cset)
 {
 	struct zio_channel *chan;
-	struct zio_block *block;
-	struct zio_control *ctrl;
-	uint8_t datum;
-	int i, j;
 
+	zgp_timed[cset->index].armed = 0;
 	chan_for_each(chan, cset) {
-		block = chan->active_block;
-		if (!block)
-			continue;
-		ctrl = zio_get_ctrl(block);
-		/* fill the whole block */
-		for (j = 0; j < ctrl->nsamples; j++) {
-			datum = 0;
-			for (i = 0; i < zgp_nin; i++)
-				datum |= gpio_get_value(zgp_in[i]) << i;
-			((unsigned char *)block->data)[j] = datum;
-		}
+		zio_buffer_free_block(chan->bi, chan->active_block);
+		zio_chan_set_active(chan, NULL);
 	}
-	return 0; /* done */
 }
 
+static int zgp_info_get(struct device *dev, struct zio_attribute *zattr,
+			uint32_t *usr_val)
+{
+	struct zio_cset *cset;
+
+	if ((zattr->flags & ZIO_ATTR_TYPE) != ZIO_ATTR_TYPE_EXT ||
+	    zattr->id != ZGP_LATE)
+		return 0;
+	cset = to_zio_cset(dev);
+	*usr_val = READ_ONCE(zgp_timed[cset->index].late);
+	return 0;
+}
+
+static const struct zio_sysfs_operations zgp_sysfs_ops = {
+	.info_get = zgp_info_get,
+};
+
 static struct zio_cset zgp_cset[] = {
 	{
-		.raw_io =	zgp_output,
+		.raw_io =	zgp_raw_io,
+		.stop_io =	zgp_stop_io,
 		.n_chan =	1,
 		.ssize =	1,
 		.flags =	ZIO_DIR_OUTPUT | ZIO_CSET_TYPE_ANALOG,
+		.zattr_set = {
+			.ext_zattr = zgp_cset_ext,
+			.n_ext_attr = ARRAY_SIZE(zgp_cset_ext),
+		},
 	},
 	{
-		.raw_io =	zgp_input,
+		.raw_io =	zgp_raw_io,
+		.stop_io =	zgp_stop_io,
 		.n_chan =	1,
 		.ssize =	1,
 		.flags =	ZIO_DIR_INPUT | ZIO_CSET_TYPE_ANALOG,
+		.zattr_set = {
+			.ext_zattr = zgp_cset_ext,
+			.n_ext_attr = ARRAY_SIZE(zgp_cset_ext),
+		},
 	},
 };
 static struct zio_device zgp_tmpl = {
 	.owner =		THIS_MODULE,
 	.cset =			zgp_cset,
 	.n_cset =		ARRAY_SIZE(zgp_cset),
+	.s_op =			&zgp_sysfs_ops,
 	.zattr_set = {
 		.std_zattr = zgp_zattr_dev,
 	},
@@ -129,6 +387,49 @@ static struct zio_driver zpg_zdrv = {
 	.min_version = ZIO_VERSION(1, 1, 0),
 };
 
+/* Prepare the timing of a cset: the gpios are already requested */
+static int zgp_timed_init(struct zgp_timed *t, int *gpio, int n,
+			  const char *name)
+{
+	int i;
+
+	t->ndesc = n;
+	for (i = 0; i < n; i++) {
+		t->desc[i] = gpio_to_desc(gpio[i]);
+		if (gpiod_cansleep(t->desc[i]))
+			t->cansleep = 1;
+	}
+	spin_lock_init(&t->lock);
+	init_waitqueue_head(&t->q);
+	hrtimer_init(&t->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	t->timer.function = zgp_timer_fn;
+	t->period = ns_to_ktime(NSEC_PER_MSEC);
+	t->last = ktime_get();
+	if (!t->cansleep)
+		return 0;
+	t->thread = kthread_run(zgp_thread, t, "zio-gpio-%s", name);
+	if (IS_ERR(t->thread)) {
+		i = PTR_ERR(t->thread);
+		t->thread = NULL;
+		return i;
+	}
+	return 0;
+}
+
+/* Nothing is started any more, and what is running is stopped */
+static void zgp_timed_exit(struct zgp_timed *t)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&t->lock, flags);
+	t->exiting = 1;
+	spin_unlock_irqrestore(&t->lock, flags);
+	hrtimer_cancel(&t->timer);
+	if (t->thread)
+		kthread_stop(t->thread);
+	t->thread = NULL;
+}
+
 static int __init zgp_init(void)
 {
 	int i, err;
@@ -137,8 +438,8 @@ static int __init zgp_init(void)
 	BUILD_BUG_ON(ZGPIO_NOUT > 8);
 	BUILD_BUG_ON(ZGPIO_NIN > 8);
 
-	if (zgp_nout == 0) {
-		pr_err(KBUILD_MODNAME ": please pass out= gpio list\n");
+	if (zgp_nout == 0 && zgp_nin == 0) {
+		pr_err(KBUILD_MODNAME ": please pass out= or in= gpio list\n");
 		return -ENODEV;
 	}
 
@@ -160,6 +461,18 @@ static int __init zgp_init(void)
 		}
 	}
 
+	for (i = 0; i < zgp_nout; i++)
+		gpio_direction_output(zgp_out[i], 0);
+	for (i = 0; i < zgp_nin; i++)
+		gpio_direction_input(zgp_in[i]);
+
+	err = zgp_timed_init(zgp_timed + 0, zgp_out, zgp_nout, "out");
+	if (err)
+		goto out_timed;
+	err = zgp_timed_init(zgp_timed + 1, zgp_in, zgp_nin, "in");
+	if (err)
+		goto out_timed0;
+
 	if (zgp_trigger)
 		zgp_tmpl.preferred_trigger = zgp_trigger;
 	if (zgp_buffer)
@@ -167,7 +480,7 @@ static int __init zgp_init(void)
 
 	err = zio_register_driver(&zpg_zdrv);
 	if (err)
-		goto out_input;
+		goto out_timed1;
 	zgp_dev = zio_allocate_device();
 	if (IS_ERR(zgp_dev)) {
 		err = PTR_ERR(zgp_dev);
@@ -180,17 +493,18 @@ static int __init zgp_init(void)
 		       err);
 		goto out_reg;
 	}
-
-	for (i = 0; i < zgp_nout; i++)
-		gpio_direction_output(zgp_out[i], 0);
-	for (i = 0; i < zgp_nin; i++)
-		gpio_direction_input(zgp_in[i]);
 	return 0;
 
 out_reg:
 	zio_free_device(zgp_dev);
 out_alloc:
 	zio_unregister_driver(&zpg_zdrv);
+out_timed1:
+	zgp_timed_exit(zgp_timed + 1);
+out_timed0:
+	zgp_timed_exit(zgp_timed + 0);
+out_timed:
+	i = zgp_nin;
 out_input:
 	/* i is one more than the last registered gpio */
 	for (i--; i >= 0; i--)
@@ -207,6 +521,9 @@ static void __exit zgp_exit(void)
 {
 	int i;
 
+	/* Stop timing first: pending blocks are then freed by abort */
+	zgp_timed_exit(zgp_timed + 0);
+	zgp_timed_exit(zgp_timed + 1);
 	zio_unregister_device(zgp_dev);
 	zio_free_device(zgp_dev);
 	zio_unregister_driver(&zpg_zdrv);
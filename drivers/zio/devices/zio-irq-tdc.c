@@ -13,73 +13,350 @@
  *
  * The driver is used to experiment with self-timed peripherals. cset 0
  * includes a stop_io function that shows how to return a partial block
+ *
+ * Events come from the interrupt (if irq= is passed) and from a software
+ * source, an hrtimer whose rate and burst length are attributes of cset 0.
+ * In hard-irq context we only take the stamp and store it in a per-cpu
+ * fifo; a work item merges the fifos and packs stamps into blocks. The
+ * other attributes of cset 0 count events and losses, and report the
+ * highest event rate measured with nothing lost, to find out how fast
+ * the whole chain can go.
  */
 
 #include <linux/module.h>
+#include <linux/version.h>
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/slab.h>
 #include <linux/interrupt.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
 
 #include <linux/zio.h>
+#include <linux/zio-buffer.h>
 #include <linux/zio-trigger.h>
 
 ZIO_PARAM_BUFFER(ztdc_buffer);
 
+/*
+ * The timer plays the interrupt: both must run in hard-irq context, as
+ * each per-cpu fifo has a single producer. PREEMPT_RT would otherwise
+ * expire the timer in softirq context, and PREEMPT_RT or "threadirqs"
+ * would run the handler in a thread: either can be preempted by the
+ * other in the middle of a push.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 4, 0)
+#define ZTDC_TIMER_MODE HRTIMER_MODE_REL_HARD
+#else
+#define ZTDC_TIMER_MODE HRTIMER_MODE_REL
+#endif
+#define ZTDC_IRQ_FLAGS (IRQF_SHARED | IRQF_NO_THREAD)
+
 int ztdc_irq = -1;
 module_param_named(irq, ztdc_irq, int, 0444);
 
-/* The interrupt handler is taking timestamps and filling blocks */
+static int ztdc_fifo_len = 4096;
+module_param_named(fifo_len, ztdc_fifo_len, int, 0444);
+MODULE_PARM_DESC(fifo_len, "Stamps in each per-cpu fifo (power of 2)");
+
+/* Attributes of cset 0: the source first, then statistics */
+enum ztdc_ext {
+	ZTDC_EVENT_RATE,
+	ZTDC_BURST,
+	ZTDC_EVENTS,
+	ZTDC_FIFO_LOST,
+	ZTDC_BLOCK_LOST,
+	ZTDC_RATE,
+	ZTDC_MAX_RATE,
+};
+static struct zio_attribute ztdc_ext[] = {
+	[ZTDC_EVENT_RATE] = ZIO_ATTR_EXT("event-rate", ZIO_RW_PERM,
+					 ZTDC_EVENT_RATE, 0),
+	[ZTDC_BURST] = ZIO_ATTR_EXT_RNG("burst", ZIO_RW_PERM,
+					ZTDC_BURST, 1, 1, 1024),
+	[ZTDC_EVENTS] = ZIO_ATTR_EXT("events", ZIO_RO_PERM, ZTDC_EVENTS, 0),
+	[ZTDC_FIFO_LOST] = ZIO_ATTR_EXT("fifo-lost", ZIO_RO_PERM,
+					ZTDC_FIFO_LOST, 0),
+	[ZTDC_BLOCK_LOST] = ZIO_ATTR_EXT("block-lost", ZIO_RO_PERM,
+					 ZTDC_BLOCK_LOST, 0),
+	[ZTDC_RATE] = ZIO_ATTR_EXT("rate", ZIO_RO_PERM, ZTDC_RATE, 0),
+	/* Writing resets it, usually to 0 */
+	[ZTDC_MAX_RATE] = ZIO_ATTR_EXT("max-rate", ZIO_RW_PERM,
+				       ZTDC_MAX_RATE, 0),
+};
+
+#define ZTDC_MIN_PERIOD_NS	1000
+#define ZTDC_WINDOW_NS		(100 * NSEC_PER_MSEC)
+#define ZTDC_BATCH		256
+
+/*
+ * Each cpu has a fifo of stamps, written in hard-irq context and read by
+ * the packer. Head and tail are free-running, and only written by one
+ * side each, so no lock is needed; they are in different cache lines.
+ */
+struct ztdc_fifo {
+	unsigned int head;
+	unsigned int lost;		/* stamps dropped: the fifo was full */
+	struct timespec *ts;
+	unsigned int tail ____cacheline_aligned_in_smp;
+	unsigned int snap;		/* head, as seen by the packer */
+};
+static struct ztdc_fifo __percpu *ztdc_fifo;
+static struct ztdc_fifo **ztdc_src;	/* packer: fifos with data */
+
+/* The software source, and what the packer measures */
+static struct {
+	struct hrtimer timer;
+	u64 period_ns;			/* 0: stopped */
+	unsigned int burst;
+	int exiting;			/* under the device lock */
+
+	struct work_struct work;
+	struct mutex lock;		/* one packer at a time */
+	struct timespec batch[ZTDC_BATCH];
+	uint32_t events, block_lost, rate, max_rate;
+	ktime_t win_start;
+	uint64_t win_events;
+	uint32_t win_lost;		/* losses when the window started */
+} ztdc;
+
+/* The probe function saves the real device, see below */
+static struct zio_device *ztdc_dev;
+
+/*
+ * Called in hard-irq context for each event: store the stamp and kick
+ * the packer if the fifo was empty. The barrier pairs with the one in
+ * the packer, so either we see the tail it stored or it sees our head.
+ */
+static void ztdc_capture(void)
+{
+	struct ztdc_fifo *f = this_cpu_ptr(ztdc_fifo);
+	unsigned int head = f->head;
+
+	if (head - smp_load_acquire(&f->tail) >= ztdc_fifo_len) {
+		f->lost++;
+		return;
+	}
+	getnstimeofday(&f->ts[head & (ztdc_fifo_len - 1)]);
+	smp_store_release(&f->head, head + 1);
+	smp_mb();
+	if (READ_ONCE(f->tail) == head)
+		schedule_work(&ztdc.work);
+}
+
 irqreturn_t ztdc_handler(int irq, void *dev_id)
 {
-	struct timespec ts, *tsp;
-	struct zio_device *dev = dev_id;
-	struct zio_cset *cset;
-	struct zio_channel *chan;
+	ztdc_capture();
+	return IRQ_NONE; /* none because we rely on other devices */
+}
+
+static enum hrtimer_restart ztdc_timer_fn(struct hrtimer *timer)
+{
+	u64 period = READ_ONCE(ztdc.period_ns);
+	unsigned int i, burst = READ_ONCE(ztdc.burst);
+
+	if (!period)
+		return HRTIMER_NORESTART;
+	for (i = 0; i < burst; i++)
+		ztdc_capture();
+	/* If we are late, events are skipped: the rate reports them */
+	hrtimer_forward_now(timer, ns_to_ktime(period));
+	return HRTIMER_RESTART;
+}
+
+/* Called with the attribute values, under the device lock */
+static void ztdc_timer_set(uint32_t rate, uint32_t burst)
+{
+	u64 period = 0;
+
+	if (rate && !ztdc.exiting) {
+		period = div_u64((u64)burst * NSEC_PER_SEC, rate);
+		if (period < ZTDC_MIN_PERIOD_NS)
+			period = ZTDC_MIN_PERIOD_NS;
+	}
+	WRITE_ONCE(ztdc.burst, burst);
+	WRITE_ONCE(ztdc.period_ns, period);
+	/* The timer stops by itself when the period is 0 */
+	if (period)
+		hrtimer_start(&ztdc.timer, ns_to_ktime(period),
+			      ZTDC_TIMER_MODE);
+}
+
+/*
+ * Fill cset 0: several stamps per block. We return the block only when
+ * full, Actually, if we get stop_io, we return it as partially-filled.
+ * The first stamp is saved in the trigger too, whence it reaches the
+ * control for all channels ad data_done time. Stamps are copied under
+ * the cset lock; the cset is busy while a full block is completed.
+ */
+static void ztdc_pack_data(struct zio_cset *cset, struct timespec *ts, int n)
+{
+	struct zio_channel *chan = cset->chan;
 	struct zio_block *block;
+	unsigned long flags;
+	int count, full;
 
-	getnstimeofday(&ts);
-
-	/*
-	 * fill cset 0: several per block. We return the block only when full,
-	 * Actually, if we get stop_io, we return it as partially-filled.
-	 * The first stamp is saved in the trigger too, whence it reaches the
-	 * control for all channels ad data_done time.
-	 */
-	cset = dev->cset;
-	chan = cset->chan;
-	block = chan->active_block;
-	if (block) {
-		if (!block->uoff)
-			cset->ti->tstamp = ts;
-		tsp = block->data + block->uoff;
-		*tsp = ts;
-		block->uoff += sizeof(ts);
-		if (block->uoff == block->datalen) {
-			block->uoff = 0; /* for read method */
+	while (n) {
+		spin_lock_irqsave(&cset->lock, flags);
+		block = chan->active_block;
+		if (!block) {
+			/* If armed, data_done reports it and allocates again */
+			chan->current_ctrl->zio_alarms |=
+				ZIO_ALARM_LOST_TRIGGER;
+			ztdc.block_lost++;
+			count = 1;
+			full = cset->ti->flags & ZIO_TI_ARMED;
+		} else {
+			if (!block->uoff)
+				cset->ti->tstamp = *ts;
+			count = (block->datalen - block->uoff) / sizeof(*ts);
+			if (count > n)
+				count = n;
+			memcpy(block->data + block->uoff, ts,
+			       count * sizeof(*ts));
+			block->uoff += count * sizeof(*ts);
+			full = block->uoff == block->datalen;
+			if (full)
+				block->uoff = 0; /* for read method */
+		}
+		if (full)
+			zio_cset_busy_set(cset, 0);
+		spin_unlock_irqrestore(&cset->lock, flags);
+		if (full) {
 			zio_trigger_data_done(cset);
+			zio_cset_busy_clear(cset, 1);
 		}
-	} else {
-		chan->current_ctrl->zio_alarms |= ZIO_ALARM_LOST_TRIGGER;
+		ts += count;
+		n -= count;
 	}
+}
 
-	/*
-	 * fill cset 1: a zero-size thing: save the stamp in the trigger
-	 * because that's whence data_done copies it to all channels.
-	 * Also, fix nsamples in the current control, where it is
-	 * prepared for us every time the trigger is armed.
-	 */
-	cset = dev->cset + 1;
-	chan = cset->chan;
-	block = chan->active_block;
-	if (block) {
-		cset->ti->tstamp = ts;
-		chan->current_ctrl->nsamples = 1;
+/*
+ * Fill cset 1: a zero-size thing: save the stamp in the trigger
+ * because that's whence data_done copies it to all channels.
+ * Also, fix nsamples in the current control, where it is
+ * prepared for us every time the trigger is armed.
+ */
+static void ztdc_pack_ctrl(struct zio_cset *cset, struct timespec *ts, int n)
+{
+	struct zio_channel *chan = cset->chan;
+	unsigned long flags;
+	int armed;
+
+	for (; n; n--, ts++) {
+		spin_lock_irqsave(&cset->lock, flags);
+		armed = cset->ti->flags & ZIO_TI_ARMED;
+		if (chan->active_block) {
+			cset->ti->tstamp = *ts;
+			chan->current_ctrl->nsamples = 1;
+		} else {
+			chan->current_ctrl->zio_alarms |=
+				ZIO_ALARM_LOST_TRIGGER;
+		}
+		if (armed)
+			zio_cset_busy_set(cset, 0);
+		spin_unlock_irqrestore(&cset->lock, flags);
+		if (!armed)
+			continue;
 		zio_trigger_data_done(cset);
-	} else {
-		chan->current_ctrl->zio_alarms |= ZIO_ALARM_LOST_TRIGGER;
+		zio_cset_busy_clear(cset, 1);
 	}
-	return IRQ_NONE; /* none because we rely on other devices */
+}
+
+static uint32_t ztdc_fifo_lost(void)
+{
+	uint32_t lost = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		lost += READ_ONCE(per_cpu_ptr(ztdc_fifo, cpu)->lost);
+	return lost;
+}
+
+/* A window is over: if nothing was lost, it is a sustained rate */
+static void ztdc_window(int n)
+{
+	ktime_t now = ktime_get();
+	uint32_t lost;
+	s64 ns;
+
+	ztdc.events += n;
+	ztdc.win_events += n;
+	ns = ktime_to_ns(ktime_sub(now, ztdc.win_start));
+	if (ns < ZTDC_WINDOW_NS)
+		return;
+	ztdc.rate = div64_u64(ztdc.win_events * NSEC_PER_SEC, ns);
+	lost = ztdc_fifo_lost() + ztdc.block_lost;
+	if (lost == ztdc.win_lost && ztdc.rate > ztdc.max_rate)
+		ztdc.max_rate = ztdc.rate;
+	ztdc.win_lost = lost;
+	ztdc.win_events = 0;
+	ztdc.win_start = now;
+}
+
+static struct timespec *ztdc_first(struct ztdc_fifo *f)
+{
+	return f->ts + (f->tail & (ztdc_fifo_len - 1));
+}
+
+static int ztdc_before(struct timespec *a, struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
+	return a->tv_nsec < b->tv_nsec;
+}
+
+/*
+ * The packer: each fifo is ordered, so we merge them (usually only one
+ * has data) in batches, and pack the batches in both csets.
+ */
+static void ztdc_pack_work(struct work_struct *work)
+{
+	struct zio_device *zdev = READ_ONCE(ztdc_dev);
+	struct ztdc_fifo *f;
+	int cpu, i, best, nsrc, n;
+
+	mutex_lock(&ztdc.lock);
+again:
+	nsrc = 0;
+	for_each_possible_cpu(cpu) {
+		f = per_cpu_ptr(ztdc_fifo, cpu);
+		f->snap = smp_load_acquire(&f->head);
+		if (f->snap != f->tail)
+			ztdc_src[nsrc++] = f;
+	}
+	while (nsrc) {
+		for (n = 0; n < ZTDC_BATCH && nsrc; n++) {
+			best = 0;
+			for (i = 1; i < nsrc; i++)
+				if (ztdc_before(ztdc_first(ztdc_src[i]),
+						ztdc_first(ztdc_src[best])))
+					best = i;
+			f = ztdc_src[best];
+			ztdc.batch[n] = *ztdc_first(f);
+			smp_store_release(&f->tail, f->tail + 1);
+			if (f->tail == f->snap)
+				ztdc_src[best] = ztdc_src[--nsrc];
+		}
+		if (zdev) {
+			ztdc_pack_data(zdev->cset, ztdc.batch, n);
+			ztdc_pack_ctrl(zdev->cset + 1, ztdc.batch, n);
+		}
+		ztdc_window(n);
+	}
+	/* Pairs with ztdc_capture(): new stamps are seen here or kick us */
+	smp_mb();
+	for_each_possible_cpu(cpu) {
+		f = per_cpu_ptr(ztdc_fifo, cpu);
+		if (READ_ONCE(f->head) != f->tail)
+			goto again;
+	}
+	mutex_unlock(&ztdc.lock);
 }
 
 /*
@@ -98,7 +375,7 @@ static void ztdc_stop_io(struct zio_cset *cset)
 			continue;
 		if (!block->uoff) {/* Empty: just free it */
 			zio_buffer_free_block(chan->bi, block);
-			chan->active_block = 0;
+			zio_chan_set_active(chan, NULL);
 		} else {
 			/* Close up the partial block, and return it */
 			chan->current_ctrl->nsamples =
@@ -129,13 +406,64 @@ static int ztdc_input(struct zio_cset *cset)
  * The probe function receives a new zio_device, which is different from
  * what we allocated (that one is the "hardwre" device). So save it
  */
-static struct zio_device *ztdc_dev;
 static int ztdc_probe(struct zio_device *zdev)
 {
 	ztdc_dev = zdev;
 	return 0;
 }
 
+static int ztdc_conf_set(struct device *dev, struct zio_attribute *zattr,
+			 uint32_t usr_val)
+{
+	struct zio_attribute *ext;
+
+	if ((zattr->flags & ZIO_ATTR_TYPE) != ZIO_ATTR_TYPE_EXT)
+		return 0;
+	ext = to_zio_cset(dev)->zattr_set.ext_zattr;
+	switch (zattr->id) {
+	case ZTDC_EVENT_RATE:
+		ztdc_timer_set(usr_val, ext[ZTDC_BURST].value);
+		break;
+	case ZTDC_BURST:
+		ztdc_timer_set(ext[ZTDC_EVENT_RATE].value, usr_val);
+		break;
+	case ZTDC_MAX_RATE:
+		WRITE_ONCE(ztdc.max_rate, usr_val);
+		break;
+	}
+	return 0;
+}
+
+static int ztdc_info_get(struct device *dev, struct zio_attribute *zattr,
+			 uint32_t *usr_val)
+{
+	if ((zattr->flags & ZIO_ATTR_TYPE) != ZIO_ATTR_TYPE_EXT)
+		return 0;
+	switch (zattr->id) {
+	case ZTDC_EVENTS:
+		*usr_val = READ_ONCE(ztdc.events);
+		break;
+	case ZTDC_FIFO_LOST:
+		*usr_val = ztdc_fifo_lost();
+		break;
+	case ZTDC_BLOCK_LOST:
+		*usr_val = READ_ONCE(ztdc.block_lost);
+		break;
+	case ZTDC_RATE:
+		*usr_val = READ_ONCE(ztdc.rate);
+		break;
+	case ZTDC_MAX_RATE:
+		*usr_val = READ_ONCE(ztdc.max_rate);
+		break;
+	}
+	return 0;
+}
+
+static const struct zio_sysfs_operations ztdc_sysfs_ops = {
+	.conf_set = ztdc_conf_set,
+	.info_get = ztdc_info_get,
+};
+
 static struct zio_cset ztdc_cset[] = {
 	{
 		ZIO_SET_OBJ_NAME("data-stamps"),
@@ -145,6 +473,10 @@ static struct zio_cset ztdc_cset[] = {
 					ZIO_CSET_SELF_TIMED,
 		.n_chan =	1,
 		.ssize =	sizeof(struct timespec),
+		.zattr_set = {
+			.ext_zattr = ztdc_ext,
+			.n_ext_attr = ARRAY_SIZE(ztdc_ext),
+		},
 	},
 	{
 		ZIO_SET_OBJ_NAME("ctrl-stamps"),
@@ -161,6 +493,7 @@ static struct zio_device ztdc_tmpl = {
 	.owner =		THIS_MODULE,
 	.cset =			ztdc_cset,
 	.n_cset =		ARRAY_SIZE(ztdc_cset),
+	.s_op =			&ztdc_sysfs_ops,
 };
 
 /* The driver uses a table of templates */
@@ -189,32 +522,77 @@ irqreturn_t ztdc_fake_handler(int irq, void *dev_id)
 	return IRQ_NONE;
 }
 
+static int ztdc_fifo_alloc(void)
+{
+	struct ztdc_fifo *f;
+	int cpu;
+
+	ztdc_fifo = alloc_percpu(struct ztdc_fifo);
+	ztdc_src = kcalloc(nr_cpu_ids, sizeof(*ztdc_src), GFP_KERNEL);
+	if (!ztdc_fifo || !ztdc_src)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		f = per_cpu_ptr(ztdc_fifo, cpu);
+		f->ts = kmalloc_node(ztdc_fifo_len * sizeof(*f->ts),
+				     GFP_KERNEL, cpu_to_node(cpu));
+		if (!f->ts)
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+/* Also called on allocation errors, so check everything */
+static void ztdc_fifo_free(void)
+{
+	int cpu;
+
+	if (ztdc_fifo) {
+		for_each_possible_cpu(cpu)
+			kfree(per_cpu_ptr(ztdc_fifo, cpu)->ts);
+		free_percpu(ztdc_fifo);
+	}
+	kfree(ztdc_src);
+}
+
 static int __init ztdc_init(void)
 {
 	int err;
 
-	if (ztdc_irq < 0) {
-		pr_err("%s: please pass interrupt number as irq=\n",
-		       KBUILD_MODNAME);
+	if (ztdc_fifo_len < 2 || !is_power_of_2(ztdc_fifo_len)) {
+		pr_err("%s: fifo_len must be a power of 2\n", KBUILD_MODNAME);
 		return -EINVAL;
 	}
 
-	/* Try to request the interrupt first, to catch common errors */
-	err = request_irq(ztdc_irq, ztdc_fake_handler, IRQF_SHARED,
-			  KBUILD_MODNAME, ztdc_init);
-	if (err < 0) {
-		pr_err("%s: can't request shared irq %i: error %i\n",
-		       KBUILD_MODNAME, ztdc_irq, -err);
-		return err;
+	if (ztdc_irq < 0) {
+		pr_info("%s: no irq, using the software source only\n",
+			KBUILD_MODNAME);
+	} else {
+		/* Try to request the interrupt first, to catch common errors */
+		err = request_irq(ztdc_irq, ztdc_fake_handler, ZTDC_IRQ_FLAGS,
+				  KBUILD_MODNAME, ztdc_init);
+		if (err < 0) {
+			pr_err("%s: can't request shared irq %i: error %i\n",
+			       KBUILD_MODNAME, ztdc_irq, -err);
+			return err;
+		}
+		free_irq(ztdc_irq, ztdc_init);
 	}
-	free_irq(ztdc_irq, ztdc_init);
+
+	mutex_init(&ztdc.lock);
+	INIT_WORK(&ztdc.work, ztdc_pack_work);
+	hrtimer_init(&ztdc.timer, CLOCK_MONOTONIC, ZTDC_TIMER_MODE);
+	ztdc.timer.function = ztdc_timer_fn;
+	ztdc.win_start = ktime_get();
+	err = ztdc_fifo_alloc();
+	if (err)
+		goto out_fifo;
 
 	if (ztdc_buffer)
 		ztdc_tmpl.preferred_buffer = ztdc_buffer;
 
 	err = zio_register_driver(&ztdc_zdrv);
 	if (err)
-		return err;
+		goto out_fifo;
 
 	ztdc_init_dev = zio_allocate_device();
 	if (IS_ERR(ztdc_init_dev)) {
@@ -225,7 +603,9 @@ static int __init ztdc_init(void)
 	err = zio_register_device(ztdc_init_dev, "ztdc", 0);
 	if (err)
 		goto out_register;
-	err = request_irq(ztdc_irq, ztdc_handler, IRQF_SHARED,
+	if (ztdc_irq < 0)
+		return 0;
+	err = request_irq(ztdc_irq, ztdc_handler, ZTDC_IRQ_FLAGS,
 			  KBUILD_MODNAME, ztdc_dev);
 	if (!err)
 		return 0;
@@ -234,21 +614,33 @@ static int __init ztdc_init(void)
 	pr_err("%s: can't request shared irq %i: error %i\n",
 	       KBUILD_MODNAME, ztdc_irq, -err);
 
-	zio_unregister_device(ztdc_dev);
+	zio_unregister_device(ztdc_init_dev);
 out_register:
 	zio_free_device(ztdc_init_dev);
 out_alloc:
 	zio_unregister_driver(&ztdc_zdrv);
+out_fifo:
+	ztdc_fifo_free();
 	return err;
 }
 
 static void __exit ztdc_exit(void)
 {
-	free_irq(ztdc_irq, ztdc_dev);
+	/* Stop the sources and the packer, before the csets go away */
+	if (ztdc_irq >= 0)
+		free_irq(ztdc_irq, ztdc_dev);
+	spin_lock(&ztdc_dev->lock);
+	ztdc.exiting = 1;
+	WRITE_ONCE(ztdc.period_ns, 0);
+	spin_unlock(&ztdc_dev->lock);
+	hrtimer_cancel(&ztdc.timer);
+	flush_work(&ztdc.work);
+
 	zio_unregister_device(ztdc_init_dev);
 	zio_free_device(ztdc_init_dev);
 	ztdc_dev = NULL;
 	zio_unregister_driver(&ztdc_zdrv);
+	ztdc_fifo_free();
 }
 
 module_init(ztdc_init);
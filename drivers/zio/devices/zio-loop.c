@@ -10,10 +10,16 @@
  * cset 0:  two output channels, that send to cset 1 (0 == O == Output)
  * cset 1:  two input channels, that receive from cset 0 (1 == I == Input)
  * cset 2:  one output channel, appears as data-only to a char device
+ * cset 3:  one input channel, returns data written to a char device
  * cset 4:  one output channel, like 2 but char device gets control+data
  *
- * cset 3 (not implemented): input channel, returns data from a char device
  * cset 5 (not implemented): input, receives ctrl and data from chardev
+ *
+ * Cset 1 is self-timed, like hardware that is always ready to receive: a
+ * block written to cset 0 is looped as soon as the trigger fires, and
+ * several of them can be queued in the buffers of either side. Data
+ * written to cset 3 goes to a fifo, so the writer can run ahead of
+ * the input trigger by fifo_kb kilobytes.
  */
 #define DEBUG
 #include <linux/module.h>
@@ -27,6 +33,9 @@
 #endif
 #include <linux/slab.h>
 #include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/mutex.h>
+#include <linux/kfifo.h>
 #include <linux/miscdevice.h>
 #include <linux/stringify.h>
 #if KERNEL_VERSION(4, 14, 0) > LINUX_VERSION_CODE
@@ -42,6 +51,10 @@
 ZIO_PARAM_TRIGGER(zloop_trigger);
 ZIO_PARAM_BUFFER(zloop_buffer);
 
+static int zloop_fifo_kb = 64;
+module_param_named(fifo_kb, zloop_fifo_kb, int, 0444);
+MODULE_PARM_DESC(fifo_kb, "Size of the cset 3 fifo, rounded to a power of 2");
+
 /* Name the csets. Use defines so as to stringify them */
 #define ZLOOP_CSET_OUT_LOOP		0
 #define ZLOOP_CSET_IN_LOOP		1
@@ -64,6 +77,11 @@ struct zloop_cdev_data {
 	unsigned offset, ctrl_offset;
 	spinlock_t lock;
 	wait_queue_head_t q;
+
+	/* Only for the write device: data not yet acquired by cset 3 */
+	struct kfifo fifo;
+	struct mutex wlock; /* one writer at a time feeds the fifo */
+	int armed; /* a block is waiting for data, under the cset lock */
 };
 
 static struct zloop_cdev_data zloop_cdata[] = {
@@ -81,24 +99,31 @@ static struct zloop_cdev_data zloop_cdata[] = {
 static int zloop_wr_pending, zloop_rd_pending;
 DEFINE_SPINLOCK(zloop_lock);
 
-static int zloop_complete(struct zio_device *zdev, int cset_index)
+/* Called with zloop_lock held, so stop_io can't free the blocks */
+static void zloop_complete(struct zio_device *zdev)
 {
 	struct zio_cset *cset_out = zdev->cset + ZLOOP_CSET_OUT_LOOP;
 	struct zio_cset *cset_in = zdev->cset + ZLOOP_CSET_IN_LOOP;
 	struct zio_channel *ch_in, *ch_out;
 	struct zio_control *ctrl_in, *ctrl_out;
+	struct zio_block *b_in, *b_out;
 	int isize, osize;
-	int i;
+	int i, can_swap;
 
-	pr_debug("%s: pending is (%i,%i), cset %i\n", __func__,
-		 zloop_rd_pending, zloop_wr_pending, cset_index);
-	/* both are waiting, so clear the bits without locking*/
-	zloop_rd_pending = zloop_wr_pending = 0;
+	/*
+	 * If both ends use the same buffer type, and the type allows it,
+	 * blocks of the same size exchange their data instead of copying
+	 * it: the output block is freed right after, with the input memory.
+	 */
+	can_swap = cset_in->zbuf == cset_out->zbuf &&
+		(cset_in->zbuf->flags & ZIO_BUF_FLAG_SWAP_DATA);
 
 	/* copy data from the input to the output. Can't use cset_for_each */
 	for (i = 0; i < cset_in->n_chan; i++) {
 		ch_in = cset_in->chan + i;
 		ch_out = cset_out->chan + i;
+		b_in = ch_in->active_block;
+		b_out = ch_out->active_block;
 
 		/*
 		 * Hot point: if an output channel is disabled and
@@ -106,11 +131,10 @@ static int zloop_complete(struct zio_device *zdev, int cset_index)
 		 * zeroes. If the input is disabled, the associated
 		 * output is discarded.
 		 */
-		if (!ch_in->active_block)
+		if (!b_in)
 			continue;
-		if (!ch_out->active_block) {
-			memset(ch_in->active_block->data, 0,
-			       ch_in->active_block->datalen);
+		if (!b_out) {
+			memset(b_in->data, 0, b_in->datalen);
 			continue;
 		}
 		/*
@@ -122,55 +146,156 @@ static int zloop_complete(struct zio_device *zdev, int cset_index)
 		 * receives a copy of current_ctrl at the end of it all).
 		 */
 		ctrl_in = ch_in->current_ctrl;
-		ctrl_out = zio_get_ctrl(ch_out->active_block);
+		ctrl_out = zio_get_ctrl(b_out);
 		isize = ctrl_in->nsamples;
 		osize = ctrl_out->nsamples;
+		if (can_swap && osize == isize &&
+		    b_in->datalen == b_out->datalen) {
+			swap(b_in->data, b_out->data);
+			continue;
+		}
 		if (osize > isize)
 			osize = isize;
-		memcpy(ch_in->active_block->data, ch_out->active_block->data,
-		       osize);
+		memcpy(b_in->data, b_out->data, osize);
 		if (osize < isize)
-			memset(ch_in->active_block->data + osize, 0,
-			       isize - osize);
+			memset(b_in->data + osize, 0, isize - osize);
 	}
-
-	/* One is calling us, the other one must be notified */
-	if (cset_index == cset_out->index)
-		zio_trigger_data_done(cset_in);
-	else
-		zio_trigger_data_done(cset_out);
-	return 0; /* done now, for the caller */
 }
 
 static int zloop_try_complete(struct zio_device *zdev, int cset_index)
 {
-	int ret = -EAGAIN;
+	struct zio_cset *other;
+	unsigned long flags;
+	int *mine, *theirs;
 
 	pr_debug("%s -- cset %i\n", __func__, cset_index);
-	spin_lock(&zloop_lock);
 	if (cset_index == ZLOOP_CSET_OUT_LOOP) {
-		if (zloop_wr_pending)
-			goto out_warn;
-		zloop_wr_pending++;
-		if (zloop_rd_pending) {
-			spin_unlock(&zloop_lock);
-			return zloop_complete(zdev, cset_index);
-		}
+		mine = &zloop_wr_pending;
+		theirs = &zloop_rd_pending;
+		other = zdev->cset + ZLOOP_CSET_IN_LOOP;
 	} else {
-		if (zloop_rd_pending)
-			goto out_warn;
-		zloop_rd_pending++;
-		if (zloop_wr_pending) {
-			spin_unlock(&zloop_lock);
-			return zloop_complete(zdev, cset_index);
-		}
+		mine = &zloop_rd_pending;
+		theirs = &zloop_wr_pending;
+		other = zdev->cset + ZLOOP_CSET_OUT_LOOP;
 	}
-	spin_unlock(&zloop_lock);
-	return ret;
+
+	spin_lock_irqsave(&zloop_lock, flags);
+	if (*mine)
+		goto out_warn;
+	if (!*theirs) {
+		*mine = 1;
+		spin_unlock_irqrestore(&zloop_lock, flags);
+		return -EAGAIN;
+	}
+	/* both are waiting now: exchange data and clear the flag */
+	*theirs = 0;
+	zloop_complete(zdev);
+	spin_unlock_irqrestore(&zloop_lock, flags);
+
+	/* One is calling us, the other one must be notified */
+	zio_trigger_data_done(other);
+	return 0; /* done now, for the caller */
 out_warn:
-	spin_unlock(&zloop_lock);
+	spin_unlock_irqrestore(&zloop_lock, flags);
 	WARN(1, "%s: counter corruption\n", __func__);
-	return ret;
+	return -EAGAIN;
+}
+
+/* stop_io of cset 0 and 1, in locked context: nobody waits for us */
+static void zloop_stop_loop(struct zio_cset *cset)
+{
+	struct zio_channel *chan;
+
+	spin_lock(&zloop_lock);
+	if (cset->index == ZLOOP_CSET_OUT_LOOP)
+		zloop_wr_pending = 0;
+	else
+		zloop_rd_pending = 0;
+	chan_for_each(chan, cset) {
+		zio_buffer_free_block(chan->bi, chan->active_block);
+		zio_chan_set_active(chan, NULL);
+	}
+	spin_unlock(&zloop_lock);
+}
+
+/*
+ * Cset 3: the block is claimed under the cset lock when the fifo has
+ * enough data for it (or is full, if the block is larger than the fifo),
+ * and the cset is busy while it is filled, so abort waits for us.
+ */
+static int zloop_in_data_claim(struct zio_cset *cset,
+			       struct zloop_cdev_data *data)
+{
+	struct zio_block *block = cset->chan->active_block;
+
+	if (block && kfifo_len(&data->fifo) < block->datalen &&
+	    !kfifo_is_full(&data->fifo))
+		return 0;
+	data->armed = 0;
+	zio_cset_busy_set(cset, 0);
+	return 1;
+}
+
+static void zloop_in_data_fill(struct zio_cset *cset,
+			       struct zloop_cdev_data *data)
+{
+	struct zio_block *block = cset->chan->active_block;
+	unsigned int len;
+
+	if (block) {
+		/* Like the loop, a short block is padded with zeroes */
+		len = kfifo_out(&data->fifo, block->data, block->datalen);
+		if (len < block->datalen)
+			memset(block->data + len, 0, block->datalen - len);
+	}
+	zio_cset_busy_clear(cset, 1);
+	/* there is room for the writer */
+	wake_up_interruptible(&data->q);
+}
+
+static int zloop_raw_in_data(struct zio_cset *cset)
+{
+	struct zloop_cdev_data *data = zloop_cdata + ZLOOP_TYPE_WRITE_DATA;
+	unsigned long flags;
+	int claimed;
+
+	spin_lock_irqsave(&cset->lock, flags);
+	claimed = zloop_in_data_claim(cset, data);
+	if (!claimed)
+		data->armed = 1;
+	spin_unlock_irqrestore(&cset->lock, flags);
+	if (!claimed)
+		return -EAGAIN; /* the writer will call data_done */
+	zloop_in_data_fill(cset, data);
+	return 0;
+}
+
+/* Called by the writer after feeding the fifo */
+static void zloop_in_data_try(struct zio_cset *cset,
+			      struct zloop_cdev_data *data)
+{
+	unsigned long flags;
+	int claimed;
+
+	spin_lock_irqsave(&cset->lock, flags);
+	claimed = data->armed && zloop_in_data_claim(cset, data);
+	spin_unlock_irqrestore(&cset->lock, flags);
+	if (!claimed)
+		return;
+	zloop_in_data_fill(cset, data);
+	zio_trigger_data_done(cset);
+}
+
+/* stop_io of cset 3, in locked context: the writer is not filling */
+static void zloop_stop_in_data(struct zio_cset *cset)
+{
+	struct zio_channel *chan;
+
+	zloop_cdata[ZLOOP_TYPE_WRITE_DATA].armed = 0;
+	chan_for_each(chan, cset) {
+		zio_buffer_free_block(chan->bi, chan->active_block);
+		zio_chan_set_active(chan, NULL);
+	}
 }
 
 static int zloop_raw_output(struct zio_cset *cset)
@@ -208,7 +333,7 @@ static int zloop_raw_input(struct zio_cset *cset)
 	case ZLOOP_CSET_IN_LOOP:
 		return zloop_try_complete(cset->zdev, cset->index);
 	case ZLOOP_CSET_IN_DATA:
-		return -EAGAIN; /* FIXME */
+		return zloop_raw_in_data(cset);
 	}
 	return -EOPNOTSUPP; /* never */
 }
@@ -235,6 +360,7 @@ static struct zio_cset zloop_cset[] = {
 	[ZLOOP_CSET_OUT_LOOP] = {
 		SET_OBJ_NAME_NUM("out-loop", ZLOOP_CSET_OUT_LOOP),
 		.raw_io =	zloop_raw_output,
+		.stop_io =	zloop_stop_loop,
 		.flags =	ZIO_DIR_OUTPUT,
 		.n_chan =	2,
 		.ssize =	1,
@@ -242,7 +368,8 @@ static struct zio_cset zloop_cset[] = {
 	[ZLOOP_CSET_IN_LOOP] = {
 		SET_OBJ_NAME_NUM("in-loop", ZLOOP_CSET_IN_LOOP),
 		.raw_io =	zloop_raw_input,
-		.flags =	ZIO_DIR_INPUT,
+		.stop_io =	zloop_stop_loop,
+		.flags =	ZIO_DIR_INPUT | ZIO_CSET_SELF_TIMED,
 		.n_chan =	2,
 		.ssize =	1,
 	},
@@ -256,6 +383,7 @@ static struct zio_cset zloop_cset[] = {
 	[ZLOOP_CSET_IN_DATA] = {
 		SET_OBJ_NAME_NUM("in-data", ZLOOP_CSET_IN_DATA),
 		.raw_io =	zloop_raw_input,
+		.stop_io =	zloop_stop_in_data,
 		.flags =	ZIO_DIR_INPUT,
 		.n_chan =	1,
 		.ssize =	1,
@@ -299,7 +427,15 @@ static struct zio_driver zloop_zdrv = {
 
 static unsigned int zloop_poll(struct file *f, struct poll_table_struct *wait)
 {
-	/* FIXME poll */
+	struct zloop_cdev_data *data = f->private_data;
+	struct zio_channel *chan = data->cset->chan;
+
+	poll_wait(f, &data->q, wait);
+	if (data->type == ZLOOP_TYPE_WRITE_DATA)
+		return kfifo_is_full(&data->fifo) ? 0 : POLLOUT | POLLWRNORM;
+	/* Like read, a spurious result is possible and harmless */
+	if (READ_ONCE(chan->active_block) && !READ_ONCE(data->busy))
+		return POLLIN | POLLRDNORM;
 	return 0;
 }
 
@@ -368,11 +504,45 @@ out:
 	return ret;
 }
 
+/*
+ * Write feeds the fifo of cset 3, and completes the pending block if
+ * there is enough data for it. We only sleep if the fifo is full.
+ */
 static ssize_t zloop_write(struct file *f, const char __user *buf,
 			   size_t count, loff_t *offp)
 {
-	/* FIXME write */
-	return -ENOSYS;
+	struct zloop_cdev_data *data = f->private_data;
+	struct zio_cset *cset = data->cset;
+	unsigned int copied;
+	ssize_t done = 0;
+	int err = 0;
+
+	if (mutex_lock_interruptible(&data->wlock))
+		return -ERESTARTSYS;
+	while (count) {
+		if (kfifo_is_full(&data->fifo)) {
+			if (f->f_flags & O_NONBLOCK) {
+				err = -EAGAIN;
+				break;
+			}
+			if (wait_event_interruptible(data->q,
+					!kfifo_is_full(&data->fifo))) {
+				err = -ERESTARTSYS;
+				break;
+			}
+			continue;
+		}
+		err = kfifo_from_user(&data->fifo, buf, count, &copied);
+		if (err)
+			break;
+		buf += copied;
+		count -= copied;
+		done += copied;
+		*offp += copied;
+		zloop_in_data_try(cset, data);
+	}
+	mutex_unlock(&data->wlock);
+	return done ? done : err;
 }
 
 /* We need 3 different open calls, to make private data point to each data */
@@ -493,10 +663,17 @@ static int __init zloop_init(void)
 		spin_lock_init(&zloop_cdata[i].lock);
 		init_waitqueue_head(&zloop_cdata[i].q);
 	}
+	mutex_init(&zloop_cdata[ZLOOP_TYPE_WRITE_DATA].wlock);
+	if (zloop_fifo_kb < 1)
+		zloop_fifo_kb = 1;
+	err = kfifo_alloc(&zloop_cdata[ZLOOP_TYPE_WRITE_DATA].fifo,
+			  zloop_fifo_kb * 1024, GFP_KERNEL);
+	if (err)
+		return err;
 
 	err = zio_register_driver(&zloop_zdrv);
 	if (err)
-		return err;
+		goto out_drv;
 	zloop_hwdev = zio_allocate_device();
 	if (IS_ERR(zloop_hwdev)) {
 		err = PTR_ERR(zloop_hwdev);
@@ -516,6 +693,8 @@ out_dev:
 	zio_free_device(zloop_hwdev);
 out_alloc:
 	zio_unregister_driver(&zloop_zdrv);
+out_drv:
+	kfifo_free(&zloop_cdata[ZLOOP_TYPE_WRITE_DATA].fifo);
 	return err;
 }
 
@@ -525,6 +704,7 @@ static void __exit zloop_exit(void)
 	zio_unregister_device(zloop_hwdev);
 	zio_free_device(zloop_hwdev);
 	zio_unregister_driver(&zloop_zdrv);
+	kfifo_free(&zloop_cdata[ZLOOP_TYPE_WRITE_DATA].fifo);
 }
 
 module_init(zloop_init);
@@ -23,6 +23,8 @@ static int zmini_ndev = 1;
 module_param_named(ndev, zmini_ndev, int, 0444);
 static int zmini_nchan = 1;
 module_param_named(nchan, zmini_nchan, int, 0444);
+static int zmini_few_uevents;
+module_param_named(few_uevents, zmini_few_uevents, int, 0444);
 
 static int zmini_input(struct zio_cset *cset)
 {
@@ -91,6 +93,8 @@ static int __init zmini_init(void)
 	if (zmini_buffer)
 		zmini_tmpl.preferred_buffer = zmini_buffer;
 	zmini_cset[0].n_chan = zmini_nchan;
+	if (zmini_few_uevents)
+		zmini_cset[0].flags |= ZIO_CSET_FEW_UEVENTS;
 
 	err = zio_register_driver(&zmini_zdrv);
 	if (err)
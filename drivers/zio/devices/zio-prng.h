@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright 2011-2019 CERN
+ */
+
+/*
+ * The pseudo-random generators shared by the software devices:
+ * xorshift128+ for the data, and splitmix64 to seed it from a single
+ * value. We can't use vector registers in kernel space, so a device that
+ * needs throughput interleaves several independent xorshift states: the
+ * CPU then overlaps their dependency chains.
+ */
+#ifndef __ZIO_PRNG_H__
+#define __ZIO_PRNG_H__
+
+#include <linux/types.h>
+
+static inline uint64_t zio_xorshift128p(uint64_t *s)
+{
+	uint64_t x = s[0], y = s[1];
+
+	s[0] = y;
+	x ^= x << 23;
+	s[1] = x ^ y ^ (x >> 17) ^ (y >> 26);
+	return s[1] + y;
+}
+
+static inline uint64_t zio_splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+#endif /* __ZIO_PRNG_H__ */
@@ -0,0 +1,616 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright 2011-2019 CERN
+ */
+
+/*
+ * zio-siggen is a software signal generator, to feed realistic data to
+ * buffers, triggers and user space. Each channel generates a sine, a
+ * square wave, a linear chirp, sine bursts or band-limited noise, with
+ * optional noise added; the parameters are extended attributes of the
+ * channel and may change while running: they apply from the next block.
+ * The three csets have 8, 16 and 32-bit samples, and their "nbits"
+ * attribute sets the resolution within the sample.
+ *
+ * Generation only depends on the parameters and on the number of samples
+ * since the last write to "seed" (which restarts all channels of the
+ * cset), so a recorded sequence of attribute writes replays the same data.
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/bitops.h>
+#include <linux/math64.h>
+#include <asm/unaligned.h>
+
+#include <linux/zio.h>
+#include <linux/zio-buffer.h>
+#include <linux/zio-trigger.h>
+
+#include "zio-prng.h"
+
+#define SIGGEN_VERSION ZIO_HEX_VERSION(1, 0, 0)
+#define SIGGEN_MAX_CHAN 16
+
+ZIO_PARAM_TRIGGER(siggen_trigger);
+ZIO_PARAM_BUFFER(siggen_buffer);
+
+static int siggen_nchan = 4;
+module_param_named(nchan, siggen_nchan, int, 0444);
+MODULE_PARM_DESC(nchan, "Number of channels in each cset (1-16)");
+
+enum siggen_wave {
+	SIGGEN_SINE,
+	SIGGEN_SQUARE,
+	SIGGEN_CHIRP,
+	SIGGEN_BURST,
+	SIGGEN_NOISE,
+	SIGGEN_N_WAVE,
+};
+
+/* Attributes of the cset (the rate only defines the time base) */
+enum siggen_cset_ext {
+	SIGGEN_RATE,
+	SIGGEN_SEED,
+};
+static struct zio_attribute siggen_cset_ext[] = {
+	[SIGGEN_RATE] = ZIO_ATTR_EXT_RNG("sample-rate", ZIO_RW_PERM,
+					 SIGGEN_RATE, 1000000, 1, ~0U),
+	[SIGGEN_SEED] = ZIO_ATTR_EXT("seed", ZIO_RW_PERM, SIGGEN_SEED, 0),
+};
+
+/* Attributes of each channel: frequencies in mHz, levels in 1/1000 */
+enum siggen_chan_ext {
+	SIGGEN_WAVEFORM,
+	SIGGEN_FREQ,
+	SIGGEN_AMPLITUDE,
+	SIGGEN_OFFSET,
+	SIGGEN_PHASE,
+	SIGGEN_DUTY,
+	SIGGEN_FREQ_END,
+	SIGGEN_SWEEP,
+	SIGGEN_BURST_ON,
+	SIGGEN_BURST_PERIOD,
+	SIGGEN_NOISE_LEVEL,
+	SIGGEN_NOISE_CUTOFF,
+};
+static struct zio_attribute siggen_chan_ext[] = {
+	[SIGGEN_WAVEFORM] = ZIO_ATTR_EXT_RNG("waveform", ZIO_RW_PERM,
+			SIGGEN_WAVEFORM, SIGGEN_SINE, 0, SIGGEN_N_WAVE - 1),
+	[SIGGEN_FREQ] = ZIO_ATTR_EXT("frequency-mhz", ZIO_RW_PERM,
+			SIGGEN_FREQ, 1000000),
+	[SIGGEN_AMPLITUDE] = ZIO_ATTR_EXT_RNG("amplitude", ZIO_RW_PERM,
+			SIGGEN_AMPLITUDE, 800, 0, 1000),
+	/* signed: the value is two's complement, from -1000 to 1000 */
+	[SIGGEN_OFFSET] = ZIO_ATTR_EXT("offset", ZIO_RW_PERM,
+			SIGGEN_OFFSET, 0),
+	[SIGGEN_PHASE] = ZIO_ATTR_EXT_RNG("phase-deg", ZIO_RW_PERM,
+			SIGGEN_PHASE, 0, 0, 359),
+	[SIGGEN_DUTY] = ZIO_ATTR_EXT_RNG("duty", ZIO_RW_PERM,
+			SIGGEN_DUTY, 500, 0, 1000),
+	[SIGGEN_FREQ_END] = ZIO_ATTR_EXT("chirp-end-mhz", ZIO_RW_PERM,
+			SIGGEN_FREQ_END, 10000000),
+	[SIGGEN_SWEEP] = ZIO_ATTR_EXT("chirp-samples", ZIO_RW_PERM,
+			SIGGEN_SWEEP, 100000),
+	[SIGGEN_BURST_ON] = ZIO_ATTR_EXT("burst-samples", ZIO_RW_PERM,
+			SIGGEN_BURST_ON, 1000),
+	[SIGGEN_BURST_PERIOD] = ZIO_ATTR_EXT("burst-period", ZIO_RW_PERM,
+			SIGGEN_BURST_PERIOD, 10000),
+	[SIGGEN_NOISE_LEVEL] = ZIO_ATTR_EXT_RNG("noise", ZIO_RW_PERM,
+			SIGGEN_NOISE_LEVEL, 0, 0, 1000),
+	[SIGGEN_NOISE_CUTOFF] = ZIO_ATTR_EXT("noise-cutoff-mhz", ZIO_RW_PERM,
+			SIGGEN_NOISE_CUTOFF, 0),
+};
+
+ZIO_ATTR_DEFINE_STD(ZIO_DEV, siggen_zattr_dev) = {
+	ZIO_SET_ATTR_VERSION(SIGGEN_VERSION),
+};
+ZIO_ATTR_DEFINE_STD(ZIO_DEV, siggen_zattr_cset8) = {
+	ZIO_ATTR_RNG(zdev, ZIO_ATTR_NBITS, ZIO_RW_PERM, 0, 8, 1, 8),
+};
+ZIO_ATTR_DEFINE_STD(ZIO_DEV, siggen_zattr_cset16) = {
+	ZIO_ATTR_RNG(zdev, ZIO_ATTR_NBITS, ZIO_RW_PERM, 0, 16, 1, 16),
+};
+ZIO_ATTR_DEFINE_STD(ZIO_DEV, siggen_zattr_cset32) = {
+	ZIO_ATTR_RNG(zdev, ZIO_ATTR_NBITS, ZIO_RW_PERM, 0, 32, 1, 32),
+};
+
+/*
+ * Samples are computed in Q30 (full scale is +/- 1 << 30), in chunks,
+ * with one loop per stage and no per-sample branching on the waveform,
+ * so the compiler can unroll the loops and the CPU pipeline them.
+ */
+#define SIGGEN_ONE	(1 << 30)
+#define SIGGEN_CHUNK	64
+#define SIGGEN_TBL_BITS	12
+#define SIGGEN_TBL	(1 << SIGGEN_TBL_BITS)
+
+static int32_t siggen_sin_tbl[SIGGEN_TBL + 1]; /* one more, to interpolate */
+
+/* The state of a channel, which parameters don't change */
+struct siggen_chan {
+	uint32_t phase;
+	uint32_t pos;		/* position in the chirp, or in the burst */
+	int64_t inc_q16;	/* chirp: current phase increment */
+	int32_t lp;		/* low-pass state of the noise */
+	uint64_t prng[2];
+};
+
+/* One device, three csets: their state is allocated at load time */
+#define SIGGEN_RESET 0 /* bit number in flags */
+static struct siggen_cset {
+	unsigned long flags;
+	uint32_t seed;
+	struct siggen_chan *chan;
+} siggen_cset_state[3];
+
+/* Parameters of a channel, converted once per block */
+struct siggen_param {
+	unsigned int wave;
+	uint32_t inc, duty;
+	int64_t inc_q16, dinc_q16;	/* chirp */
+	uint32_t sweep, burst_on, burst_period;
+	int32_t ampl_q16, offset, noise_q16;
+	uint32_t alpha_q16;		/* low-pass coefficient */
+};
+
+/* sin(x) for x in [0, pi/2], Q30, with a Taylor polynomial (error 6e-8) */
+static int32_t __init siggen_sin_q30(int64_t x)
+{
+	static const int div[] = {110, 72, 42, 20, 6};
+	int64_t x2 = (x * x) >> 30, t = SIGGEN_ONE;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(div); i++)
+		t = SIGGEN_ONE - div_s64((x2 * t) >> 30, div[i]);
+	return min_t(int64_t, (x * t) >> 30, SIGGEN_ONE);
+}
+
+static void __init siggen_init_table(void)
+{
+	const int q = SIGGEN_TBL / 4;
+	int i;
+
+	/* 2 * pi in Q30 is 6746518852 */
+	for (i = 0; i <= q; i++)
+		siggen_sin_tbl[i] = siggen_sin_q30(div_s64(6746518852LL * i,
+							   SIGGEN_TBL));
+	for (i = 1; i < q; i++)
+		siggen_sin_tbl[2 * q - i] = siggen_sin_tbl[i];
+	for (i = 0; i < 2 * q; i++)
+		siggen_sin_tbl[2 * q + i] = -siggen_sin_tbl[i];
+	siggen_sin_tbl[SIGGEN_TBL] = siggen_sin_tbl[0];
+}
+
+/* Table lookup with linear interpolation, on a 32-bit phase */
+static inline int32_t siggen_sin(uint32_t phase)
+{
+	uint32_t i = phase >> (32 - SIGGEN_TBL_BITS);
+	uint32_t f = (phase >> (16 - SIGGEN_TBL_BITS)) & 0xffff;
+	int32_t a = siggen_sin_tbl[i], b = siggen_sin_tbl[i + 1];
+
+	return a + (int32_t)(((int64_t)(b - a) * f) >> 16);
+}
+
+/* Phase increment per sample, for a frequency in mHz */
+static uint32_t siggen_inc(uint32_t mhz, uint32_t rate)
+{
+	return div64_u64((uint64_t)mhz << 32, (uint64_t)rate * 1000);
+}
+
+#define SIGGEN_PARAM(chan, id) ((chan)->zattr_set.ext_zattr[id].value)
+
+static void siggen_get_param(struct zio_channel *chan, uint32_t rate,
+			     struct siggen_param *p)
+{
+	uint32_t cutoff = SIGGEN_PARAM(chan, SIGGEN_NOISE_CUTOFF);
+	int32_t offset = SIGGEN_PARAM(chan, SIGGEN_OFFSET);
+	uint64_t alpha;
+
+	p->wave = SIGGEN_PARAM(chan, SIGGEN_WAVEFORM);
+	p->inc = siggen_inc(SIGGEN_PARAM(chan, SIGGEN_FREQ), rate);
+	p->duty = div_u64((uint64_t)SIGGEN_PARAM(chan, SIGGEN_DUTY) << 32,
+			  1000);
+	p->sweep = SIGGEN_PARAM(chan, SIGGEN_SWEEP);
+	p->inc_q16 = (int64_t)p->inc << 16;
+	p->dinc_q16 = 0;
+	if (p->sweep)
+		p->dinc_q16 = div_s64(((int64_t)siggen_inc(
+				SIGGEN_PARAM(chan, SIGGEN_FREQ_END), rate) -
+				p->inc) << 16, p->sweep);
+	p->burst_on = SIGGEN_PARAM(chan, SIGGEN_BURST_ON);
+	p->burst_period = SIGGEN_PARAM(chan, SIGGEN_BURST_PERIOD);
+
+	p->ampl_q16 = (SIGGEN_PARAM(chan, SIGGEN_AMPLITUDE) << 16) / 1000;
+	offset = clamp(offset, -1000, 1000);
+	p->offset = div_s64((int64_t)offset * SIGGEN_ONE, 1000);
+	p->noise_q16 = (SIGGEN_PARAM(chan, SIGGEN_NOISE_LEVEL) << 16) / 1000;
+
+	/* One-pole low-pass: alpha is 2 pi fc / fs, 1 (white) if no cutoff */
+	alpha = 1 << 16;
+	if (cutoff)
+		alpha = div64_u64((uint64_t)cutoff * 411775, /* 2pi << 16 */
+				  (uint64_t)rate * 1000);
+	p->alpha_q16 = min_t(uint64_t, alpha, 1 << 16);
+}
+
+/* Restart a channel, as after a write to "seed" */
+static void siggen_reset_chan(struct zio_channel *chan, uint32_t seed,
+			      struct siggen_chan *sch)
+{
+	uint64_t x = ((uint64_t)seed << 32) | chan->index;
+
+	sch->phase = div_u64((uint64_t)SIGGEN_PARAM(chan, SIGGEN_PHASE) << 32,
+			     360);
+	sch->pos = 0;
+	sch->inc_q16 = -1; /* chirp: take the start frequency */
+	sch->lp = 0;
+	sch->prng[0] = zio_splitmix64(&x);
+	sch->prng[1] = zio_splitmix64(&x);
+}
+
+/* The waveforms */
+static void siggen_gen_sine(struct siggen_chan *sch, struct siggen_param *p,
+			    int32_t *v, unsigned int n)
+{
+	uint32_t phase = sch->phase, inc = p->inc;
+	unsigned int i;
+
+	for (i = 0; i < n; i++, phase += inc)
+		v[i] = siggen_sin(phase);
+	sch->phase = phase;
+}
+
+static void siggen_gen_square(struct siggen_chan *sch,
+			      struct siggen_param *p, int32_t *v,
+			      unsigned int n)
+{
+	uint32_t phase = sch->phase, inc = p->inc, duty = p->duty;
+	unsigned int i;
+
+	for (i = 0; i < n; i++, phase += inc)
+		v[i] = phase < duty ? SIGGEN_ONE : -SIGGEN_ONE;
+	sch->phase = phase;
+}
+
+static void siggen_gen_chirp(struct siggen_chan *sch, struct siggen_param *p,
+			     int32_t *v, unsigned int n)
+{
+	uint32_t phase = sch->phase, pos = sch->pos;
+	int64_t inc = sch->inc_q16;
+	unsigned int i;
+
+	if (inc < 0 || !p->sweep || pos >= p->sweep) {
+		inc = p->inc_q16;
+		pos = 0;
+	}
+	for (i = 0; i < n; i++) {
+		v[i] = siggen_sin(phase);
+		phase += (uint32_t)(inc >> 16);
+		inc += p->dinc_q16;
+		if (++pos == p->sweep) {
+			pos = 0;
+			inc = p->inc_q16;
+		}
+	}
+	sch->phase = phase;
+	sch->pos = pos;
+	sch->inc_q16 = inc;
+}
+
+static void siggen_gen_burst(struct siggen_chan *sch, struct siggen_param *p,
+			     int32_t *v, unsigned int n)
+{
+	uint32_t phase = sch->phase, inc = p->inc, pos = sch->pos;
+	unsigned int i;
+
+	for (i = 0; i < n; i++, phase += inc) {
+		v[i] = pos < p->burst_on ? siggen_sin(phase) : 0;
+		if (++pos >= p->burst_period)
+			pos = 0;
+	}
+	sch->phase = phase;
+	sch->pos = pos;
+}
+
+/* White noise from the PRNG through the low-pass filter */
+static void siggen_gen_noise(struct siggen_chan *sch, struct siggen_param *p,
+			     int32_t *v, unsigned int n)
+{
+	int32_t lp = sch->lp, w;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		w = (int32_t)(zio_xorshift128p(sch->prng) >> 32) >> 1;
+		lp += ((int64_t)(w - lp) * p->alpha_q16) >> 16;
+		v[i] = lp;
+	}
+	sch->lp = lp;
+}
+
+static void (*siggen_gen[SIGGEN_N_WAVE])(struct siggen_chan *sch,
+					 struct siggen_param *p,
+					 int32_t *v, unsigned int n) = {
+	[SIGGEN_SINE] = siggen_gen_sine,
+	[SIGGEN_SQUARE] = siggen_gen_square,
+	[SIGGEN_CHIRP] = siggen_gen_chirp,
+	[SIGGEN_BURST] = siggen_gen_burst,
+	[SIGGEN_NOISE] = siggen_gen_noise,
+};
+
+/* Amplitude, then added noise (full-scale relative) */
+static void siggen_scale(struct siggen_chan *sch, struct siggen_param *p,
+			 int32_t *v, int32_t *noise, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		v[i] = ((int64_t)v[i] * p->ampl_q16) >> 16;
+	if (!p->noise_q16 || p->wave == SIGGEN_NOISE)
+		return;
+	siggen_gen_noise(sch, p, noise, n);
+	for (i = 0; i < n; i++)
+		v[i] += ((int64_t)noise[i] * p->noise_q16) >> 16;
+}
+
+/* Offset, saturation, and conversion to nbits within the sample size */
+#define SIGGEN_PACK(_type, _data, _v, _n, _offset, _shift) do {		\
+	_type *__d = (_data);						\
+	unsigned int __i;						\
+	int64_t __x;							\
+									\
+	for (__i = 0; __i < (_n); __i++) {				\
+		__x = (int64_t)(_v)[__i] + (_offset);			\
+		__x = clamp_t(int64_t, __x, -SIGGEN_ONE, SIGGEN_ONE - 1); \
+		__x = (_shift) >= 0 ? __x >> (_shift) : __x << 1;	\
+		put_unaligned((_type)__x, __d + __i);			\
+	}								\
+} while (0)
+
+static void *siggen_pack(void *data, int32_t *v, unsigned int n,
+			 struct siggen_param *p, unsigned int nbits,
+			 unsigned int ssize)
+{
+	int shift = 31 - nbits; /* -1 for 32 bits */
+
+	switch (ssize) {
+	case 1:
+		SIGGEN_PACK(int8_t, data, v, n, p->offset, shift);
+		break;
+	case 2:
+		SIGGEN_PACK(int16_t, data, v, n, p->offset, shift);
+		break;
+	case 4:
+		SIGGEN_PACK(int32_t, data, v, n, p->offset, shift);
+		break;
+	}
+	return data + n * ssize;
+}
+
+/*
+ * Generate n samples for a channel; data is NULL if the block could not
+ * be allocated: the state advances all the same, for the next blocks
+ */
+static void siggen_fill(struct zio_channel *chan, struct siggen_chan *sch,
+			void *data, unsigned int n, uint32_t rate,
+			unsigned int nbits)
+{
+	int32_t v[SIGGEN_CHUNK], noise[SIGGEN_CHUNK];
+	struct siggen_param p;
+	unsigned int k;
+
+	siggen_get_param(chan, rate, &p);
+	while (n) {
+		k = min_t(unsigned int, n, SIGGEN_CHUNK);
+		siggen_gen[p.wave](sch, &p, v, k);
+		siggen_scale(sch, &p, v, noise, k);
+		if (data)
+			data = siggen_pack(data, v, k, &p, nbits,
+					   chan->cset->ssize);
+		n -= k;
+	}
+}
+
+static int siggen_input(struct zio_cset *cset)
+{
+	struct siggen_cset *sc = &siggen_cset_state[cset->index];
+	struct zio_channel *chan;
+	struct zio_block *block;
+	uint32_t rate, nbits;
+	unsigned int n;
+
+	rate = cset->zattr_set.ext_zattr[SIGGEN_RATE].value;
+	nbits = cset->zattr_set.std_zattr[ZIO_ATTR_NBITS].value;
+	if (test_and_clear_bit(SIGGEN_RESET, &sc->flags))
+		for (n = 0; n < cset->n_chan; n++)
+			siggen_reset_chan(&cset->chan[n], READ_ONCE(sc->seed),
+					  &sc->chan[n]);
+
+	/* Return immediately: just fill the blocks */
+	chan_for_each(chan, cset) {
+		block = chan->active_block;
+		if (block) {
+			n = block->datalen / cset->ssize;
+			chan->current_ctrl->nbits = nbits;
+		} else {
+			n = cset->ti->nsamples;
+		}
+		siggen_fill(chan, &sc->chan[chan->index],
+			    block ? block->data : NULL, n, rate, nbits);
+	}
+	return 0; /* Already done */
+}
+
+static int siggen_conf_set(struct device *dev, struct zio_attribute *zattr,
+			   uint32_t usr_val)
+{
+	struct zio_cset *cset;
+	struct siggen_cset *sc;
+
+	/* Everything applies to the next block; "seed" restarts the cset */
+	if (to_zio_head(dev)->zobj_type != ZIO_CSET ||
+	    (zattr->flags & ZIO_ATTR_TYPE) != ZIO_ATTR_TYPE_EXT ||
+	    zattr->id != SIGGEN_SEED)
+		return 0;
+	cset = to_zio_cset(dev);
+	sc = &siggen_cset_state[cset->index];
+	WRITE_ONCE(sc->seed, usr_val);
+	smp_mb__before_atomic();
+	set_bit(SIGGEN_RESET, &sc->flags);
+	return 0;
+}
+
+static const struct zio_sysfs_operations siggen_sysfs_ops = {
+	.conf_set = siggen_conf_set,
+};
+
+static struct zio_channel siggen_chan_tmpl = {
+	.zattr_set = {
+		.ext_zattr = siggen_chan_ext,
+		.n_ext_attr = ARRAY_SIZE(siggen_chan_ext),
+	},
+};
+
+static struct zio_cset siggen_cset[] = {
+	{
+		ZIO_SET_OBJ_NAME("siggen-8"),
+		.raw_io =	siggen_input,
+		.n_chan =	4,
+		.ssize =	1,
+		.flags =	ZIO_DIR_INPUT | ZIO_CSET_TYPE_ANALOG,
+		.chan_template = &siggen_chan_tmpl,
+		.zattr_set = {
+			.std_zattr = siggen_zattr_cset8,
+			.ext_zattr = siggen_cset_ext,
+			.n_ext_attr = ARRAY_SIZE(siggen_cset_ext),
+		},
+	},
+	{
+		ZIO_SET_OBJ_NAME("siggen-16"),
+		.raw_io =	siggen_input,
+		.n_chan =	4,
+		.ssize =	2,
+		.flags =	ZIO_DIR_INPUT | ZIO_CSET_TYPE_ANALOG,
+		.chan_template = &siggen_chan_tmpl,
+		.zattr_set = {
+			.std_zattr = siggen_zattr_cset16,
+			.ext_zattr = siggen_cset_ext,
+			.n_ext_attr = ARRAY_SIZE(siggen_cset_ext),
+		},
+	},
+	{
+		ZIO_SET_OBJ_NAME("siggen-32"),
+		.raw_io =	siggen_input,
+		.n_chan =	4,
+		.ssize =	4,
+		.flags =	ZIO_DIR_INPUT | ZIO_CSET_TYPE_ANALOG,
+		.chan_template = &siggen_chan_tmpl,
+		.zattr_set = {
+			.std_zattr = siggen_zattr_cset32,
+			.ext_zattr = siggen_cset_ext,
+			.n_ext_attr = ARRAY_SIZE(siggen_cset_ext),
+		},
+	},
+};
+
+static struct zio_device siggen_tmpl = {
+	.owner =		THIS_MODULE,
+	.cset =			siggen_cset,
+	.n_cset =		ARRAY_SIZE(siggen_cset),
+	.s_op =			&siggen_sysfs_ops,
+	.zattr_set = {
+		.std_zattr = siggen_zattr_dev,
+	},
+};
+
+static struct zio_device *siggen_dev;
+static const struct zio_device_id siggen_table[] = {
+	{"zsiggen", &siggen_tmpl},
+	{},
+};
+
+static struct zio_driver siggen_zdrv = {
+	.driver = {
+		.name = "zsiggen",
+		.owner = THIS_MODULE,
+	},
+	.id_table = siggen_table,
+	/* All drivers compiled within the ZIO projects are compatibile
+	   with the last version */
+	.min_version = ZIO_VERSION(1, 1, 0),
+};
+
+static void siggen_free_state(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(siggen_cset_state); i++)
+		kfree(siggen_cset_state[i].chan);
+}
+
+static int __init siggen_init(void)
+{
+	int i, err;
+
+	if (siggen_nchan < 1 || siggen_nchan > SIGGEN_MAX_CHAN) {
+		pr_err("%s: nchan is %i: out of range\n", KBUILD_MODNAME,
+		       siggen_nchan);
+		return -EINVAL;
+	}
+	siggen_init_table();
+	for (i = 0; i < ARRAY_SIZE(siggen_cset); i++) {
+		siggen_cset[i].n_chan = siggen_nchan;
+		siggen_cset_state[i].chan = kcalloc(siggen_nchan,
+						    sizeof(struct siggen_chan),
+						    GFP_KERNEL);
+		if (!siggen_cset_state[i].chan) {
+			err = -ENOMEM;
+			goto out_state;
+		}
+		set_bit(SIGGEN_RESET, &siggen_cset_state[i].flags);
+	}
+	if (siggen_trigger)
+		siggen_tmpl.preferred_trigger = siggen_trigger;
+	if (siggen_buffer)
+		siggen_tmpl.preferred_buffer = siggen_buffer;
+
+	err = zio_register_driver(&siggen_zdrv);
+	if (err)
+		goto out_state;
+	siggen_dev = zio_allocate_device();
+	if (IS_ERR(siggen_dev)) {
+		err = PTR_ERR(siggen_dev);
+		goto out_alloc;
+	}
+	siggen_dev->owner = THIS_MODULE;
+	err = zio_register_device(siggen_dev, "zsiggen", 0);
+	if (err)
+		goto out_dev;
+	return 0;
+
+out_dev:
+	zio_free_device(siggen_dev);
+out_alloc:
+	zio_unregister_driver(&siggen_zdrv);
+out_state:
+	siggen_free_state();
+	return err;
+}
+
+static void __exit siggen_exit(void)
+{
+	zio_unregister_device(siggen_dev);
+	zio_free_device(siggen_dev);
+	zio_unregister_driver(&siggen_zdrv);
+	siggen_free_state();
+}
+
+module_init(siggen_init);
+module_exit(siggen_exit);
+
+MODULE_VERSION(GIT_VERSION); /* Defined in local Makefile */
+MODULE_DESCRIPTION("A zio driver which generates sine, chirp, burst and noise");
+MODULE_LICENSE("GPL");
+
+ADDITIONAL_VERSIONS;
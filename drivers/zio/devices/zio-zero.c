@@ -9,16 +9,30 @@
  *  channels are completely software driven. The input channels fill
  *  the data block with zeroes, random data and sequential numbers,
  *  respectively. The output channel just discards data it receives.
+ *
+ *  The last cset is self-timed: a kernel thread produces its blocks at
+ *  the rate set in "sample-rate" (0: as fast as possible), with the
+ *  block size of the trigger, to load buffers and consumers like a fast
+ *  ADC. Its 64-bit channels are zero, pseudo-random and a counter; the
+ *  counter advances for lost blocks too, so readers can detect them.
  */
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/slab.h>
 #include <linux/random.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
 #include <asm/unaligned.h>
 
 #include <linux/zio.h>
 #include <linux/zio-buffer.h>
+#include <linux/zio-trigger.h>
+
+#include "zio-prng.h"
 
 #define ZZERO_VERSION ZIO_HEX_VERSION(1, 1, 0)
 
@@ -44,10 +58,37 @@ ZIO_ATTR_DEFINE_STD(ZIO_DEV, zzero_zattr_cset32) = {
 /* This attribute is the sequence point for input channel number 0 of cset 2 */
 enum zzero_ext {
 	ZZERO_SEQ,
+	ZZERO_RATE,
+	ZZERO_ACHIEVED,
+	ZZERO_DROPPED,
 };
 static struct zio_attribute zzero_cset1_ext[] = {
 	ZIO_ATTR_EXT("sequence", ZIO_RW_PERM, ZZERO_SEQ, 0),
 };
+/* Attributes of the stream cset: the rate must be the first one */
+static struct zio_attribute zzero_stream_ext[] = {
+	ZIO_ATTR_EXT("sample-rate", ZIO_RW_PERM, ZZERO_RATE, 1000000),
+	ZIO_ATTR_EXT("achieved-rate", ZIO_RO_PERM, ZZERO_ACHIEVED, 0),
+	ZIO_ATTR_EXT("dropped", ZIO_RO_PERM, ZZERO_DROPPED, 0),
+};
+
+#define ZZS_SLACK_NS	(10 * NSEC_PER_USEC)
+#define ZZS_MAX_LAG_NS	(10 * NSEC_PER_MSEC) /* then, don't catch up */
+
+/* One stream cset, one thread: one lazy structure */
+static struct {
+	struct task_struct *thread;
+	wait_queue_head_t q;
+	struct zio_cset *cset;
+	int armed, running;		/* changed with the cset lock */
+	ktime_t next;			/* when the current block is complete */
+	ktime_t win_start;		/* achieved-rate is measured each second */
+	uint64_t win_samples;
+	uint32_t achieved;
+	uint32_t dropped;
+	uint64_t seq;
+	uint64_t prng[4][2];
+} zzs;
 /*
  * This generates a sequence of 32-bit little-endian numbers.
  * It is meant to be used for diagnostics and regression testing of buffers
@@ -88,6 +129,169 @@ static void zzero_get_interleaved(struct zio_channel *chan,
 		}
 	}
 }
+
+/* Four xorshift128+ states interleaved, see zio-prng.h */
+static void zzero_fill_random(uint8_t *data, unsigned int n)
+{
+	while (n >= 4) {
+		put_unaligned_le64(zio_xorshift128p(zzs.prng[0]), data);
+		put_unaligned_le64(zio_xorshift128p(zzs.prng[1]), data + 8);
+		put_unaligned_le64(zio_xorshift128p(zzs.prng[2]), data + 16);
+		put_unaligned_le64(zio_xorshift128p(zzs.prng[3]), data + 24);
+		data += 32;
+		n -= 4;
+	}
+	while (n--) {
+		put_unaligned_le64(zio_xorshift128p(zzs.prng[0]), data);
+		data += 8;
+	}
+}
+
+static void zzero_fill_sequence(uint8_t *data, unsigned int n)
+{
+	uint64_t seq = zzs.seq;
+
+	while (n >= 4) {
+		put_unaligned_le64(seq, data);
+		put_unaligned_le64(seq + 1, data + 8);
+		put_unaligned_le64(seq + 2, data + 16);
+		put_unaligned_le64(seq + 3, data + 24);
+		seq += 4;
+		data += 32;
+		n -= 4;
+	}
+	while (n--) {
+		put_unaligned_le64(seq++, data);
+		data += 8;
+	}
+}
+
+/* Fill the blocks of the stream cset, and account for them */
+static void zzero_stream_fill(struct zio_cset *cset, ktime_t now)
+{
+	unsigned int nsamples = cset->ti->nsamples;
+	struct zio_channel *chan;
+	struct zio_block *block;
+	s64 ns;
+
+	chan_for_each(chan, cset) {
+		block = chan->active_block;
+		if (!block) {
+			zzs.dropped++;
+			continue;
+		}
+		switch (chan->index) {
+		case 0: /* zero */
+			memset(block->data, 0x0, block->datalen);
+			break;
+		case 1: /* random */
+			zzero_fill_random(block->data, block->datalen / 8);
+			break;
+		case 2: /* sequence */
+			zzero_fill_sequence(block->data, block->datalen / 8);
+			break;
+		}
+	}
+	zzs.seq += nsamples;
+
+	zzs.win_samples += nsamples;
+	ns = ktime_to_ns(ktime_sub(now, zzs.win_start));
+	if (ns >= NSEC_PER_SEC) {
+		zzs.achieved = div64_u64(zzs.win_samples * NSEC_PER_SEC, ns);
+		zzs.win_samples = 0;
+		zzs.win_start = now;
+	}
+}
+
+/*
+ * The thread is the device: it waits until the current block is due,
+ * then fills it and completes the transfer. The cset is marked busy
+ * while blocks are filled, so abort waits for us.
+ */
+static int zzero_stream_thread(void *arg)
+{
+	struct zio_cset *cset;
+	unsigned long flags;
+	ktime_t next, now;
+	int armed;
+
+	while (!kthread_should_stop()) {
+		wait_event_interruptible(zzs.q, READ_ONCE(zzs.armed) ||
+					 kthread_should_stop());
+		cset = READ_ONCE(zzs.cset);
+		if (!cset)
+			continue;
+
+		spin_lock_irqsave(&cset->lock, flags);
+		armed = zzs.armed;
+		next = zzs.next;
+		now = ktime_get();
+		if (armed && !ktime_after(next, now)) {
+			zzs.armed = 0;
+			zio_cset_busy_set(cset, 0);
+		}
+		spin_unlock_irqrestore(&cset->lock, flags);
+		if (!armed)
+			continue;
+		if (ktime_after(next, now)) {
+			set_current_state(TASK_INTERRUPTIBLE);
+			schedule_hrtimeout_range(&next, ZZS_SLACK_NS,
+						 HRTIMER_MODE_ABS);
+			continue;
+		}
+
+		zzero_stream_fill(cset, now);
+		zio_trigger_data_done(cset); /* it re-arms: we are self-timed */
+		/* Only now may an abort proceed: the blocks are stored */
+		zio_cset_busy_clear(cset, 1);
+		cond_resched();
+	}
+	return 0;
+}
+
+/* raw_io of the stream cset: schedule the block and wake the thread */
+static int zzero_input_stream(struct zio_cset *cset)
+{
+	uint32_t rate = cset->zattr_set.ext_zattr[0].value;
+	unsigned long flags;
+	ktime_t now;
+	u64 period;
+
+	period = rate ? div_u64((u64)cset->ti->nsamples * NSEC_PER_SEC, rate)
+		: 0;
+	now = ktime_get();
+	spin_lock_irqsave(&cset->lock, flags);
+	if (!zzs.running) {
+		zzs.running = 1;
+		zzs.next = now;
+		zzs.win_start = now;
+		zzs.win_samples = 0;
+	}
+	/* Blocks are due on a fixed schedule, but we don't burst to catch up */
+	zzs.next = ktime_add_ns(zzs.next, period);
+	if (ktime_before(zzs.next, ktime_sub_ns(now, ZZS_MAX_LAG_NS)))
+		zzs.next = now;
+	zzs.cset = cset;
+	WRITE_ONCE(zzs.armed, 1);
+	spin_unlock_irqrestore(&cset->lock, flags);
+	wake_up(&zzs.q);
+
+	return -EAGAIN; /* the thread calls data_done */
+}
+
+/* stop_io of the stream cset, in locked context: the thread is not busy */
+static void zzero_stop_stream(struct zio_cset *cset)
+{
+	struct zio_channel *chan;
+
+	zzs.armed = 0;
+	zzs.running = 0;
+	chan_for_each(chan, cset) {
+		zio_buffer_free_block(chan->bi, chan->active_block);
+		zio_chan_set_active(chan, NULL);
+	}
+}
+
 /* 8 bits input function */
 static int zzero_input_8(struct zio_cset *cset)
 {
@@ -151,8 +355,25 @@ static int zzero_conf_set(struct device *dev, struct zio_attribute *zattr,
 	return 0;
 }
 
+static int zzero_info_get(struct device *dev, struct zio_attribute *zattr,
+			  uint32_t *usr_val)
+{
+	if ((zattr->flags & ZIO_ATTR_TYPE) != ZIO_ATTR_TYPE_EXT)
+		return 0;
+	switch (zattr->id) {
+	case ZZERO_ACHIEVED:
+		*usr_val = READ_ONCE(zzs.achieved);
+		break;
+	case ZZERO_DROPPED:
+		*usr_val = READ_ONCE(zzs.dropped);
+		break;
+	}
+	return 0;
+}
+
 static const struct zio_sysfs_operations zzero_sysfs_ops = {
 	.conf_set = zzero_conf_set,
+	.info_get = zzero_info_get,
 };
 
 static struct zio_cset zzero_cset[] = {
@@ -189,6 +410,19 @@ static struct zio_cset zzero_cset[] = {
 			.n_ext_attr = ARRAY_SIZE(zzero_cset1_ext),
 		},
 	},
+	{
+		ZIO_SET_OBJ_NAME("zero-stream-64"),
+		.raw_io =	zzero_input_stream,
+		.stop_io =	zzero_stop_stream,
+		.n_chan =	3,
+		.ssize =	8,
+		.flags =	ZIO_DIR_INPUT | ZIO_CSET_TYPE_ANALOG |
+				ZIO_CSET_SELF_TIMED,
+		.zattr_set = {
+			.ext_zattr = zzero_stream_ext,
+			.n_ext_attr = ARRAY_SIZE(zzero_stream_ext),
+		},
+	},
 };
 
 static struct zio_device zzero_tmpl = {
@@ -226,10 +460,15 @@ static int __init zzero_init(void)
 		zzero_tmpl.preferred_trigger = zzero_trigger;
 	if (zzero_buffer)
 		zzero_tmpl.preferred_buffer = zzero_buffer;
+	init_waitqueue_head(&zzs.q);
+	get_random_bytes(zzs.prng, sizeof(zzs.prng));
+	zzs.thread = kthread_run(zzero_stream_thread, NULL, "zio-zero");
+	if (IS_ERR(zzs.thread))
+		return PTR_ERR(zzs.thread);
 
 	err = zio_register_driver(&zzero_zdrv);
 	if (err)
-		return err;
+		goto out_drv;
 	zzero_dev = zio_allocate_device();
 	if (IS_ERR(zzero_dev)) {
 		err = PTR_ERR(zzero_dev);
@@ -244,11 +483,15 @@ out_dev:
 	zio_free_device(zzero_dev);
 out_all:
 	zio_unregister_driver(&zzero_zdrv);
+out_drv:
+	kthread_stop(zzs.thread);
 	return err;
 }
 
 static void __exit zzero_exit(void)
 {
+	/* Stop the thread first: the abort at unregister frees its blocks */
+	kthread_stop(zzs.thread);
 	zio_unregister_device(zzero_dev);
 	zio_free_device(zzero_dev);
 	zio_unregister_driver(&zzero_zdrv);
@@ -13,83 +13,232 @@
 #include <linux/list.h>
 #include <linux/mm.h>
 #include <linux/dma-mapping.h>
+#include <linux/dmapool.h>
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/delay.h>
 
 #include <linux/zio-dma.h>
+#include <linux/zio-buffer.h>
+#include <linux/zio-trigger.h>
 #include "zio-internal.h"
 
-static int zio_calculate_nents(struct zio_blocks_sg *sg_blocks,
-			       unsigned int n_blocks)
+static inline struct page *zio_dma_page(void *bufp)
 {
-	int i, bytesleft;
-	void *bufp;
-	int mapbytes;
-	int nents = 0;
+	if (is_vmalloc_addr(bufp))
+		return vmalloc_to_page(bufp);
+	return virt_to_page(bufp);
+}
+
+/*
+ * Length of the physically contiguous run starting at bufp, within
+ * bytesleft and the maximum segment size of the device. Kmalloc blocks
+ * and contiguous areas become a single scatterlist entry, vmalloc ones
+ * are merged only where consecutive pages happen to be contiguous.
+ */
+static unsigned int zio_dma_run(void *bufp, size_t bytesleft,
+				unsigned int max_seg, struct page **page)
+{
+	struct page *pg, *next;
+	size_t len;
+
+	pg = zio_dma_page(bufp);
+	*page = pg;
+	len = min_t(size_t, bytesleft, PAGE_SIZE - offset_in_page(bufp));
+	while (len < bytesleft && len < max_seg) {
+		next = zio_dma_page(bufp + len);
+		if (page_to_pfn(next) != page_to_pfn(pg) + 1)
+			break;
+		pg = next;
+		len += min_t(size_t, bytesleft - len, PAGE_SIZE);
+	}
+	return min_t(size_t, len, max_seg);
+}
+
+/* Number of scatterlist entries for a memory range */
+static unsigned int zio_dma_count_runs(void *bufp, size_t bytesleft,
+				       unsigned int max_seg)
+{
+	unsigned int nents = 0, mapbytes;
+	struct page *page;
+
+	while (bytesleft) {
+		mapbytes = zio_dma_run(bufp, bytesleft, max_seg, &page);
+		bufp += mapbytes;
+		bytesleft -= mapbytes;
+		nents++;
+	}
+	return nents;
+}
 
-	for (i = 0; i < n_blocks; ++i) {
-		bytesleft = sg_blocks[i].block->datalen;
-		bufp = sg_blocks[i].block->data;
+/* Fill scatterlist entries for a memory range, return the next entry */
+static struct scatterlist *zio_dma_set_runs(struct scatterlist *sg,
+					    void *bufp, size_t bytesleft,
+					    unsigned int max_seg)
+{
+	unsigned int mapbytes;
+	struct page *page;
+
+	while (bytesleft) {
+		mapbytes = zio_dma_run(bufp, bytesleft, max_seg, &page);
+		sg_set_page(sg, page, mapbytes, offset_in_page(bufp));
+		pr_debug("sg item (%p(+0x%lx), len:%d, left:%zu)\n",
+			 page, offset_in_page(bufp), mapbytes,
+			 bytesleft - mapbytes);
+		bufp += mapbytes;
+		bytesleft -= mapbytes;
+		sg = sg_next(sg);
+	}
+	return sg;
+}
+
+static int zio_calculate_nents(struct zio_dma_sgt *zdma)
+{
+	unsigned int max_seg = dma_get_max_seg_size(zdma->hwdev);
+	struct zio_blocks_sg *sg_blocks = zdma->sg_blocks;
+	int i, nents = 0;
+
+	for (i = 0; i < zdma->n_blocks; ++i) {
 		sg_blocks[i].first_nent = nents;
-		while (bytesleft) {
-			nents++;
-			if (bytesleft < (PAGE_SIZE - offset_in_page(bufp)))
-				mapbytes = bytesleft;
-			else
-				mapbytes = PAGE_SIZE - offset_in_page(bufp);
-			bufp += mapbytes;
-			bytesleft -= mapbytes;
-		}
+		nents += zio_dma_count_runs(sg_blocks[i].block->data,
+					    sg_blocks[i].block->datalen,
+					    max_seg);
 	}
 	return nents;
 }
 
 static void zio_dma_setup_scatter(struct zio_dma_sgt *zdma)
 {
-	struct scatterlist *sg;
-	int bytesleft = 0;
-	void *bufp = NULL;
-	int mapbytes;
-	int i, i_blk;
+	unsigned int max_seg = dma_get_max_seg_size(zdma->hwdev);
+	struct scatterlist *sg = zdma->sgt.sgl;
+	struct zio_block *block;
+	int i;
 
-	i_blk = 0;
-	for_each_sg(zdma->sgt.sgl, sg, zdma->sgt.nents, i) {
-		if (i_blk < zdma->n_blocks && i == zdma->sg_blocks[i_blk].first_nent) {
-			WARN(bytesleft, "unmapped byte in block %i\n",
-			     i_blk - 1);
-			/*
-			 * Configure the DMA for a new block, reset index and
-			 * data pointer
-			 */
-			bytesleft = zdma->sg_blocks[i_blk].block->datalen;
-			bufp = zdma->sg_blocks[i_blk].block->data;
-
-			i_blk++; /* index the next block */
-			if (unlikely(i_blk > zdma->n_blocks))
-				BUG();
-		}
+	/* Each block starts a new entry, at sg_blocks[i].first_nent */
+	for (i = 0; i < zdma->n_blocks; ++i) {
+		block = zdma->sg_blocks[i].block;
+		sg = zio_dma_set_runs(sg, block->data, block->datalen,
+				      max_seg);
+	}
+}
 
-		/*
-		 * If there are less bytes left than what fits
-		 * in the current page (plus page alignment offset)
-		 * we just feed in this, else we stuff in as much
-		 * as we can.
-		 */
-		if (bytesleft < (PAGE_SIZE - offset_in_page(bufp)))
-			mapbytes = bytesleft;
-		else
-			mapbytes = PAGE_SIZE - offset_in_page(bufp);
-		/* Map the page */
-		if (is_vmalloc_addr(bufp))
-			sg_set_page(sg, vmalloc_to_page(bufp), mapbytes,
-				    offset_in_page(bufp));
-		else
-			sg_set_buf(sg, bufp, mapbytes);
-		/* Configure next values */
-		bufp += mapbytes;
-		bytesleft -= mapbytes;
-		pr_debug("sg item (%p(+0x%lx), len:%d, left:%d)\n",
-			 virt_to_page(bufp), offset_in_page(bufp),
-			 mapbytes, bytesleft);
+/*
+ * Transfer descriptors come from a dma_pool of coherent memory, one per
+ * device and descriptor size, if the driver created it at probe time.
+ * The pool is a device resource, so it goes away with the driver binding.
+ * Without a pool, the descriptors of a mapping are one coherent vector:
+ * drivers written before the pool index it through page_desc_pool.
+ */
+struct zio_dma_pool_res {
+	struct dma_pool *pool;
+	size_t size;
+};
+
+static void zio_dma_pool_release(struct device *hwdev, void *res)
+{
+	dma_pool_destroy(((struct zio_dma_pool_res *)res)->pool);
+}
+
+static int zio_dma_pool_match(struct device *hwdev, void *res, void *data)
+{
+	return ((struct zio_dma_pool_res *)res)->size == *(size_t *)data;
+}
+
+static struct dma_pool *zio_dma_pool_find(struct device *hwdev, size_t size)
+{
+	struct zio_dma_pool_res *res;
+
+	res = devres_find(hwdev, zio_dma_pool_release, zio_dma_pool_match,
+			  &size);
+	return res ? res->pool : NULL;
+}
+
+/*
+ * zio_dma_pool_init
+ * @hwdev: low level device responsible of the DMA
+ * @page_desc_size: the size (in byte) of the dma transfer descriptor of the
+ *                  specific hw
+ * @align: the alignment the hardware requires for descriptors (or 0)
+ *
+ * It creates the descriptor pool used by zio_dma_map_sg and
+ * zio_dma_area_map; call it once from probe, as it can sleep. It is
+ * optional: without a pool the descriptors of each mapping are one
+ * contiguous coherent vector.
+ */
+int zio_dma_pool_init(struct device *hwdev, size_t page_desc_size,
+		      size_t align)
+{
+	struct zio_dma_pool_res *res;
+
+	if (zio_dma_pool_find(hwdev, page_desc_size))
+		return 0;
+	res = devres_alloc(zio_dma_pool_release, sizeof(*res), GFP_KERNEL);
+	if (!res)
+		return -ENOMEM;
+	res->size = page_desc_size;
+	res->pool = dma_pool_create(dev_name(hwdev), hwdev, page_desc_size,
+				    align, 0);
+	if (!res->pool) {
+		devres_free(res);
+		return -ENOMEM;
+	}
+	devres_add(hwdev, res);
+	return 0;
+}
+EXPORT_SYMBOL(zio_dma_pool_init);
+
+static void zio_dma_desc_free(struct device *hwdev, struct dma_pool *pool,
+			      size_t size, unsigned int n, void **desc,
+			      dma_addr_t *dma_desc)
+{
+	unsigned int i;
+
+	if (desc && !pool && desc[0])
+		dma_free_coherent(hwdev, size * n, desc[0], dma_desc[0]);
+	for (i = 0; desc && pool && i < n && desc[i]; i++)
+		dma_pool_free(pool, desc[i], dma_desc[i]);
+	kfree(dma_desc);
+	kfree(desc);
+}
+
+static int zio_dma_desc_alloc(struct device *hwdev, size_t size,
+			      unsigned int n, struct dma_pool **pool,
+			      void ***desc, dma_addr_t **dma_desc, gfp_t gfp)
+{
+	dma_addr_t dma_vec;
+	unsigned int i;
+	void *vec;
+
+	*pool = zio_dma_pool_find(hwdev, size);
+	*desc = kcalloc(n, sizeof(**desc), gfp);
+	*dma_desc = kcalloc(n, sizeof(**dma_desc), gfp);
+	if (!*desc || !*dma_desc)
+		goto out;
+	if (!*pool) {
+		vec = dma_alloc_coherent(hwdev, size * n, &dma_vec, gfp);
+		if (!vec)
+			goto out;
+		memset(vec, 0, size * n);
+		for (i = 0; i < n; i++) {
+			(*desc)[i] = vec + i * size;
+			(*dma_desc)[i] = dma_vec + i * size;
+		}
+		return 0;
 	}
+	for (i = 0; i < n; i++) {
+		(*desc)[i] = dma_pool_alloc(*pool, gfp, &(*dma_desc)[i]);
+		if (!(*desc)[i])
+			goto out;
+		memset((*desc)[i], 0, size);
+	}
+	return 0;
+out:
+	dev_err(hwdev, "cannot allocate coherent dma memory\n");
+	zio_dma_desc_free(hwdev, *pool, size, n, *desc, *dma_desc);
+	*desc = NULL;
+	*dma_desc = NULL;
+	return -ENOMEM;
 }
 
 /*
@@ -123,6 +272,7 @@ struct zio_dma_sgt *zio_dma_alloc_sg(struct zio_channel *chan,
 	if (!zdma)
 		return ERR_PTR(-ENOMEM);
 	zdma->chan = chan;
+	zdma->dir = DMA_FROM_DEVICE; /* the caller may change it */
 	/* Allocate a new list of blocks with sg information */
 	zdma->sg_blocks = kzalloc(sizeof(struct zio_blocks_sg) * n_blocks, gfp);
 	if (!zdma->sg_blocks) {
@@ -137,8 +287,8 @@ struct zio_dma_sgt *zio_dma_alloc_sg(struct zio_channel *chan,
 		zdma->sg_blocks[i].block = blocks[i];
 
 
-	/* calculate the number of necessary pages to transfer */
-	pages = zio_calculate_nents(zdma->sg_blocks, zdma->n_blocks);
+	/* calculate the number of necessary sg entries to transfer */
+	pages = zio_calculate_nents(zdma);
 	if (!pages) {
 		err = -EINVAL;
 		goto out_calc_nents;
@@ -151,6 +301,7 @@ struct zio_dma_sgt *zio_dma_alloc_sg(struct zio_channel *chan,
 
 	/* Setup the scatter list for the provided block */
 	zio_dma_setup_scatter(zdma);
+	dev_dbg(hwdev, "%u blocks in %u sg entries\n", n_blocks, pages);
 
 	return zdma;
 
@@ -190,94 +341,124 @@ EXPORT_SYMBOL(zio_dma_free_sg);
  *
  *It maps a sg table
  *
+ * Descriptors are contiguous in page_desc_pool only if the driver did not
+ * call zio_dma_pool_init(); otherwise use page_desc[] and dma_next_desc.
+ * There is one descriptor per mapped segment (n_desc of them), which may
+ * be less than the scatterlist entries: use dma_addr and len of zio_dma_sg
+ * rather than the entry itself.
+ *
  * fill_desc
  * @zdma: zio DMA descriptor from zio_dma_alloc_sg()
- * @page_idx: index of the current page transfer
+ * @page_idx: index of the current descriptor
  * @block_idx: index of the current zio_block
  * @page_desc: current descriptor to fill
  * @dev_mem_offset: offset within the device memory
- * @sg: current sg descriptor
+ * @sg: the mapped sg entry this descriptor belongs to
  */
 int zio_dma_map_sg(struct zio_dma_sgt *zdma, size_t page_desc_size,
 			int (*fill_desc)(struct zio_dma_sg *zsg))
 {
-	unsigned int i, err = 0, sglen, i_blk;
-	uint32_t dev_mem_off = 0;
+	unsigned int i, sglen, i_blk, nents, d = 0;
+	unsigned long off = 0, end, lim, blk_start = 0, blk_end = 0;
+	struct zio_blocks_sg *sgb = NULL;
 	struct scatterlist *sg;
 	struct zio_dma_sg zsg;
-	void *item_ptr;
-	size_t size;
+	dma_addr_t addr;
+	ktime_t t0;
+	int err;
 
 	if (unlikely(!zdma || !fill_desc))
 		return -EINVAL;
 
-	/* Limited to 32-bit (kernel limit) */
+	/* At most one descriptor per entry, see below */
+	t0 = ktime_get();
+	nents = zdma->sgt.nents;
 	zdma->page_desc_size = page_desc_size;
-	size = zdma->page_desc_size * zdma->sgt.nents;
-	zdma->page_desc_pool = kzalloc(size, GFP_ATOMIC);
-	if (!zdma->page_desc_pool) {
-		dev_err(zdma->hwdev, "cannot allocate coherent dma memory\n");
-		return -ENOMEM;
-	}
-	zdma->dma_page_desc_pool = dma_map_single(zdma->hwdev,
-						  zdma->page_desc_pool, size,
-						  DMA_TO_DEVICE);
-	if (dma_mapping_error(zdma->hwdev, zdma->dma_page_desc_pool)) {
-		dev_err(zdma->hwdev, "cannot map dma memory for descriptors\n");
-		err = -ENOMEM;
-		goto out_map_single;
-	}
+	err = zio_dma_desc_alloc(zdma->hwdev, page_desc_size, nents,
+				 &zdma->pool, &zdma->page_desc,
+				 &zdma->dma_page_desc, GFP_ATOMIC);
+	if (err)
+		return err;
+	zdma->page_desc_pool = zdma->page_desc[0];
+	zdma->dma_page_desc_pool = zdma->dma_page_desc[0];
 
 	/* Map DMA buffers */
-	sglen = dma_map_sg(zdma->hwdev, zdma->sgt.sgl, zdma->sgt.nents,
-			   DMA_FROM_DEVICE);
+	sglen = dma_map_sg(zdma->hwdev, zdma->sgt.sgl, nents, zdma->dir);
 	if (!sglen) {
 		dev_err(zdma->hwdev, "cannot map dma SG memory\n");
+		err = -ENOMEM;
 		goto out_map_sg;
 	}
 
+	/*
+	 * Only sglen entries are valid after mapping. An IOMMU may merge
+	 * entries of different blocks: such segments are split again at
+	 * block boundaries, so a descriptor never spans two blocks. Merged
+	 * entries are whole, so there are at most nents descriptors.
+	 */
 	i_blk = 0;
-	for_each_sg(zdma->sgt.sgl, sg, zdma->sgt.nents, i) {
-		dev_dbg(zdma->hwdev, "%d 0x%x\n", i, dev_mem_off);
-		if (i_blk < zdma->n_blocks && i == zdma->sg_blocks[i_blk].first_nent) {
-			dev_dbg(zdma->hwdev, "%d is the first nent of block %d\n", i, i_blk);
-			dev_mem_off = zdma->sg_blocks[i_blk].dev_mem_off;
-
-			i_blk++; /* index the next block */
-			if (unlikely(i_blk > zdma->n_blocks)) {
+	for_each_sg(zdma->sgt.sgl, sg, sglen, i) {
+		addr = sg_dma_address(sg);
+		end = off + sg_dma_len(sg);
+		while (off < end) {
+			while (off >= blk_end && i_blk < zdma->n_blocks) {
+				sgb = &zdma->sg_blocks[i_blk++];
+				sgb->first_desc = d;
+				blk_start = blk_end;
+				blk_end += sgb->block->datalen;
+			}
+			lim = min(end, blk_end);
+			if (unlikely(off >= lim || d >= nents)) {
 				dev_err(zdma->hwdev, "DMA map out of block\n");
-				BUG();
+				err = -EINVAL;
+				goto out_fill_desc;
 			}
-		}
 
-		item_ptr = zdma->page_desc_pool + (zdma->page_desc_size * i);
-
- 		/* Configure hardware pages */
-		zsg.zsgt = zdma;
-		zsg.sg = sg;
-		zsg.dev_mem_off = dev_mem_off;
-		zsg.page_desc = item_ptr;
-		zsg.block_idx = i_blk;
-		zsg.page_idx= i;
-		err = fill_desc(&zsg);
-		if (err) {
-			dev_err(zdma->hwdev, "Cannot fill descriptor %d\n", i);
-			goto out_fill_desc;
+			/* Configure hardware pages */
+			zsg.zsgt = zdma;
+			zsg.area = NULL;
+			zsg.sg = sg;
+			zsg.dma_addr = addr;
+			zsg.len = lim - off;
+			zsg.flags = 0;
+			zsg.dev_mem_off = sgb->dev_mem_off + (off - blk_start);
+			zsg.slice_off = 0;
+			zsg.page_desc = zdma->page_desc[d];
+			zsg.dma_page_desc = zdma->dma_page_desc[d];
+			zsg.dma_next_desc = (lim < end || i + 1 < sglen) &&
+					    d + 1 < nents ?
+					    zdma->dma_page_desc[d + 1] : 0;
+			zsg.block_idx = i_blk;
+			zsg.page_idx = d;
+			dev_dbg(zdma->hwdev, "%d 0x%x\n", d, zsg.dev_mem_off);
+			err = fill_desc(&zsg);
+			if (err) {
+				dev_err(zdma->hwdev,
+					"Cannot fill descriptor %d\n", d);
+				goto out_fill_desc;
+			}
+			addr += zsg.len;
+			off = lim;
+			d++;
 		}
-
-		dev_mem_off += sg_dma_len(sg);
 	}
+	zdma->n_desc = d;
+	dev_dbg(zdma->hwdev,
+		"%u blocks: %u sg entries, %u mapped, %u descriptors, %lli ns\n",
+		zdma->n_blocks, nents, sglen, d,
+		ktime_to_ns(ktime_sub(ktime_get(), t0)));
 
 	return 0;
 
 out_fill_desc:
-	dma_unmap_sg(zdma->hwdev, zdma->sgt.sgl, zdma->sgt.nents,
-		     DMA_FROM_DEVICE);
+	dma_unmap_sg(zdma->hwdev, zdma->sgt.sgl, nents, zdma->dir);
 out_map_sg:
-	dma_unmap_single(zdma->hwdev, zdma->dma_page_desc_pool, size,
-			 DMA_TO_DEVICE);
-out_map_single:
-	kfree(zdma->page_desc_pool);
+	zio_dma_desc_free(zdma->hwdev, zdma->pool, page_desc_size, nents,
+			  zdma->page_desc, zdma->dma_page_desc);
+	zdma->page_desc = NULL;
+	zdma->dma_page_desc = NULL;
+	zdma->page_desc_pool = NULL;
+	zdma->dma_page_desc_pool = 0;
 
 	return err;
 }
@@ -292,15 +473,1253 @@ EXPORT_SYMBOL(zio_dma_map_sg);
  */
 void zio_dma_unmap_sg(struct zio_dma_sgt *zdma)
 {
-	size_t size;
-
-	size = zdma->page_desc_size * zdma->sgt.nents;
-	dma_unmap_sg(zdma->hwdev, zdma->sgt.sgl, zdma->sgt.nents,
-		     DMA_FROM_DEVICE);
-	dma_unmap_single(zdma->hwdev, zdma->dma_page_desc_pool, size,
-			 DMA_TO_DEVICE);
-	kfree(zdma->page_desc_pool);
+	dma_unmap_sg(zdma->hwdev, zdma->sgt.sgl, zdma->sgt.nents, zdma->dir);
+	zio_dma_desc_free(zdma->hwdev, zdma->pool, zdma->page_desc_size,
+			  zdma->sgt.nents, zdma->page_desc,
+			  zdma->dma_page_desc);
+	zdma->page_desc = NULL;
+	zdma->dma_page_desc = NULL;
 	zdma->dma_page_desc_pool = 0;
 	zdma->page_desc_pool = NULL;
+	zdma->n_desc = 0;
 }
 EXPORT_SYMBOL(zio_dma_unmap_sg);
+
+
+/*
+ * Persistent mappings. For continuous acquisition in the same memory the
+ * scatterlist, the mapping and the transfer descriptors are built once:
+ * each block is then a slice (offset, length) of the area. The
+ * descriptors of the segments covered by a slice already hold the whole
+ * segment, so only the first and the last one (and those left partial
+ * by an earlier slice) are written again; the remaining per-transfer
+ * cost is cache maintenance of the data. If the descriptors depend on
+ * where the slice starts (e.g. the device offset is relative to it),
+ * the user sets ZIO_DMA_AREA_REFILL and all of them are written.
+ *
+ * Segments never cross a slot boundary (the scatterlist is built so, and
+ * segments merged by an IOMMU are split again), so slices laid out in
+ * slots own their descriptors and can be in flight at the same time. A
+ * slice owns its descriptors from prepare to complete, and a slice that
+ * would share one with a slice in flight is refused.
+ */
+static unsigned long zio_dma_area_chunk(struct zio_dma_area *area,
+					unsigned long off)
+{
+	if (!area->slot)
+		return area->size - off;
+	return min_t(size_t, area->size - off,
+		     area->slot - off % area->slot);
+}
+
+static int zio_dma_area_setup_scatter(struct zio_dma_area *area)
+{
+	unsigned int max_seg = dma_get_max_seg_size(area->hwdev);
+	struct scatterlist *sg;
+	unsigned long off, len;
+	unsigned int nents = 0;
+	int err;
+
+	for (off = 0; off < area->size; off += len) {
+		len = zio_dma_area_chunk(area, off);
+		nents += zio_dma_count_runs(area->buf + off, len, max_seg);
+	}
+	err = sg_alloc_table(&area->sgt, nents, GFP_KERNEL);
+	if (err)
+		return err;
+	sg = area->sgt.sgl;
+	for (off = 0; off < area->size; off += len) {
+		len = zio_dma_area_chunk(area, off);
+		sg = zio_dma_set_runs(sg, area->buf + off, len, max_seg);
+	}
+	return 0;
+}
+
+/*
+ * Index the n mapped segments as descriptors, splitting them at slot
+ * boundaries. Each descriptor covers whole scatterlist entries (mapping
+ * only merges entries), recorded for cache maintenance. It returns the
+ * number of descriptors, at most the number of entries.
+ */
+static unsigned int zio_dma_area_index(struct zio_dma_area *area, int n)
+{
+	struct scatterlist *sg, *ent = area->sgt.sgl;
+	unsigned long off = 0, ent_off = 0, end, lim;
+	unsigned int d = 0, e = 0;
+	dma_addr_t addr;
+	int i;
+
+	for_each_sg(area->sgt.sgl, sg, n, i) {
+		addr = sg_dma_address(sg);
+		end = off + sg_dma_len(sg);
+		while (off < end) {
+			lim = off + min_t(unsigned long, end - off,
+					  zio_dma_area_chunk(area, off));
+			area->seg_off[d] = off;
+			area->seg_addr[d] = addr;
+			area->seg_sg[d] = ent;
+			area->seg_ent[d] = e;
+			for (; ent && ent_off < lim; e++) {
+				ent_off += ent->length;
+				ent = sg_next(ent);
+			}
+			addr += lim - off;
+			off = lim;
+			d++;
+		}
+	}
+	area->seg_off[d] = off;
+	area->seg_ent[d] = e;
+	return d;
+}
+
+/* Write the descriptor of a segment, for a piece of a slice */
+static int zio_dma_area_fill(struct zio_dma_area *area, unsigned int i,
+			     unsigned long offset, unsigned long start,
+			     unsigned long end, unsigned long flags)
+{
+	struct zio_dma_sg zsg;
+
+	zsg.zsgt = NULL;
+	zsg.area = area;
+	zsg.sg = NULL;
+	zsg.dma_addr = area->seg_addr[i] + (start - area->seg_off[i]);
+	zsg.len = end - start;
+	zsg.dev_mem_off = start;
+	zsg.slice_off = offset;
+	zsg.page_desc = area->page_desc[i];
+	zsg.dma_page_desc = area->dma_page_desc[i];
+	zsg.dma_next_desc = i + 1 < area->n_seg ?
+			    area->dma_page_desc[i + 1] : 0;
+	zsg.block_idx = 0;
+	zsg.page_idx = i;
+	zsg.flags = flags;
+	return area->fill_desc(&zsg);
+}
+
+/*
+ * zio_dma_area_map
+ * @hwdev: low level device responsible of the DMA
+ * @buf: the memory area (lowmem or vmalloc), it must outlive the mapping
+ * @size: size of the area
+ * @slot: no segment crosses a multiple of it (0 for no such limit)
+ * @dir: direction of data transfers
+ * @page_desc_size: the size (in byte) of the dma transfer descriptor of the
+ *                  specific hw
+ * @fill_desc: callback for the driver in order to fill each transfer
+ *             descriptor: it uses dma_addr and len of zio_dma_sg, and
+ *             flags tell the first and last descriptor of a slice
+ * @priv: for the callback, in the priv field of the area
+ *
+ * It maps the area once and fills a descriptor for each mapped segment.
+ * It can sleep.
+ */
+struct zio_dma_area *zio_dma_area_map(struct device *hwdev, void *buf,
+				      size_t size, size_t slot,
+				      enum dma_data_direction dir,
+				      size_t page_desc_size,
+				      int (*fill_desc)(struct zio_dma_sg *zsg),
+				      void *priv)
+{
+	struct zio_dma_area *area;
+	unsigned int nents;
+	ktime_t t0;
+	int i, n, err;
+
+	if (unlikely(!hwdev || !buf || !size || !page_desc_size || !fill_desc))
+		return ERR_PTR(-EINVAL);
+
+	t0 = ktime_get();
+	area = kzalloc(sizeof(*area), GFP_KERNEL);
+	if (!area)
+		return ERR_PTR(-ENOMEM);
+	area->hwdev = hwdev;
+	area->buf = buf;
+	area->size = size;
+	area->slot = slot;
+	area->dir = dir;
+	area->page_desc_size = page_desc_size;
+	area->fill_desc = fill_desc;
+	area->priv = priv;
+	spin_lock_init(&area->lock);
+
+	err = zio_dma_area_setup_scatter(area);
+	if (err)
+		goto out;
+	n = dma_map_sg(hwdev, area->sgt.sgl, area->sgt.nents, dir);
+	if (!n) {
+		dev_err(hwdev, "cannot map dma SG memory\n");
+		err = -ENOMEM;
+		goto out_map_sg;
+	}
+
+	/* The mapping may merge pages: index the resulting segments */
+	err = -ENOMEM;
+	nents = area->sgt.nents;
+	area->seg_off = kcalloc(nents + 1, sizeof(*area->seg_off), GFP_KERNEL);
+	area->seg_addr = kcalloc(nents, sizeof(*area->seg_addr), GFP_KERNEL);
+	area->seg_sg = kcalloc(nents, sizeof(*area->seg_sg), GFP_KERNEL);
+	area->seg_ent = kcalloc(nents + 1, sizeof(*area->seg_ent), GFP_KERNEL);
+	area->dirty = kcalloc(BITS_TO_LONGS(nents), sizeof(long), GFP_KERNEL);
+	area->busy = kcalloc(BITS_TO_LONGS(nents), sizeof(long), GFP_KERNEL);
+	if (!area->seg_off || !area->seg_addr || !area->seg_sg ||
+	    !area->seg_ent || !area->dirty || !area->busy)
+		goto out_alloc;
+	n = zio_dma_area_index(area, n);
+	area->n_seg = n;
+	err = zio_dma_desc_alloc(hwdev, page_desc_size, n, &area->pool,
+				 &area->page_desc, &area->dma_page_desc,
+				 GFP_KERNEL);
+	if (err)
+		goto out_alloc;
+	area->page_desc_pool = area->page_desc[0];
+	area->dma_page_desc_pool = area->dma_page_desc[0];
+
+	for (i = 0; i < n; i++) {
+		err = zio_dma_area_fill(area, i, 0, area->seg_off[i],
+					area->seg_off[i + 1], 0);
+		if (err) {
+			dev_err(hwdev, "Cannot fill descriptor %d\n", i);
+			goto out_fill;
+		}
+	}
+	dev_dbg(hwdev, "area of %zu bytes: %u sg entries, %u descriptors, %lli ns\n",
+		size, area->sgt.nents, n,
+		ktime_to_ns(ktime_sub(ktime_get(), t0)));
+	return area;
+
+out_fill:
+	zio_dma_desc_free(hwdev, area->pool, page_desc_size, n,
+			  area->page_desc, area->dma_page_desc);
+out_alloc:
+	kfree(area->busy);
+	kfree(area->dirty);
+	kfree(area->seg_ent);
+	kfree(area->seg_sg);
+	kfree(area->seg_addr);
+	kfree(area->seg_off);
+	dma_unmap_sg(hwdev, area->sgt.sgl, area->sgt.nents, dir);
+out_map_sg:
+	sg_free_table(&area->sgt);
+out:
+	kfree(area);
+	return ERR_PTR(err);
+}
+EXPORT_SYMBOL(zio_dma_area_map);
+
+/*
+ * zio_dma_area_unmap
+ * @area: persistent mapping from zio_dma_area_map()
+ *
+ * It releases the mapping; no transfer may be running
+ */
+void zio_dma_area_unmap(struct zio_dma_area *area)
+{
+	dma_unmap_sg(area->hwdev, area->sgt.sgl, area->sgt.nents, area->dir);
+	sg_free_table(&area->sgt);
+	zio_dma_desc_free(area->hwdev, area->pool, area->page_desc_size,
+			  area->n_seg, area->page_desc, area->dma_page_desc);
+	kfree(area->busy);
+	kfree(area->dirty);
+	kfree(area->seg_ent);
+	kfree(area->seg_sg);
+	kfree(area->seg_addr);
+	kfree(area->seg_off);
+	kfree(area);
+}
+EXPORT_SYMBOL(zio_dma_area_unmap);
+
+/* Index of the segment including the given offset (binary search) */
+static unsigned int zio_dma_area_seg(struct zio_dma_area *area,
+				     unsigned long offset)
+{
+	unsigned int lo = 0, hi = area->n_seg - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (area->seg_off[mid] <= offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+/*
+ * zio_dma_slice_prepare
+ * @area: persistent mapping from zio_dma_area_map()
+ * @offset: offset of the transfer within the area
+ * @len: length of the transfer
+ * @slice: filled with the descriptors to hand to the hardware
+ *
+ * It takes the descriptors of the slice, rewrites those at its edges and
+ * gives the memory to the device. It returns -EBUSY if a descriptor
+ * belongs to a slice not completed yet. It can be called in atomic
+ * context.
+ */
+int zio_dma_slice_prepare(struct zio_dma_area *area, unsigned long offset,
+			  size_t len, struct zio_dma_slice *slice)
+{
+	unsigned int i, first, last;
+	unsigned long start, end, flags, irqflags;
+	int err;
+
+	if (unlikely(!len || offset >= area->size ||
+		     len > area->size - offset))
+		return -EINVAL;
+
+	first = zio_dma_area_seg(area, offset);
+	last = zio_dma_area_seg(area, offset + len - 1);
+	spin_lock_irqsave(&area->lock, irqflags);
+	if (find_next_bit(area->busy, last + 1, first) <= last) {
+		spin_unlock_irqrestore(&area->lock, irqflags);
+		return -EBUSY;
+	}
+	bitmap_set(area->busy, first, last - first + 1);
+	spin_unlock_irqrestore(&area->lock, irqflags);
+
+	for (i = first; i <= last; i++) {
+		start = max(offset, area->seg_off[i]);
+		end = min(offset + len, area->seg_off[i + 1]);
+		flags = (i == first ? ZIO_DMA_SG_FIRST : 0) |
+			(i == last ? ZIO_DMA_SG_LAST : 0);
+		/* A whole inner segment: the descriptor is ready, if clean */
+		if (!flags && !test_bit(i, area->dirty) &&
+		    !(area->flags & ZIO_DMA_AREA_REFILL))
+			continue;
+		err = zio_dma_area_fill(area, i, offset, start, end, flags);
+		if (err)
+			goto out_fill;
+		if (flags)
+			__set_bit(i, area->dirty);
+		else
+			__clear_bit(i, area->dirty);
+	}
+	/* Descriptors are coherent: just order them before the data */
+	wmb();
+
+	slice->offset = offset;
+	slice->len = len;
+	slice->first_desc = first;
+	slice->n_desc = last - first + 1;
+	slice->dma_desc = area->dma_page_desc[first];
+	dma_sync_sg_for_device(area->hwdev, area->seg_sg[first],
+			       area->seg_ent[last + 1] - area->seg_ent[first],
+			       area->dir);
+	return 0;
+
+out_fill:
+	spin_lock_irqsave(&area->lock, irqflags);
+	bitmap_clear(area->busy, first, last - first + 1);
+	spin_unlock_irqrestore(&area->lock, irqflags);
+	return err;
+}
+EXPORT_SYMBOL(zio_dma_slice_prepare);
+
+/*
+ * zio_dma_slice_complete
+ * @area: persistent mapping from zio_dma_area_map()
+ * @slice: a slice from zio_dma_slice_prepare(), whose transfer is over
+ *
+ * It gives the memory of the slice back to the CPU, and releases its
+ * descriptors
+ */
+void zio_dma_slice_complete(struct zio_dma_area *area,
+			    struct zio_dma_slice *slice)
+{
+	unsigned int first = slice->first_desc;
+	unsigned int last = first + slice->n_desc - 1;
+	unsigned long irqflags;
+
+	dma_sync_sg_for_cpu(area->hwdev, area->seg_sg[first],
+			    area->seg_ent[last + 1] - area->seg_ent[first],
+			    area->dir);
+	spin_lock_irqsave(&area->lock, irqflags);
+	bitmap_clear(area->busy, first, slice->n_desc);
+	spin_unlock_irqrestore(&area->lock, irqflags);
+}
+EXPORT_SYMBOL(zio_dma_slice_complete);
+
+/*
+ * zio_dma_block_prepare
+ * @area: persistent mapping from zio_dma_area_map()
+ * @block: a block whose data lives in the area
+ * @slice: filled with the descriptors to hand to the hardware
+ *
+ * zio_dma_slice_prepare() for the data of a block
+ */
+int zio_dma_block_prepare(struct zio_dma_area *area, struct zio_block *block,
+			  struct zio_dma_slice *slice)
+{
+	if (unlikely(block->data < area->buf ||
+		     block->data >= area->buf + area->size))
+		return -EINVAL;
+	return zio_dma_slice_prepare(area, block->data - area->buf,
+				     block->datalen, slice);
+}
+EXPORT_SYMBOL(zio_dma_block_prepare);
+
+
+/*
+ * Asynchronous DMA engine. Drivers all do the same: raw_io starts a
+ * transfer of the active blocks of the enabled channels and returns
+ * -EAGAIN; the completion calls zio_trigger_data_done. Here this is done
+ * once, and the driver only fills descriptors and starts or stops the
+ * device.
+ *
+ * The device transfers to or from the blocks themselves. A work item
+ * binds each channel to its buffer instance: if the buffer exposes its
+ * data area (zio_bi_area_get), the area is pinned and mapped once with
+ * zio_dma_area_map, and a block is a slice of it, so the per-transfer
+ * cost is cache maintenance. Other blocks (a kmalloc buffer, an area not
+ * bound yet, or ZIO_DMA_ASYNC_MAP_SG) are mapped together with
+ * zio_dma_map_sg, one table per transfer. When the buffer replaces its
+ * area, or the channel gets another buffer, the binding is released as
+ * soon as no transfer uses it, and a new one is made.
+ *
+ * With ZIO_DMA_ASYNC_PINGPONG (input only), the next transfer is queued
+ * as soon as one starts, so the device moves to it without waiting for
+ * software, in blocks the engine allocates from the bound buffer
+ * instances. When the trigger is re-armed, raw_io "claims" the queued
+ * transfer, whose blocks become the active ones; the blocks the trigger
+ * allocated meanwhile are used for the next transfer. A queued transfer that
+ * completes before being claimed (the trigger was not re-armed in time)
+ * is dropped with its blocks. Abort goes through stop_io: the transfers
+ * are detached, and the driver stops the device from a work item, as it
+ * may sleep; the blocks the device may still write are freed after it.
+ *
+ * Blocks are mapped with the engine unlocked (the transfer is PREPARING
+ * meanwhile), and a stop in between is noticed through za->stops.
+ */
+
+static inline unsigned long zio_dma_async_base(struct zio_dma_async *za,
+					       unsigned int chan)
+{
+	return za->ops->dev_mem_off ? za->ops->dev_mem_off(za, chan) : 0;
+}
+
+/* The fill_desc of a bound area: device offsets restart with each slice */
+static int zio_dma_async_fill_area(struct zio_dma_sg *zsg)
+{
+	struct zio_dma_async_bind *b = zsg->area->priv;
+	struct zio_dma_async *za = b->za;
+
+	zsg->dev_mem_off = zio_dma_async_base(za, b->chan) +
+			   (zsg->dev_mem_off - zsg->slice_off);
+	return za->ops->fill_desc(zsg);
+}
+
+/* The fill_desc of a transfer table: tell where each block starts, ends */
+static int zio_dma_async_fill_sg(struct zio_dma_sg *zsg)
+{
+	struct zio_dma_async *za = zsg->zsgt->priv;
+	struct zio_blocks_sg *sgb;
+	unsigned long off;
+
+	sgb = &zsg->zsgt->sg_blocks[zsg->block_idx - 1]; /* counts from 1 */
+	off = zsg->dev_mem_off - sgb->dev_mem_off;
+	zsg->flags = (off ? 0 : ZIO_DMA_SG_FIRST) |
+		     (off + zsg->len == sgb->block->datalen ?
+		      ZIO_DMA_SG_LAST : 0);
+	return za->ops->fill_desc(zsg);
+}
+
+/* The buffer replaced the area: it calls us locked, we can't sleep */
+static void zio_dma_async_invalidate(struct zio_bi_area *ba)
+{
+	struct zio_dma_async_bind *b = ba->priv;
+	struct zio_dma_async *za = b->za;
+	unsigned long flags;
+
+	spin_lock_irqsave(&za->lock, flags);
+	b->stale = 1;
+	spin_unlock_irqrestore(&za->lock, flags);
+	schedule_work(&za->bind_work);
+}
+
+/*
+ * Bind a channel to its buffer instance, in process context with the
+ * change lock held (so the instance is the one of cset->zbuf). Blocks
+ * in the area are page aligned, and its segments are split at pages:
+ * blocks in flight at the same time never share a descriptor.
+ */
+static void zio_dma_async_bind(struct zio_dma_async *za,
+			       struct zio_dma_async_bind *b,
+			       struct zio_cset *cset)
+{
+	struct zio_bi *bi = cset->chan[b->chan].bi;
+	struct zio_dma_area *area;
+	unsigned long flags;
+
+	if (!try_module_get(cset->zbuf->owner))
+		return;
+	b->owner = cset->zbuf->owner;
+	get_device(&bi->head.dev);
+
+	/* From now on, an invalidation is seen */
+	spin_lock_irqsave(&za->lock, flags);
+	b->stale = 0;
+	spin_unlock_irqrestore(&za->lock, flags);
+
+	memset(&b->ba, 0, sizeof(b->ba));
+	b->ba.align = PAGE_SIZE;
+	b->ba.invalidate = zio_dma_async_invalidate;
+	b->ba.priv = b;
+	b->area = NULL;
+	if (!(za->flags & ZIO_DMA_ASYNC_MAP_SG) &&
+	    !zio_bi_area_get(bi, &b->ba)) {
+		area = zio_dma_area_map(za->hwdev, b->ba.data, b->ba.size,
+					PAGE_SIZE, za->dir, za->page_desc_size,
+					zio_dma_async_fill_area, b);
+		if (IS_ERR(area)) {
+			zio_bi_area_put(&b->ba);
+		} else {
+			area->flags |= ZIO_DMA_AREA_REFILL;
+			b->area = area;
+		}
+	}
+
+	spin_lock_irqsave(&za->lock, flags);
+	b->bi = bi;
+	spin_unlock_irqrestore(&za->lock, flags);
+	dev_dbg(za->hwdev, "channel %u bound to %s%s\n", b->chan,
+		dev_name(&bi->head.dev), b->area ? ", area mapped" : "");
+}
+
+/* Release a binding nobody uses; the caller cleared b->bi, locked */
+static void zio_dma_async_unbind(struct zio_dma_async_bind *b,
+				 struct zio_bi *bi)
+{
+	if (b->area) {
+		zio_dma_area_unmap(b->area);
+		zio_bi_area_put(&b->ba);
+		b->area = NULL;
+	}
+	put_device(&bi->head.dev);
+	module_put(b->owner);
+}
+
+/* Take a binding for release if it is stale and unused */
+static struct zio_bi *zio_dma_async_unbind_take(struct zio_dma_async *za,
+						struct zio_dma_async_bind *b,
+						struct zio_bi *cur_bi)
+{
+	struct zio_bi *bi;
+	unsigned long flags;
+
+	spin_lock_irqsave(&za->lock, flags);
+	bi = b->bi;
+	if (bi && ((za->flags & ZIO_DMA_ASYNC_DEAD) || bi != cur_bi))
+		b->stale = 1;
+	if (bi && b->stale && !b->users)
+		b->bi = NULL;
+	else
+		bi = NULL;
+	spin_unlock_irqrestore(&za->lock, flags);
+	return bi;
+}
+
+static void zio_dma_async_bind_work(struct work_struct *work)
+{
+	struct zio_dma_async *za = container_of(work, struct zio_dma_async,
+						bind_work);
+	struct zio_dma_async_bind *b;
+	struct zio_channel *chan;
+	struct zio_cset *cset;
+	struct zio_bi *bi;
+	unsigned int i;
+
+	zio_change_lock();
+	cset = READ_ONCE(za->cset);
+	for (i = 0; i < za->n_chan; i++) {
+		b = &za->bind[i];
+		chan = cset && i < cset->n_chan ? &cset->chan[i] : NULL;
+		bi = zio_dma_async_unbind_take(za, b, chan ? chan->bi : NULL);
+		if (bi)
+			zio_dma_async_unbind(b, bi);
+		if (!chan || !test_bit(i, cset->chan_enabled) ||
+		    READ_ONCE(b->bi) ||
+		    (READ_ONCE(za->flags) & ZIO_DMA_ASYNC_DEAD))
+			continue;
+		zio_dma_async_bind(za, b, cset);
+	}
+	zio_change_unlock();
+}
+
+/*
+ * The binding of a channel, if it is the one of its buffer instance;
+ * else a work item is asked to (re)bind it, if worth it. Engine locked.
+ */
+static struct zio_dma_async_bind *__zio_dma_async_bound(
+						struct zio_dma_async *za,
+						struct zio_channel *chan)
+{
+	struct zio_dma_async_bind *b = &za->bind[chan->index];
+
+	if (b->bi && !b->stale && b->bi == chan->bi)
+		return b;
+	if ((za->flags & ZIO_DMA_ASYNC_PINGPONG) ||
+	    (!(za->flags & ZIO_DMA_ASYNC_MAP_SG) && chan->bi->b_op->area_get))
+		schedule_work(&za->bind_work);
+	return NULL;
+}
+
+/* Give back a block of a transfer: its slice, its binding, the block */
+static void zio_dma_async_blk_release(struct zio_dma_async *za,
+				      struct zio_dma_async_blk *blk,
+				      int *rebind)
+{
+	unsigned long flags;
+
+	if (blk->area)
+		zio_dma_slice_complete(blk->area, &blk->slice);
+	if (blk->owned)
+		zio_buffer_free_block(blk->bi, blk->block);
+	if (blk->spare)
+		zio_buffer_free_block(blk->bi, blk->spare);
+	if (blk->held) { /* process context: see __zio_dma_async_detach */
+		put_device(&blk->bi->head.dev);
+		module_put(blk->owner);
+	}
+	if (blk->bind) {
+		spin_lock_irqsave(&za->lock, flags);
+		if (!--blk->bind->users && blk->bind->stale)
+			*rebind = 1;
+		spin_unlock_irqrestore(&za->lock, flags);
+	}
+	memset(blk, 0, sizeof(*blk));
+}
+
+/* Release what a transfer maps and owns: then it can be reused */
+static void zio_dma_async_release(struct zio_dma_async *za,
+				  struct zio_dma_async_xfer *x)
+{
+	unsigned int i;
+	int rebind = 0;
+
+	if (x->sgt) {
+		zio_dma_unmap_sg(x->sgt);
+		zio_dma_free_sg(x->sgt);
+		x->sgt = NULL;
+	}
+	for (i = 0; i < za->n_chan; i++)
+		zio_dma_async_blk_release(za, &x->blk[i], &rebind);
+	x->claimed = 0;
+	x->cancelled = 0;
+	if (rebind)
+		schedule_work(&za->bind_work);
+}
+
+/* Release a transfer the device never got */
+static void zio_dma_async_drop(struct zio_dma_async *za,
+			       struct zio_dma_async_xfer *x)
+{
+	unsigned long flags;
+
+	zio_dma_async_release(za, x);
+	spin_lock_irqsave(&za->lock, flags);
+	x->state = ZIO_DMA_XFER_IDLE;
+	spin_unlock_irqrestore(&za->lock, flags);
+}
+
+/*
+ * Map the blocks of a transfer, with the engine unlocked: a slice of
+ * the bound area where possible, else all together in one table
+ */
+static int zio_dma_async_map(struct zio_dma_async *za,
+			     struct zio_dma_async_xfer *x)
+{
+	struct zio_dma_async_blk *blk;
+	struct zio_dma_area *area;
+	struct zio_blocks_sg *sgb;
+	struct zio_dma_sgt *sgt;
+	unsigned int i, j, end, n = 0, first = 0;
+	int err;
+
+	for (i = 0; i < za->n_chan; i++) {
+		blk = &x->blk[i];
+		if (!blk->block)
+			continue;
+		area = blk->bind ? blk->bind->area : NULL;
+		if (area && !zio_dma_block_prepare(area, blk->block,
+						   &blk->slice)) {
+			blk->area = area;
+			blk->page_desc = area->page_desc;
+			blk->dma_page_desc = area->dma_page_desc;
+			continue;
+		}
+		if (!n)
+			first = i;
+		x->sg_blocks[n++] = blk->block;
+	}
+	if (!n)
+		return 0;
+
+	sgt = zio_dma_alloc_sg(&za->cset->chan[first], za->hwdev,
+			       x->sg_blocks, n, GFP_ATOMIC);
+	if (IS_ERR(sgt))
+		return PTR_ERR(sgt);
+	sgt->dir = za->dir;
+	sgt->priv = za;
+	for (i = 0, j = 0; i < za->n_chan; i++) {
+		if (!x->blk[i].block || x->blk[i].area)
+			continue;
+		sgb = &sgt->sg_blocks[j++];
+		sgb->chan = &za->cset->chan[i];
+		sgb->dev_mem_off = zio_dma_async_base(za, i);
+	}
+	err = zio_dma_map_sg(sgt, za->page_desc_size, zio_dma_async_fill_sg);
+	if (err) {
+		zio_dma_free_sg(sgt);
+		return err;
+	}
+	for (j = 0; j < n; j++) {
+		sgb = &sgt->sg_blocks[j];
+		blk = &x->blk[sgb->chan->index];
+		end = j + 1 < n ? sgt->sg_blocks[j + 1].first_desc :
+				  sgt->n_desc;
+		blk->slice.offset = 0;
+		blk->slice.len = sgb->block->datalen;
+		blk->slice.first_desc = sgb->first_desc;
+		blk->slice.n_desc = end - sgb->first_desc;
+		blk->slice.dma_desc = sgt->dma_page_desc[sgb->first_desc];
+		blk->page_desc = sgt->page_desc;
+		blk->dma_page_desc = sgt->dma_page_desc;
+	}
+	x->sgt = sgt;
+	return 0;
+}
+
+static void zio_dma_async_stop_work(struct work_struct *work);
+
+/*
+ * zio_dma_async_init
+ * @za: the engine, usually in the driver structure
+ * @hwdev: low level device responsible of the DMA
+ * @ops: driver operations
+ * @page_desc_size: size of the transfer descriptor
+ * @n_chan: number of channels of the cset
+ * @dir: DMA_FROM_DEVICE for an input cset, DMA_TO_DEVICE for output
+ * @flags: ZIO_DMA_ASYNC_PINGPONG, ZIO_DMA_ASYNC_MAP_SG, or 0
+ *
+ * Call it from probe, as it can sleep. Tables are mapped and unmapped
+ * in atomic context, where coherent memory can be allocated but not
+ * freed: it creates the descriptor pool, if the driver did not.
+ */
+int zio_dma_async_init(struct zio_dma_async *za, struct device *hwdev,
+		       const struct zio_dma_async_ops *ops,
+		       size_t page_desc_size, unsigned int n_chan,
+		       enum dma_data_direction dir, unsigned long flags)
+{
+	struct zio_dma_async_xfer *x;
+	unsigned int i;
+	int err;
+
+	if (unlikely(!n_chan || !page_desc_size ||
+		     (dir != DMA_FROM_DEVICE && dir != DMA_TO_DEVICE)))
+		return -EINVAL;
+	memset(za, 0, sizeof(*za));
+	za->hwdev = hwdev;
+	za->ops = ops;
+	za->page_desc_size = page_desc_size;
+	za->n_chan = n_chan;
+	za->dir = dir;
+	za->flags = flags & ZIO_DMA_ASYNC_MAP_SG;
+	if (dir == DMA_FROM_DEVICE)
+		za->flags |= flags & ZIO_DMA_ASYNC_PINGPONG;
+	spin_lock_init(&za->lock);
+	INIT_WORK(&za->bind_work, zio_dma_async_bind_work);
+	INIT_WORK(&za->stop_work, zio_dma_async_stop_work);
+	za->cur = &za->xfer[0];
+	za->next = &za->xfer[1];
+
+	err = zio_dma_pool_init(hwdev, page_desc_size, 0);
+	if (err)
+		return err;
+	err = -ENOMEM;
+	za->bind = kcalloc(n_chan, sizeof(*za->bind), GFP_KERNEL);
+	if (!za->bind)
+		goto out;
+	for (i = 0; i < n_chan; i++) {
+		za->bind[i].za = za;
+		za->bind[i].chan = i;
+	}
+	for (i = 0; i < ARRAY_SIZE(za->xfer); i++) {
+		x = &za->xfer[i];
+		x->blk = kcalloc(n_chan, sizeof(*x->blk), GFP_KERNEL);
+		x->sg_blocks = kcalloc(n_chan, sizeof(*x->sg_blocks),
+				       GFP_KERNEL);
+		if (!x->blk || !x->sg_blocks)
+			goto out;
+	}
+	return 0;
+
+out:
+	for (i = 0; i < ARRAY_SIZE(za->xfer); i++) {
+		kfree(za->xfer[i].sg_blocks);
+		kfree(za->xfer[i].blk);
+	}
+	kfree(za->bind);
+	return err;
+}
+EXPORT_SYMBOL(zio_dma_async_init);
+
+/* Hand a mapped transfer to the driver, with the engine locked */
+static int __zio_dma_async_start(struct zio_dma_async *za,
+				 struct zio_dma_async_xfer *x)
+{
+	int err;
+
+	x->cookie = za->cookie + 1;
+	err = za->ops->start(za, x);
+	if (err)
+		return err;
+	za->cookie++;
+	x->state = ZIO_DMA_XFER_RUNNING;
+	return 0;
+}
+
+/* A transfer being prepared was stopped: the stop work releases it */
+static void __zio_dma_async_stopped(struct zio_dma_async *za,
+				    struct zio_dma_async_xfer *x)
+{
+	x->state = ZIO_DMA_XFER_STOPPED;
+	za->flags |= ZIO_DMA_ASYNC_STOPPING;
+	schedule_work(&za->stop_work);
+}
+
+/*
+ * Reserve the other transfer for the blocks to queue after cur, with
+ * the same lengths. Its blocks are those a claim of cur replaced, or
+ * come from the buffer instances the channels are bound to, so all of
+ * them must be. Engine locked.
+ */
+static struct zio_dma_async_xfer *__zio_dma_async_reserve(
+						struct zio_dma_async *za,
+						struct zio_cset *cset)
+{
+	struct zio_dma_async_xfer *next = za->next;
+	struct zio_dma_async_bind *b;
+	struct zio_channel *chan;
+	unsigned int i;
+
+	if (!(za->flags & ZIO_DMA_ASYNC_PINGPONG) ||
+	    next->state != ZIO_DMA_XFER_IDLE)
+		return NULL;
+	chan_for_each(chan, cset)
+		if (za->cur->blk[chan->index].len &&
+		    !__zio_dma_async_bound(za, chan))
+			return NULL;
+	for (i = 0; i < za->n_chan; i++) {
+		if (!za->cur->blk[i].len)
+			continue;
+		b = &za->bind[i];
+		b->users++;
+		next->blk[i].len = za->cur->blk[i].len;
+		next->blk[i].bind = b;
+		next->blk[i].bi = b->bi;
+		next->blk[i].block = za->cur->blk[i].spare;
+		next->blk[i].owned = 1;
+		za->cur->blk[i].spare = NULL;
+	}
+	next->claimed = 0;
+	next->state = ZIO_DMA_XFER_PREPARING;
+	return next;
+}
+
+/* Allocate and map the blocks of a reserved transfer, then queue it */
+static void zio_dma_async_prefetch(struct zio_dma_async *za,
+				   struct zio_dma_async_xfer *x,
+				   unsigned int stops)
+{
+	struct zio_dma_async_blk *blk;
+	unsigned long flags;
+	unsigned int i;
+	int err = 0;
+
+	for (i = 0; i < za->n_chan && !err; i++) {
+		blk = &x->blk[i];
+		if (!blk->len || blk->block)
+			continue;
+		blk->block = zio_buffer_alloc_block(blk->bi, blk->len,
+						    GFP_ATOMIC);
+		if (!blk->block)
+			err = -ENOMEM;
+	}
+	if (!err)
+		err = zio_dma_async_map(za, x);
+
+	spin_lock_irqsave(&za->lock, flags);
+	if (!err && (za->stops != stops || x->cancelled))
+		err = -EINTR;
+	if (!err)
+		err = __zio_dma_async_start(za, x);
+	spin_unlock_irqrestore(&za->lock, flags);
+	if (err)
+		zio_dma_async_drop(za, x);
+}
+
+/*
+ * The trigger claims a queued transfer: its blocks become the active
+ * ones. Those the trigger allocated are kept for the next transfer:
+ * freeing them here would take the buffer lock under ours, the other
+ * way round from an output trigger arming in store_block.
+ */
+static void __zio_dma_async_claim(struct zio_dma_async *za,
+				  struct zio_dma_async_xfer *x,
+				  struct zio_cset *cset)
+{
+	struct zio_dma_async_blk *blk;
+	struct zio_channel *chan;
+
+	chan_for_each(chan, cset) {
+		blk = &x->blk[chan->index];
+		if (!blk->block)
+			continue;
+		blk->spare = chan->active_block;
+		zio_chan_set_active(chan, blk->block);
+		blk->owned = 0;
+	}
+	x->claimed = 1;
+}
+
+/* A queued transfer can be claimed if it matches the active blocks */
+static int zio_dma_async_match(struct zio_dma_async *za,
+			       struct zio_dma_async_xfer *x,
+			       struct zio_cset *cset)
+{
+	struct zio_dma_async_blk *blk;
+	struct zio_channel *chan;
+	unsigned int i, n = 0;
+	size_t len;
+
+	chan_for_each(chan, cset) {
+		blk = &x->blk[chan->index];
+		len = chan->active_block ? chan->active_block->datalen : 0;
+		if (len != blk->len || (len && blk->bi != chan->bi))
+			return 0;
+		n += !!len;
+	}
+	for (i = 0; i < za->n_chan; i++)
+		n -= !!x->blk[i].len;
+	return !n;
+}
+
+/*
+ * zio_dma_async_raw_io
+ * @za: the engine
+ * @cset: the cset being armed
+ *
+ * To be called by the raw_io method of the cset. It returns -EAGAIN
+ * when a transfer is running, and zio_dma_async_done() completes it
+ * later. It returns -EBUSY if a transfer runs that it cannot claim
+ * (e.g. the block size changed), or while the device is being stopped
+ */
+int zio_dma_async_raw_io(struct zio_dma_async *za, struct zio_cset *cset)
+{
+	struct zio_dma_async_xfer *cur, *next = NULL;
+	struct zio_dma_async_blk *blk;
+	struct zio_channel *chan;
+	struct zio_block *block;
+	unsigned int stops, n = 0;
+	unsigned long flags;
+	int err, start = 0;
+
+	chan_for_each(chan, cset) {
+		block = chan->active_block;
+		if (!block || !block->datalen)
+			continue;
+		if (chan->index >= za->n_chan)
+			return -EINVAL;
+		n++;
+	}
+	if (!n)
+		return 0; /* nothing to transfer */
+
+	spin_lock_irqsave(&za->lock, flags);
+	za->cset = cset;
+	cur = za->cur;
+	stops = za->stops;
+	if (za->flags & (ZIO_DMA_ASYNC_DEAD | ZIO_DMA_ASYNC_STOPPING)) {
+		err = -EBUSY;
+	} else if (cur->state == ZIO_DMA_XFER_RUNNING) {
+		/* Claim the transfer in flight, queue the other one */
+		if (cur->claimed || !zio_dma_async_match(za, cur, cset)) {
+			err = -EBUSY;
+		} else {
+			__zio_dma_async_claim(za, cur, cset);
+			next = __zio_dma_async_reserve(za, cset);
+			err = -EAGAIN;
+		}
+	} else if (cur->state == ZIO_DMA_XFER_PREPARING && !cur->claimed &&
+		   za->next->state == ZIO_DMA_XFER_IDLE) {
+		/* Queued, but not started yet: give it up, start ours */
+		cur->cancelled = 1;
+		za->cur = za->next;
+		za->next = cur;
+		cur = za->cur;
+		start = 1;
+	} else if (cur->state != ZIO_DMA_XFER_IDLE) {
+		err = -EBUSY;
+	} else {
+		start = 1;
+	}
+	if (start) {
+		/* Map the active blocks, with the engine unlocked */
+		chan_for_each(chan, cset) {
+			block = chan->active_block;
+			if (!block || !block->datalen)
+				continue;
+			blk = &cur->blk[chan->index];
+			blk->block = block;
+			blk->len = block->datalen;
+			blk->bind = __zio_dma_async_bound(za, chan);
+			if (blk->bind && blk->bind->area)
+				blk->bind->users++;
+			else
+				blk->bind = NULL;
+		}
+		cur->claimed = 1;
+		cur->state = ZIO_DMA_XFER_PREPARING;
+	}
+	spin_unlock_irqrestore(&za->lock, flags);
+
+	if (start) {
+		err = zio_dma_async_map(za, cur);
+		spin_lock_irqsave(&za->lock, flags);
+		if (za->stops != stops) {
+			/* stop_io took the blocks meanwhile */
+			__zio_dma_async_stopped(za, cur);
+			start = 0;
+			err = -EBUSY;
+		} else if (!err) {
+			err = __zio_dma_async_start(za, cur);
+			if (!err)
+				next = __zio_dma_async_reserve(za, cset);
+		}
+		spin_unlock_irqrestore(&za->lock, flags);
+		if (!err)
+			err = -EAGAIN;
+		else if (start)
+			zio_dma_async_drop(za, cur);
+	}
+	if (next)
+		zio_dma_async_prefetch(za, next, stops);
+	return err;
+}
+EXPORT_SYMBOL(zio_dma_async_raw_io);
+
+/*
+ * zio_dma_async_done
+ * @za: the engine
+ * @cookie: the cookie the driver received with the transfer
+ * @err: 0, or a negative error if the transfer failed
+ *
+ * The driver calls this when a transfer completes, even in hard-irq
+ * context; transfers complete in the order they were started. The call
+ * is ignored if the engine was stopped meanwhile. On error the blocks
+ * are discarded, and the control reports ZIO_ALARM_LOST_BLOCK
+ */
+void zio_dma_async_done(struct zio_dma_async *za, uint32_t cookie, int err)
+{
+	struct zio_cset *cset = READ_ONCE(za->cset);
+	struct zio_dma_async_xfer *x;
+	struct zio_channel *chan;
+	unsigned long flags;
+	int claimed;
+
+	if (!cset)
+		return;
+	/* The cset lock orders us with stop_io; busy makes abort wait */
+	spin_lock_irqsave(&cset->lock, flags);
+	spin_lock(&za->lock);
+	x = za->cur;
+	if (x->state != ZIO_DMA_XFER_RUNNING || x->cookie != cookie) {
+		spin_unlock(&za->lock);
+		spin_unlock_irqrestore(&cset->lock, flags);
+		return;
+	}
+	x->state = ZIO_DMA_XFER_DONE;
+	za->cur = za->next;
+	za->next = x;
+	claimed = x->claimed;
+	if (!claimed)
+		za->dropped++;
+	else
+		zio_cset_busy_set(cset, 0);
+	spin_unlock(&za->lock);
+	spin_unlock_irqrestore(&cset->lock, flags);
+
+	/* Unmap, and free the blocks of a dropped transfer */
+	zio_dma_async_release(za, x);
+	if (claimed && err) {
+		spin_lock_irqsave(&cset->lock, flags);
+		chan_for_each(chan, cset) {
+			if (!chan->active_block)
+				continue;
+			zio_buffer_free_block(chan->bi, chan->active_block);
+			zio_chan_set_active(chan, NULL);
+		}
+		spin_unlock_irqrestore(&cset->lock, flags);
+	}
+
+	spin_lock_irqsave(&za->lock, flags);
+	x->state = ZIO_DMA_XFER_IDLE;
+	spin_unlock_irqrestore(&za->lock, flags);
+
+	if (claimed) {
+		zio_trigger_data_done(cset);
+		zio_cset_busy_clear(cset, 1);
+	}
+}
+EXPORT_SYMBOL(zio_dma_async_done);
+
+/*
+ * Detach the transfers from the device; the caller stops it. The
+ * device may still write the active blocks of a claimed transfer, so
+ * stop_io (cset locked) takes them from the channels, with a hold on
+ * their buffer instance: they are freed after the device is stopped.
+ */
+static int __zio_dma_async_detach(struct zio_dma_async *za,
+				  struct zio_cset *cset)
+{
+	struct zio_dma_async_xfer *x;
+	struct zio_dma_async_blk *blk;
+	struct zio_channel *chan;
+	int i, n = 0;
+
+	za->stops++;
+	for (i = 0; i < ARRAY_SIZE(za->xfer); i++) {
+		x = &za->xfer[i];
+		if (cset && x->claimed &&
+		    (x->state == ZIO_DMA_XFER_RUNNING ||
+		     x->state == ZIO_DMA_XFER_PREPARING)) {
+			chan_for_each(chan, cset) {
+				blk = &x->blk[chan->index];
+				if (!blk->block ||
+				    blk->block != chan->active_block)
+					continue;
+				get_device(&chan->bi->head.dev);
+				__module_get(cset->zbuf->owner);
+				blk->bi = chan->bi;
+				blk->owner = cset->zbuf->owner;
+				blk->owned = 1;
+				blk->held = 1;
+				zio_chan_set_active(chan, NULL);
+			}
+		}
+		if (x->state != ZIO_DMA_XFER_RUNNING)
+			continue;
+		x->state = ZIO_DMA_XFER_STOPPED;
+		n++;
+	}
+	return n;
+}
+
+/* Stop the device, then release the detached transfers */
+static void zio_dma_async_stop(struct zio_dma_async *za)
+{
+	unsigned long flags;
+	int i, stopped[ARRAY_SIZE(za->xfer)];
+
+	spin_lock_irqsave(&za->lock, flags);
+	for (i = 0; i < ARRAY_SIZE(za->xfer); i++)
+		stopped[i] = za->xfer[i].state == ZIO_DMA_XFER_STOPPED;
+	spin_unlock_irqrestore(&za->lock, flags);
+
+	za->ops->stop(za);
+	for (i = 0; i < ARRAY_SIZE(za->xfer); i++)
+		if (stopped[i])
+			zio_dma_async_release(za, &za->xfer[i]);
+
+	spin_lock_irqsave(&za->lock, flags);
+	for (i = 0; i < ARRAY_SIZE(za->xfer); i++)
+		if (stopped[i])
+			za->xfer[i].state = ZIO_DMA_XFER_IDLE;
+	/* A transfer being prepared may have been stopped meanwhile */
+	for (i = 0; i < ARRAY_SIZE(za->xfer); i++)
+		if (za->xfer[i].state == ZIO_DMA_XFER_STOPPED)
+			break;
+	if (i == ARRAY_SIZE(za->xfer))
+		za->flags &= ~ZIO_DMA_ASYNC_STOPPING;
+	spin_unlock_irqrestore(&za->lock, flags);
+}
+
+static void zio_dma_async_stop_work(struct work_struct *work)
+{
+	zio_dma_async_stop(container_of(work, struct zio_dma_async,
+					stop_work));
+}
+
+/*
+ * zio_dma_async_stop_io
+ * @za: the engine
+ * @cset: the cset being aborted
+ *
+ * To be called by the stop_io method of the cset, in atomic context:
+ * the transfers are detached and the active blocks are freed, those
+ * being transferred after the device is stopped. That happens later,
+ * and raw_io refuses new transfers until then
+ */
+void zio_dma_async_stop_io(struct zio_dma_async *za, struct zio_cset *cset)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&za->lock, flags);
+	if (__zio_dma_async_detach(za, cset)) {
+		za->flags |= ZIO_DMA_ASYNC_STOPPING;
+		schedule_work(&za->stop_work);
+	}
+	spin_unlock_irqrestore(&za->lock, flags);
+	__zio_internal_abort_free(cset);
+}
+EXPORT_SYMBOL(zio_dma_async_stop_io);
+
+/*
+ * zio_dma_async_exit
+ * @za: the engine
+ *
+ * To be called before unregistering the device: a queued transfer may be
+ * running even if the trigger is not armed. The device is stopped, and
+ * the bindings are released; raw_io refuses any new transfer. It sleeps
+ */
+void zio_dma_async_exit(struct zio_dma_async *za)
+{
+	struct zio_bi *bi;
+	unsigned long flags;
+	int i, busy;
+
+	spin_lock_irqsave(&za->lock, flags);
+	za->flags |= ZIO_DMA_ASYNC_DEAD;
+	__zio_dma_async_detach(za, NULL);
+	spin_unlock_irqrestore(&za->lock, flags);
+
+	/* Transfers being prepared or completed are released by others */
+	do {
+		flush_work(&za->stop_work);
+		zio_dma_async_stop(za);
+		busy = 0;
+		spin_lock_irqsave(&za->lock, flags);
+		for (i = 0; i < ARRAY_SIZE(za->xfer); i++)
+			busy |= za->xfer[i].state != ZIO_DMA_XFER_IDLE;
+		spin_unlock_irqrestore(&za->lock, flags);
+		if (busy)
+			msleep(1);
+	} while (busy);
+
+	/* Nothing uses the bindings: once unpinned, nobody queues work */
+	cancel_work_sync(&za->bind_work);
+	for (i = 0; i < za->n_chan; i++) {
+		bi = zio_dma_async_unbind_take(za, &za->bind[i], NULL);
+		if (bi)
+			zio_dma_async_unbind(&za->bind[i], bi);
+	}
+	cancel_work_sync(&za->bind_work);
+
+	for (i = 0; i < ARRAY_SIZE(za->xfer); i++) {
+		kfree(za->xfer[i].sg_blocks);
+		kfree(za->xfer[i].blk);
+	}
+	kfree(za->bind);
+}
+EXPORT_SYMBOL(zio_dma_async_exit);
@@ -9,6 +9,9 @@
 #include <linux/init.h>
 #include <linux/types.h>
 #include <linux/delay.h>
+#include <linux/eventfd.h>
+#include <linux/hrtimer.h>
+#include <linux/version.h>
 
 #include <linux/zio.h>
 #include <linux/zio-sysfs.h>
@@ -16,7 +19,7 @@
 #include <linux/zio-trigger.h>
 #include "zio-internal.h"
 
-static void __zio_internal_abort_free(struct zio_cset *cset)
+void __zio_internal_abort_free(struct zio_cset *cset)
 {
 	struct zio_channel *chan;
 	struct zio_block *block;
@@ -24,7 +27,7 @@ static void __zio_internal_abort_free(struct zio_cset *cset)
 	chan_for_each(chan, cset) {
 		block = chan->active_block;
 		zio_buffer_free_block(chan->bi, block);
-		chan->active_block = NULL;
+		zio_chan_set_active(chan, NULL);
 	}
 }
 
@@ -38,25 +41,33 @@ static void __zio_internal_abort_free(struct zio_cset *cset)
  */
 int __zio_trigger_abort_disable(struct zio_cset *cset, int disable)
 {
-	struct zio_ti *ti = cset->ti;
+	struct zio_ti *ti;
 	unsigned long flags;
 	int ret;
 
 	spin_lock_irqsave(&cset->lock, flags);
+	ti = cset->ti;
 
 	/* If we are hardware-busy, cannot abort (the caller may retry) */
-	if (cset->flags & ZIO_CSET_HW_BUSY) {
+	if (zio_cset_is_busy(cset)) {
 		spin_unlock_irqrestore(&cset->lock, flags);
 		return -EAGAIN;
 	}
 
 	/* Save previous flags status */
-	ret = ti->flags;
+	ret = READ_ONCE(ti->flags);
 	/*
 	 * If the trigger is running (ZIO_TI_ARMED), then abort it.
 	 * Since the whole data_done procedure happens in locked context,
 	 * there is no concurrency with an already-completing trigger event.
+	 * Disable first, so nobody can arm again after we clear the flag:
+	 * the barrier pairs with the one in zio_arm_trigger_ts, so either
+	 * we see ARMED or the arming path sees DISABLED and backs off.
 	 */
+	if (disable) {
+		set_bit(ZIO_STATUS_BIT, &ti->flags);
+		smp_mb__after_atomic();
+	}
 	if (ti->flags & ZIO_TI_ARMED) {
 		if (ti->t_op->abort)
 			ti->t_op->abort(ti);
@@ -64,10 +75,8 @@ int __zio_trigger_abort_disable(struct zio_cset *cset, int disable)
 			ti->cset->stop_io(ti->cset);
 		else
 			__zio_internal_abort_free(cset);
-		ti->flags &= (~ZIO_TI_ARMED);
+		clear_bit(ZIO_TI_ARMED_BIT, &ti->flags);
 	}
-	if (disable)
-		ti->flags |= ZIO_DISABLED;
 	spin_unlock_irqrestore(&cset->lock, flags);
 	return ret;
 }
@@ -94,7 +103,7 @@ static int __zio_arm_input_trigger(struct zio_ti *ti)
 		datalen = ctrl->ssize * ti->nsamples;
 		block = zio_buffer_alloc_block(chan->bi, datalen, GFP_ATOMIC);
 		/* If alloc error, it is reported at data_done time */
-		chan->active_block = block;
+		zio_chan_set_active(chan, block);
 	}
 	i = cset->raw_io(cset);
 
@@ -118,24 +127,39 @@ static int __zio_trigger_data_done(struct zio_cset *cset);
  * When a software trigger fires, it should call this function. It
  * used to be called zio_fire_trigger, but actually it only arms the trigger.
  * When hardware is self-timed, the actual trigger fires later.
+ * Triggers that stamp the event earlier (e.g. in hard-irq context, while
+ * arming is deferred) pass the stamp to zio_arm_trigger_ts instead: it is
+ * used for the first arm only, as later ones happen at data_done time.
  */
-void zio_arm_trigger(struct zio_ti *ti)
+void zio_arm_trigger_ts(struct zio_ti *ti, const struct timespec *ts)
 {
 	struct zio_channel *chan;
-	unsigned long flags;
 	int ret;
 
 	do {
-		/* if trigger is disabled or already pending, return */
-		spin_lock_irqsave(&ti->cset->lock, flags);
-		if (unlikely((ti->flags & ZIO_STATUS) == ZIO_DISABLED ||
-			     (ti->flags & ZIO_TI_ARMED))) {
-			spin_unlock_irqrestore(&ti->cset->lock, flags);
+		/*
+		 * If trigger is disabled or already pending, return. Setting
+		 * the flag makes us the owner of the arm/data_done sequence:
+		 * it is only cleared at the end of data_done or by abort.
+		 */
+		if (unlikely(test_bit(ZIO_STATUS_BIT, &ti->flags)) ||
+		    test_and_set_bit(ZIO_TI_ARMED_BIT, &ti->flags))
 			return;
+		/*
+		 * An abort may have disabled us after the first test, and
+		 * missed ARMED: check again (test_and_set_bit is a full
+		 * barrier) and give the event up before touching anything
+		 */
+		if (unlikely(test_bit(ZIO_STATUS_BIT, &ti->flags))) {
+			clear_bit(ZIO_TI_ARMED_BIT, &ti->flags);
+			return;
+		}
+		if (ts) {
+			ti->tstamp = *ts;
+			ts = NULL;
+		} else {
+			getnstimeofday(&ti->tstamp);
 		}
-		ti->flags |= ZIO_TI_ARMED;
-		getnstimeofday(&ti->tstamp);
-		spin_unlock_irqrestore(&ti->cset->lock, flags);
 
 		if (ti->t_op->arm)
 			ret = ti->t_op->arm(ti);
@@ -153,7 +177,7 @@ void zio_arm_trigger(struct zio_ti *ti)
 			chan_for_each(chan, ti->cset) {
 				zio_buffer_free_block(chan->bi,
 						      chan->active_block);
-				chan->active_block = NULL;
+				zio_chan_set_active(chan, NULL);
 				chan->current_ctrl->zio_alarms |=
 							ZIO_ALARM_LOST_TRIGGER;
 			}
@@ -169,9 +193,13 @@ void zio_arm_trigger(struct zio_ti *ti)
 		return;
 
 	/* real error: un-arm */
-	spin_lock_irqsave(&ti->cset->lock, flags);
-	ti->flags &= ~ZIO_TI_ARMED;
-	spin_unlock_irqrestore(&ti->cset->lock, flags);
+	clear_bit(ZIO_TI_ARMED_BIT, &ti->flags);
+}
+EXPORT_SYMBOL(zio_arm_trigger_ts);
+
+void zio_arm_trigger(struct zio_ti *ti)
+{
+	zio_arm_trigger_ts(ti, NULL);
 }
 EXPORT_SYMBOL(zio_arm_trigger);
 
@@ -202,7 +230,7 @@ static int __zio_trigger_data_done(struct zio_cset *cset)
 	else
 		must_rearm = zio_generic_data_done(cset);
 
-	cset->ti->flags &= ~ZIO_TI_ARMED;
+	clear_bit(ZIO_TI_ARMED_BIT, &cset->ti->flags);
 	spin_unlock_irqrestore(&cset->lock, flags);
 
 	return must_rearm;
@@ -212,8 +240,11 @@ int zio_trigger_data_done(struct zio_cset *cset)
 {
 	int must_rearm = __zio_trigger_data_done(cset);
 
-	if (must_rearm)
-		zio_arm_trigger(cset->ti);
+	if (must_rearm) {
+		rcu_read_lock();
+		zio_arm_trigger(zio_cset_ti(cset));
+		rcu_read_unlock();
+	}
 
 	return must_rearm; /* Actually, "already_rearmed" */
 }
@@ -226,8 +257,176 @@ int zio_generic_push_block(struct zio_ti *ti,
 {
 	if (chan->active_block)
 		return -EBUSY;
-	chan->active_block = block;
+	zio_chan_set_active(chan, block);
 
 	return 0;
 }
 EXPORT_SYMBOL(zio_generic_push_block);
+
+
+#if KERNEL_VERSION(6, 8, 0) <= LINUX_VERSION_CODE
+#define zio_eventfd_signal(ctx) eventfd_signal(ctx)
+#else
+#define zio_eventfd_signal(ctx) eventfd_signal(ctx, 1)
+#endif
+
+static void zio_bi_wake_work_fn(struct irq_work *work)
+{
+	struct zio_bi *bi = container_of(work, struct zio_bi, wake_work);
+
+	wake_up_interruptible(&bi->q);
+}
+
+/*
+ * If the cset has a cpu-affinity, readers are awaken from one of those
+ * CPUs: the scheduler then tends to run them there, near their data,
+ * and not on the CPU that happened to complete the transfer.
+ */
+static void zio_bi_wake(struct zio_bi *bi)
+{
+#ifdef CONFIG_SMP
+	struct cpumask *mask = bi->cset->cpu_affinity;
+	unsigned int cpu;
+
+	if (!cpumask_empty(mask) &&
+	    !cpumask_test_cpu(raw_smp_processor_id(), mask)) {
+		cpu = cpumask_any_and(mask, cpu_online_mask);
+		if (cpu < nr_cpu_ids) {
+			irq_work_queue_on(&bi->wake_work, cpu);
+			return;
+		}
+	}
+#endif
+	wake_up_interruptible(&bi->q);
+}
+
+static enum hrtimer_restart zio_bi_wake_fn(struct hrtimer *timer)
+{
+	struct zio_bi *bi = container_of(timer, struct zio_bi, wake_timer);
+
+	zio_bi_wake(bi);
+	return HRTIMER_NORESTART;
+}
+
+void zio_bi_wake_init(struct zio_bi *bi)
+{
+	bi->wake_blocks = 1;
+	bi->wake_usec = 0;
+	hrtimer_init(&bi->wake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	bi->wake_timer.function = zio_bi_wake_fn;
+	init_irq_work(&bi->wake_work, zio_bi_wake_work_fn);
+}
+
+/*
+ * Readers are awaken when wake_blocks blocks are waiting for them, or
+ * wake_usec after the first one arrived, whichever comes first. With
+ * the default wake_blocks of 1 this is the usual wake on first block.
+ * A buffer smaller than wake_blocks wakes them when full, see below.
+ */
+static void __zio_bi_wake_readers(struct zio_bi *bi, unsigned int level)
+{
+	if (level == bi->wake_blocks) {
+		if (bi->wake_blocks > 1 && bi->wake_usec)
+			hrtimer_try_to_cancel(&bi->wake_timer);
+		zio_bi_wake(bi);
+	} else if (level == 1 && bi->wake_usec) {
+		hrtimer_start(&bi->wake_timer,
+			      ns_to_ktime((u64)bi->wake_usec * NSEC_PER_USEC),
+			      HRTIMER_MODE_REL);
+	}
+}
+
+/*
+ * zio_bi_level_update
+ * Buffer types call this, with bi->lock held, whenever a block enters
+ * (delta > 0) or leaves (delta < 0) the list of stored blocks. For input,
+ * this is what wakes up readers, according to wakeup moderation.
+ * When the level reaches the high watermark, or goes back to the low
+ * watermark, the eventfd is signalled and waiters are awaken: readers
+ * see POLLPRI while above high-watermark, writers with the "block"
+ * policy sleep.
+ */
+void zio_bi_level_update(struct zio_bi *bi, int delta)
+{
+	unsigned int level;
+	int crossed = 0;
+
+	level = atomic_add_return(delta, &bi->nblocks);
+	if (delta > 0 && (bi->flags & ZIO_DIR) == ZIO_DIR_INPUT)
+		__zio_bi_wake_readers(bi, level);
+	if (!bi->wm_high)
+		return;
+
+	if (!(bi->flags & ZIO_BI_WM_HIGH) && level >= bi->wm_high) {
+		bi->flags |= ZIO_BI_WM_HIGH;
+		crossed = 1;
+	} else if ((bi->flags & ZIO_BI_WM_HIGH) && level <= bi->wm_low) {
+		bi->flags &= ~ZIO_BI_WM_HIGH;
+		crossed = 1;
+	}
+	if (!crossed)
+		return;
+
+	if (bi->wm_evfd)
+		zio_eventfd_signal(bi->wm_evfd);
+	wake_up_interruptible(&bi->q);
+}
+EXPORT_SYMBOL(zio_bi_level_update);
+
+/*
+ * zio_bi_wake_full
+ * Called when a block cannot be allocated because the buffer is full:
+ * if wakeup moderation still holds readers back, the level will never
+ * reach wake_blocks, so wake them now.
+ */
+void zio_bi_wake_full(struct zio_bi *bi)
+{
+	unsigned int level = atomic_read(&bi->nblocks);
+
+	if ((bi->flags & ZIO_DIR) != ZIO_DIR_INPUT)
+		return;
+	if (!level || level >= READ_ONCE(bi->wake_blocks))
+		return;
+	if (READ_ONCE(bi->wake_usec))
+		hrtimer_try_to_cancel(&bi->wake_timer);
+	zio_bi_wake(bi);
+}
+EXPORT_SYMBOL(zio_bi_wake_full);
+
+/*
+ * zio_buffer_drop_oldest
+ * Overflow management for the drop-oldest policy. Instead of paying a
+ * retr/free for every incoming block, stored blocks are dropped in one go
+ * down to the low watermark (a single block if there is no watermark).
+ * It returns the number of dropped blocks.
+ */
+int zio_buffer_drop_oldest(struct zio_bi *bi)
+{
+	struct zio_block *block;
+	int level, target, n = 0;
+
+	if (bi->flags & ZIO_BI_NO_LEVEL) {
+		/* No level to drop to: remove the oldest block, as before */
+		block = bi->b_op->retr_block(bi);
+		if (!block)
+			return 0;
+		bi->b_op->free_block(bi, block);
+		return 1;
+	}
+	level = atomic_read(&bi->nblocks);
+	if (!level)
+		return 0; /* blocks are all in the hands of users or triggers */
+	target = level - 1;
+	if (bi->wm_high && bi->wm_low < target)
+		target = bi->wm_low;
+
+	while (atomic_read(&bi->nblocks) > target) {
+		block = bi->b_op->retr_block(bi);
+		if (!block)
+			break;
+		bi->b_op->free_block(bi, block);
+		n++;
+	}
+	return n;
+}
+EXPORT_SYMBOL(zio_buffer_drop_oldest);
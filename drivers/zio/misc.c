@@ -52,6 +52,7 @@ enum FFA_STATUS {
 struct zio_ffa {
 	spinlock_t lock;
 	struct ffa_cell *cell;
+	int node;	/* cells are allocated here, like the area they track */
 };
 
 /* The iterator starts at head, and stops when we fall at head again */
@@ -68,19 +69,21 @@ static inline struct ffa_cell *__ffa_next(struct ffa_cell *c,
 
 
 /* The create and destroy must be called in non-atomic context and don't lock */
-struct zio_ffa *zio_ffa_create(unsigned long begin, unsigned long end)
+struct zio_ffa *zio_ffa_create_node(unsigned long begin, unsigned long end,
+				    int node)
 {
 	struct zio_ffa *ffa;
 	struct ffa_cell *c;
 
-	ffa = kzalloc(sizeof(*ffa), GFP_KERNEL);
-	c =  kzalloc(sizeof(*c), GFP_KERNEL);
+	ffa = kzalloc_node(sizeof(*ffa), GFP_KERNEL, node);
+	c =  kzalloc_node(sizeof(*c), GFP_KERNEL, node);
 	if (!ffa || !c) {
 		kfree(ffa);
 		kfree(c);
 		return NULL;
 	}
 	spin_lock_init(&ffa->lock);
+	ffa->node = node;
 	INIT_LIST_HEAD(&c->list);
 	c->begin = begin;
 	c->end = end;
@@ -88,6 +91,12 @@ struct zio_ffa *zio_ffa_create(unsigned long begin, unsigned long end)
 	ffa->cell = c;
 	return ffa;
 }
+EXPORT_SYMBOL(zio_ffa_create_node);
+
+struct zio_ffa *zio_ffa_create(unsigned long begin, unsigned long end)
+{
+	return zio_ffa_create_node(begin, end, NUMA_NO_NODE);
+}
 EXPORT_SYMBOL(zio_ffa_create);
 
 void zio_ffa_destroy(struct zio_ffa *ffa)
@@ -179,7 +188,7 @@ found:
 		return ret;
 	}
 	/* split the cell: "new" is the busy head, ffa still points to c */
-	new = kzalloc(sizeof(*new), gfp);
+	new = kzalloc_node(sizeof(*new), gfp, ffa->node);
 	new->begin = c->begin;
 	new->end = new->begin + size;
 	c->begin = new->end;
@@ -209,7 +218,7 @@ void zio_ffa_free_s(struct zio_ffa *ffa, unsigned long addr, size_t size)
 	BUG_ON(c->status == FFA_FREE);
 	if (c->begin != addr) {
 		/* add a busy cell before us */
-		prev = kzalloc(sizeof(*prev), GFP_ATOMIC);
+		prev = kzalloc_node(sizeof(*prev), GFP_ATOMIC, ffa->node);
 		prev->begin = c->begin;
 		prev->end = addr;
 		prev->status = c->status;
@@ -218,7 +227,7 @@ void zio_ffa_free_s(struct zio_ffa *ffa, unsigned long addr, size_t size)
 	}
 	if (c->end != addr + size) {
 		/* add a busy cell after us */
-		next = kzalloc(sizeof(*next), GFP_ATOMIC);
+		next = kzalloc_node(sizeof(*next), GFP_ATOMIC, ffa->node);
 		next->begin = end;
 		next->end = c->end;
 		next->status = c->status;
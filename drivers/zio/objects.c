@@ -7,6 +7,15 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/types.h>
+#include <linux/eventfd.h>
+#include <linux/mutex.h>
+#include <linux/delay.h>
+#include <linux/version.h>
+#if KERNEL_VERSION(4, 11, 0) > LINUX_VERSION_CODE
+#include <linux/sched.h>
+#else
+#include <linux/sched/signal.h>
+#endif
 
 #include <linux/zio.h>
 #include <linux/zio-sysfs.h>
@@ -62,7 +71,9 @@ static void __cset_release(struct device *dev)
 	zio_minorbase_put(cset);
 
 	/* Release allocated memory for children channels */
+	kfree(cset->chan_enabled);
 	kfree(cset->chan);
+	free_cpumask_var(cset->cpu_affinity);
 }
 
 static void __chan_release(struct device *dev)
@@ -96,6 +107,10 @@ static void __bi_release(struct device *dev)
 
 	/* Remove zio attribute */
 	zio_destroy_attributes(&bi->head);
+	hrtimer_cancel(&bi->wake_timer);
+	irq_work_sync(&bi->wake_work);
+	if (bi->wm_evfd)
+		eventfd_ctx_put(bi->wm_evfd);
 	/* Destroy buffer instance. It frees buffer resources */
 	bi->b_op->destroy(bi);
 
@@ -210,6 +225,17 @@ static void zio_trigger_put(struct zio_trigger_type *trig,
 		module_put(trig->owner);
 }
 
+/*
+ * Children of a cset being registered with ZIO_CSET_FEW_UEVENTS send no
+ * uevent: the cset sends one when complete. Those created later (e.g.
+ * when the trigger or buffer is changed) send their own, as usual.
+ */
+static void zio_cset_quiet(struct zio_cset *cset, struct device *dev)
+{
+	if (dev_get_uevent_suppress(&cset->head.dev))
+		dev_set_uevent_suppress(dev, 1);
+}
+
 /**
  * The function creates, initialize and register a new buffer instance of
  * a given type.
@@ -248,7 +274,16 @@ static struct zio_bi *__bi_create(struct zio_buffer_type *zbuf,
 	bi->f_op = zbuf->f_op;
 	bi->v_op = zbuf->v_op;
 	bi->flags |= (chan->flags & ZIO_DIR);
+	bi->policy = (chan->flags & ZIO_DIR) == ZIO_DIR_OUTPUT ?
+		ZIO_BI_POLICY_BLOCK : ZIO_BI_POLICY_DROP_NEWEST;
+	/* Buffer types may still ask for drop-oldest with the old flag */
+	if (bi->flags & ZIO_BI_PREF_NEW)
+		bi->policy = ZIO_BI_POLICY_DROP_OLDEST;
+	if (!(zbuf->flags & ZIO_BUF_FLAG_LEVEL))
+		bi->flags |= ZIO_BI_NO_LEVEL;
+	atomic_set(&bi->nblocks, 0);
 	init_waitqueue_head(&bi->q);
+	zio_bi_wake_init(bi);
 
 	/* Initialize head */
 	bi->head.dev.type = &bi_device_type;
@@ -265,6 +300,7 @@ static struct zio_bi *__bi_create(struct zio_buffer_type *zbuf,
 		goto out_destory;
 
 	/* Register buffer instance */
+	zio_cset_quiet(chan->cset, &bi->head.dev);
 	err = device_register(&bi->head.dev);
 	if (err)
 		goto out_remove;
@@ -360,6 +396,7 @@ static struct zio_ti *__ti_create(struct zio_trigger_type *trig,
 	__ctrl_update_nsamples(ti);
 
 	/* Register trigger instance */
+	zio_cset_quiet(cset, &ti->head.dev);
 	err = device_register(&ti->head.dev);
 	if (err)
 		goto out_remove;
@@ -395,8 +432,14 @@ static void __ti_destroy(struct zio_trigger_type *trig, struct zio_ti *ti)
 	device_unregister(&ti->head.dev);
 }
 
-/* This is only called in process context (through a sysfs operation) */
-int zio_change_current_trigger(struct zio_cset *cset, char *name)
+/*
+ * This is only called in process context (through a sysfs operation).
+ * Files may be open: the old instance is aborted, so blocks it acquired
+ * reach the buffer, and then the new one is published under cset->lock.
+ * Lockless users (see zio_cset_ti) may still look at the old one, so
+ * it is released after a grace period.
+ */
+static int __zio_change_current_trigger(struct zio_cset *cset, char *name)
 {
 	struct zio_trigger_type *trig, *trig_old = cset->trig;
 	struct zio_ti *ti, *ti_old = cset->ti;
@@ -431,27 +474,31 @@ int zio_change_current_trigger(struct zio_cset *cset, char *name)
 
 	/* Ok, we are done. Kill the current trigger to replace it*/
 	zio_trigger_abort_disable(cset, 1);
+	get_device(&ti_old->head.dev);
 	__ti_destroy(trig_old, ti_old);
-	zio_trigger_put(trig_old, cset->zdev->owner);
 
 	/* Set new trigger and rename "trigger-tmp" to "trigger" */
 	spin_lock_irqsave(&cset->lock, flags);
 	cset->trig = trig;
-	cset->ti = ti;
-	err = device_rename(&ti->head.dev, "trigger");
+	rcu_assign_pointer(cset->ti, ti);
+	for (i = 0; i < cset->n_chan; ++i)
+		cset->chan[i].ti = ti;
 	spin_unlock_irqrestore(&cset->lock, flags);
+	err = device_rename(&ti->head.dev, "trigger");
 
 	WARN(err, "%s: cannot rename trigger folder for cset%d\n", __func__,
 	     cset->index);
 
+	synchronize_rcu();
+	put_device(&ti_old->head.dev);
+	zio_trigger_put(trig_old, cset->zdev->owner);
+
 	/* Update current control for each channel */
 	for (i = 0; i < cset->n_chan; ++i)
 		__zattr_trig_init_ctrl(ti, cset->chan[i].current_ctrl);
 
 	/* Enable this new trigger (FIXME: unless the user doesn't want it) */
-	spin_lock_irqsave(&cset->lock, flags);
-	ti->flags &= ~ZIO_DISABLED;
-	spin_unlock_irqrestore(&cset->lock, flags);
+	clear_bit(ZIO_STATUS_BIT, &ti->flags);
 
 	/* Finally, arm it if so needed */
 	if (zio_cset_early_arm(cset))
@@ -470,14 +517,22 @@ out_put:
  * The code is very similar to the change of trigger above, and it must
  * temporary disable the trigger. It will remember whether it was disabled
  * when entering this thing, but later we'll have a "-" to keep it disabled.
+ *
+ * Files may be open. The abort returns in-flight blocks to the old
+ * instances, then the new ones are published under cset->lock, so the
+ * next arm and store use them. Open files keep reading the old instance
+ * until it is empty (see zio_f_follow in chardev.c): the last of them
+ * releases it. Output instances must be empty, as their blocks are still
+ * to be output: the change is refused otherwise.
  */
-int zio_change_current_buffer(struct zio_cset *cset, char *name)
+static int __zio_change_current_buffer(struct zio_cset *cset, char *name)
 {
 	struct zio_buffer_type *zbuf, *zbuf_old = cset->zbuf;
-	struct zio_ti *ti = cset->ti;
-	struct zio_bi **bi_vector;
-	unsigned long flags, tflags;
-	int i, j, err;
+	struct zio_bi **bi_vector, **old_vector;
+	struct zio_channel *chan;
+	struct zio_ti *ti;
+	unsigned long flags;
+	int i, err, tflags;
 
 	pr_debug("%s\n", __func__);
 
@@ -490,30 +545,13 @@ int zio_change_current_buffer(struct zio_cset *cset, char *name)
 	if (IS_ERR(zbuf))
 		return PTR_ERR(zbuf);
 
-	bi_vector = kzalloc(sizeof(struct zio_bi *) * cset->n_chan,
-			     GFP_KERNEL);
+	bi_vector = kcalloc(2 * cset->n_chan, sizeof(struct zio_bi *),
+			    GFP_KERNEL);
 	if (!bi_vector) {
 		err = -ENOMEM;
 		goto out_put;
 	}
-
-	/* If any of the instances are busy, refuse the change */
-	spin_lock_irqsave(&cset->lock, flags);
-	for (i = 0, j  = 0; i < cset->n_chan; ++i) {
-		cset->chan[i].bi->flags |= ZIO_DISABLED;
-		j += atomic_read(&cset->chan[i].bi->use_count);
-	}
-	/* If busy, clear the disabled thing and let it run */
-	for (i = 0; i < cset->n_chan; ++i) {
-		if (j)
-			cset->chan[i].bi->flags &= ~ZIO_DISABLED;
-	}
-	spin_unlock_irqrestore(&cset->lock, flags);
-
-	if (j) {
-		err = -EBUSY;
-		goto out_put;
-	}
+	old_vector = bi_vector + cset->n_chan;
 
 	/* Create a new buffer instance for each channel of the cset */
 	for (i = 0; i < cset->n_chan; ++i) {
@@ -526,41 +564,123 @@ int zio_change_current_buffer(struct zio_cset *cset, char *name)
 	}
 	tflags = zio_trigger_abort_disable(cset, 1);
 
+	/* Nobody is transferring a block with user space while we check */
+	for (i = 0; i < cset->n_chan; ++i)
+		zio_user_block_get(&cset->chan[i], TASK_UNINTERRUPTIBLE);
+	err = 0;
+	if ((cset->flags & ZIO_DIR) == ZIO_DIR_OUTPUT) {
+		chan_for_each(chan, cset) {
+			if (atomic_read(&chan->bi->nblocks) || chan->user_block)
+				err = -EBUSY;
+		}
+	}
+	if (!err) {
+		spin_lock_irqsave(&cset->lock, flags);
+		for (i = 0; i < cset->n_chan; ++i) {
+			old_vector[i] = cset->chan[i].bi;
+			rcu_assign_pointer(cset->chan[i].bi, bi_vector[i]);
+		}
+		cset->zbuf = zbuf;
+		spin_unlock_irqrestore(&cset->lock, flags);
+	}
+	for (i = 0; i < cset->n_chan; ++i)
+		zio_user_block_put(&cset->chan[i]);
+	if (err)
+		goto out_restore;
+
 	for (i = 0; i < cset->n_chan; ++i) {
-		/* Delete old buffer instance */
-		__bi_destroy(zbuf_old, cset->chan[i].bi);
-		/* Assign new buffer instance */
-		cset->chan[i].bi = bi_vector[i];
-		/* Rename buffer-tmp to trigger */
-		err = device_rename(&cset->chan[i].bi->head.dev, "buffer");
+		/* Delete old buffer instance, files may still hold it */
+		get_device(&old_vector[i]->head.dev);
+		__bi_destroy(zbuf_old, old_vector[i]);
+		/* Rename buffer-tmp to buffer */
+		err = device_rename(&bi_vector[i]->head.dev, "buffer");
 		if (err)
 			WARN(1, "%s: cannot rename buffer folder for"
 				" cset%d:chan%d\n", __func__, cset->index, i);
 	}
-	cset->zbuf = zbuf;
+	/* Release the old instances when lockless users are done */
+	synchronize_rcu();
+	for (i = 0; i < cset->n_chan; ++i) {
+		/* Readers sleeping on an empty instance must move on */
+		wake_up_interruptible_all(&old_vector[i]->q);
+		put_device(&old_vector[i]->head.dev);
+	}
 	kfree(bi_vector);
 	zio_buffer_put(zbuf_old, cset->zdev->owner);
+	err = 0;
 
+out_restore:
 	/* exit the disabled region: keep it disabled if needed */
-	spin_lock_irqsave(&cset->lock, flags);
-	ti->flags = (ti->flags & ~ZIO_DISABLED) | tflags;
-	spin_unlock_irqrestore(&cset->lock, flags);
+	ti = cset->ti;
+	if (!(tflags & ZIO_DISABLED))
+		clear_bit(ZIO_STATUS_BIT, &ti->flags);
 
 	/* Finally, arm the trigger if so needed */
 	if (zio_cset_early_arm(cset))
 		zio_arm_trigger(ti);
-
-	return 0;
+	if (!err)
+		return 0;
 
 out_create:
-	for (j = i-1; j >= 0; --j)
-		__bi_destroy(zbuf, bi_vector[j]);
+	for (--i; i >= 0; --i)
+		__bi_destroy(zbuf, bi_vector[i]);
 	kfree(bi_vector);
 out_put:
 	zio_buffer_put(zbuf, cset->zdev->owner);
 	return err;
 }
 
+/* Changes of trigger and buffer are serialized: each uses the other one */
+static DEFINE_MUTEX(zio_change_mutex);
+
+int zio_change_current_trigger(struct zio_cset *cset, char *name)
+{
+	int err;
+
+	mutex_lock(&zio_change_mutex);
+	err = __zio_change_current_trigger(cset, name);
+	mutex_unlock(&zio_change_mutex);
+	return err;
+}
+
+int zio_change_current_buffer(struct zio_cset *cset, char *name)
+{
+	int err;
+
+	mutex_lock(&zio_change_mutex);
+	err = __zio_change_current_buffer(cset, name);
+	mutex_unlock(&zio_change_mutex);
+	return err;
+}
+
+/*
+ * Others who use cset->ti or cset->bi across a sleep keep them alive,
+ * and whoever aborts and restores a trigger takes the mutex too, so the
+ * restore doesn't undo the work of another (e.g. an enable store).
+ */
+void zio_change_lock(void)
+{
+	mutex_lock(&zio_change_mutex);
+}
+
+/*
+ * Attribute stores of a trigger instance cannot wait for the mutex: a
+ * trigger change holds it while removing the instance, and that waits
+ * for them. So they restart, like lock_device_hotplug_sysfs()
+ */
+int zio_change_lock_sysfs(void)
+{
+	if (mutex_trylock(&zio_change_mutex))
+		return 0;
+	msleep(5); /* avoid busy looping */
+	return restart_syscall();
+}
+
+void zio_change_unlock(void)
+{
+	mutex_unlock(&zio_change_mutex);
+}
+
 static int cset_set_trigger(struct zio_cset *cset)
 {
 	struct zio_trigger_type *trig;
@@ -708,7 +828,7 @@ static int chan_register(struct zio_channel *chan, struct zio_channel *chan_t)
 		goto out_zattr_check;
 
 	/* Allocate, initialize and assign a current control for channel */
-	ctrl = zio_alloc_control(GFP_KERNEL);
+	ctrl = zio_alloc_control_node(GFP_KERNEL, zio_cset_node(chan->cset));
 	if (!ctrl) {
 		err = -ENOMEM;
 		goto out_zattr_check;
@@ -733,6 +853,7 @@ static int chan_register(struct zio_channel *chan, struct zio_channel *chan_t)
 	chan->head.dev.type = &chan_device_type;
 	chan->head.dev.parent = &chan->cset->head.dev;
 
+	zio_cset_quiet(chan->cset, &chan->head.dev);
 	err = device_register(&chan->head.dev);
 	if (err)
 		goto out_ctrl_bits;
@@ -915,14 +1036,36 @@ static int cset_register(struct zio_cset *cset, struct zio_cset *cset_t)
 	snprintf(cset_name, ZIO_NAME_LEN, "cset%i", cset->index);
 	dev_set_name(&cset->head.dev, cset_name);
 	spin_lock_init(&cset->lock);
+	/* Not hardware-busy: an abort has nothing to wait for */
+	init_completion(&cset->hw_idle);
+	complete_all(&cset->hw_idle);
 	cset->head.dev.type = &cset_device_type;
 	cset->head.dev.parent = &cset->zdev->head.dev;
+	/*
+	 * A cset with thousands of channels would flood udev: if the
+	 * driver asks for it, the cset sends a single "add" once it is
+	 * complete, see zio_cset_quiet
+	 */
+	if (cset->flags & ZIO_CSET_FEW_UEVENTS)
+		dev_set_uevent_suppress(&cset->head.dev, 1);
 	err = device_register(&cset->head.dev);
 	if (err)
 		goto out_zattr_check;
 
 	zobj_create_link(&cset->head);
 
+	/* Empty affinity: readers are awaken from the completing CPU */
+	if (!zalloc_cpumask_var(&cset->cpu_affinity, GFP_KERNEL)) {
+		err = -ENOMEM;
+		goto out_buf;
+	}
+	if (ZIO_HAS_BINARY_CONTROL) {
+		err = sysfs_create_bin_file(&cset->head.dev.kobj,
+					    &zio_bin_bulk_attr);
+		if (err)
+			goto out_buf;
+	}
+
 	/*
 	 * The cset must have a buffer type. If none is associated
 	 * to the cset, ZIO selects the preferred or default one.
@@ -949,9 +1092,17 @@ static int cset_register(struct zio_cset *cset, struct zio_cset *cset_t)
 
 	/* Allocate a new vector of channel for the new zio cset instance */
 	size = sizeof(struct zio_channel) * cset->n_chan;
-	cset->chan = kzalloc(size, GFP_KERNEL);
+	cset->chan = kzalloc_node(size, GFP_KERNEL, zio_cset_node(cset));
 	if (!cset->chan)
 		goto out_n_chan;
+	/* And the bitmaps of enabled and ready channels, in one allocation */
+	size = BITS_TO_LONGS(cset->n_chan);
+	cset->chan_enabled = kcalloc(2 * size, sizeof(long), GFP_KERNEL);
+	if (!cset->chan_enabled) {
+		err = -ENOMEM;
+		goto out_bitmap;
+	}
+	cset->chan_ready = cset->chan_enabled + size;
 
 	/* Setup interleaved channel if it exists */
 	cset->interleave = zio_assign_interleave_channel(cset);
@@ -972,16 +1123,20 @@ static int cset_register(struct zio_cset *cset, struct zio_cset *cset_t)
 		/* if interleave only, normal channels are disabled */
 		if (cset->flags & ZIO_CSET_INTERLEAVE_ONLY)
 			cset->chan[i].flags |= ZIO_DISABLED;
+		zio_chan_enabled_sync(&cset->chan[i]);
 	}
 
-	spin_lock(&zstat->lock);
-	list_add(&cset->list_cset, &zstat->list_cset);
-	spin_unlock(&zstat->lock);
+	/* Let open find the channels */
+	err = zio_minors_publish(cset);
+	if (err)
+		goto out_reg;
+	if (cset->flags & ZIO_CSET_FEW_UEVENTS) {
+		dev_set_uevent_suppress(&cset->head.dev, 0);
+		kobject_uevent(&cset->head.dev.kobj, KOBJ_ADD);
+	}
 
 	/* Finally, enable the trigger and arm it if needed */
-	spin_lock_irqsave(&cset->lock, flags);
-	ti->flags &= ~ZIO_DISABLED;
-	spin_unlock_irqrestore(&cset->lock, flags);
+	clear_bit(ZIO_STATUS_BIT, &ti->flags);
 
 	if (zio_cset_early_arm(cset))
 		zio_arm_trigger(ti);
@@ -991,6 +1146,8 @@ static int cset_register(struct zio_cset *cset, struct zio_cset *cset_t)
 out_reg:
 	for (j = i-1; j >= 0; j--)
 		chan_unregister(&cset->chan[j]);
+	kfree(cset->chan_enabled);
+out_bitmap:
 	kfree(cset->chan);
 out_n_chan:
 	__ti_destroy(cset->trig, ti);
@@ -1014,10 +1171,11 @@ static void cset_unregister(struct zio_cset *cset)
 
 	if (!cset)
 		return;
-	/* Remove from csets list*/
-	spin_lock(&zstat->lock);
-	list_del(&cset->list_cset);
-	spin_unlock(&zstat->lock);
+	/* No more open of the channels */
+	zio_minors_unpublish(cset);
+	/* No more bulk configuration, it uses the trigger */
+	if (ZIO_HAS_BINARY_CONTROL)
+		sysfs_remove_bin_file(&cset->head.dev.kobj, &zio_bin_bulk_attr);
 	/* Make it idle */
 	zio_trigger_abort_disable(cset, 1);
 	/* Unregister all child channels */
@@ -1330,6 +1488,9 @@ int zio_register_buf(struct zio_buffer_type *zbuf, const char *name)
 	if (err)
 		return err < 0 ? err : -EBUSY;
 	strncpy(zbuf->head.name, name, ZIO_OBJ_NAME_LEN);
+	if (!(zbuf->flags & ZIO_BUF_FLAG_LEVEL))
+		pr_warn("%s: \"%s\" buffer doesn't report its fill level\n",
+			__func__, name);
 
 	err = zio_init_buffer_fops(zbuf);
 	if (err < 0)
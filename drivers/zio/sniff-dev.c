@@ -14,81 +14,198 @@
 #include <linux/sched/signal.h>
 #endif
 #include <linux/list.h>
+#include <linux/rculist.h>
 #include <linux/fs.h>
 #include <linux/poll.h>
 #include <linux/miscdevice.h>
-#include <linux/spinlock.h>
+#include <linux/capability.h>
+#include <linux/mutex.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/compat.h>
+#include <linux/uaccess.h>
 
 #include <linux/zio.h>
 #include <linux/zio-user.h>
 
-#define ZSD_MAX_LEN 1024 /* Half a meg at most. Static by now */
+/*
+ * Each reader has a ring of controls, filled by zio_free_control on any
+ * CPU and in any context. Writers reserve a cell with a compare-and-swap
+ * on head and then publish it through the sequence number of the cell
+ * (a bounded queue as described by D. Vyukov): nothing is allocated and
+ * no lock is taken. A cell is free for the writer at position "pos" when
+ * its sequence is "pos", and it is ready for the reader when the
+ * sequence is "pos + 1". There is a single reader: the file mutex.
+ */
+struct zio_sniffdev_ring {
+	atomic_t head;			/* next cell for writers */
+	unsigned int tail;		/* next cell for the reader */
+	unsigned int mask;		/* depth - 1 */
+	unsigned int *seq;
+	struct zio_control *ctrl;
+};
 
-/* There is one such things for each reader. This hosts a list of controls */
+/* There is one such thing for each reader */
 struct zio_sniffdev_file {
-	struct list_head list;
-	spinlock_t lock;
+	struct list_head list;		/* RCU, for zio_sniffdev_add */
+	struct mutex lock;		/* the reader, and ring changes */
 	wait_queue_head_t q;
-	struct list_head controls;
-	int len;
-	uint8_t zio_alarms; /* Either 0 or ZIO_ALARM_LOST_SNIFF */
+	struct zio_sniffdev_ring __rcu *ring;
+	struct zio_sniff_filter __rcu *filter;
+	atomic_t lost;			/* report ZIO_ALARM_LOST_SNIFF */
 };
 static LIST_HEAD(zio_sniffdev_files);
 static DEFINE_MUTEX(zio_sniffdev_mtx);
 
-/* Each control in the list "controls" above is one of these */
-struct zio_sniffdev_ctrl {
-	struct list_head list;
-	struct zio_control *ctrl;
-	int size;
-};
+static struct zio_sniffdev_ring *zsd_ring_create(unsigned int depth)
+{
+	struct zio_sniffdev_ring *r;
+	unsigned int i;
+
+	depth = roundup_pow_of_two(depth);
+	r = kzalloc(sizeof(*r), GFP_KERNEL);
+	if (!r)
+		return NULL;
+	r->seq = vmalloc(depth * sizeof(*r->seq));
+	r->ctrl = vmalloc(depth * sizeof(*r->ctrl));
+	if (!r->seq || !r->ctrl) {
+		vfree(r->seq);
+		vfree(r->ctrl);
+		kfree(r);
+		return NULL;
+	}
+	r->mask = depth - 1;
+	for (i = 0; i < depth; i++)
+		r->seq[i] = i;
+	return r;
+}
+
+static void zsd_ring_destroy(struct zio_sniffdev_ring *r)
+{
+	if (!r)
+		return;
+	vfree(r->seq);
+	vfree(r->ctrl);
+	kfree(r);
+}
+
+/* Reserve a cell, copy the control, publish. False if the ring is full */
+static bool zsd_ring_push(struct zio_sniffdev_ring *r,
+			  struct zio_control *ctrl, uint8_t alarms)
+{
+	unsigned int pos, seq, i;
+	int dif;
+
+	pos = atomic_read(&r->head);
+	for (;;) {
+		i = pos & r->mask;
+		seq = smp_load_acquire(&r->seq[i]);
+		dif = (int)(seq - pos);
+		if (dif == 0) {
+			seq = atomic_cmpxchg(&r->head, pos, pos + 1);
+			if (seq == pos)
+				break;
+			pos = seq;
+		} else if (dif < 0) {
+			return false;
+		} else {
+			pos = atomic_read(&r->head);
+		}
+	}
+	memcpy(&r->ctrl[i], ctrl, sizeof(*ctrl));
+	r->ctrl[i].zio_alarms |= alarms;
+	smp_store_release(&r->seq[i], pos + 1);
+	return true;
+}
+
+/* The reader side: the result is only stable with the file mutex held */
+static inline bool zsd_ring_empty(struct zio_sniffdev_ring *r)
+{
+	unsigned int pos = r->tail;
+
+	return smp_load_acquire(&r->seq[pos & r->mask]) != pos + 1;
+}
+
+/* Lockless check, for wait_event and poll: the ring may be replaced */
+static bool zsd_readable(struct zio_sniffdev_file *f)
+{
+	bool ret;
+
+	rcu_read_lock();
+	ret = !zsd_ring_empty(rcu_dereference(f->ring));
+	rcu_read_unlock();
+	return ret;
+}
+
+static bool zsd_match(struct zio_sniff_filter *flt, struct zio_control *ctrl)
+{
+	struct zio_addr *addr = &ctrl->addr;
+
+	if (!flt)
+		return true;
+	if (flt->devname[0] &&
+	    strncmp(flt->devname, addr->devname, ZIO_OBJ_NAME_LEN))
+		return false;
+	if (flt->dev_id != ZIO_SNIFF_ANY_ID && flt->dev_id != addr->dev_id)
+		return false;
+	if (flt->cset != ZIO_SNIFF_ANY && flt->cset != addr->cset)
+		return false;
+	if (flt->chan != ZIO_SNIFF_ANY && flt->chan != addr->chan)
+		return false;
+	if ((flt->zio_alarms || flt->drv_alarms) &&
+	    !(flt->zio_alarms & ctrl->zio_alarms) &&
+	    !(flt->drv_alarms & ctrl->drv_alarms))
+		return false;
+	return true;
+}
 
 /* Add a new control to all files. Can be called in atomic context */
 void zio_sniffdev_add(struct zio_control *ctrl)
 {
-	int size = zio_control_size(NULL); /* oops when ch->ctrlsize */
 	struct zio_sniffdev_file *f;
-	struct zio_sniffdev_ctrl *c;
-	struct zio_control *newctrl;
-	unsigned long flags;
+	struct zio_sniffdev_ring *r;
+	uint8_t alarms;
 
-	list_for_each_entry(f, &zio_sniffdev_files, list) {
-		if (f->len >= ZSD_MAX_LEN) {
-			f->zio_alarms |= ZIO_ALARM_LOST_SNIFF;
+	rcu_read_lock();
+	list_for_each_entry_rcu(f, &zio_sniffdev_files, list) {
+		if (!zsd_match(rcu_dereference(f->filter), ctrl))
 			continue;
-		}
-		newctrl = kmemdup(ctrl, size, GFP_ATOMIC);
-		c = kmalloc(sizeof(*c), GFP_ATOMIC);
-		if (!newctrl || !c) {
-			f->zio_alarms |= ZIO_ALARM_LOST_SNIFF;
-			kfree(c);
-			kfree(newctrl);
+		r = rcu_dereference(f->ring);
+		alarms = 0;
+		if (unlikely(atomic_read(&f->lost)) && atomic_xchg(&f->lost, 0))
+			alarms = ZIO_ALARM_LOST_SNIFF;
+		if (!zsd_ring_push(r, ctrl, alarms)) {
+			atomic_set(&f->lost, 1);
 			continue;
 		}
-		newctrl->zio_alarms |= f->zio_alarms;
-		c->ctrl = newctrl;
-		c->size = size;
-		spin_lock_irqsave(&f->lock, flags);
-		list_add_tail(&c->list, &f->controls);
-		f->len++;
-		spin_unlock_irqrestore(&f->lock, flags);
-		wake_up_interruptible(&f->q);
+		/* Pairs with the barrier in wait_event (set_current_state) */
+		smp_mb();
+		if (waitqueue_active(&f->q))
+			wake_up_interruptible(&f->q);
 	}
+	rcu_read_unlock();
 }
 
 int zio_sniffdev_open (struct inode *ino, struct file *file)
 {
 	struct zio_sniffdev_file *f;
+	struct zio_sniffdev_ring *r;
 
 	f = kzalloc(sizeof(*f), GFP_USER);
 	if (!f)
 		return -ENOMEM;
+	r = zsd_ring_create(ZIO_SNIFF_DEPTH_DEFAULT);
+	if (!r) {
+		kfree(f);
+		return -ENOMEM;
+	}
+	RCU_INIT_POINTER(f->ring, r);
 
-	spin_lock_init(&f->lock);
+	mutex_init(&f->lock);
 	init_waitqueue_head(&f->q);
-	INIT_LIST_HEAD(&f->controls);
 	mutex_lock(&zio_sniffdev_mtx);
-	list_add(&f->list, &zio_sniffdev_files);
+	list_add_rcu(&f->list, &zio_sniffdev_files);
+	WRITE_ONCE(zio_sniffdev_users, zio_sniffdev_users + 1);
 	mutex_unlock(&zio_sniffdev_mtx);
 
 	file->private_data = f;
@@ -98,69 +215,72 @@ int zio_sniffdev_open (struct inode *ino, struct file *file)
 int zio_sniffdev_release(struct inode *ino, struct file *file)
 {
 	struct zio_sniffdev_file *f = file->private_data;
-	struct zio_sniffdev_ctrl *c;
-	struct list_head *l, *n;
 
 	mutex_lock(&zio_sniffdev_mtx);
-	list_del(&f->list);
+	list_del_rcu(&f->list);
+	WRITE_ONCE(zio_sniffdev_users, zio_sniffdev_users - 1);
 	mutex_unlock(&zio_sniffdev_mtx);
+	synchronize_rcu(); /* no writer is using the ring any more */
 
-	list_for_each_safe(l, n, &f->controls) {
-		c = list_entry(l, struct zio_sniffdev_ctrl, list);
-		list_del(&c->list);
-		kfree(c->ctrl);
-		kfree(c);
-	}
+	zsd_ring_destroy(rcu_dereference_protected(f->ring, 1));
+	kfree(rcu_dereference_protected(f->filter, 1));
+	kfree(f);
 	return 0;
 }
 
-static inline int __zio_sniffdev_empty(struct zio_sniffdev_file *f )
+static int zio_sniffdev_wait(struct zio_sniffdev_file *f, struct file *file)
 {
-	unsigned long flags;
-	int ret;
+	int err;
 
-	spin_lock_irqsave(&f->lock, flags);
-	ret = f->len == 0;
-	spin_unlock_irqrestore(&f->lock, flags);
-	return ret;
+	for (;;) {
+		err = mutex_lock_interruptible(&f->lock);
+		if (err)
+			return err;
+		if (!zsd_ring_empty(rcu_dereference_protected(f->ring, 1)))
+			return 0; /* with the mutex held */
+		mutex_unlock(&f->lock);
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		/* Without the mutex the ring may change: just check again */
+		wait_event_interruptible(f->q, zsd_readable(f));
+		if (signal_pending(current))
+			return -ERESTARTSYS;
+	}
 }
 
+/* Return as many whole controls as they fit in the user buffer */
 ssize_t zio_sniffdev_read(struct file *file, char __user *buf, size_t count,
 			  loff_t *offp)
 {
 	struct zio_sniffdev_file *f = file->private_data;
-	struct zio_sniffdev_ctrl *c = NULL;
-	unsigned long flags;
+	struct zio_sniffdev_ring *r;
+	size_t size = sizeof(struct zio_control), done = 0;
+	unsigned int pos;
+	int err;
 
-again:
-	while (__zio_sniffdev_empty(f)) {
-		if (file->f_flags & O_NONBLOCK)
-			return -EAGAIN;
-		wait_event_interruptible(f->q, !__zio_sniffdev_empty(f));
-		if (signal_pending(current))
-			return -ERESTARTSYS;
-	}
-	/* Lock again: child and parent may contend */
-	spin_lock_irqsave(&f->lock, flags);
-	if (f->len) {
-		f->len--;
-		c = list_entry(f->controls.next, struct zio_sniffdev_ctrl,
-			       list);
-		list_del(&c->list);
-	}
-	spin_unlock_irqrestore(&f->lock, flags);
-	if (!c)
-		goto again;
-	if (count < c->size)
+	if (count < size)
 		return -EINVAL;
-	count = c->size;
+	err = zio_sniffdev_wait(f, file);
+	if (err)
+		return err;
+
+	r = rcu_dereference_protected(f->ring, lockdep_is_held(&f->lock));
+	while (done + size <= count && !zsd_ring_empty(r)) {
+		pos = r->tail;
+		err = copy_to_user(buf + done, &r->ctrl[pos & r->mask], size);
+		if (err)
+			break;
+		/* Give the cell back to the writers, one lap later */
+		smp_store_release(&r->seq[pos & r->mask], pos + r->mask + 1);
+		r->tail = pos + 1;
+		done += size;
+	}
+	mutex_unlock(&f->lock);
 
-	if (copy_to_user(buf, c->ctrl, count))
+	if (!done)
 		return -EFAULT;
-	*offp += count;
-	kfree(c->ctrl);
-	kfree(c);
-	return count;
+	*offp += done;
+	return done;
 }
 
 unsigned int zio_sniffdev_poll(struct file *file, struct poll_table_struct *w)
@@ -168,17 +288,87 @@ unsigned int zio_sniffdev_poll(struct file *file, struct poll_table_struct *w)
 	struct zio_sniffdev_file *f = file->private_data;
 
 	poll_wait(file, &f->q, w);
-	if (__zio_sniffdev_empty(f))
+	if (!zsd_readable(f))
 		return 0;
 	return POLLIN | POLLRDNORM;
 }
 
+static long zio_sniffdev_set_filter(struct zio_sniffdev_file *f,
+				    void __user *uarg)
+{
+	struct zio_sniff_filter *flt = NULL, *old;
+
+	if (uarg) {
+		flt = memdup_user(uarg, sizeof(*flt));
+		if (IS_ERR(flt))
+			return PTR_ERR(flt);
+	}
+	mutex_lock(&f->lock);
+	old = rcu_dereference_protected(f->filter, 1);
+	rcu_assign_pointer(f->filter, flt);
+	mutex_unlock(&f->lock);
+	synchronize_rcu();
+	kfree(old);
+	return 0;
+}
+
+/* The new ring replaces the old one, discarding what was not read yet */
+static long zio_sniffdev_set_depth(struct zio_sniffdev_file *f,
+				   unsigned long depth)
+{
+	struct zio_sniffdev_ring *r, *old;
+
+	if (!depth || depth > ZIO_SNIFF_DEPTH_MAX)
+		return -EINVAL;
+	/* Any user can open us: large rings are for the administrator */
+	if (depth > ZIO_SNIFF_DEPTH_USER && !capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	r = zsd_ring_create(depth);
+	if (!r)
+		return -ENOMEM;
+	mutex_lock(&f->lock);
+	old = rcu_dereference_protected(f->ring, 1);
+	rcu_assign_pointer(f->ring, r);
+	mutex_unlock(&f->lock);
+	synchronize_rcu();
+	zsd_ring_destroy(old);
+	return 0;
+}
+
+static long zio_sniffdev_ioctl(struct file *file, unsigned int cmd,
+			       unsigned long arg)
+{
+	struct zio_sniffdev_file *f = file->private_data;
+
+	switch (cmd) {
+	case ZIO_SNIFF_IOC_FILTER:
+		return zio_sniffdev_set_filter(f, (void __user *)arg);
+	case ZIO_SNIFF_IOC_DEPTH:
+		return zio_sniffdev_set_depth(f, arg);
+	}
+	return -ENOTTY;
+}
+
+#ifdef CONFIG_COMPAT
+static long zio_sniffdev_compat_ioctl(struct file *file, unsigned int cmd,
+				      unsigned long arg)
+{
+	if (cmd == ZIO_SNIFF_IOC_FILTER)
+		arg = (unsigned long)compat_ptr(arg);
+	return zio_sniffdev_ioctl(file, cmd, arg);
+}
+#endif
+
 struct file_operations zio_sniffdev_fops = {
 	.owner=		THIS_MODULE,
 	.open =		zio_sniffdev_open,
 	.release =	zio_sniffdev_release,
 	.read =		zio_sniffdev_read,
 	.poll =		zio_sniffdev_poll,
+	.unlocked_ioctl = zio_sniffdev_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl =	zio_sniffdev_compat_ioctl,
+#endif
 	.llseek =	no_llseek,
 };
 
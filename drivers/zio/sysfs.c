@@ -392,8 +392,11 @@ int __zio_object_enable(struct zio_obj_head *head, unsigned int enable)
 	/* if the status is not changing */
 	if (!(enable ^ status))
 		return 0;
-	/* change status */
-	*zf = (*zf & (~ZIO_STATUS)) | status;
+	/* change status: trigger flags are changed locklessly elsewhere */
+	if (status)
+		set_bit(ZIO_STATUS_BIT, zf);
+	else
+		clear_bit(ZIO_STATUS_BIT, zf);
 
 	switch (head->zobj_type) {
 	case ZIO_DEV:
@@ -425,10 +428,13 @@ int __zio_object_enable(struct zio_obj_head *head, unsigned int enable)
 	case ZIO_CHAN:
 		dev_dbg(&head->dev, "(chan)\n");
 		chan = to_zio_chan(&head->dev);
+		zio_chan_enabled_sync(chan);
 
 		if (chan->cset->flags & ZIO_CSET_CHAN_INTERLEAVE) {
 			__ctrl_update_nsamples(chan->cset->ti);
 			__chan_enable_interleave(chan, enable);
+			/* it may have been forced to disabled */
+			zio_chan_enabled_sync(chan);
 		}
 
 		/* channel callback */
@@ -568,6 +574,10 @@ static ssize_t zobj_store_enable(struct device *dev,
 	if (err || val < 0 || val > 1)
 		return -EINVAL;
 
+	/* Don't race with attribute stores restoring the trigger */
+	err = zio_change_lock_sysfs();
+	if (err)
+		return err;
 	lock = __zio_get_dev_spinlock(head);
 	do {
 		spin_lock(lock);
@@ -576,6 +586,7 @@ static ssize_t zobj_store_enable(struct device *dev,
 		if (err == -EAGAIN)
 			msleep(1);
 	} while (err  == -EAGAIN);
+	zio_change_unlock();
 	return count;
 }
 /*
@@ -656,28 +667,35 @@ static ssize_t zattr_store(struct device *dev, struct device_attribute *attr,
 		return -EINVAL;
 	}
 
-	lock = __zio_get_dev_spinlock(head);
-	spin_lock(lock);
-
-	/* cannot modify trigger's attributes while is armed */
+	/*
+	 * Cannot modify trigger's attributes while is armed. Stopping it
+	 * may sleep, waiting for the hardware: do it before locking. The
+	 * whole stop/configure/restore is serialized with enable stores
+	 * and with other stores doing the same
+	 */
 	if (head->zobj_type == ZIO_TI) {
+		err = zio_change_lock_sysfs();
+		if (err)
+			return err;
 		ti = to_zio_ti(&head->dev);
 		tflags = zio_trigger_abort_disable(ti->cset, 1);
 	}
 
 	/* Configure the attribute */
+	lock = __zio_get_dev_spinlock(head);
+	spin_lock(lock);
 	err = __zio_conf_set(head, zattr, (uint32_t)val);
+	spin_unlock(lock);
 
-	if (head->zobj_type == ZIO_TI) {
+	if (ti) {
 		/* restore trigger status */
-		if (ti && ((tflags & ZIO_STATUS) == ZIO_ENABLED))
-			ti->flags = (ti->flags & ~ZIO_STATUS) | ZIO_ENABLED;
-		if (ti && (tflags & ZIO_TI_ARMED))
+		if ((tflags & ZIO_STATUS) == ZIO_ENABLED)
+			clear_bit(ZIO_STATUS_BIT, &ti->flags);
+		if (tflags & ZIO_TI_ARMED)
 			zio_arm_trigger(ti);
+		zio_change_unlock();
 	}
 
-	spin_unlock(lock);
-
 	return err ? err : count;
 }
 
@@ -829,7 +847,8 @@ static ssize_t zio_show_dire(struct device *dev,
 }
 
 /**
- * It configures the buffer preference:
+ * It configures the buffer preference. This is the old interface to the
+ * overflow policy, kept for compatibility:
  * 0 - it will keep the oldest block when the buffer is full
  * 1 - it will remove old blocks in order to store the new ones
  */
@@ -841,10 +860,14 @@ static ssize_t zio_store_pref(struct device *dev,
 	unsigned long flags;
 
 	spin_lock_irqsave(&bi->lock, flags);
-	if (buf[0] == '0')
+	if (buf[0] == '0') {
 		bi->flags &= ~ZIO_BI_PREF_NEW;
-	else
+		bi->policy = (bi->flags & ZIO_DIR) == ZIO_DIR_OUTPUT ?
+			ZIO_BI_POLICY_BLOCK : ZIO_BI_POLICY_DROP_NEWEST;
+	} else {
 		bi->flags |= ZIO_BI_PREF_NEW;
+		bi->policy = ZIO_BI_POLICY_DROP_OLDEST;
+	}
 	spin_unlock_irqrestore(&bi->lock, flags);
 
 	return count;
@@ -854,7 +877,236 @@ static ssize_t zio_show_pref(struct device *dev,
 {
 	struct zio_bi *bi = to_zio_bi(dev);
 
-	return sprintf(buf, "%d\n", !!(bi->flags & ZIO_BI_PREF_NEW));
+	return sprintf(buf, "%d\n", bi->policy == ZIO_BI_POLICY_DROP_OLDEST);
+}
+
+static const char *zio_bi_policy_names[] = {
+	[ZIO_BI_POLICY_DROP_NEWEST] = "drop-newest",
+	[ZIO_BI_POLICY_DROP_OLDEST] = "drop-oldest",
+	[ZIO_BI_POLICY_BLOCK] = "block",
+};
+
+/**
+ * It configures what happens when the buffer is full: "drop-newest"
+ * (input only), "drop-oldest" or "block" (output only)
+ */
+static ssize_t zio_store_policy(struct device *dev,
+				struct device_attribute *attr,
+				const char *buf, size_t count)
+{
+	struct zio_bi *bi = to_zio_bi(dev);
+	int output = (bi->flags & ZIO_DIR) == ZIO_DIR_OUTPUT;
+	unsigned long flags;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(zio_bi_policy_names); ++i)
+		if (sysfs_streq(buf, zio_bi_policy_names[i]))
+			break;
+	if (i == ARRAY_SIZE(zio_bi_policy_names))
+		return -EINVAL;
+	if ((i == ZIO_BI_POLICY_BLOCK && !output) ||
+	    (i == ZIO_BI_POLICY_DROP_NEWEST && output))
+		return -EINVAL;
+
+	spin_lock_irqsave(&bi->lock, flags);
+	bi->policy = i;
+	/* The old flag is an alias, keep it in sync with the policy */
+	if (i == ZIO_BI_POLICY_DROP_OLDEST)
+		bi->flags |= ZIO_BI_PREF_NEW;
+	else
+		bi->flags &= ~ZIO_BI_PREF_NEW;
+	spin_unlock_irqrestore(&bi->lock, flags);
+	/* Writers blocked by the previous policy may proceed */
+	wake_up_interruptible(&bi->q);
+
+	return count;
+}
+static ssize_t zio_show_policy(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct zio_bi *bi = to_zio_bi(dev);
+
+	return sprintf(buf, "%s\n", zio_bi_policy_names[bi->policy]);
+}
+
+/**
+ * Watermarks are expressed in blocks. The high one enables notifications
+ * (0 disables them); the low one must be lower than the high one.
+ */
+static ssize_t __zio_store_wm(struct device *dev, const char *buf,
+			      size_t count, int high)
+{
+	struct zio_bi *bi = to_zio_bi(dev);
+	unsigned long flags;
+	unsigned int val;
+	int err = 0;
+
+	if (kstrtouint(buf, 0, &val))
+		return -EINVAL;
+
+	spin_lock_irqsave(&bi->lock, flags);
+	if (high) {
+		if (val && val <= bi->wm_low)
+			err = -EINVAL;
+		else
+			bi->wm_high = val;
+	} else {
+		if (bi->wm_high && val >= bi->wm_high)
+			err = -EINVAL;
+		else
+			bi->wm_low = val;
+	}
+	/* Start again from a known state, the next block re-evaluates it */
+	if (!err)
+		bi->flags &= ~ZIO_BI_WM_HIGH;
+	spin_unlock_irqrestore(&bi->lock, flags);
+	wake_up_interruptible(&bi->q);
+
+	return err ? err : count;
+}
+static ssize_t zio_store_hiwm(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	return __zio_store_wm(dev, buf, count, 1);
+}
+static ssize_t zio_show_hiwm(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", to_zio_bi(dev)->wm_high);
+}
+static ssize_t zio_store_lowm(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	return __zio_store_wm(dev, buf, count, 0);
+}
+static ssize_t zio_show_lowm(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", to_zio_bi(dev)->wm_low);
+}
+
+/**
+ * Wakeup moderation: readers are awaken when wakeup-blocks blocks are
+ * stored or wakeup-usec after the first one, whichever comes first.
+ */
+static ssize_t zio_store_wblk(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct zio_bi *bi = to_zio_bi(dev);
+	unsigned long flags;
+	unsigned int val;
+
+	if (kstrtouint(buf, 0, &val) || !val)
+		return -EINVAL;
+
+	spin_lock_irqsave(&bi->lock, flags);
+	bi->wake_blocks = val;
+	spin_unlock_irqrestore(&bi->lock, flags);
+	/* Readers may be waiting for a bigger number of blocks */
+	wake_up_interruptible(&bi->q);
+
+	return count;
+}
+static ssize_t zio_show_wblk(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", to_zio_bi(dev)->wake_blocks);
+}
+static ssize_t zio_store_wuse(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct zio_bi *bi = to_zio_bi(dev);
+	unsigned long flags;
+	unsigned int val;
+
+	if (kstrtouint(buf, 0, &val))
+		return -EINVAL;
+
+	spin_lock_irqsave(&bi->lock, flags);
+	bi->wake_usec = val;
+	spin_unlock_irqrestore(&bi->lock, flags);
+	wake_up_interruptible(&bi->q);
+
+	return count;
+}
+static ssize_t zio_show_wuse(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", to_zio_bi(dev)->wake_usec);
+}
+
+/**
+ * It returns the number of blocks stored in the buffer instance
+ */
+static ssize_t zio_show_level(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct zio_bi *bi = to_zio_bi(dev);
+
+	return sprintf(buf, "%d\n", atomic_read(&bi->nblocks));
+}
+
+/**
+ * NUMA node for the memory of the cset buffers. It applies to what is
+ * allocated later (e.g. change current_buffer to reallocate); -1 goes
+ * back to the node of the parent device.
+ */
+static ssize_t zio_store_numa(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	int node;
+
+	if (kstrtoint(buf, 0, &node))
+		return -EINVAL;
+	if (node == NUMA_NO_NODE)
+		node = dev_to_node(dev->parent);
+	else if (node < 0 || node >= MAX_NUMNODES || !node_online(node))
+		return -EINVAL;
+	set_dev_node(dev, node);
+
+	return count;
+}
+static ssize_t zio_show_numa(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", dev_to_node(dev));
+}
+
+/**
+ * CPUs (a cpu list, like "0-3,8") readers are awaken from. An empty list
+ * means the CPU that completed the block.
+ */
+static ssize_t zio_store_cpus(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct zio_cset *cset = to_zio_cset(dev);
+	cpumask_var_t mask;
+	int err;
+
+	if (!alloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+	err = cpulist_parse(buf, mask);
+	if (!err && !cpumask_empty(mask) &&
+	    !cpumask_intersects(mask, cpu_online_mask))
+		err = -EINVAL;
+	if (!err)
+		cpumask_copy(cset->cpu_affinity, mask);
+	free_cpumask_var(mask);
+
+	return err ? err : count;
+}
+static ssize_t zio_show_cpus(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct zio_cset *cset = to_zio_cset(dev);
+
+	return sprintf(buf, "%*pbl\n", cpumask_pr_args(cset->cpu_affinity));
 }
 
 
@@ -931,6 +1183,279 @@ struct bin_attribute zio_bin_attr[] = {
 	}
 };
 
+/*
+ * Bulk configuration of a cset. Every value is checked first; then they
+ * are applied with a single trigger abort/re-arm and a single pass over
+ * the current controls, instead of one of each per sysfs write.
+ * Slots 0..15 are the standard attributes, 16..47 the extended ones.
+ */
+#define ZIO_BULK_SLOTS (ZIO_MAX_STD_ATTR + ZIO_MAX_EXT_ATTR)
+
+static inline int __bulk_selected(struct zio_ctrl_attr *ca, int i)
+{
+	if (i < ZIO_MAX_STD_ATTR)
+		return !!(ca->std_mask & BIT(i));
+	return !!(ca->ext_mask & BIT(i - ZIO_MAX_STD_ATTR));
+}
+
+static inline uint32_t __bulk_val(struct zio_ctrl_attr *ca, int i)
+{
+	if (i < ZIO_MAX_STD_ATTR)
+		return ca->std_val[i];
+	return ca->ext_val[i - ZIO_MAX_STD_ATTR];
+}
+
+/* Forget slot i and the following ones, that were not applied */
+static void __bulk_trim(struct zio_ctrl_attr *ca, int i)
+{
+	if (i < ZIO_MAX_STD_ATTR) {
+		ca->std_mask &= BIT(i) - 1;
+		ca->ext_mask = 0;
+	} else {
+		ca->ext_mask &= (1ULL << (i - ZIO_MAX_STD_ATTR)) - 1;
+	}
+}
+
+/* The attribute in a set that is stored in control slot i, if any */
+static struct zio_attribute *__bulk_find(struct zio_attribute_set *set,
+					 int i)
+{
+	struct zio_attribute *zattr;
+	int j;
+
+	if (i < ZIO_MAX_STD_ATTR) {
+		if (i >= set->n_std_attr || i == ZIO_ATTR_VERSION)
+			return NULL;
+		zattr = &set->std_zattr[i];
+		if (zattr->index != i)
+			return NULL; /* unused std attribute */
+		return zattr;
+	}
+	for (j = 0; j < set->n_ext_attr; ++j) {
+		zattr = &set->ext_zattr[j];
+		if ((zattr->flags & ZIO_ATTR_CONTROL) &&
+		    zattr->index == i - ZIO_MAX_STD_ATTR)
+			return zattr;
+	}
+	return NULL;
+}
+
+static int __bulk_check(struct zio_obj_head *head, struct zio_ctrl_attr *ca)
+{
+	struct zio_attribute_set *set = zio_get_from_obj(head, zattr_set);
+	struct zio_attribute *zattr;
+	uint32_t val;
+	int i;
+
+	for (i = 0; i < ZIO_BULK_SLOTS; ++i) {
+		if (!__bulk_selected(ca, i))
+			continue;
+		zattr = __bulk_find(set, i);
+		if (!zattr || !zattr->s_op || !zattr->s_op->conf_set ||
+		    !(zattr->attr.attr.mode & S_IWUGO)) {
+			dev_err(&head->dev, "bulk-config: no writable attribute in %s slot %i\n",
+				i < ZIO_MAX_STD_ATTR ? "std" : "ext",
+				i < ZIO_MAX_STD_ATTR ? i : i - ZIO_MAX_STD_ATTR);
+			return -EINVAL;
+		}
+		val = __bulk_val(ca, i);
+		if (zattr->min != zattr->max &&
+		    (val < zattr->min || val > zattr->max)) {
+			dev_err(&head->dev, "%s: value %u exceed range [%u, %u]\n",
+				zattr->attr.attr.name, val, zattr->min,
+				zattr->max);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+/* Apply the values to one object; on error, ca only keeps what was done */
+static int __bulk_apply(struct zio_obj_head *head, struct zio_ctrl_attr *ca)
+{
+	struct zio_attribute_set *set = zio_get_from_obj(head, zattr_set);
+	struct zio_attribute *zattr;
+	uint32_t val;
+	int i, err;
+
+	for (i = 0; i < ZIO_BULK_SLOTS; ++i) {
+		if (!__bulk_selected(ca, i))
+			continue;
+		zattr = __bulk_find(set, i);
+		val = __bulk_val(ca, i);
+		err = zattr->s_op->conf_set(&head->dev, zattr, val);
+		if (err) {
+			__bulk_trim(ca, i);
+			return err;
+		}
+		zattr->value = val;
+	}
+	return 0;
+}
+
+/* Copy the selected values into a control, as __zattr_valcpy does */
+static void __bulk_copy(struct zio_ctrl_attr *dst, struct zio_ctrl_attr *src)
+{
+	int i;
+
+	for (i = 0; i < ZIO_MAX_STD_ATTR; ++i)
+		if (src->std_mask & BIT(i))
+			dst->std_val[i] = src->std_val[i];
+	for (i = 0; i < ZIO_MAX_EXT_ATTR; ++i)
+		if (src->ext_mask & BIT(i))
+			dst->ext_val[i] = src->ext_val[i];
+	dst->std_mask |= src->std_mask;
+	dst->ext_mask |= src->ext_mask;
+}
+
+/*
+ * The only pass over the current controls: dev values go to all csets.
+ * Channels before n_ok took all the channel values, channel n_ok (if a
+ * conf_set failed) only the ones in part.
+ */
+static void __bulk_propagate(struct zio_cset *cset, struct zio_bulk_config *cfg,
+			     int n_ok, struct zio_ctrl_attr *part)
+{
+	struct zio_device *zdev = cset->zdev;
+	struct zio_control *ctrl;
+	struct zio_cset *c;
+	unsigned long flags;
+	int i, j;
+
+	for (i = 0; i < zdev->n_cset; ++i) {
+		c = &zdev->cset[i];
+		if (c != cset && !cfg->dev.std_mask && !cfg->dev.ext_mask)
+			continue;
+		spin_lock_irqsave(&c->lock, flags);
+		if (c == cset && (cfg->trig.std_mask || cfg->trig.ext_mask))
+			__ctrl_update_nsamples(c->ti);
+		for (j = 0; j < c->n_chan; ++j) {
+			ctrl = c->chan[j].current_ctrl;
+			__bulk_copy(&ctrl->attr_channel, &cfg->dev);
+			if (c != cset)
+				continue;
+			__bulk_copy(&ctrl->attr_channel, &cfg->cset);
+			if (j < n_ok)
+				__bulk_copy(&ctrl->attr_channel, &cfg->chan);
+			else if (j == n_ok)
+				__bulk_copy(&ctrl->attr_channel, part);
+			__bulk_copy(&ctrl->attr_trigger, &cfg->trig);
+		}
+		spin_unlock_irqrestore(&c->lock, flags);
+	}
+}
+
+/* The caller holds the change mutex: cset->ti cannot be replaced */
+static int __bulk_config(struct zio_cset *cset, struct zio_bulk_config *cfg)
+{
+	struct zio_ti *ti = cset->ti;
+	spinlock_t *lock = &cset->zdev->lock;
+	struct zio_ctrl_attr part;
+	int i, err, n_ok = 0, tflags;
+
+	/* Validate everything, against every channel too */
+	err = __bulk_check(&cset->zdev->head, &cfg->dev);
+	if (!err)
+		err = __bulk_check(&cset->head, &cfg->cset);
+	for (i = 0; !err && i < cset->n_chan; ++i)
+		err = __bulk_check(&cset->chan[i].head, &cfg->chan);
+	if (!err)
+		err = __bulk_check(&ti->head, &cfg->trig);
+	if (err)
+		return err;
+
+	/* Stop the trigger once: it may sleep, so do it before locking */
+	tflags = zio_trigger_abort_disable(cset, 1);
+
+	/*
+	 * A driver may still refuse a value: then nothing after it is
+	 * applied, and the controls only report what was applied.
+	 */
+	memset(&part, 0, sizeof(part));
+	spin_lock(lock);
+	err = __bulk_apply(&cset->zdev->head, &cfg->dev);
+	if (err)
+		memset(&cfg->cset, 0, sizeof(cfg->cset));
+	else
+		err = __bulk_apply(&cset->head, &cfg->cset);
+	while (!err && n_ok < cset->n_chan) {
+		part = cfg->chan;
+		err = __bulk_apply(&cset->chan[n_ok].head, &part);
+		if (!err)
+			n_ok++;
+	}
+	if (err)
+		memset(&cfg->trig, 0, sizeof(cfg->trig));
+	else
+		err = __bulk_apply(&ti->head, &cfg->trig);
+
+	__bulk_propagate(cset, cfg, n_ok, &part);
+	if ((cfg->trig.std_mask || cfg->trig.ext_mask) && ti->t_op->config)
+		ti->t_op->config(ti, cset->chan[0].current_ctrl);
+	spin_unlock(lock);
+
+	/* And restart it once, as it was */
+	if ((tflags & ZIO_STATUS) == ZIO_ENABLED)
+		clear_bit(ZIO_STATUS_BIT, &ti->flags);
+	if (tflags & ZIO_TI_ARMED)
+		zio_arm_trigger(ti);
+	return err;
+}
+
+static ssize_t zobj_write_bulk(struct file *file, struct kobject *kobj,
+			       struct bin_attribute *bin_attr,
+			       char *buf, loff_t off, size_t count)
+{
+	struct zio_cset *cset;
+	struct zio_bulk_config *cfg;
+	int err;
+
+	/* The whole configuration comes in a single write */
+	if (off != 0)
+		return -ESPIPE; /* Illegal seek */
+	if (count != sizeof(*cfg))
+		return -EINVAL;
+
+	cset = to_zio_cset(container_of(kobj, struct device, kobj));
+	cfg = kmemdup(buf, sizeof(*cfg), GFP_KERNEL);
+	if (!cfg)
+		return -ENOMEM;
+	zio_change_lock();
+	err = __bulk_config(cset, cfg);
+	zio_change_unlock();
+	kfree(cfg);
+
+	return err ? err : count;
+}
+
+static ssize_t zobj_read_bulk(struct file *file, struct kobject *kobj,
+			      struct bin_attribute *bin_attr,
+			      char *buf, loff_t off, size_t count)
+{
+	struct zio_cset *cset;
+	unsigned long flags;
+
+	/* This file must be read entirely, and it returns a control */
+	if (off != 0)
+		return -ESPIPE; /* Illegal seek */
+	if (count < __ZIO_CONTROL_SIZE)
+		return -EINVAL;
+
+	cset = to_zio_cset(container_of(kobj, struct device, kobj));
+	spin_lock_irqsave(&cset->lock, flags);
+	memcpy(buf, cset->chan[0].current_ctrl, __ZIO_CONTROL_SIZE);
+	spin_unlock_irqrestore(&cset->lock, flags);
+
+	return __ZIO_CONTROL_SIZE;
+}
+
+struct bin_attribute zio_bin_bulk_attr = {
+	.attr = { .name = "bulk-config", .mode = ZIO_RW_PERM, },
+	.size = sizeof(struct zio_bulk_config),
+	.read = zobj_read_bulk,
+	.write = zobj_write_bulk,
+};
+
 #endif /* ZIO_HAS_BINARY_CONTROL */
 
 /* This is only for internal use (DAN == default attribute name) */
@@ -946,6 +1471,14 @@ enum zio_default_attribute_numeration {
 	ZIO_DAN_DIRE,   /* direction */
 	ZIO_DAN_PREF,	/* prefer-new */
 	ZIO_DAN_INTE,	/* interleave */
+	ZIO_DAN_OVPO,	/* overflow-policy */
+	ZIO_DAN_HIWM,	/* high-watermark */
+	ZIO_DAN_LOWM,	/* low-watermark */
+	ZIO_DAN_LEVL,	/* fill-level */
+	ZIO_DAN_WBLK,	/* wakeup-blocks */
+	ZIO_DAN_WUSE,	/* wakeup-usec */
+	ZIO_DAN_NUMA,	/* numa-node */
+	ZIO_DAN_CPUS,	/* cpu-affinity */
 };
 
 /* default zio attributes */
@@ -972,6 +1505,22 @@ static struct device_attribute zio_default_attributes[] = {
 				zio_show_pref, zio_store_pref),
 	[ZIO_DAN_INTE] = __ATTR(interleave, ZIO_RW_PERM,
 				zio_show_inte, NULL),
+	[ZIO_DAN_OVPO] = __ATTR(overflow-policy, ZIO_RW_PERM,
+				zio_show_policy, zio_store_policy),
+	[ZIO_DAN_HIWM] = __ATTR(high-watermark, ZIO_RW_PERM,
+				zio_show_hiwm, zio_store_hiwm),
+	[ZIO_DAN_LOWM] = __ATTR(low-watermark, ZIO_RW_PERM,
+				zio_show_lowm, zio_store_lowm),
+	[ZIO_DAN_LEVL] = __ATTR(fill-level, ZIO_RO_PERM,
+				zio_show_level, NULL),
+	[ZIO_DAN_WBLK] = __ATTR(wakeup-blocks, ZIO_RW_PERM,
+				zio_show_wblk, zio_store_wblk),
+	[ZIO_DAN_WUSE] = __ATTR(wakeup-usec, ZIO_RW_PERM,
+				zio_show_wuse, zio_store_wuse),
+	[ZIO_DAN_NUMA] = __ATTR(numa-node, ZIO_RW_PERM,
+				zio_show_numa, zio_store_numa),
+	[ZIO_DAN_CPUS] = __ATTR(cpu-affinity, ZIO_RW_PERM,
+				zio_show_cpus, zio_store_cpus),
 	__ATTR_NULL,
 };
 /* default attributes for most of the zio objects */
@@ -991,6 +1540,8 @@ static struct attribute *def_cset_attrs_ptr[] = {
 	&zio_default_attributes[ZIO_DAN_CTRI].attr,
 	&zio_default_attributes[ZIO_DAN_CBUF].attr,
 	&zio_default_attributes[ZIO_DAN_DIRE].attr,
+	&zio_default_attributes[ZIO_DAN_NUMA].attr,
+	&zio_default_attributes[ZIO_DAN_CPUS].attr,
 	NULL,
 };
 /* default attributes for channel */
@@ -1006,6 +1557,12 @@ static struct attribute *def_bi_attrs_ptr[] = {
 	&zio_default_attributes[ZIO_DAN_TYPE].attr,
 	&zio_default_attributes[ZIO_DAN_FLUS].attr,
 	&zio_default_attributes[ZIO_DAN_PREF].attr,
+	&zio_default_attributes[ZIO_DAN_OVPO].attr,
+	&zio_default_attributes[ZIO_DAN_HIWM].attr,
+	&zio_default_attributes[ZIO_DAN_LOWM].attr,
+	&zio_default_attributes[ZIO_DAN_LEVL].attr,
+	&zio_default_attributes[ZIO_DAN_WBLK].attr,
+	&zio_default_attributes[ZIO_DAN_WUSE].attr,
 	NULL,
 };
 
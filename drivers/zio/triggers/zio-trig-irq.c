@@ -6,7 +6,12 @@
 
 /*
  * This is a trigger based on an external IRQ. You can specify the IRQ
- * number or the GPIO number -- then the associated IRQ is used
+ * number or the GPIO number -- then the associated IRQ is used.
+ *
+ * The hard handler can drop interrupts before arming: it may only fire
+ * every Nth interrupt ("decimation") and never within "min-interval-ns"
+ * of the previous trigger. In "threaded" mode it only stamps the event
+ * into a per-instance fifo, and arming happens in the irq thread.
  */
 
 #include <linux/kernel.h>
@@ -15,6 +20,8 @@
 #include <linux/slab.h>
 #include <linux/interrupt.h>
 #include <linux/gpio.h>
+#include <linux/kfifo.h>
+#include <linux/ktime.h>
 
 #include <linux/zio.h>
 #include <linux/zio-sysfs.h>
@@ -26,10 +33,37 @@ static int zti_gpio = -1;
 module_param_named(irq, zti_irq, int, 0444);
 module_param_named(gpio, zti_gpio, int, 0444);
 
+#define ZTI_FIFO_LEN 64 /* stamps waiting for the thread; power of 2 */
+
+struct zti_instance {
+	struct zio_ti		ti;
+	/* configuration, read by the hard handler */
+	uint32_t		decimation;
+	uint32_t		threaded;
+	uint64_t		min_ns;
+	/* hard handler state */
+	uint32_t		count;
+	uint64_t		last_ns;
+	/* statistics, only written by the hard handler */
+	uint32_t		decimated;
+	uint32_t		suppressed;
+	uint32_t		fifo_lost;
+	atomic_t		busy;	/* written where arming happens */
+	DECLARE_KFIFO(fifo, struct timespec, ZTI_FIFO_LEN);
+};
+#define to_zti_instance(ti) container_of(ti, struct zti_instance, ti)
+
 enum zti_attrs {
 	ZTI_ATTR_NSAMPLES = 0,
 	ZTI_ATTR_IRQ,
 	ZTI_ATTR_GPIO,
+	ZTI_ATTR_DECIMATION,	/* fire every Nth irq */
+	ZTI_ATTR_MIN_INTERVAL,	/* ns, 0 to disable */
+	ZTI_ATTR_THREADED,	/* arm from the irq thread */
+	ZTI_ATTR_DECIMATED,	/* statistics, read-only */
+	ZTI_ATTR_SUPPRESSED,
+	ZTI_ATTR_FIFO_LOST,
+	ZTI_ATTR_BUSY,
 };
 
 static ZIO_ATTR_DEFINE_STD(ZIO_TRG, zti_std_attr) = {
@@ -40,25 +74,126 @@ static ZIO_ATTR_DEFINE_STD(ZIO_TRG, zti_std_attr) = {
 static struct zio_attribute zti_ext_attr[] = {
 	ZIO_ATTR_EXT("irq", ZIO_RO_PERM, ZTI_ATTR_IRQ, -1),
 	ZIO_ATTR_EXT("gpio", ZIO_RO_PERM, ZTI_ATTR_GPIO, -1),
+	ZIO_ATTR_EXT_RNG("decimation", ZIO_RW_PERM,
+			 ZTI_ATTR_DECIMATION, 1, 1, ~0U),
+	ZIO_ATTR_EXT("min-interval-ns", ZIO_RW_PERM, ZTI_ATTR_MIN_INTERVAL, 0),
+	ZIO_ATTR_EXT_RNG("threaded", ZIO_RW_PERM, ZTI_ATTR_THREADED, 0, 0, 1),
+	ZIO_ATTR_EXT("decimated", ZIO_RO_PERM, ZTI_ATTR_DECIMATED, 0),
+	ZIO_ATTR_EXT("suppressed", ZIO_RO_PERM, ZTI_ATTR_SUPPRESSED, 0),
+	ZIO_ATTR_EXT("fifo-lost", ZIO_RO_PERM, ZTI_ATTR_FIFO_LOST, 0),
+	ZIO_ATTR_EXT("busy", ZIO_RO_PERM, ZTI_ATTR_BUSY, 0),
 };
 static int zti_conf_set(struct device *dev, struct zio_attribute *zattr,
 		uint32_t  usr_val)
 {
+	struct zio_ti *ti = to_zio_ti(dev);
+	struct zti_instance *zti = to_zti_instance(ti);
+
 	pr_debug("%s:%d\n", __func__, __LINE__);
-	zattr->value = usr_val;
+	if ((zattr->flags & ZIO_ATTR_TYPE) != ZIO_ATTR_TYPE_EXT)
+		return 0;
+	switch (zattr->id) {
+	case ZTI_ATTR_DECIMATION:
+		WRITE_ONCE(zti->decimation, usr_val);
+		WRITE_ONCE(zti->count, 0);
+		break;
+	case ZTI_ATTR_MIN_INTERVAL:
+		WRITE_ONCE(zti->min_ns, usr_val);
+		break;
+	case ZTI_ATTR_THREADED:
+		WRITE_ONCE(zti->threaded, usr_val);
+		break;
+	}
+	return 0;
+}
 
+static int zti_info_get(struct device *dev, struct zio_attribute *zattr,
+			uint32_t *usr_val)
+{
+	struct zio_ti *ti = to_zio_ti(dev);
+	struct zti_instance *zti = to_zti_instance(ti);
+
+	if ((zattr->flags & ZIO_ATTR_TYPE) != ZIO_ATTR_TYPE_EXT)
+		return 0;
+	switch (zattr->id) {
+	case ZTI_ATTR_DECIMATED:
+		*usr_val = READ_ONCE(zti->decimated);
+		break;
+	case ZTI_ATTR_SUPPRESSED:
+		*usr_val = READ_ONCE(zti->suppressed);
+		break;
+	case ZTI_ATTR_FIFO_LOST:
+		*usr_val = READ_ONCE(zti->fifo_lost);
+		break;
+	case ZTI_ATTR_BUSY:
+		*usr_val = atomic_read(&zti->busy);
+		break;
+	}
 	return 0;
 }
 
 static struct zio_sysfs_operations zti_s_ops = {
 	.conf_set = zti_conf_set,
+	.info_get = zti_info_get,
 };
 
+/* An event while the previous one is still being acquired is lost */
+static void zti_arm(struct zti_instance *zti, const struct timespec *ts)
+{
+	if (test_bit(ZIO_TI_ARMED_BIT, &zti->ti.flags)) {
+		atomic_inc(&zti->busy);
+		return;
+	}
+	zio_arm_trigger_ts(&zti->ti, ts);
+}
+
+/*
+ * The hard handler only does counter and clock work before deciding.
+ * Decimation is checked first, as it costs no clock read; an irq that
+ * passes decimation but falls within min-interval-ns restarts the count.
+ */
 static irqreturn_t zti_handler(int irq, void *dev_id)
 {
-	struct zio_ti *ti = dev_id;
+	struct zti_instance *zti = dev_id;
+	struct timespec ts;
+	uint64_t min_ns, now;
+
+	if (++zti->count < READ_ONCE(zti->decimation)) {
+		zti->decimated++;
+		return IRQ_HANDLED;
+	}
+	zti->count = 0;
+
+	min_ns = READ_ONCE(zti->min_ns);
+	if (min_ns) {
+		now = ktime_to_ns(ktime_get());
+		if (now - zti->last_ns < min_ns) {
+			zti->suppressed++;
+			return IRQ_HANDLED;
+		}
+		zti->last_ns = now;
+	}
+
+	if (!READ_ONCE(zti->threaded)) {
+		zti_arm(zti, NULL);
+		return IRQ_HANDLED;
+	}
+
+	/* Single producer (this handler) and consumer (the thread) */
+	getnstimeofday(&ts);
+	if (!kfifo_in(&zti->fifo, &ts, 1))
+		zti->fifo_lost++;
+	return IRQ_WAKE_THREAD;
+}
+
+/* Arm with the stamp taken in hard-irq context, not the current time */
+static irqreturn_t zti_thread(int irq, void *dev_id)
+{
+	struct zti_instance *zti = dev_id;
+	struct timespec ts;
 
-	zio_arm_trigger(ti);
+	while (kfifo_out(&zti->fifo, &ts, 1))
+		zti_arm(zti, &ts);
 	return IRQ_HANDLED;
 }
 
@@ -78,6 +213,7 @@ static struct zio_ti *zti_create(struct zio_trigger_type *trig,
 				 struct zio_cset *cset,
 				 struct zio_control *ctrl, fmode_t flags)
 {
+	struct zti_instance *zti;
 	struct zio_ti *ti;
 	int edges[] = {
 		IRQF_TRIGGER_FALLING | IRQF_TRIGGER_RISING,
@@ -89,22 +225,28 @@ static struct zio_ti *zti_create(struct zio_trigger_type *trig,
 
 	pr_debug("%s:%d\n", __func__, __LINE__);
 
-	ti = kzalloc(sizeof(*ti), GFP_ATOMIC);
-	if (!ti)
+	zti = kzalloc(sizeof(*zti), GFP_ATOMIC);
+	if (!zti)
 		return ERR_PTR(-ENOMEM);
+	ti = &zti->ti;
 	ti->flags = ZIO_DISABLED;
 	ti->cset = cset;
 
+	/* Fill own fields: defaults match zti_ext_attr */
+	zti->decimation = 1;
+	INIT_KFIFO(zti->fifo);
+
 	/* Try all edge settings (gpio stuff prefers edges, but pci wants 0) */
 	for (i = 0; i < ARRAY_SIZE(edges); i++) {
-		ret = request_irq(zti_irq, zti_handler, IRQF_SHARED | edges[i],
-			  KBUILD_MODNAME, ti);
+		ret = request_threaded_irq(zti_irq, zti_handler, zti_thread,
+					   IRQF_SHARED | edges[i],
+					   KBUILD_MODNAME, zti);
 		if (ret == -EBUSY)
 			continue;
 		break; /* success or other error */
 	}
 	if (ret < 0) {
-		kfree(ti);
+		kfree(zti);
 		return ERR_PTR(ret);
 	}
 	return ti;
@@ -112,9 +254,11 @@ static struct zio_ti *zti_create(struct zio_trigger_type *trig,
 
 static void zti_destroy(struct zio_ti *ti)
 {
+	struct zti_instance *zti = to_zti_instance(ti);
+
 	pr_debug("%s:%d\n", __func__, __LINE__);
-	free_irq(zti_irq, ti);
-	kfree(ti);
+	free_irq(zti_irq, zti); /* waits for the thread too */
+	kfree(zti);
 }
 
 static const struct zio_trigger_operations zti_trigger_ops = {
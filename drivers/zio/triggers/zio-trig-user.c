@@ -40,20 +40,6 @@ struct zio_sysfs_operations ztu_s_ops = {
 	.conf_set = ztu_conf_set,
 };
 
-/*
- * zio_all_block_ready
- * It returns 1 if all channels have an active_block, otherwise it returns 0
- */
-static inline unsigned int zio_all_block_ready(struct zio_cset *cset)
-{
-	struct zio_channel *chan;
-
-	chan_for_each(chan, cset)
-		if (!chan->active_block)
-			return 0;
-	return 1;
-}
-
 static int ztu_data_done(struct zio_cset *cset)
 {
 	int rearm;
@@ -69,7 +55,7 @@ static int ztu_data_done(struct zio_cset *cset)
 		return 0;
 
 	/* If it is output and all blocks are ready, we must force re-arming */
-	return zio_all_block_ready(cset);
+	return zio_cset_all_ready(cset);
 }
 
 /* The buffer pushes a block if it has none queued and one is written */
@@ -85,7 +71,7 @@ static int ztu_push_block(struct zio_ti *ti, struct zio_channel *chan,
 		return err;
 
 	/* If all enabled channels are ready, tell hardware we are ready */
-	if (zio_all_block_ready(cset))
+	if (zio_cset_all_ready(cset))
 		zio_arm_trigger(ti);
 	return 0;
 }
@@ -2,6 +2,7 @@
 #define ZIO_INTERNAL_H_
 
 #include <linux/version.h>
+#include <linux/idr.h>
 
 #if LINUX_VERSION_CODE > KERNEL_VERSION(2,6,34)
 #define ZIO_HAS_BINARY_CONTROL 1
@@ -16,6 +17,7 @@ extern const struct attribute_group *def_chan_groups_ptr[];
 extern const struct attribute_group *def_ti_groups_ptr[];
 extern const struct attribute_group *def_bi_groups_ptr[];
 extern struct bin_attribute zio_bin_attr[];
+extern struct bin_attribute zio_bin_bulk_attr;
 /* Defined in object.c, used also in bus.c  */
 extern struct device_type zdevhw_device_type;
 extern struct device_type zdev_device_type;
@@ -36,14 +38,14 @@ struct zio_object_list_item {
 struct zio_status {
 	/* a pointer to set up standard ktype with create */
 	struct kobject		*kobj;
-	/* The minor numbers are allocated with the first-fit allocator. */
-	struct zio_ffa		*minors;
+	/* The minor numbers: a range for each cset, with an even base */
+	DECLARE_BITMAP(minors, ZIO_NR_MINORS);
 	struct cdev		chrdev;
 	dev_t			basedev;
 	spinlock_t		lock;
 
-	/* List of cset, used to retrieve a cset from a minor base*/
-	struct list_head	list_cset;
+	/* Channels by minor / 2, for open; lookups are RCU-safe */
+	struct idr		chan_idr;
 
 	/* The three lists of registered devices, with owner module */
 	struct zio_object_list	all_devices;
@@ -56,6 +58,8 @@ extern struct zio_status zio_global_status;
 /* Defined in chardev.c */
 extern int zio_minorbase_get(struct zio_cset *zcset);
 extern void zio_minorbase_put(struct zio_cset *zcset);
+extern int zio_minors_publish(struct zio_cset *zcset);
+extern void zio_minors_unpublish(struct zio_cset *zcset);
 
 extern int zio_register_cdev(void);
 extern void zio_unregister_cdev(void);
@@ -72,6 +76,10 @@ extern void zio_default_buffer_exit(void);
 extern int zio_default_trigger_init(void);
 extern void zio_default_trigger_exit(void);
 
+/* Defined in helpers.c */
+extern void zio_bi_wake_init(struct zio_bi *bi);
+extern void __zio_internal_abort_free(struct zio_cset *cset);
+
 /* Defined in sysfs.c */
 extern void __ctrl_update_nsamples(struct zio_ti *ti);
 extern void __zattr_trig_init_ctrl(struct zio_ti *ti, struct zio_control *ctrl);
@@ -96,5 +104,8 @@ extern void __zdev_unregister(struct zio_device *zdev);
 extern struct zio_device *zio_device_find_child(struct zio_device *parent);
 extern int zio_change_current_trigger(struct zio_cset *cset, char *name);
 extern int zio_change_current_buffer(struct zio_cset *cset, char *name);
+extern void zio_change_lock(void);
+extern int zio_change_lock_sysfs(void);
+extern void zio_change_unlock(void);
 
 #endif /* ZIO_INTERNAL_H_ */
@@ -12,6 +12,8 @@
 #include <linux/list.h>
 #include <linux/spinlock.h>
 #include <linux/wait.h>
+#include <linux/hrtimer.h>
+#include <linux/irq_work.h>
 
 #include <linux/zio.h>
 #include <linux/zio-user.h>
@@ -47,6 +49,18 @@ struct zio_buffer_type {
 
 /* buffer_type->flags */
 #define ZIO_BUF_FLAG_ALLOC_FOPS	0x00000001 /* set by zio-core */
+/*
+ * block->data is a separate allocation, freed with the block whatever its
+ * size: two blocks of this buffer type may exchange their data pointers
+ */
+#define ZIO_BUF_FLAG_SWAP_DATA	0x00000002
+/*
+ * store and retr report the fill level with zio_bi_level_update(). Without
+ * this flag the buffer type must wake up readers on its own, as it did
+ * before: poll(2) then retrieves a block to report readiness, and fill
+ * level, watermarks and wakeup moderation are not available.
+ */
+#define ZIO_BUF_FLAG_LEVEL	0x00000004
 
 extern const struct file_operations zio_generic_file_operations;
 
@@ -58,25 +72,57 @@ void zio_unregister_buf(struct zio_buffer_type *zbuf);
 int zio_slab_init(void);
 void zio_slab_exit(void);
 struct zio_control *zio_alloc_control(gfp_t gfp);
+struct zio_control *zio_alloc_control_node(gfp_t gfp, int node);
 void zio_free_control(struct zio_control *ctrl);
 
 
+/*
+ * What happens when a block does not fit in a full buffer instance.
+ * Input channels default to drop-newest (the new block is lost), output
+ * channels default to block (the writer sleeps or gets EAGAIN).
+ */
+enum zio_bi_policy {
+	ZIO_BI_POLICY_DROP_NEWEST = 0,
+	ZIO_BI_POLICY_DROP_OLDEST,	/* drop down to the low watermark */
+	ZIO_BI_POLICY_BLOCK,		/* output only */
+};
+
+struct eventfd_ctx;
 struct zio_bi {
 	struct zio_obj_head	head;
-	struct list_head	list;		/* instance list */
+
+	/*
+	 * Hot fields, used by store and retr for each block: the ones before
+	 * the lock fill a cache line on 64-bit machines (see core.c)
+	 */
+	const struct zio_buffer_operations	*b_op ____cacheline_aligned_in_smp;
 	struct zio_channel	*chan;
 	struct zio_cset		*cset;		/* short for chan->cset */
+	unsigned long flags;			/* input or output, etc */
+	atomic_t		nblocks;	/* stored, not yet retrieved */
+
+	/* Overflow policy and fill-level notification (see helpers.c) */
+	enum zio_bi_policy	policy;
+	unsigned int		wm_high;	/* blocks, 0 = disabled */
+	unsigned int		wm_low;		/* blocks */
+
+	/* Wakeup moderation for input: N blocks or T usecs, first wins */
+	unsigned int		wake_blocks;	/* 1 = wake on first block */
+	unsigned int		wake_usec;	/* 0 = no time bound */
+	spinlock_t		lock;
 
 	/* Those using generic_read need this information */
-	unsigned long flags;			/* input or output, etc */
 	wait_queue_head_t q;			/* for reading or writing */
-	spinlock_t		lock;
 	atomic_t		use_count;
+	struct eventfd_ctx	*wm_evfd;
+	struct hrtimer		wake_timer;
+	struct irq_work		wake_work;	/* wake on cset cpu-affinity */
+
+	struct list_head	list;		/* instance list */
 
 	/* Standard and extended attributes for this object */
 	struct zio_attribute_set		zattr_set;
 
-	const struct zio_buffer_operations	*b_op;
 	const struct file_operations		*f_op;
 	const struct vm_operations_struct	*v_op;
 };
@@ -88,10 +134,21 @@ enum zio_bi_flag_mask {
 	ZIO_BI_PUSHING = 0x10,	/* a push is being performed */
 	ZIO_BI_NOSPACE = 0x20, /**< No space left in the buffer
 				  (e.g. buffer is full ) */
+	ZIO_BI_WM_HIGH = 0x40, /**< fill level reached the high watermark
+				  and did not go back to the low one */
 	/* Configuration */
-	ZIO_BI_PREF_NEW = 0x100, /**< prefer new blocks instead old ones */
+	ZIO_BI_PREF_NEW = 0x100, /**< prefer new blocks instead old ones:
+				   an alias for ZIO_BI_POLICY_DROP_OLDEST */
+	ZIO_BI_NO_LEVEL = 0x200, /**< the buffer type doesn't report its
+				   fill level (no ZIO_BUF_FLAG_LEVEL) */
 };
 
+static inline int zio_bi_drops_oldest(struct zio_bi *bi)
+{
+	return bi->policy == ZIO_BI_POLICY_DROP_OLDEST ||
+		(bi->flags & ZIO_BI_PREF_NEW);
+}
+
 /**
  * This helper returns the value of a sysfs attribute of a buffer instance
  */
@@ -101,6 +158,32 @@ static inline uint32_t zio_bi_std_val(struct zio_bi *bi,
 	return bi->zattr_set.std_zattr[attr].value;
 }
 
+/*
+ * The data area of a buffer instance, for users that map it once instead
+ * of mapping each block, e.g. for DMA with zio_dma_area_map(). Buffer
+ * types whose blocks live in one area may offer area_get and area_put.
+ *
+ * area_get pins the area new blocks come from: it stays allocated until
+ * area_put, even if the instance is destroyed meanwhile, and later blocks
+ * start at a multiple of "align". When the area stops being the current
+ * one (the buffer is resized, released when idle, or destroyed) the
+ * buffer calls invalidate, with a spinlock held: the user must not sleep
+ * nor call area_put from there, but should schedule it, once it stopped
+ * using the area. area_get can sleep; area_put can be called in any
+ * context. The user sets align, invalidate and priv, the buffer the rest.
+ */
+struct zio_bi_area {
+	void			*data;
+	size_t			size;
+	size_t			align;		/* power of 2, or 0 */
+	void			(*invalidate)(struct zio_bi_area *ba);
+	void			*priv;		/* for the user */
+
+	const struct zio_buffer_operations	*b_op;
+	void			*buf_priv;	/* for the buffer */
+	struct list_head	list;		/* for the buffer */
+};
+
 /*
  * Each buffer implementation must provide the following methods, because
  * internal management of individual data instances is left to each of them.
@@ -135,6 +218,11 @@ struct zio_buffer_operations {
 	struct zio_bi *		(*create)(struct zio_buffer_type *zbuf,
 					  struct zio_channel *chan);
 	void			(*destroy)(struct zio_bi *bi);
+
+	/* Optional, see struct zio_bi_area above */
+	int			(*area_get)(struct zio_bi *bi,
+					    struct zio_bi_area *ba);
+	void			(*area_put)(struct zio_bi_area *ba);
 };
 
 /*
@@ -147,10 +235,36 @@ enum zio_cdev_type {
 };
 struct zio_f_priv {
 	struct zio_channel *chan; /* where current block and buffer live */
+	struct zio_bi *bi;	/* instance in use, may be a replaced one */
 	enum zio_cdev_type type;
+	unsigned int busy_poll_usec; /* spin before sleeping (0 = never) */
+	unsigned int poll_pull;	/* poll(2) may retrieve, and thus pull */
 };
 
-/* Buffer helpers */
+/*
+ * Buffer helpers; store and retr should update the level, poll relies on
+ * it (see ZIO_BUF_FLAG_LEVEL)
+ */
+void zio_bi_level_update(struct zio_bi *bi, int delta);
+void zio_bi_wake_full(struct zio_bi *bi);
+int zio_buffer_drop_oldest(struct zio_bi *bi);
+/* Take and release chan->user_block (mode is TASK_[UN]INTERRUPTIBLE) */
+int zio_user_block_get(struct zio_channel *chan, unsigned int mode);
+void zio_user_block_put(struct zio_channel *chan);
+
+static inline int zio_bi_area_get(struct zio_bi *bi, struct zio_bi_area *ba)
+{
+	if (!bi->b_op->area_get)
+		return -EOPNOTSUPP;
+	ba->b_op = bi->b_op;
+	return bi->b_op->area_get(bi, ba);
+}
+
+static inline void zio_bi_area_put(struct zio_bi_area *ba)
+{
+	ba->b_op->area_put(ba);
+}
+
 static inline struct zio_block *zio_buffer_retr_block(struct zio_bi *bi)
 {
 	if (unlikely(bi->flags & ZIO_DISABLED)) {
@@ -200,12 +314,9 @@ static inline struct zio_block *zio_buffer_alloc_block(struct zio_bi *bi,
 	block = bi->b_op->alloc_block(bi, datalen, gfp);
 	if (!block && (bi->flags & ZIO_BI_NOSPACE)) {
 		/* We cannot allocate because the buffer is full */
-		if (bi->flags & ZIO_BI_PREF_NEW) {
-			/* try by removing the oldest block */
-			block = bi->b_op->retr_block(bi);
-			bi->b_op->free_block(bi, block);
+		zio_bi_wake_full(bi);
+		if (zio_bi_drops_oldest(bi) && zio_buffer_drop_oldest(bi))
 			block = bi->b_op->alloc_block(bi, datalen, gfp);
-		}
 		/*
 		 * NOTE: with this kind of management we'll have problem with
 		 * SELF_TIMED device because they are going to arm as soon as
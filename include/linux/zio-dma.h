@@ -9,62 +9,340 @@
 #define ZIO_HELPERS_H_
 
 #include <linux/zio.h>
+#include <linux/zio-buffer.h>
 #include <linux/scatterlist.h>
+#include <linux/dma-mapping.h>
+#include <linux/dmapool.h>
+#include <linux/workqueue.h>
 
 /**
  * It describe a zio block to be mapped with sg
  * @block: is the block to map
  * @first_nent: it tells the index of the first DMA transfer corresponding to
  *              the start of this block
+ * @first_desc: index of the first descriptor of this block, once mapped
  * @dev_mem_off: device memory offset where retrieve data for this block
+ * @chan: the channel of the block (only used by zio_dma_async)
  */
 struct zio_blocks_sg {
 	struct zio_block *block;
 	unsigned int first_nent;
+	unsigned int first_desc;
 	unsigned long dev_mem_off;
+	struct zio_channel *chan;
 };
 
 /**
  * it describes the DMA sg mapping
  * @hwdev: the low level driver which will do DMA
+ * @dir: direction of data transfers (DMA_FROM_DEVICE after allocation)
  * @sg_blocks: one or more blocks to map
  * @n_blocks: number of blocks to map
- * @sgt: scatter gather table
+ * @sgt: scatter gather table (physically contiguous pages are merged)
  * @page_desc_size: size of the transfer descriptor
- * @page_desc_pool: vector of transfer descriptors
- * @dma_page_desc_pool: dma address of the vector of transfer descriptors
+ * @pool: coherent pool of the descriptors, see zio_dma_pool_init (or NULL)
+ * @n_desc: number of filled descriptors, one per mapped segment
+ * @page_desc: transfer descriptors (contiguous only if pool is NULL)
+ * @dma_page_desc: dma address of each transfer descriptor
+ * @page_desc_pool: the first transfer descriptor (all of them, if pool
+ *                  is NULL)
+ * @dma_page_desc_pool: dma address of the first transfer descriptor
+ * @priv: for the fill_desc callback
  */
 struct zio_dma_sgt {
 	struct zio_channel *chan;
 	struct device *hwdev;
+	enum dma_data_direction dir;
 	struct zio_blocks_sg *sg_blocks;
 	unsigned int n_blocks;
 	struct sg_table sgt;
 	size_t page_desc_size;
+	struct dma_pool *pool;
+	unsigned int n_desc;
+	void **page_desc;
+	dma_addr_t *dma_page_desc;
+	void *page_desc_pool;
+	dma_addr_t dma_page_desc_pool;
+	void *priv;
+};
+
+struct zio_dma_sg;
+
+/**
+ * It describes a persistent DMA mapping of a memory area (for example the
+ * data area of a buffer instance), built once and reused for every block
+ * @hwdev: the low level device which will do DMA
+ * @buf: the area, in lowmem or vmalloc space
+ * @size: size of the area
+ * @slot: segments are split at multiples of it (0 if not)
+ * @dir: direction of data transfers
+ * @flags: ZIO_DMA_AREA_REFILL if descriptors depend on where the slice
+ *         starts (see zio_dma_sg), so each slice rewrites all of them
+ * @sgt: scatter gather table (physically contiguous pages are merged)
+ * @n_seg: number of mapped segments (each with its own descriptor)
+ * @seg_off: offset of each segment in the area (and the size, at n_seg)
+ * @seg_addr: bus address of each segment
+ * @seg_sg: first scatterlist entry of each segment, for dma_sync_sg
+ * @seg_ent: index of that entry (and the number of entries, at n_seg)
+ * @lock: protects the busy bitmap
+ * @busy: descriptors owned by a slice in flight
+ * @dirty: descriptors not holding their whole-segment content
+ * @page_desc_size: size of the transfer descriptor
+ * @pool: coherent pool of the descriptors, see zio_dma_pool_init (or NULL)
+ * @page_desc: transfer descriptors, one per segment
+ * @dma_page_desc: dma address of each transfer descriptor
+ * @page_desc_pool: the first transfer descriptor
+ * @dma_page_desc_pool: dma address of the first transfer descriptor
+ * @fill_desc: driver callback, see zio_dma_map_sg
+ * @priv: for the driver callback
+ */
+struct zio_dma_area {
+	struct device *hwdev;
+	void *buf;
+	size_t size;
+	size_t slot;
+	enum dma_data_direction dir;
+	unsigned long flags;
+	struct sg_table sgt;
+	unsigned int n_seg;
+	unsigned long *seg_off;
+	dma_addr_t *seg_addr;
+	struct scatterlist **seg_sg;
+	unsigned int *seg_ent;
+	spinlock_t lock;
+	unsigned long *busy;
+	unsigned long *dirty;
+	size_t page_desc_size;
+	struct dma_pool *pool;
+	void **page_desc;
+	dma_addr_t *dma_page_desc;
 	void *page_desc_pool;
 	dma_addr_t dma_page_desc_pool;
+	int (*fill_desc)(struct zio_dma_sg *zsg);
+	void *priv;
+};
+#define ZIO_DMA_AREA_REFILL	0x1
+
+/**
+ * It describes a transfer within a persistent mapping
+ * @offset: offset of the transfer in the area
+ * @len: length of the transfer
+ * @first_desc: index of the first descriptor of the transfer
+ * @n_desc: number of descriptors of the transfer
+ * @dma_desc: dma address of the first descriptor
+ */
+struct zio_dma_slice {
+	unsigned long offset;
+	size_t len;
+	unsigned int first_desc;
+	unsigned int n_desc;
+	dma_addr_t dma_desc;
 };
 
 /**
  * It describes the current page-mapping
- * @zsgt: link to the generic descriptor
- * @sg: scatterlist of the current page
- * @dev_mem_off: device memory offset where start I/O
+ * @zsgt: link to the generic descriptor (NULL for a zio_dma_area)
+ * @area: link to the persistent mapping (NULL for a zio_dma_sgt)
+ * @sg: mapped scatterlist entry of this transfer (NULL for a zio_dma_area)
+ * @dma_addr: bus address of this transfer
+ * @len: length of this transfer
+ * @dev_mem_off: device memory offset where start I/O (for a zio_dma_area:
+ *               the offset of this transfer in the area)
+ * @slice_off: for a zio_dma_area, offset of the slice being prepared (0
+ *             when the area is mapped)
  * @page_desc: private structure describing the HW page-mapping
+ * @dma_page_desc: dma address of page_desc
+ * @dma_next_desc: dma address of the next descriptor (0 for the last one),
+ *                 to chain them: they are not contiguous in memory
  * @block_idx: index of the last mapped block
- * @page_idx: index of the last mapped page
+ * @page_idx: index of the last mapped page (or of the descriptor)
+ * @flags: ZIO_DMA_SG_FIRST and ZIO_DMA_SG_LAST, for a zio_dma_area
  */
 struct zio_dma_sg {
 	struct zio_dma_sgt *zsgt;
+	struct zio_dma_area *area;
 	struct scatterlist *sg;
 
+	dma_addr_t dma_addr;
+	unsigned int len;
 	uint32_t dev_mem_off;
+	unsigned long slice_off;
 	void *page_desc;
+	dma_addr_t dma_page_desc;
+	dma_addr_t dma_next_desc;
 
 	unsigned int block_idx;
 	unsigned int page_idx;
+	unsigned long flags;
 };
+#define ZIO_DMA_SG_FIRST	0x1 /* first descriptor of a slice */
+#define ZIO_DMA_SG_LAST		0x2 /* last descriptor of a slice */
+
+struct zio_dma_async;
+struct zio_dma_async_xfer;
 
+/**
+ * Driver operations of an asynchronous DMA engine
+ * @fill_desc: fill a transfer descriptor, as for zio_dma_map_sg; the
+ *             engine sets dev_mem_off from the operation below, and
+ *             flags tell the first and last descriptor of each block
+ * @dev_mem_off: device memory offset of the data of a channel (optional)
+ * @start: start a transfer, or queue it after the one in progress.
+ *         It runs in atomic context and must not complete the transfer
+ *         itself: the completion is reported later, with the cookie, by
+ *         zio_dma_async_done()
+ * @stop: halt the device, dropping both the running and the queued
+ *        transfer: when it returns the device must not access them any
+ *        more. It runs in process context and can sleep
+ *        (e.g. dmaengine_terminate_sync)
+ */
+struct zio_dma_async_ops {
+	int (*fill_desc)(struct zio_dma_sg *zsg);
+	unsigned long (*dev_mem_off)(struct zio_dma_async *za,
+				     unsigned int chan);
+	int (*start)(struct zio_dma_async *za, struct zio_dma_async_xfer *x);
+	void (*stop)(struct zio_dma_async *za);
+};
+
+/**
+ * The binding of a channel: the engine holds its buffer instance, to
+ * allocate the blocks of queued transfers, and the persistent mapping
+ * of its data area if the buffer exposes it (see zio_bi_area_get)
+ * @za: the engine
+ * @chan: index of the channel
+ * @bi: the buffer instance, held (NULL if not bound)
+ * @owner: the module of the buffer type, held
+ * @ba: the pinned data area, if area is not NULL
+ * @area: persistent mapping of the data area, or NULL
+ * @users: blocks of transfers which use the binding
+ * @stale: the area was replaced, or the channel has another buffer
+ *         instance: the binding is released when unused
+ */
+struct zio_dma_async_bind {
+	struct zio_dma_async *za;
+	unsigned int chan;
+	struct zio_bi *bi;
+	struct module *owner;
+	struct zio_bi_area ba;
+	struct zio_dma_area *area;
+	unsigned int users;
+	int stale;
+};
+
+/**
+ * A block of a transfer of the asynchronous DMA engine
+ * @block: the block, NULL for channels not transferred
+ * @len: its length
+ * @bind: the binding it uses (slice in its area, or block from its
+ *        buffer instance), or NULL
+ * @area: the mapping the slice belongs to, or NULL if the block is
+ *        mapped in the scatter-gather table of the transfer
+ * @slice: its descriptors; for a block in the table offset is 0
+ * @page_desc: the descriptors, from first_desc on (n_desc of them)
+ * @dma_page_desc: their dma addresses
+ * @spare: the block of the trigger a claim replaced, owned
+ * @bi: the buffer instance of owned blocks, to free them
+ * @owner: the module of its buffer type, if held
+ * @owned: the engine frees the block (it is not an active block)
+ * @held: the engine holds bi and its module (detached active block)
+ */
+struct zio_dma_async_blk {
+	struct zio_block *block;
+	size_t len;
+	struct zio_dma_async_bind *bind;
+	struct zio_dma_area *area;
+	struct zio_dma_slice slice;
+	void **page_desc;
+	dma_addr_t *dma_page_desc;
+	struct zio_block *spare;
+	struct zio_bi *bi;
+	struct module *owner;
+	int owned;
+	int held;
+};
+
+/**
+ * A transfer of the asynchronous DMA engine: the blocks themselves are
+ * mapped, with a slice of the area of their buffer instance or in a
+ * scatter-gather table mapped for the transfer
+ * @blk: one per channel
+ * @sgt: the blocks mapped for this transfer only, or NULL
+ * @sg_blocks: scratch vector of the blocks to map
+ * @cookie: identifier of the transfer for the driver
+ * @state: ZIO_DMA_XFER_IDLE, _PREPARING (being mapped, with the engine
+ *         unlocked), _RUNNING, _DONE (being completed) or _STOPPED
+ *         (waiting for the driver stop operation)
+ * @claimed: the trigger waits for it (else it is a prefetch, and the
+ *           engine owns its blocks)
+ * @cancelled: a prefetch the trigger gave up while it was prepared
+ */
+struct zio_dma_async_xfer {
+	struct zio_dma_async_blk *blk;
+	struct zio_dma_sgt *sgt;
+	struct zio_block **sg_blocks;
+	uint32_t cookie;
+	int state;
+	int claimed;
+	int cancelled;
+};
+#define ZIO_DMA_XFER_IDLE	0
+#define ZIO_DMA_XFER_RUNNING	1
+#define ZIO_DMA_XFER_DONE	2
+#define ZIO_DMA_XFER_STOPPED	3
+#define ZIO_DMA_XFER_PREPARING	4
+
+/**
+ * It describes the asynchronous DMA engine of a cset: raw_io starts a
+ * transfer to or from the active blocks, the completion calls data_done
+ * @cset: the cset, as last passed to zio_dma_async_raw_io
+ * @hwdev: the low level device which will do DMA
+ * @ops: driver operations
+ * @page_desc_size: size of the transfer descriptor
+ * @n_chan: number of channels of the cset
+ * @dir: direction of data transfers
+ * @bind: the binding of each channel
+ * @bind_work: binds the channels and releases stale bindings
+ * @flags: ZIO_DMA_ASYNC_PINGPONG to queue the next transfer in advance,
+ *         ZIO_DMA_ASYNC_MAP_SG to map the blocks of each transfer with
+ *         zio_dma_map_sg, never through the area of the buffer
+ * @lock: protects the transfers and the bindings
+ * @xfer: the two transfers
+ * @cur: the transfer in progress
+ * @next: the transfer queued after it
+ * @stop_work: calls the stop operation after stop_io
+ * @stops: incremented by each stop, for transfers being prepared
+ * @cookie: the last cookie assigned
+ * @dropped: queued transfers which completed before the trigger claimed
+ *           them (their data is lost)
+ * @priv: for the driver
+ */
+struct zio_dma_async {
+	struct zio_cset *cset;
+	struct device *hwdev;
+	const struct zio_dma_async_ops *ops;
+	size_t page_desc_size;
+	unsigned int n_chan;
+	enum dma_data_direction dir;
+	struct zio_dma_async_bind *bind;
+	struct work_struct bind_work;
+	unsigned long flags;
+	spinlock_t lock;
+	struct zio_dma_async_xfer xfer[2];
+	struct zio_dma_async_xfer *cur;
+	struct zio_dma_async_xfer *next;
+	struct work_struct stop_work;
+	unsigned int stops;
+	uint32_t cookie;
+	unsigned long dropped;
+	void *priv;
+};
+#define ZIO_DMA_ASYNC_PINGPONG	0x1
+#define ZIO_DMA_ASYNC_DEAD	0x2 /* set by zio_dma_async_exit */
+#define ZIO_DMA_ASYNC_STOPPING	0x4 /* stop_work is pending */
+#define ZIO_DMA_ASYNC_MAP_SG	0x8
+
+extern int zio_dma_pool_init(struct device *hwdev, size_t page_desc_size,
+			     size_t align);
 extern struct zio_dma_sgt *zio_dma_alloc_sg(struct zio_channel *chan,
 					    struct device *hwdev,
 					    struct zio_block **blocks,
@@ -75,4 +353,34 @@ extern int zio_dma_map_sg(struct zio_dma_sgt *zdma, size_t page_desc_size,
 			  int (*fill_desc)(struct zio_dma_sg *zsg));
 extern void zio_dma_unmap_sg(struct zio_dma_sgt *zdma);
 
+extern struct zio_dma_area *zio_dma_area_map(struct device *hwdev, void *buf,
+					     size_t size, size_t slot,
+					     enum dma_data_direction dir,
+					     size_t page_desc_size,
+					     int (*fill_desc)(struct zio_dma_sg *zsg),
+					     void *priv);
+extern void zio_dma_area_unmap(struct zio_dma_area *area);
+extern int zio_dma_slice_prepare(struct zio_dma_area *area,
+				 unsigned long offset, size_t len,
+				 struct zio_dma_slice *slice);
+extern void zio_dma_slice_complete(struct zio_dma_area *area,
+				   struct zio_dma_slice *slice);
+extern int zio_dma_block_prepare(struct zio_dma_area *area,
+				 struct zio_block *block,
+				 struct zio_dma_slice *slice);
+
+extern int zio_dma_async_init(struct zio_dma_async *za,
+			      struct device *hwdev,
+			      const struct zio_dma_async_ops *ops,
+			      size_t page_desc_size, unsigned int n_chan,
+			      enum dma_data_direction dir,
+			      unsigned long flags);
+extern int zio_dma_async_raw_io(struct zio_dma_async *za,
+				struct zio_cset *cset);
+extern void zio_dma_async_done(struct zio_dma_async *za, uint32_t cookie,
+			       int err);
+extern void zio_dma_async_stop_io(struct zio_dma_async *za,
+				  struct zio_cset *cset);
+extern void zio_dma_async_exit(struct zio_dma_async *za);
+
 #endif /* ZIO_HELPERS_H_ */
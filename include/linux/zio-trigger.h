@@ -3,6 +3,7 @@
 #define __ZIO_TRIGGER_H__
 
 #include <linux/delay.h>
+#include <linux/bitmap.h>
 #include <linux/zio.h>
 #include <linux/zio-buffer.h>
 
@@ -45,10 +46,14 @@ struct zio_ti {
 	const struct zio_trigger_operations	*t_op;
 };
 
-/* first 4bit are reserved for zio object universal flags */
+/*
+ * first 4bit are reserved for zio object universal flags. The trigger
+ * flags change with atomic bit operations: arming takes no lock
+ */
 enum zio_ti_flag_mask {
 	ZIO_TI_ARMED = 0x10,		/* trigger is armed, device rules */
 };
+#define ZIO_TI_ARMED_BIT	4
 
 #define to_zio_ti(obj) container_of(obj, struct zio_ti, head.dev)
 
@@ -62,6 +67,7 @@ static inline uint32_t zio_ti_std_val(struct zio_ti *ti,
 }
 
 void zio_arm_trigger(struct zio_ti *ti);
+void zio_arm_trigger_ts(struct zio_ti *ti, const struct timespec *ts);
 
 /*
  * When a buffer has a complete block of data, it can send it to the trigger
@@ -129,14 +135,17 @@ int __zio_trigger_abort_disable(struct zio_cset *cset, int disable);
 int zio_generic_push_block(struct zio_ti *ti,struct zio_channel *chan,
 			   struct zio_block *block);
 
-/* This can only be called in non-atomic context */
+/*
+ * This can only be called in non-atomic context: if the hardware is busy
+ * it sleeps until the driver calls zio_cset_busy_clear()
+ */
 static inline int zio_trigger_abort_disable(struct zio_cset *cset, int disable)
 {
 	int ret;
 	do {
 		ret = __zio_trigger_abort_disable(cset, disable);
 		if (ret == -EAGAIN)
-			msleep(1);
+			wait_for_completion(&cset->hw_idle);
 	} while (ret == -EAGAIN);
 	return ret;
 }
@@ -172,7 +181,7 @@ static inline int zio_generic_data_done(struct zio_cset *cset)
 		ctrl = chan->current_ctrl;
 
 		/* Remove the block from active block */
-		chan->active_block = NULL;
+		zio_chan_set_active(chan, NULL);
 
 		/* Update the current control: sequence and timestamp */
 		ctrl->seq_num++;
@@ -198,11 +207,29 @@ static inline int zio_generic_data_done(struct zio_cset *cset)
 
 	/* Only for output: prepare the next event if any is ready */
 	chan_for_each(chan, cset)
-		chan->active_block = zio_buffer_retr_block(chan->bi);
+		zio_chan_set_active(chan, zio_buffer_retr_block(chan->bi));
 
 	return (self_timed ? 1 : 0);
 }
 
+/*
+ * Whether all enabled channels have an active block (used for output).
+ * The ready bitmap answers "no" in constant time, the common case while
+ * blocks are being pushed; a "yes" is confirmed on the channels, because
+ * drivers may clear active_block without zio_chan_set_active().
+ */
+static inline int zio_cset_all_ready(struct zio_cset *cset)
+{
+	struct zio_channel *chan;
+
+	if (!bitmap_subset(cset->chan_enabled, cset->chan_ready, cset->n_chan))
+		return 0;
+	chan_for_each(chan, cset)
+		if (!chan->active_block)
+			return 0;
+	return 1;
+}
+
 /**
  * This helper try to push a block to the trigger
  */
@@ -210,17 +237,21 @@ static inline int zio_trigger_try_push(struct zio_bi *bi,
 				       struct zio_channel *chan,
 				       struct zio_block *block)
 {
-	struct zio_ti *ti = chan->cset->ti;
-	int pushed;
+	struct zio_ti *ti;
+	int pushed = 0;
 
+	rcu_read_lock();
+	ti = zio_cset_ti(chan->cset);
 	/* chek if trigger is disabled */
 	if (unlikely((ti->flags & ZIO_STATUS) == ZIO_DISABLED))
-		return 0;
+		goto out;
 
 	/* Keep the lock, but mark we are pushing so trigger-user won't retr */
 	bi->flags |= ZIO_BI_PUSHING;
 	pushed = (ti->t_op->push_block(ti, chan, block) == 0);
 	bi->flags &=  ~ZIO_BI_PUSHING;
+out:
+	rcu_read_unlock();
 	return pushed;
 }
 
@@ -8,6 +8,8 @@
 #ifndef __ZIO_USER_H__
 #define __ZIO_USER_H__
 
+#include <linux/ioctl.h>
+
 #define ZIO_VERSION(M, m, p) (((M & 0xFF) << 24) | ((m & 0xFF) << 16) | (p & 0xFFFF))
 
 static inline uint8_t zio_version_major(uint32_t version)
@@ -189,7 +191,7 @@ struct zio_control {
 
 	/* byte 72 */
 	uint32_t mem_offset;	/* position in mmap buffer of this block */
-	uint32_t reserved;	/* possibly another offset, or space for 64b */
+	uint32_t reserved;	/* buffer-specific: the vmalloc area id */
 	uint32_t flags;		/* endianness etc, see below */
 
 	/* byte 84 */
@@ -214,6 +216,21 @@ struct zio_control {
 
 #define ZIO_CONTROL_INTERLEAVE_DATA	0x00000040 /* for interleaved data */
 
+/*
+ * Bulk configuration of a cset, written at once to its "bulk-config"
+ * binary attribute instead of one sysfs file per attribute. Masks and
+ * indexes are the ones of the control: attributes of the device, of the
+ * cset and of the channels (applied to all channels) end up together in
+ * attr_channel, those of the trigger in attr_trigger. Reading the file
+ * returns the resulting control of the first channel.
+ */
+struct zio_bulk_config {
+	struct zio_ctrl_attr dev;
+	struct zio_ctrl_attr cset;
+	struct zio_ctrl_attr chan;
+	struct zio_ctrl_attr trig;
+};
+
 #ifdef __KERNEL__
 /*
  * Compile-time check that the control structure is the right size.
@@ -227,6 +244,84 @@ static inline void __unused_check_size(void)
 
 #endif /* __KERNEL__ */
 
+/*
+ * ioctl commands for the char devices of a channel. Numbers below 0x40
+ * are handled by the generic file operations, so every buffer using them
+ * supports them; the other ones are only supported by the buffer types
+ * documented to support them, and the others return ENOTTY.
+ */
+#define ZIO_IOC_MAGIC	'Z'
+
+/*
+ * Watermark notifications: the argument is an eventfd file descriptor,
+ * signalled when the fill level of the buffer instance crosses the
+ * high-watermark (going up) or the low-watermark (going down). A
+ * negative descriptor detaches the current eventfd.
+ */
+#define ZIO_IOC_WM_EVENTFD	_IO(ZIO_IOC_MAGIC, 0x01)
+
+/*
+ * Busy polling, for input: read(2) and poll(2) on this file spin on the
+ * buffer for up to the given number of microseconds before sleeping.
+ * The setting belongs to the file, 0 (default) disables it.
+ */
+#define ZIO_IOC_BUSY_POLL	_IO(ZIO_IOC_MAGIC, 0x02)
+#define ZIO_BUSY_POLL_MAX_USEC	1000000
+
+/*
+ * Input poll(2) only looks at the buffer fill level, so it never arms
+ * the trigger. With a non-zero argument poll(2) on this file retrieves a
+ * block when none is ready, asking the trigger to pull data like read(2)
+ * does. The setting belongs to the file, 0 (default) disables it.
+ */
+#define ZIO_IOC_POLL_PULL	_IO(ZIO_IOC_MAGIC, 0x03)
+
+/*
+ * The "usermem" buffer stores blocks in memory provided by user space.
+ * The region is registered (and its pages pinned) on either char device
+ * of the channel, and mem_offset in each control is relative to addr.
+ * The region is released when the file used to register it is closed.
+ */
+struct zio_umem_region {
+	uint64_t addr;		/* virtual address in the calling process */
+	uint64_t size;		/* bytes, at most 4GB (mem_offset is 32 bits) */
+};
+
+#define ZIO_IOC_UMEM_REGISTER	_IOW(ZIO_IOC_MAGIC, 0x40, \
+				     struct zio_umem_region)
+#define ZIO_IOC_UMEM_UNREGISTER	_IO(ZIO_IOC_MAGIC, 0x41)
+
+/*
+ * ioctl commands for /dev/zio-sniff.ctrl. Each open file has its own
+ * ring of controls: when it is full new controls are lost, and the next
+ * one returned carries ZIO_ALARM_LOST_SNIFF. The filter selects which
+ * controls enter the ring: an empty devname and the "any" values match
+ * everything, and if any alarm mask is set at least one of those alarms
+ * must be set in the control. A NULL argument removes the filter.
+ * Changing the depth (a number of controls, rounded up to a power of
+ * two) discards the controls not read yet. Each control takes about
+ * 512 bytes of kernel memory: above ZIO_SNIFF_DEPTH_USER, CAP_SYS_ADMIN
+ * is needed.
+ */
+struct zio_sniff_filter {
+	char devname[ZIO_OBJ_NAME_LEN];
+	uint32_t dev_id;	/* ZIO_SNIFF_ANY_ID: any */
+	uint16_t cset;		/* ZIO_SNIFF_ANY: any */
+	uint16_t chan;		/* ZIO_SNIFF_ANY: any */
+	uint8_t zio_alarms;
+	uint8_t drv_alarms;
+	uint16_t filler;
+};
+#define ZIO_SNIFF_ANY		0xffff
+#define ZIO_SNIFF_ANY_ID	0xffffffff
+
+#define ZIO_SNIFF_IOC_FILTER	_IOW(ZIO_IOC_MAGIC, 0x80, \
+				     struct zio_sniff_filter)
+#define ZIO_SNIFF_IOC_DEPTH	_IO(ZIO_IOC_MAGIC, 0x81)
+#define ZIO_SNIFF_DEPTH_DEFAULT	1024
+#define ZIO_SNIFF_DEPTH_USER	4096
+#define ZIO_SNIFF_DEPTH_MAX	65536
+
 /* Device type names */
 #define zdevhw_device_type_name "zio_hw_type"
 #define zdev_device_type_name "zio_zdev_type"
@@ -23,6 +23,11 @@ extern const uint32_t zio_version;
 #include <linux/list.h>
 #include <linux/string.h>
 #include <linux/spinlock.h>
+#include <linux/bitops.h>
+#include <linux/cache.h>
+#include <linux/cpumask.h>
+#include <linux/completion.h>
+#include <linux/rcupdate.h>
 
 #include <linux/zio-sysfs.h>
 
@@ -99,6 +104,8 @@ enum zio_obj_flags {
 	ZIO_DIR_INPUT		= 0x0,
 	ZIO_DIR_OUTPUT		= 0x2,
 };
+/* Bit number of ZIO_STATUS, for atomic bit operations on the flags */
+#define ZIO_STATUS_BIT		0
 
 /*
  * zio_device_id -- struct use to match driver with device
@@ -157,31 +164,37 @@ struct zio_device *zio_find_device(char *name, uint32_t dev_id);
  */
 struct zio_cset {
 	struct zio_obj_head	head;
+
+	/* Hot fields, used at each trigger event: keep them in one line */
+	struct zio_ti		*ti ____cacheline_aligned_in_smp;
+	/* The cset is an array of channels */
+	struct zio_channel	*chan;
+	unsigned int		n_chan;
+	unsigned		ssize;		/* sample size (bytes) */
+	unsigned long		flags;
+	unsigned long		*chan_enabled;	/* bitmap, for chan_for_each */
+	unsigned long		*chan_ready;	/* bitmap, active_block set */
+	int			(*raw_io)(struct zio_cset *cset);
+	void			(*stop_io)(struct zio_cset *cset);
+
 	struct zio_device	*zdev;		/* parent zio device */
 	struct zio_buffer_type	*zbuf;		/* buffer type for bi */
 	struct zio_trigger_type *trig;		/* trigger type for ti*/
-	struct zio_ti		*ti;		/* trigger instance */
-	int			(*raw_io)(struct zio_cset *cset);
-	void			(*stop_io)(struct zio_cset *cset);
 	void			(*change_flags)(struct zio_obj_head *head,
 						unsigned long mask);
 	spinlock_t		lock;		 /* for flags and triggers */
 
-	unsigned		ssize;		/* sample size (bytes) */
 	unsigned		index;		/* index within parent */
-	unsigned long		flags;
 	struct zio_attribute_set zattr_set;
 
 	struct zio_channel	*chan_template;
 	/* Interleaved channel template */
 	struct zio_channel	*interleave;
-	/* The cset is an array of channels */
-	struct zio_channel	*chan;
-	unsigned int		n_chan;
 
 	void			*priv_d;	/* private for the device */
 
-	struct list_head	list_cset;	/* for cset global list */
+	cpumask_var_t		cpu_affinity;	/* reader wakeups, if not empty */
+	struct completion	hw_idle;	/* completed when HW_BUSY clears */
 	int			minor, maxminor;
 	char			*default_zbuf;
 	char			*default_trig;
@@ -200,9 +213,30 @@ enum zio_cset_flags {
 	ZIO_CSET_SELF_TIMED	= 0x100, /* for trigger use (see docs) */
 	ZIO_CSET_CHAN_INTERLEAVE= 0x200, /* 1 if cset can interleave */
 	ZIO_CSET_INTERLEAVE_ONLY= 0x400, /* 1 if interleave only */
-	ZIO_CSET_HW_BUSY	= 0x800, /* set by driver, delays abort */
+	ZIO_CSET_HW_BUSY	= 0x800, /* set by driver, delays abort (atomic) */
+	ZIO_CSET_FEW_UEVENTS	= 0x1000, /* one uevent for all the channels */
 };
 
+/*
+ * Buffers allocate blocks, controls and areas on the node of the cset
+ * device: by default it is the node of the parent device, and it can be
+ * changed in sysfs ("numa-node") before the buffer is allocated.
+ */
+static inline int zio_cset_node(struct zio_cset *cset)
+{
+	return dev_to_node(&cset->head.dev);
+}
+
+/*
+ * The trigger instance can be replaced while the cset runs: it is
+ * published under cset->lock, and released after a grace period. Users
+ * not holding cset->lock must call this in an RCU read-side section.
+ */
+static inline struct zio_ti *zio_cset_ti(struct zio_cset *cset)
+{
+	return rcu_dereference(cset->ti);
+}
+
 /* Check the flags so we know whether to arm immediately or not */
 static inline int zio_cset_early_arm(struct zio_cset *cset)
 {
@@ -221,11 +255,22 @@ static inline int zio_cset_early_arm(struct zio_cset *cset)
 
 struct zio_channel {
 	struct zio_obj_head	head;
-	struct zio_cset		*cset;		/* parent cset */
-	struct zio_ti		*ti;		/* cset trigger instance */
+
+	/*
+	 * Hot fields, used for each block by triggers, buffers and char
+	 * devices: they start a cache line and fill it on 64-bit machines
+	 */
+	struct zio_cset		*cset ____cacheline_aligned_in_smp;
 	struct zio_bi		*bi;		/* buffer instance */
-	unsigned int		index;		/* index within parent */
+	struct zio_block	*active_block;	/* being managed by hardware */
+	struct zio_control	*current_ctrl;	/* the active one */
 	unsigned long		flags;
+	unsigned long		user_flags;	/* atomic bits, see below */
+	struct zio_block	*user_block;	/* being transferred w/ user */
+	unsigned int		index;		/* index within parent */
+
+	struct zio_ti		*ti;		/* cset trigger instance */
+	struct zio_bi		*user_bi;	/* where user_block comes from */
 	struct zio_attribute_set zattr_set;
 
 	struct device		*ctrl_dev;	/* control char device */
@@ -234,15 +279,21 @@ struct zio_channel {
 	void			*priv_d;	/* private for the device */
 	void			*priv_t;	/* private for the trigger */
 
-	struct zio_control	*current_ctrl;	/* the active one */
-	struct zio_block	*user_block;	/* being transferred w/ user */
-	struct mutex		user_lock;
-	struct zio_block	*active_block;	/* being managed by hardware */
+	struct mutex		user_lock;	/* only if USER_BUSY is contended */
 
 	void			(*change_flags)(struct zio_obj_head *head,
 						unsigned long mask);
 };
 
+/*
+ * Like the trigger of the cset, the buffer instance can be replaced:
+ * lockless users must call this in an RCU read-side section
+ */
+static inline struct zio_bi *zio_chan_bi(struct zio_channel *chan)
+{
+	return rcu_dereference(chan->bi);
+}
+
 /* first 4bit are reserved for zio object universal flags */
 enum zio_chan_flags {
 	ZIO_CHAN_POLAR		= 0x10,	/* 0 is positive - 1 is negative*/
@@ -250,19 +301,49 @@ enum zio_chan_flags {
 	ZIO_CHAN_POLAR_NEGATIVE	= 0x10,
 };
 
-/* get each channel from cset */
+/* bit numbers in chan->user_flags: poll(2) tests them with no lock held */
+enum zio_chan_user_bits {
+	ZIO_CHAN_USER_CTRL	= 0,	/* user_block control not read yet */
+	ZIO_CHAN_USER_BUSY	= 1,	/* user_block owned: see chardev.c */
+};
+
+/*
+ * get each channel from cset: the bitmap of enabled channels avoids
+ * touching disabled ones. Whoever changes ZIO_DISABLED in the flags of a
+ * registered channel must call zio_chan_enabled_sync() afterwards.
+ */
 static inline struct zio_channel *zio_first_enabled_chan(struct zio_cset *cset,
 						struct zio_channel *chan)
 {
-	if (unlikely(chan - cset->chan >= cset->n_chan))
+	unsigned int i = chan - cset->chan;
+
+	if (unlikely(i >= cset->n_chan))
 		return NULL;
-	while (1) {
-		if (!(chan->flags & ZIO_DISABLED))
-			return chan; /* if is enabled, use this */
-		if (chan->index+1 == cset->n_chan)
-			return NULL; /* no more channels */
-		chan++;
-	}
+	i = find_next_bit(cset->chan_enabled, cset->n_chan, i);
+	return i < cset->n_chan ? cset->chan + i : NULL;
+}
+
+static inline void zio_chan_enabled_sync(struct zio_channel *chan)
+{
+	if (chan->flags & ZIO_DISABLED)
+		clear_bit(chan->index, chan->cset->chan_enabled);
+	else
+		set_bit(chan->index, chan->cset->chan_enabled);
+}
+
+/*
+ * Set (or clear, with NULL) the active block of a channel. The bitmap of
+ * ready channels lets triggers know in constant time whether all enabled
+ * channels have a block (see zio_cset_all_ready() in zio-trigger.h)
+ */
+static inline void zio_chan_set_active(struct zio_channel *chan,
+				       struct zio_block *block)
+{
+	chan->active_block = block;
+	if (block)
+		set_bit(chan->index, chan->cset->chan_ready);
+	else
+		clear_bit(chan->index, chan->cset->chan_ready);
 }
 #define chan_for_each(cptr, cset)				\
 		for (cptr = cset->chan;				\
@@ -303,11 +384,18 @@ struct zio_block {
 };
 
 
+#define ZIO_CSET_HW_BUSY_BIT	11
+
 /**
- * Mark the cset as 'busy'
+ * Mark the cset as 'busy', so an abort waits for zio_cset_busy_clear()
  * @param cset the cset to set busy
- * @param locked '1' if you want to protect the operatio, '0' if you will
- *               protect the operation by yourself
+ * @param locked '1' if you want to protect the operation, '0' if you
+ *               already hold the cset lock
+ *
+ * The abort checks the flag under the cset lock, so this must be called
+ * under it too: then an abort either runs before us, or sees the flag
+ * and waits. The completion is re-armed before the flag is set, so an
+ * abort that sees the flag always finds it not completed.
  */
 static inline void zio_cset_busy_set(struct zio_cset *cset, int locked)
 {
@@ -315,16 +403,20 @@ static inline void zio_cset_busy_set(struct zio_cset *cset, int locked)
 
 	if (locked)
 		spin_lock_irqsave(&cset->lock, flags);
-	cset->flags |= ZIO_CSET_HW_BUSY;
+	reinit_completion(&cset->hw_idle);
+	set_bit(ZIO_CSET_HW_BUSY_BIT, &cset->flags);
 	if (locked)
 		spin_unlock_irqrestore(&cset->lock, flags);
 }
 
 /**
- * Mark the cset as 'not busy'
+ * Mark the cset as 'not busy', waking up whoever waits to abort
  * @param cset the cset to set busy
- * @param locked '1' if you want to protect the operatio, '0' if you will
- *               protect the operation by yourself
+ * @param locked '1' if you want to protect the operation, '0' if you
+ *               already hold the cset lock (or don't need it)
+ *
+ * The flag is cleared before completing: a waiter that wakes up (or
+ * arrives later) retries the abort and finds the cset idle.
  */
 static inline void zio_cset_busy_clear(struct zio_cset *cset, int locked)
 {
@@ -332,7 +424,8 @@ static inline void zio_cset_busy_clear(struct zio_cset *cset, int locked)
 
 	if (locked)
 		spin_lock_irqsave(&cset->lock, flags);
-	cset->flags &= ~ZIO_CSET_HW_BUSY;
+	clear_bit(ZIO_CSET_HW_BUSY_BIT, &cset->flags);
+	complete_all(&cset->hw_idle);
 	if (locked)
 		spin_unlock_irqrestore(&cset->lock, flags);
 }
@@ -343,7 +436,7 @@ static inline void zio_cset_busy_clear(struct zio_cset *cset, int locked)
  */
 static inline int zio_cset_is_busy(struct zio_cset *cset)
 {
-	return !!(cset->flags & ZIO_CSET_HW_BUSY);
+	return test_bit(ZIO_CSET_HW_BUSY_BIT, &cset->flags);
 }
 
 /*
@@ -364,10 +457,15 @@ static inline unsigned int zio_control_size(struct zio_channel *chan)
 	return __ZIO_CONTROL_SIZE;
 }
 
-/* We have an optional misc device that returns all control blocks */
+/*
+ * We have an optional misc device that returns all control blocks. It
+ * is only called while zio_sniffdev_users (the number of open files) is
+ * not zero, so without readers freeing a control costs a single branch.
+ */
 int zio_sniffdev_init(void);
 void zio_sniffdev_exit(void);
 void zio_sniffdev_add(struct zio_control *ctrl);
+extern unsigned int zio_sniffdev_users;
 
 /*
  * Misc library-like code, from zio-misc.c
@@ -375,6 +473,8 @@ void zio_sniffdev_add(struct zio_control *ctrl);
 
 /* first-fit allocator */
 struct zio_ffa *zio_ffa_create(unsigned long begin, unsigned long end);
+struct zio_ffa *zio_ffa_create_node(unsigned long begin, unsigned long end,
+				    int node);
 void zio_ffa_destroy(struct zio_ffa *ffa);
 #define ZIO_FFA_NOSPACE ((unsigned long)-1) /* caller ensures -1 is invalid */
 unsigned long zio_ffa_alloc(struct zio_ffa *ffa, size_t size, gfp_t gfp);
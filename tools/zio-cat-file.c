@@ -43,6 +43,7 @@ int main(int argc, char **argv)
 	struct zio_control ctrl;
 	void *buffer;
 	int buffersize = 0;
+	uint32_t area = 0;
 	void *map,*ptr;
 	struct timeval tv1, tv2;
 
@@ -122,6 +123,19 @@ int main(int argc, char **argv)
 				j, off, size);
 
 		if (map) {
+			/* vmalloc buffer resized: the new area needs a new map */
+			if (j && ctrl.reserved != area) {
+				munmap(map, buffersize);
+				buffersize = pagesize;
+				map = mmap(0, buffersize, PROT_READ, MAP_PRIVATE,
+					   dfd, 0);
+				buffer = map;
+				if (map == MAP_FAILED) {
+					fprintf(stderr, "mmap failed\n");
+					exit(1);
+				}
+			}
+			area = ctrl.reserved;
 			/* increase map size if needed */
 			while (off + size > buffersize) {
 				if (VERBOSE)
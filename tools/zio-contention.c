@@ -0,0 +1,139 @@
+// SPDX-License-Identifier: Unlicense
+/*
+ * Copyright 2011-2019 CERN
+ */
+
+/*
+ * Measure how well the channels of a cset can be read in parallel: one
+ * thread per control file reads blocks for a while and then the program
+ * prints the rate of each thread and the aggregate. Pass all the channels
+ * of a wide cset (e.g. 64 control files) and compare the aggregate with
+ * the rate of a single channel: with no shared lock in the per-channel
+ * paths it should scale with the number of channels (until the trigger
+ * or the CPU count is the limit).
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <linux/zio-user.h>
+
+static char git_version[] = "version: " GIT_VERSION;
+
+struct reader {
+	pthread_t thread;
+	char *name;
+	int fd;
+	unsigned long long blocks;
+	int err;
+};
+
+static volatile int stop;
+
+static void *reader_fn(void *arg)
+{
+	struct reader *r = arg;
+	struct zio_control ctrl;
+
+	while (!stop) {
+		/* Reading only the control discards data, as zio-lat does */
+		if (read(r->fd, &ctrl, sizeof(ctrl)) != sizeof(ctrl)) {
+			if (errno == EINTR)
+				continue;
+			r->err = errno;
+			break;
+		}
+		r->blocks++;
+	}
+	return NULL;
+}
+
+static void help(char *name)
+{
+	fprintf(stderr, "Use: \"%s [<opts>] <ctrl-file> [...]\"\n"
+		"       -t <seconds> duration (default 10)\n"
+		"       -V           print version information\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct reader *r;
+	struct timespec t0, t1;
+	unsigned long long total = 0, min = ~0ULL, max = 0;
+	unsigned long secs = 10;
+	double elapsed;
+	char *rest;
+	int c, i, n;
+
+	while ((c = getopt(argc, argv, "t:V")) != -1) {
+		switch (c) {
+		case 't':
+			secs = strtoul(optarg, &rest, 0);
+			if ((rest && *rest) || !secs)
+				help(argv[0]);
+			break;
+		case 'V':
+			printf("%s %s\n", argv[0], git_version);
+			exit(0);
+		default:
+			help(argv[0]);
+		}
+	}
+	n = argc - optind;
+	if (n < 1)
+		help(argv[0]);
+
+	r = calloc(n, sizeof(*r));
+	if (!r) {
+		fprintf(stderr, "%s: calloc: %s\n", argv[0], strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		r[i].name = argv[optind + i];
+		r[i].fd = open(r[i].name, O_RDONLY);
+		if (r[i].fd < 0) {
+			fprintf(stderr, "%s: %s: %s\n", argv[0], r[i].name,
+				strerror(errno));
+			exit(1);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < n; i++) {
+		errno = pthread_create(&r[i].thread, NULL, reader_fn, r + i);
+		if (errno) {
+			fprintf(stderr, "%s: pthread_create: %s\n", argv[0],
+				strerror(errno));
+			exit(1);
+		}
+	}
+	sleep(secs);
+	stop = 1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	elapsed = t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	/* Readers may be sleeping in read(2): don't wait for them forever */
+	for (i = 0; i < n; i++) {
+		if (r[i].err)
+			fprintf(stderr, "%s: %s: read: %s\n", argv[0],
+				r[i].name, strerror(r[i].err));
+		total += r[i].blocks;
+		if (r[i].blocks < min)
+			min = r[i].blocks;
+		if (r[i].blocks > max)
+			max = r[i].blocks;
+		printf("%s: %.1f blocks/s\n", r[i].name, r[i].blocks / elapsed);
+	}
+	printf("%i readers, %.1f s: aggregate %.1f blocks/s, "
+	       "per reader min %.1f max %.1f\n", n, elapsed, total / elapsed,
+	       min / elapsed, max / elapsed);
+	return 0;
+}
@@ -0,0 +1,113 @@
+// SPDX-License-Identifier: Unlicense
+/*
+ * Copyright 2011-2019 CERN
+ */
+
+/*
+ * Measure the delay between the trigger time-stamp of each block and
+ * the moment read(2) returns it to user space. Run it once sleeping and
+ * once with "-b <usec>" to compare the wait queue with busy polling.
+ * The time-stamp must come from the same clock (CLOCK_REALTIME), as it
+ * happens with the software triggers (e.g. zio-zero with the hrt trigger).
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include <linux/zio-user.h>
+
+static char git_version[] = "version: " GIT_VERSION;
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(long long *)a, y = *(long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void help(char *name)
+{
+	fprintf(stderr, "Use: \"%s [<opts>] <ctrl-file>\"\n"
+		"       -b <usec>    busy-poll budget (default: sleep)\n"
+		"       -n <number>  number of blocks (default 10000)\n"
+		"       -V           print version information\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct zio_control ctrl;
+	struct timespec now;
+	unsigned long busy = 0, i, n = 10000;
+	long long *lat, sum = 0;
+	char *rest;
+	int c, fd;
+
+	while ((c = getopt(argc, argv, "b:n:V")) != -1) {
+		switch (c) {
+		case 'b':
+			busy = strtoul(optarg, &rest, 0);
+			if (rest && *rest)
+				help(argv[0]);
+			break;
+		case 'n':
+			n = strtoul(optarg, &rest, 0);
+			if ((rest && *rest) || !n)
+				help(argv[0]);
+			break;
+		case 'V':
+			printf("%s %s\n", argv[0], git_version);
+			exit(0);
+		default:
+			help(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		help(argv[0]);
+
+	lat = calloc(n, sizeof(*lat));
+	if (!lat) {
+		fprintf(stderr, "%s: calloc: %s\n", argv[0], strerror(errno));
+		exit(1);
+	}
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind],
+			strerror(errno));
+		exit(1);
+	}
+	if (busy && ioctl(fd, ZIO_IOC_BUSY_POLL, busy) < 0) {
+		fprintf(stderr, "%s: busy poll: %s\n", argv[0],
+			strerror(errno));
+		exit(1);
+	}
+
+	/* Reading only the control discards data, so we only time controls */
+	for (i = 0; i < n; i++) {
+		if (read(fd, &ctrl, sizeof(ctrl)) != sizeof(ctrl)) {
+			fprintf(stderr, "%s: read: %s\n", argv[0],
+				strerror(errno));
+			exit(1);
+		}
+		clock_gettime(CLOCK_REALTIME, &now);
+		lat[i] = (now.tv_sec - (long long)ctrl.tstamp.secs)
+			* 1000000000LL
+			+ now.tv_nsec - (long long)ctrl.tstamp.ticks;
+		sum += lat[i];
+	}
+
+	qsort(lat, n, sizeof(*lat), cmp_ll);
+	printf("%s: %lu blocks, %s\n", argv[optind], n,
+	       busy ? "busy poll" : "sleeping");
+	printf("latency (us): min %.3f avg %.3f p50 %.3f p99 %.3f max %.3f\n",
+	       lat[0] / 1000.0, sum / 1000.0 / n, lat[n / 2] / 1000.0,
+	       lat[n * 99 / 100] / 1000.0, lat[n - 1] / 1000.0);
+	return 0;
+}
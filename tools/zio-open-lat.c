@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: Unlicense
+/*
+ * Copyright 2011-2019 CERN
+ */
+
+/*
+ * Measure how long open(2) and close(2) take on ZIO char devices. Pass
+ * many files (e.g. all the control files of zio-mini loaded with
+ * thousands of channels): the open path looks the channel up by minor
+ * number, so the latency should not depend on how many channels exist.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <linux/zio-user.h>
+
+static char git_version[] = "version: " GIT_VERSION;
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(long long *)a, y = *(long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static long long ts_diff(struct timespec *t0, struct timespec *t1)
+{
+	return (t1->tv_sec - t0->tv_sec) * 1000000000LL
+		+ t1->tv_nsec - t0->tv_nsec;
+}
+
+static void report(char *what, long long *lat, unsigned long n)
+{
+	long long sum = 0;
+	unsigned long i;
+
+	for (i = 0; i < n; i++)
+		sum += lat[i];
+	qsort(lat, n, sizeof(*lat), cmp_ll);
+	printf("%s (us): min %.3f avg %.3f p50 %.3f p99 %.3f max %.3f\n",
+	       what, lat[0] / 1000.0, sum / 1000.0 / n, lat[n / 2] / 1000.0,
+	       lat[n * 99 / 100] / 1000.0, lat[n - 1] / 1000.0);
+}
+
+static void help(char *name)
+{
+	fprintf(stderr, "Use: \"%s [<opts>] <file> [...]\"\n"
+		"       -r <number>  rounds over all files (default 1)\n"
+		"       -V           print version information\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct timespec t0, t1, t2;
+	unsigned long rounds = 1, i, n, nfiles;
+	long long *olat, *clat;
+	char *rest, *name;
+	int c, fd;
+
+	while ((c = getopt(argc, argv, "r:V")) != -1) {
+		switch (c) {
+		case 'r':
+			rounds = strtoul(optarg, &rest, 0);
+			if ((rest && *rest) || !rounds)
+				help(argv[0]);
+			break;
+		case 'V':
+			printf("%s %s\n", argv[0], git_version);
+			exit(0);
+		default:
+			help(argv[0]);
+		}
+	}
+	nfiles = argc - optind;
+	if (nfiles < 1)
+		help(argv[0]);
+
+	n = nfiles * rounds;
+	olat = calloc(n, sizeof(*olat));
+	clat = calloc(n, sizeof(*clat));
+	if (!olat || !clat) {
+		fprintf(stderr, "%s: calloc: %s\n", argv[0], strerror(errno));
+		exit(1);
+	}
+
+	for (i = 0; i < n; i++) {
+		name = argv[optind + i % nfiles];
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		fd = open(name, O_RDONLY);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		if (fd < 0) {
+			fprintf(stderr, "%s: %s: %s\n", argv[0], name,
+				strerror(errno));
+			exit(1);
+		}
+		close(fd);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		olat[i] = ts_diff(&t0, &t1);
+		clat[i] = ts_diff(&t1, &t2);
+	}
+
+	printf("%lu files, %lu opens\n", nfiles, n);
+	report("open ", olat, n);
+	report("close", clat, n);
+	return 0;
+}